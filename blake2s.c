@@ -0,0 +1,156 @@
+/*--------------------------------------------------------------------*/
+/* blake2s.c                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "blake2s.h"
+#include <string.h>
+#include <assert.h>
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y)          \
+    do {                             \
+        a = a + b + (x);             \
+        d = ROTR32(d ^ a, 16);       \
+        c = c + d;                   \
+        b = ROTR32(b ^ c, 12);       \
+        a = a + b + (y);             \
+        d = ROTR32(d ^ a, 8);        \
+        c = c + d;                   \
+        b = ROTR32(b ^ c, 7);        \
+    } while (0)
+
+/*--------------------------------------------------------------------*/
+
+static const unsigned int auIV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned char aaucSigma[10][16] = {
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+    {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+    { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+    { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+    { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+    {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+    {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+    { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+    {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0}
+};
+
+/*--------------------------------------------------------------------*/
+
+static unsigned int load32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Compress the block in ctx->buf; iLast is set for the final block */
+static void compress(BLAKE2S_CTX *ctx, int iLast)
+{
+    unsigned int v[16];
+    unsigned int m[16];
+    const unsigned char *s;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = load32(ctx->buf + 4 * i);
+
+    for (i = 0; i < 8; i++) {
+        v[i] = ctx->h[i];
+        v[i + 8] = auIV[i];
+    }
+    v[12] ^= ctx->t[0];
+    v[13] ^= ctx->t[1];
+    if (iLast)
+        v[14] = ~v[14];
+
+    for (i = 0; i < 10; i++) {
+        s = aaucSigma[i];
+        G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]]);
+        G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]]);
+        G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]]);
+        G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]]);
+        G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (i = 0; i < 8; i++)
+        ctx->h[i] ^= v[i] ^ v[i + 8];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add uLen bytes to the 64 bit message counter */
+static void incrementCounter(BLAKE2S_CTX *ctx, size_t uLen)
+{
+    ctx->t[0] += (unsigned int)uLen;
+    if (ctx->t[0] < (unsigned int)uLen)
+        ctx->t[1]++;
+}
+
+/*--------------------------------------------------------------------*/
+
+void blake2s_init(BLAKE2S_CTX *ctx)
+{
+    assert(ctx != NULL);
+
+    memcpy(ctx->h, auIV, sizeof(auIV));
+    // parameter block: digest length, no key, fanout 1, depth 1
+    ctx->h[0] ^= 0x01010000 ^ BLAKE2S_OUTLEN;
+    ctx->t[0] = 0;
+    ctx->t[1] = 0;
+    ctx->buflen = 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+void blake2s_update(BLAKE2S_CTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t uFill;
+
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+
+    // the last block is held back until final, since it is compressed
+    // with the finalization flag set
+    while (len > 0) {
+        if (ctx->buflen == BLAKE2S_BLOCKLEN) {
+            incrementCounter(ctx, BLAKE2S_BLOCKLEN);
+            compress(ctx, 0);
+            ctx->buflen = 0;
+        }
+        uFill = BLAKE2S_BLOCKLEN - ctx->buflen;
+        if (uFill > len)
+            uFill = len;
+        memcpy(ctx->buf + ctx->buflen, data, uFill);
+        ctx->buflen += uFill;
+        data += uFill;
+        len -= uFill;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+void blake2s_final(BLAKE2S_CTX *ctx, unsigned char *hash)
+{
+    int i;
+
+    assert(ctx != NULL);
+    assert(hash != NULL);
+
+    incrementCounter(ctx, ctx->buflen);
+    memset(ctx->buf + ctx->buflen, 0, BLAKE2S_BLOCKLEN - ctx->buflen);
+    compress(ctx, 1);
+
+    for (i = 0; i < BLAKE2S_OUTLEN; i++)
+        hash[i] = (ctx->h[i >> 2] >> (8 * (i & 3))) & 0xff;
+}
@@ -0,0 +1,41 @@
+/*--------------------------------------------------------------------*/
+/* blake2s.h                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef BLAKE2S_INCLUDED
+#define BLAKE2S_INCLUDED
+
+#include <stddef.h>
+
+#define BLAKE2S_BLOCKLEN 64   // bytes
+#define BLAKE2S_OUTLEN   32   // bytes
+
+/* Unkeyed BLAKE2s-256 (RFC 7693) hashing state */
+
+typedef struct {
+    unsigned int h[8];
+    unsigned int t[2];
+    unsigned char buf[BLAKE2S_BLOCKLEN];
+    size_t buflen;
+} BLAKE2S_CTX;
+
+/*--------------------------------------------------------------------*/
+
+/* Initialize ctx for a 256 bit digest */
+
+void blake2s_init(BLAKE2S_CTX *ctx);
+
+/*--------------------------------------------------------------------*/
+
+/* Absorb len bytes of data into ctx */
+
+void blake2s_update(BLAKE2S_CTX *ctx, const unsigned char *data, size_t len);
+
+/*--------------------------------------------------------------------*/
+
+/* Finish ctx and place the 32 byte digest in hash */
+
+void blake2s_final(BLAKE2S_CTX *ctx, unsigned char *hash);
+
+#endif
@@ -0,0 +1,252 @@
+/*--------------------------------------------------------------------*/
+/* chacha20.c                                                         */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "chacha20.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHACHA20_X86
+#include <immintrin.h>
+#endif
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                 \
+    do {                                         \
+        a += b; d ^= a; d = ROTL32(d, 16);       \
+        c += d; b ^= c; b = ROTL32(b, 12);       \
+        a += b; d ^= a; d = ROTL32(d, 8);        \
+        c += d; b ^= c; b = ROTL32(b, 7);        \
+    } while (0)
+
+/* Generate iNumBlocks consecutive keystream blocks from the initial 
+   state auState (whose word 12 is the first block counter) into 
+   pucStream */
+typedef void (*BlocksFn)(const uint32_t auState[16], 
+                         unsigned char *pucStream, int iNumBlocks);
+
+/* Most blocks a kernel is asked for in one call */
+#define MAXBLOCKS 8
+
+/* Set with atomic stores, since the kernel is picked on first use and
+   that may happen on several threads at once */
+static BlocksFn pfBlocks;
+static pthread_once_t sPickOnce = PTHREAD_ONCE_INIT;
+
+/*--------------------------------------------------------------------*/
+
+static uint32_t load32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void store32(unsigned char *p, uint32_t u)
+{
+    p[0] = u & 0xff;
+    p[1] = (u >> 8) & 0xff;
+    p[2] = (u >> 16) & 0xff;
+    p[3] = (u >> 24) & 0xff;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Portable kernel */
+static void blocksC(const uint32_t auState[16], unsigned char *pucStream,
+                    int iNumBlocks)
+{
+    uint32_t x[16];
+    int iBlock, i;
+
+    for (iBlock = 0; iBlock < iNumBlocks; iBlock++) {
+        memcpy(x, auState, sizeof(x));
+        x[12] += iBlock;
+
+        for (i = 0; i < 10; i++) {
+            QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+            QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+            QUARTERROUND(x[2], x[6], x[10], x[14]);
+            QUARTERROUND(x[3], x[7], x[11], x[15]);
+            QUARTERROUND(x[0], x[5], x[10], x[15]);
+            QUARTERROUND(x[1], x[6], x[11], x[12]);
+            QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+            QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+        }
+
+        for (i = 0; i < 16; i++) {
+            store32(pucStream + iBlock * CHACHA20_BLOCKLEN + 4 * i,
+                    x[i] + auState[i] + (i == 12 ? (uint32_t)iBlock : 0));
+        }
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+#ifdef CHACHA20_X86
+
+#define AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+                                        _mm256_srli_epi32((x), 32 - (n)))
+
+#define AVX2_QUARTERROUND(a, b, c, d)                                    \
+    do {                                                                 \
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);          \
+        d = _mm256_shuffle_epi8(d, vRot16);                              \
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);          \
+        b = AVX2_ROTL(b, 12);                                            \
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);          \
+        d = _mm256_shuffle_epi8(d, vRot8);                               \
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);          \
+        b = AVX2_ROTL(b, 7);                                             \
+    } while (0)
+
+/* AVX2 kernel: eight blocks at once, block i of the batch in lane i of
+   every state word. Fewer than eight blocks are produced by computing
+   all eight and keeping the first iNumBlocks. */
+__attribute__((target("avx2")))
+static void blocksAvx2(const uint32_t auState[16], unsigned char *pucStream,
+                       int iNumBlocks)
+{
+    const __m256i vRot16 = _mm256_set_epi8(
+        13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2,
+        13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2);
+    const __m256i vRot8 = _mm256_set_epi8(
+        14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3,
+        14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3);
+    uint32_t auOut[16][8] __attribute__((aligned(32)));
+    __m256i x[16], vInit[16];
+    int i, iBlock;
+
+    for (i = 0; i < 16; i++)
+        vInit[i] = _mm256_set1_epi32((int)auState[i]);
+    vInit[12] = _mm256_add_epi32(vInit[12], 
+                                 _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+    for (i = 0; i < 16; i++)
+        x[i] = vInit[i];
+
+    for (i = 0; i < 10; i++) {
+        AVX2_QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+        AVX2_QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+        AVX2_QUARTERROUND(x[2], x[6], x[10], x[14]);
+        AVX2_QUARTERROUND(x[3], x[7], x[11], x[15]);
+        AVX2_QUARTERROUND(x[0], x[5], x[10], x[15]);
+        AVX2_QUARTERROUND(x[1], x[6], x[11], x[12]);
+        AVX2_QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+        AVX2_QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+    }
+
+    for (i = 0; i < 16; i++)
+        _mm256_store_si256((__m256i *)auOut[i], 
+                           _mm256_add_epi32(x[i], vInit[i]));
+
+    // back from word-major to block-major order
+    for (iBlock = 0; iBlock < iNumBlocks; iBlock++)
+        for (i = 0; i < 16; i++)
+            store32(pucStream + iBlock * CHACHA20_BLOCKLEN + 4 * i,
+                    auOut[i][iBlock]);
+}
+
+#endif
+
+/*--------------------------------------------------------------------*/
+
+int chacha20_set_impl(int iImpl)
+{
+#ifdef CHACHA20_X86
+    __builtin_cpu_init();
+    if (iImpl == CHACHA20_IMPL_AUTO)
+        iImpl = __builtin_cpu_supports("avx2") ? CHACHA20_IMPL_AVX2 
+                                                : CHACHA20_IMPL_C;
+    if (iImpl == CHACHA20_IMPL_AVX2) {
+        if (!__builtin_cpu_supports("avx2"))
+            return 0;
+        __atomic_store_n(&pfBlocks, blocksAvx2, __ATOMIC_RELEASE);
+        return 1;
+    }
+#else
+    if (iImpl == CHACHA20_IMPL_AUTO)
+        iImpl = CHACHA20_IMPL_C;
+#endif
+    if (iImpl != CHACHA20_IMPL_C)
+        return 0;
+    __atomic_store_n(&pfBlocks, blocksC, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Pick the fastest kernel, unless chacha20_set_impl() already did */
+static void pickImpl(void)
+{
+    if (__atomic_load_n(&pfBlocks, __ATOMIC_ACQUIRE) == NULL)
+        chacha20_set_impl(CHACHA20_IMPL_AUTO);
+}
+
+/*--------------------------------------------------------------------*/
+
+void chacha20_crypt(const unsigned char *pucKey,
+                    const unsigned char *pucNonce,
+                    unsigned long long ullOffset,
+                    const unsigned char *pucInput,
+                    unsigned char *pucOutput,
+                    size_t uLength)
+{
+    static const unsigned char aucSigma[16] = "expand 32-byte k";
+    unsigned char aucStream[MAXBLOCKS * CHACHA20_BLOCKLEN];
+    uint32_t auState[16];
+    BlocksFn pfKernel;
+    size_t uSkip;
+    size_t uNumBytes;
+    size_t i;
+    int iNumBlocks;
+
+    assert(pucKey != NULL);
+    assert(pucNonce != NULL);
+    assert(pucInput != NULL || uLength == 0);
+    assert(pucOutput != NULL || uLength == 0);
+    assert(ullOffset <= CHACHA20_MAXLEN &&
+           uLength <= CHACHA20_MAXLEN - ullOffset);
+
+    pthread_once(&sPickOnce, pickImpl);
+    pfKernel = __atomic_load_n(&pfBlocks, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < 4; i++)
+        auState[i] = load32(aucSigma + 4 * i);
+    for (i = 0; i < 8; i++)
+        auState[4 + i] = load32(pucKey + 4 * i);
+    auState[12] = (uint32_t)(ullOffset / CHACHA20_BLOCKLEN);
+    for (i = 0; i < 3; i++)
+        auState[13 + i] = load32(pucNonce + 4 * i);
+
+    // an offset inside a block discards the start of its keystream
+    uSkip = ullOffset % CHACHA20_BLOCKLEN;
+
+    while (uLength > 0) {
+        iNumBlocks = (int)((uSkip + uLength + CHACHA20_BLOCKLEN - 1) 
+                           / CHACHA20_BLOCKLEN);
+        if (iNumBlocks > MAXBLOCKS)
+            iNumBlocks = MAXBLOCKS;
+        pfKernel(auState, aucStream, iNumBlocks);
+
+        uNumBytes = iNumBlocks * CHACHA20_BLOCKLEN - uSkip;
+        if (uNumBytes > uLength)
+            uNumBytes = uLength;
+        for (i = 0; i < uNumBytes; i++)
+            pucOutput[i] = pucInput[i] ^ aucStream[uSkip + i];
+
+        auState[12] += iNumBlocks;
+        pucInput += uNumBytes;
+        pucOutput += uNumBytes;
+        uLength -= uNumBytes;
+        uSkip = 0;
+    }
+
+    memset(aucStream, 0, sizeof(aucStream));
+}
@@ -0,0 +1,46 @@
+/*--------------------------------------------------------------------*/
+/* chacha20.h                                                         */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef CHACHA20_INCLUDED
+#define CHACHA20_INCLUDED
+
+#include <stddef.h>
+
+#define CHACHA20_KEYLEN    32  // bytes
+#define CHACHA20_NONCELEN  12  // bytes
+#define CHACHA20_BLOCKLEN  64  // bytes
+#define CHACHA20_MAXLEN    (1ULL << 38)  // keystream bytes, 2^32 blocks
+
+/* Keystream block kernels, see chacha20_set_impl() */
+#define CHACHA20_IMPL_AUTO 0   // fastest kernel this CPU supports
+#define CHACHA20_IMPL_C    1   // portable, one block at a time
+#define CHACHA20_IMPL_AVX2 2   // eight blocks per step
+
+/*--------------------------------------------------------------------*/
+
+/* XOR uLength bytes of pucInput with the ChaCha20 (RFC 8439) keystream
+   of pucKey and pucNonce, starting at byte ullOffset of the keystream,
+   and place the result in pucOutput. Keystream block n uses block 
+   counter n, so any range of a message can be processed on its own.
+   pucInput and pucOutput may be the same buffer. The keystream ends 
+   after 2^32 blocks (256 GiB), where the block counter would wrap, so
+   ullOffset + uLength must not exceed CHACHA20_MAXLEN. */
+
+void chacha20_crypt(const unsigned char *pucKey,
+                    const unsigned char *pucNonce,
+                    unsigned long long ullOffset,
+                    const unsigned char *pucInput,
+                    unsigned char *pucOutput,
+                    size_t uLength);
+
+/*--------------------------------------------------------------------*/
+
+/* Select the keystream kernel. The kernel is otherwise picked via 
+   CPUID once, on first use by any thread. Return 0 if iImpl is not
+   supported here. */
+
+int chacha20_set_impl(int iImpl);
+
+#endif
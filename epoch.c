@@ -0,0 +1,237 @@
+/*--------------------------------------------------------------------*/
+/* epoch.c                                                            */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "epoch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define STRIPES   16    // reader counters, spread over threads
+#define LINELEN   64    // bytes per cache line
+#define RETIREDMINCAP 16
+
+/* Readers of a thread are counted in one stripe, by the parity of the
+   epoch they entered in. A stripe has a cache line to itself, so
+   readers on different cores do not write the same line. */
+struct Stripe
+{
+    unsigned long aulActive[2];
+} __attribute__((aligned(LINELEN)));
+
+/* A block waiting to be freed by pfFree, and the epoch it was
+   retired in */
+struct Retired
+{
+    void *pv;
+    void (*pfFree)(void *pv);
+    unsigned long ulEpoch;
+};
+
+/* The global epoch advances from e to e + 1 only once no reader of
+   e - 1 is left, so a block retired in epoch e is unreachable for
+   every reader once the epoch is e + 2. */
+struct Epoch
+{
+    struct Stripe asStripes[STRIPES];
+
+    /* the global epoch */
+    unsigned long ulEpoch;
+
+    /* guards the fields below and advancing the epoch */
+    pthread_mutex_t sLock;
+
+    /* retired blocks, oldest first */
+    struct Retired *psRetired;
+    size_t uNumRetired;
+    size_t uRetiredCap;
+};
+
+/* Next stripe to hand to a thread, and the stripe of this thread
+   plus one, 0 if it has none yet */
+static unsigned int uNextStripe;
+static _Thread_local unsigned int uMyStripe;
+
+/*--------------------------------------------------------------------*/
+/* Private functions:                                                 */
+/*--------------------------------------------------------------------*/
+
+/* Return the stripe of oEpoch the calling thread counts itself in */
+static struct Stripe *myStripe(Epoch_T oEpoch)
+{
+    if (uMyStripe == 0)
+        uMyStripe = __atomic_fetch_add(&uNextStripe, 1, __ATOMIC_RELAXED)
+                    % STRIPES + 1;
+    return &oEpoch->asStripes[uMyStripe - 1];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Advance the epoch of oEpoch by one if no reader of the previous
+   epoch is left. The caller holds the lock. Return 1 if it
+   advanced, 0 otherwise. */
+static int tryAdvance(Epoch_T oEpoch)
+{
+    unsigned long ulEpoch = __atomic_load_n(&oEpoch->ulEpoch,
+                                            __ATOMIC_SEQ_CST);
+    int i;
+
+    for (i = 0; i < STRIPES; i++) {
+        if (__atomic_load_n(&oEpoch->asStripes[i].aulActive[(ulEpoch + 1) & 1],
+                            __ATOMIC_SEQ_CST) != 0)
+            return 0;
+    }
+    __atomic_store_n(&oEpoch->ulEpoch, ulEpoch + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+/* Public functions:                                                  */
+/*--------------------------------------------------------------------*/
+
+Epoch_T Epoch_new(void)
+{
+    Epoch_T oEpoch;
+
+    if (posix_memalign((void **)&oEpoch, LINELEN, sizeof(struct Epoch)) != 0)
+        return NULL;
+    memset(oEpoch, 0, sizeof(struct Epoch));
+    pthread_mutex_init(&oEpoch->sLock, NULL);
+    return oEpoch;
+}
+
+/*--------------------------------------------------------------------*/
+
+void Epoch_free(Epoch_T oEpoch)
+{
+    size_t u;
+
+    assert(oEpoch != NULL);
+
+    for (u = 0; u < oEpoch->uNumRetired; u++)
+        oEpoch->psRetired[u].pfFree(oEpoch->psRetired[u].pv);
+    free(oEpoch->psRetired);
+    pthread_mutex_destroy(&oEpoch->sLock);
+    free(oEpoch);
+}
+
+/*--------------------------------------------------------------------*/
+
+unsigned long Epoch_enter(Epoch_T oEpoch)
+{
+    struct Stripe *psStripe;
+    unsigned long ulEpoch;
+
+    assert(oEpoch != NULL);
+
+    psStripe = myStripe(oEpoch);
+    for (;;) {
+        ulEpoch = __atomic_load_n(&oEpoch->ulEpoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&psStripe->aulActive[ulEpoch & 1], 1,
+                           __ATOMIC_SEQ_CST);
+
+        // a reader counted after the epoch moved on would hold up
+        // the wrong one
+        if (__atomic_load_n(&oEpoch->ulEpoch, __ATOMIC_SEQ_CST) == ulEpoch)
+            return ulEpoch;
+        __atomic_fetch_sub(&psStripe->aulActive[ulEpoch & 1], 1,
+                           __ATOMIC_RELEASE);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+void Epoch_exit(Epoch_T oEpoch, unsigned long ulTicket)
+{
+    assert(oEpoch != NULL);
+
+    __atomic_fetch_sub(&myStripe(oEpoch)->aulActive[ulTicket & 1], 1,
+                       __ATOMIC_RELEASE);
+}
+
+/*--------------------------------------------------------------------*/
+
+void Epoch_retire(Epoch_T oEpoch, void *pv)
+{
+    Epoch_retireWith(oEpoch, pv, free);
+}
+
+/*--------------------------------------------------------------------*/
+
+void Epoch_retireWith(Epoch_T oEpoch, void *pv, void (*pfFree)(void *pv))
+{
+    struct Retired *psNew;
+    unsigned long ulEpoch;
+    size_t uNewCap;
+
+    assert(oEpoch != NULL);
+    assert(pfFree != NULL);
+
+    if (pv == NULL)
+        return;
+
+    pthread_mutex_lock(&oEpoch->sLock);
+    ulEpoch = __atomic_load_n(&oEpoch->ulEpoch, __ATOMIC_SEQ_CST);
+    if (oEpoch->uNumRetired == oEpoch->uRetiredCap) {
+        uNewCap = oEpoch->uRetiredCap > 0 ? 2 * oEpoch->uRetiredCap
+                                          : RETIREDMINCAP;
+        psNew = (struct Retired *)realloc(oEpoch->psRetired,
+                                          uNewCap * sizeof(struct Retired));
+        if (psNew == NULL) {
+            // wait for the readers that might see pv to leave
+            while (__atomic_load_n(&oEpoch->ulEpoch, __ATOMIC_SEQ_CST)
+                   < ulEpoch + 2) {
+                if (!tryAdvance(oEpoch)) {
+                    pthread_mutex_unlock(&oEpoch->sLock);
+                    sched_yield();
+                    pthread_mutex_lock(&oEpoch->sLock);
+                }
+            }
+            pthread_mutex_unlock(&oEpoch->sLock);
+            pfFree(pv);
+            return;
+        }
+        oEpoch->psRetired = psNew;
+        oEpoch->uRetiredCap = uNewCap;
+    }
+    oEpoch->psRetired[oEpoch->uNumRetired].pv = pv;
+    oEpoch->psRetired[oEpoch->uNumRetired].pfFree = pfFree;
+    oEpoch->psRetired[oEpoch->uNumRetired].ulEpoch = ulEpoch;
+    oEpoch->uNumRetired++;
+    pthread_mutex_unlock(&oEpoch->sLock);
+}
+
+/*--------------------------------------------------------------------*/
+
+void Epoch_reclaim(Epoch_T oEpoch)
+{
+    unsigned long ulEpoch;
+    size_t uFreed;
+    size_t u;
+
+    assert(oEpoch != NULL);
+
+    pthread_mutex_lock(&oEpoch->sLock);
+    if (oEpoch->uNumRetired == 0) {
+        pthread_mutex_unlock(&oEpoch->sLock);
+        return;
+    }
+
+    // two steps make everything retired so far unreachable
+    if (tryAdvance(oEpoch))
+        tryAdvance(oEpoch);
+    ulEpoch = __atomic_load_n(&oEpoch->ulEpoch, __ATOMIC_SEQ_CST);
+
+    // blocks are retired in epoch order
+    for (uFreed = 0; uFreed < oEpoch->uNumRetired &&
+                     oEpoch->psRetired[uFreed].ulEpoch + 2 <= ulEpoch;
+         uFreed++)
+        oEpoch->psRetired[uFreed].pfFree(oEpoch->psRetired[uFreed].pv);
+    for (u = uFreed; u < oEpoch->uNumRetired; u++)
+        oEpoch->psRetired[u - uFreed] = oEpoch->psRetired[u];
+    oEpoch->uNumRetired -= uFreed;
+    pthread_mutex_unlock(&oEpoch->sLock);
+}
@@ -0,0 +1,68 @@
+/*--------------------------------------------------------------------*/
+/* epoch.h                                                            */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef EPOCH_INCLUDED
+#define EPOCH_INCLUDED
+
+/* An Epoch_T object lets threads read memory without locks while a
+   writer replaces it. Readers bracket their reads with Epoch_enter()
+   and Epoch_exit(). Memory the writer has unlinked is handed to
+   Epoch_retire() and freed by a later Epoch_reclaim() once every
+   reader that could still see it has left. */
+
+typedef struct Epoch *Epoch_T;
+
+/*--------------------------------------------------------------------*/
+
+/* Return a new Epoch object, or NULL if insufficient memory is
+   available. */
+
+Epoch_T Epoch_new(void);
+
+/*--------------------------------------------------------------------*/
+
+/* Free oEpoch and all memory retired to it. No reader may be
+   inside. */
+
+void Epoch_free(Epoch_T oEpoch);
+
+/*--------------------------------------------------------------------*/
+
+/* Announce that the calling thread starts reading memory guarded by
+   oEpoch. Return a ticket to pass to Epoch_exit(). Never blocks. */
+
+unsigned long Epoch_enter(Epoch_T oEpoch);
+
+/*--------------------------------------------------------------------*/
+
+/* Announce that the calling thread, which got ulTicket from
+   Epoch_enter(), is done reading. */
+
+void Epoch_exit(Epoch_T oEpoch, unsigned long ulTicket);
+
+/*--------------------------------------------------------------------*/
+
+/* Free the heap block pv, which readers can no longer reach but may
+   still be reading, once they are done. If the block cannot be
+   queued, wait for the readers and free it at once. pv may be NULL.
+   Calls from several writer threads may run at the same time. */
+
+void Epoch_retire(Epoch_T oEpoch, void *pv);
+
+/*--------------------------------------------------------------------*/
+
+/* Like Epoch_retire(), but release pv by calling pfFree(pv) rather
+   than free(pv), for blocks that own others or are shared. */
+
+void Epoch_retireWith(Epoch_T oEpoch, void *pv, void (*pfFree)(void *pv));
+
+/*--------------------------------------------------------------------*/
+
+/* Free the retired blocks of oEpoch that no reader can be reading.
+   Never waits for readers. */
+
+void Epoch_reclaim(Epoch_T oEpoch);
+
+#endif
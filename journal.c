@@ -0,0 +1,317 @@
+/*--------------------------------------------------------------------*/
+/* journal.c                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Each record is framed by its length and an FNV-1a checksum of the
+   length and the record, both 32 bit little endian */
+#define FRAMELEN 8
+
+#define BUFMINCAP 4096
+
+/* A buffer of framed records */
+struct RecordBuf
+{
+    unsigned char *pucData;
+    size_t uLen;
+    size_t uCap;
+};
+
+struct Journal
+{
+    /* file descriptor of the journal, opened for appending */
+    int fd;
+
+    /* guards all fields below */
+    pthread_mutex_t sLock;
+
+    /* signalled when a write finishes */
+    pthread_cond_t sWritten;
+
+    /* records appended and not yet handed to a writer */
+    struct RecordBuf sPending;
+
+    /* records being written; swapped with sPending by the writer */
+    struct RecordBuf sWriting;
+
+    /* number of records ever appended, and durable */
+    unsigned long ulAppended;
+    unsigned long ulDurable;
+
+    /* 1 while a caller of Journal_sync() is writing */
+    int iWriting;
+
+    /* 1 once a record has been lost */
+    int iFailed;
+};
+
+/*--------------------------------------------------------------------*/
+/* Private functions:                                                 */
+/*--------------------------------------------------------------------*/
+
+/* Return the checksum of the 4 byte frame length at pucLen and the
+   uLen bytes at pucRecord */
+static unsigned long checksum(const unsigned char *pucLen,
+                              const unsigned char *pucRecord, size_t uLen)
+{
+    unsigned long ulHash = 2166136261UL;
+    size_t u;
+
+    for (u = 0; u < 4; u++)
+        ulHash = ((ulHash ^ pucLen[u]) * 16777619UL) & 0xffffffffUL;
+    for (u = 0; u < uLen; u++)
+        ulHash = ((ulHash ^ pucRecord[u]) * 16777619UL) & 0xffffffffUL;
+    return ulHash;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void putWord(unsigned char *puc, unsigned long ulWord)
+{
+    puc[0] = ulWord & 0xff;
+    puc[1] = (ulWord >> 8) & 0xff;
+    puc[2] = (ulWord >> 16) & 0xff;
+    puc[3] = (ulWord >> 24) & 0xff;
+}
+
+/*--------------------------------------------------------------------*/
+
+static unsigned long getWord(const unsigned char *puc)
+{
+    return (unsigned long)puc[0] | (unsigned long)puc[1] << 8 |
+           (unsigned long)puc[2] << 16 | (unsigned long)puc[3] << 24;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Write the uLen bytes at pucData to fd. Return 1 on success, 0 on
+   failure. */
+static int writeAll(int fd, const unsigned char *pucData, size_t uLen)
+{
+    ssize_t iWritten;
+
+    while (uLen > 0) {
+        iWritten = write(fd, pucData, uLen);
+        if (iWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        pucData += iWritten;
+        uLen -= iWritten;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+/* Public functions:                                                  */
+/*--------------------------------------------------------------------*/
+
+Journal_T Journal_new(const char *pcFileName)
+{
+    Journal_T oJournal;
+
+    assert(pcFileName != NULL);
+
+    oJournal = (Journal_T)calloc(1, sizeof(struct Journal));
+    if (oJournal == NULL)
+        return NULL;
+
+    oJournal->fd = open(pcFileName, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (oJournal->fd < 0) {
+        free(oJournal);
+        return NULL;
+    }
+    pthread_mutex_init(&oJournal->sLock, NULL);
+    pthread_cond_init(&oJournal->sWritten, NULL);
+    return oJournal;
+}
+
+/*--------------------------------------------------------------------*/
+
+void Journal_free(Journal_T oJournal)
+{
+    assert(oJournal != NULL);
+
+    Journal_sync(oJournal);
+    close(oJournal->fd);
+    pthread_mutex_destroy(&oJournal->sLock);
+    pthread_cond_destroy(&oJournal->sWritten);
+    free(oJournal->sPending.pucData);
+    free(oJournal->sWriting.pucData);
+    free(oJournal);
+}
+
+/*--------------------------------------------------------------------*/
+
+int Journal_replay(Journal_T oJournal,
+                   void (*pfApply)(void *pvArg,
+                                   const unsigned char *pucRecord,
+                                   size_t uLen),
+                   void *pvArg)
+{
+    struct stat sStat;
+    unsigned char *pucFile;
+    size_t uFileLen;
+    size_t uOffset;
+    size_t uRead;
+    size_t uLen;
+    ssize_t iRead;
+    int iNumRecords;
+
+    assert(oJournal != NULL);
+    assert(pfApply != NULL);
+    assert(oJournal->ulAppended == 0);
+
+    if (fstat(oJournal->fd, &sStat) != 0)
+        return -1;
+    uFileLen = sStat.st_size;
+    pucFile = (unsigned char *)malloc(uFileLen + 1);
+    if (pucFile == NULL)
+        return -1;
+    for (uRead = 0; uRead < uFileLen; uRead += iRead) {
+        iRead = pread(oJournal->fd, pucFile + uRead, uFileLen - uRead,
+                      uRead);
+        if (iRead < 0 && errno == EINTR)
+            iRead = 0;
+        else if (iRead <= 0) {
+            free(pucFile);
+            return -1;
+        }
+    }
+
+    iNumRecords = 0;
+    for (uOffset = 0; uOffset + FRAMELEN <= uFileLen; uOffset += uLen) {
+        uLen = getWord(pucFile + uOffset);
+        if (uLen > uFileLen - uOffset - FRAMELEN ||
+            checksum(pucFile + uOffset, pucFile + uOffset + FRAMELEN, uLen)
+                != getWord(pucFile + uOffset + 4))
+            break;
+        uOffset += FRAMELEN;
+        pfApply(pvArg, pucFile + uOffset, uLen);
+        iNumRecords++;
+    }
+    free(pucFile);
+
+    // later appends must follow the last whole record
+    if (uOffset < uFileLen &&
+        (ftruncate(oJournal->fd, uOffset) != 0 ||
+         fdatasync(oJournal->fd) != 0))
+        return -1;
+    return iNumRecords;
+}
+
+/*--------------------------------------------------------------------*/
+
+int Journal_append(Journal_T oJournal,
+                   const void *pvFirst, size_t uFirstLen,
+                   const void *pvSecond, size_t uSecondLen)
+{
+    struct RecordBuf *psBuf;
+    unsigned char *pucFrame;
+    unsigned char *pucNew;
+    size_t uNeed;
+    size_t uNewCap;
+
+    assert(oJournal != NULL);
+    assert(pvFirst != NULL || uFirstLen == 0);
+    assert(pvSecond != NULL || uSecondLen == 0);
+
+    pthread_mutex_lock(&oJournal->sLock);
+    psBuf = &oJournal->sPending;
+    uNeed = psBuf->uLen + FRAMELEN + uFirstLen + uSecondLen;
+    if (uNeed > psBuf->uCap) {
+        uNewCap = psBuf->uCap > 0 ? psBuf->uCap : BUFMINCAP;
+        while (uNewCap < uNeed)
+            uNewCap *= 2;
+        pucNew = (unsigned char *)realloc(psBuf->pucData, uNewCap);
+        if (pucNew == NULL) {
+            oJournal->iFailed = 1;
+            pthread_mutex_unlock(&oJournal->sLock);
+            return 0;
+        }
+        psBuf->pucData = pucNew;
+        psBuf->uCap = uNewCap;
+    }
+
+    pucFrame = psBuf->pucData + psBuf->uLen;
+    putWord(pucFrame, uFirstLen + uSecondLen);
+    memcpy(pucFrame + FRAMELEN, pvFirst, uFirstLen);
+    memcpy(pucFrame + FRAMELEN + uFirstLen, pvSecond, uSecondLen);
+    putWord(pucFrame + 4, checksum(pucFrame, pucFrame + FRAMELEN,
+                                   uFirstLen + uSecondLen));
+    psBuf->uLen = uNeed;
+    oJournal->ulAppended++;
+    pthread_mutex_unlock(&oJournal->sLock);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+int Journal_sync(Journal_T oJournal)
+{
+    struct RecordBuf sBatch;
+    unsigned long ulTarget;
+    unsigned long ulBatch;
+    int iOK;
+
+    assert(oJournal != NULL);
+
+    pthread_mutex_lock(&oJournal->sLock);
+    ulTarget = oJournal->ulAppended;
+    while (!oJournal->iFailed && oJournal->ulDurable < ulTarget) {
+        if (oJournal->iWriting) {
+            pthread_cond_wait(&oJournal->sWritten, &oJournal->sLock);
+            continue;
+        }
+
+        // write everything pending, ours and that of the callers
+        // that queued up behind the last write
+        oJournal->iWriting = 1;
+        sBatch = oJournal->sPending;
+        oJournal->sPending = oJournal->sWriting;
+        oJournal->sPending.uLen = 0;
+        ulBatch = oJournal->ulAppended;
+        pthread_mutex_unlock(&oJournal->sLock);
+
+        iOK = writeAll(oJournal->fd, sBatch.pucData, sBatch.uLen) &&
+              fdatasync(oJournal->fd) == 0;
+
+        pthread_mutex_lock(&oJournal->sLock);
+        oJournal->sWriting = sBatch;
+        oJournal->iWriting = 0;
+        if (iOK)
+            oJournal->ulDurable = ulBatch;
+        else
+            oJournal->iFailed = 1;
+        pthread_cond_broadcast(&oJournal->sWritten);
+    }
+    iOK = !oJournal->iFailed;
+    pthread_mutex_unlock(&oJournal->sLock);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+int Journal_reset(Journal_T oJournal)
+{
+    assert(oJournal != NULL);
+
+    pthread_mutex_lock(&oJournal->sLock);
+    assert(!oJournal->iWriting);
+    oJournal->sPending.uLen = 0;
+    oJournal->ulDurable = oJournal->ulAppended;
+    pthread_mutex_unlock(&oJournal->sLock);
+
+    return ftruncate(oJournal->fd, 0) == 0 && fdatasync(oJournal->fd) == 0;
+}
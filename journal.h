@@ -0,0 +1,78 @@
+/*--------------------------------------------------------------------*/
+/* journal.h                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef JOURNAL_INCLUDED
+#define JOURNAL_INCLUDED
+
+#include <stddef.h>
+
+/* A Journal_T object is an append-only file of records. Records are
+   buffered in memory by Journal_append() and written and flushed to
+   disk by Journal_sync(). Each record carries its length and a
+   checksum, so a record torn by a crash is recognized on replay. */
+
+typedef struct Journal *Journal_T;
+
+/*--------------------------------------------------------------------*/
+
+/* Return a Journal object appending to the file pcFileName, which is
+   created if it does not exist. Return NULL if the file cannot be
+   opened or insufficient memory is available. */
+
+Journal_T Journal_new(const char *pcFileName);
+
+/*--------------------------------------------------------------------*/
+
+/* Write the records appended to oJournal and not yet synced, close
+   its file and free it. */
+
+void Journal_free(Journal_T oJournal);
+
+/*--------------------------------------------------------------------*/
+
+/* Call pfApply(pvArg, pucRecord, uLen) for every record in the file
+   of oJournal, oldest first. A torn or corrupted record and anything
+   after it are cut off the file. Must be called before any record is
+   appended. Return the number of records read, or -1 if the file
+   could not be read or insufficient memory is available. */
+
+int Journal_replay(Journal_T oJournal,
+                   void (*pfApply)(void *pvArg,
+                                   const unsigned char *pucRecord,
+                                   size_t uLen),
+                   void *pvArg);
+
+/*--------------------------------------------------------------------*/
+
+/* Append to oJournal a record made of the uFirstLen bytes at pvFirst
+   followed by the uSecondLen bytes at pvSecond. The record is
+   durable after the next Journal_sync(). Return 1 on success, 0 if
+   insufficient memory is available, in which case every later
+   Journal_sync() fails. */
+
+int Journal_append(Journal_T oJournal,
+                   const void *pvFirst, size_t uFirstLen,
+                   const void *pvSecond, size_t uSecondLen);
+
+/*--------------------------------------------------------------------*/
+
+/* Make every record appended to oJournal before the call durable.
+   Calls from several threads share the work: a caller that finds
+   a write in progress waits for it, and the first caller to wake
+   writes and flushes everything appended in the meantime with one
+   write and one fsync on behalf of all of them. Return 1 on success,
+   0 if a record was lost to a failed append or write. */
+
+int Journal_sync(Journal_T oJournal);
+
+/*--------------------------------------------------------------------*/
+
+/* Durably discard every record of oJournal, including records not
+   yet synced. Must not run concurrently with Journal_sync(). Return
+   1 on success, 0 if the file could not be truncated. */
+
+int Journal_reset(Journal_T oJournal);
+
+#endif
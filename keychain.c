@@ -5,624 +5,5722 @@
 
 #include "keychain.h"
 #include "keycrypto.h"
-#include "sha256.h"
+#include "keyhash.h"
+#include "parallel.h"
+#include "journal.h"
+#include "epoch.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef KEYCHAIN_STATS
+#include <time.h>
+#endif
 
 #define KEYLEN     8   // bytes
 #define HASHLEN    32  // bytes
-#define INTBUFLEN  (sizeof(int) * 8 + 1)            
+#define INTBUFLEN  (sizeof(int) * 8 + 1)
 #define KEYBUFLEN  (sizeof(unsigned char) * KEYLEN*2 + 1)
 #define HASHBUFLEN (sizeof(unsigned char) * HASHLEN*2 + 1)
+#define RECORDBUFLEN 256
+#define KEYCACHELEN  64    // cached plaintext keys, a power of 2
+#define INDEXMINCAP  16    // initial index slots, a power of 2
+#define KEYIDINLINE  16    // key IDs up to this length (with '\0')
+                           // are stored in the node
+#define NODEMINCAP   64    // initial node slots
+#define BLOCKCLASSES 32    // child blocks hold 1, 2, 4, ... slots
+#define BULKCHUNK    64    // nodes hashed per task by KeyChain_addKeys
+#define ROTATECHUNK  256   // children rehashed per task by
+                           // KeyChain_rotateKey
+#define AUDITCHUNK   1024  // node slots checked per task by
+                           // KeyChain_verifyAll
+#define SNAPALIGN    64    // alignment of snapshot arrays
+#define PURGEMINCAP  4     // initial revoked blocks awaiting purge
+#define HOLESCAN     64    // node slots KeyChain_purge() scans for holes
+                           // per key of its budget
+#define STAGEMINCAP  256   // initial bytes of journal records staged
+                           // by a transaction
+
+/* A key ID component from 255 up is written as COMPONENT_ESCAPE, its
+   number of digits and up to COMPONENT_DIGITS digits, see
+   keychain.h */
+#define COMPONENT_ESCAPE 0xff
+#define COMPONENT_DIGITS (KEYCHAIN_COMPONENTLEN - 2)
+
+/* Binary canonical records (KEYCHAIN_ENCODING_BINARY and _TREE) start
+   with a format version, 1 and 2 respectively, and a record kind,
+   followed by big endian fixed width fields:
+     node:     version, 'N', u32 ID length, ID, u32 parent ID length,
+               parent ID, encrypted key, intermediate hash, u32 type,
+               u32 depth[, u32 cipher]
+     children: 1, 'C', u32 count, count child node hashes
+               2, 'C', u32 count, child tree digest
+     tree:     2, 'T', left digest, right digest
+
+   The child tree is a balanced binary Merkle tree over the child node
+   hashes, oldest first. A run of n > 1 hashes is split after the
+   largest power of 2 below n, as in RFC 6962; a single hash is its
+   own digest. */
+#define BINARY_VERSION   1
+#define TREE_VERSION     2
+#define BINARY_NODE      'N'
+#define BINARY_CHILDREN  'C'
+#define BINARY_TREE      'T'
+#define BINARY_HDRLEN    2
 
 /*--------------------------------------------------------------------*/
 
-/* Each key is stored in a KeyNode, which are linked to form a key
-   chain. */
+/* Key nodes are addressed by their index into the node arrays of the
+   keychain. The root is node 0. */
 
-struct KeyNode
+typedef unsigned int NodeIdx;
+
+#define NONODE   ((NodeIdx)-1)
+#define ROOTNODE ((NodeIdx)0)
+
+/* Node flags */
+#define NODE_USED   0x01
+#define NODE_DIRTY  0x02   // intermediate and node hash need updating;
+                           // set on all ancestors of a dirty node
+#define NODE_HOLES  0x04   // some child slots are holes
+
+/*--------------------------------------------------------------------*/
+
+/* The fields of a key node used to walk the tree. The children of a
+   node are the first uNumChildren slots of its child block, oldest
+   first. Outside KEYCHAIN_ENCODING_TREE, removing a child other than
+   the youngest leaves an unused slot, a hole, that hashing skips and
+   KeyChain_purge() closes up later. Free child blocks are linked
+   through uFirstChild of their first slot. */
+
+struct KeyNodeLinks
 {
-    /* key ID */
-    char *pcKeyID;
+    /* index of parent, NONODE for the root */
+    NodeIdx uParent;
 
-    /* 64 bit encrypted key, encrypted by the parent key */
-    unsigned char *pucEncKey;
+    /* index of the first slot of the child block */
+    NodeIdx uFirstChild;
 
-    /* 256 bit intermediate hash or hash of the data */
-    unsigned char *pucInterHash;
+    /* number of direct children, holes included */
+    unsigned int uNumChildren;
+
+    /* slots in the child block, 0 or a power of 2 */
+    unsigned int uChildSlots;
 
-    /* 256 bit keyed hash of the key record */
-    unsigned char *pucHash;
+    /* last component of the key ID */
+    unsigned int uComponent;
+
+    /* depth of node */
+    int iDepth;
 
     /* type non-leaf: 0, leaf: 1 */
     int iType;
 
-    /* depth of node */
+    /* data cipher of a leaf, KEYCHAIN_CIPHER_* */
+    unsigned char ucCipher;
+
+    /* NODE_* flags */
+    unsigned char ucFlags;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* The key ID of a key node */
+
+struct KeyNodeID
+{
+    /* inline storage for short key IDs */
+    char acKeyID[KEYIDINLINE];
+
+    /* heap copy of a long key ID, or for an ID in the mapped snapshot
+       its offset times 2 plus 1; NULL if the ID is inline */
+    char *pcLongKeyID;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Generations of a key node, compared by KeyChain_verifyKey() to skip
+   paths that have not changed since they were last verified */
+
+struct NodeGen
+{
+    /* generation of the last change to the hashed contents of the
+       node, or of its last exposure to writes by the caller */
+    unsigned long ulChanged;
+
+    /* generation in which the path from the node to the root was last
+       verified, 0 if never */
+    unsigned long ulPathChecked;
+
+    /* generation in which the node moved into its slot; cached keys
+       and verifications of the slot from before belong to another
+       node */
+    unsigned long ulArrived;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* A cached plaintext key. The root key is never cached, so a slot
+   whose uNode is ROOTNODE is empty. Readers fill entries too, so an
+   entry is claimed by making its version odd while it is written. */
+
+struct KeyCacheEntry
+{
+    /* odd while the entry is being written */
+    unsigned long ulVersion;
+
+    /* generation the key was derived in; the key is stale if its node
+       arrived in its slot later */
+    unsigned long ulStamp;
+
+    /* key node the plaintext key belongs to */
+    NodeIdx uNode;
+
+    /* 64 bit plaintext key of uNode */
+    unsigned char aucKey[KEYLEN];
+};
+
+/*--------------------------------------------------------------------*/
+
+/* A slot of the key ID index. uNode is INDEX_EMPTY for a slot that
+   was never used and INDEX_TOMBSTONE for one whose key was removed,
+   so probe sequences stay intact. */
+
+struct IndexSlot
+{
+    /* hash of the key ID */
+    unsigned long ulHash;
+
+    /* key node with that ID */
+    NodeIdx uNode;
+};
+
+#define INDEX_EMPTY      NONODE
+#define INDEX_TOMBSTONE  (NONODE - 1)
+
+/*--------------------------------------------------------------------*/
+
+/* The interior digests of the child tree of a node, kept under
+   KEYCHAIN_ENCODING_TREE so that a changed child only rehashes its
+   path through the tree. They form a heap over uLeaves leaf positions,
+   a power of 2 no smaller than the number of children: digest i has
+   the halves 2i and 2i+1, and i >= uLeaves stands for the hash of
+   child i - uLeaves. A digest whose right half holds no children
+   equals its left half. */
+
+struct ChildTree
+{
+    /* uLeaves digests; NULL if the node has fewer than 2 children.
+       Digest 0 is unused and holds uLeaves, so a reader gets the
+       count that matches the array. */
+    unsigned char (*paucDigest)[HASHLEN];
+};
+
+/*--------------------------------------------------------------------*/
+
+/* The contents of a key node covered by its hash */
+
+struct NodeRecord
+{
+    const char *pcKeyID;
+    const char *pcParentKeyID;
+    const unsigned char *pucEncKey;
+    const unsigned char *pucInterHash;
+    int iType;
     int iDepth;
+    int iCipher;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* An update queued by KeyChain_updateKey() for the thread that applies
+   the updates of all waiting writers as one change */
+
+struct QueuedUpdate
+{
+    char *pcKeyID;
+    const unsigned char *pucInterHash;
+
+    /* 1 if applied, 0 if the key was not found; set by the combining
+       thread in iApplied and handed over in iResult, -1 until then */
+    int iApplied;
+    int iResult;
 
-    /* number of children */
-    int iNumChildren;
+    /* next older update */
+    struct QueuedUpdate *psNext;
+};
 
-    /* pointer to children (first child) */
-    struct KeyNode *psChild;
+/*--------------------------------------------------------------------*/
 
-    /* pointer to sibling node at same level */
-    struct KeyNode *psNext;
+/* The child block of a revoked key, whose nodes KeyChain_purge()
+   releases a slice at a time. Nodes go in post-order, so uCursor, the
+   next one, has no children left. */
 
-    /* pointer to parent */
-    struct KeyNode *psParent;
+struct PurgeBlock
+{
+    NodeIdx uFirst;
+    unsigned int uNumNodes;
+    unsigned int uSlots;
+    NodeIdx uCursor;
 };
 
 /*--------------------------------------------------------------------*/
 
-/* A KeyChain structure is an n-ary tree that points to the root
-   KeyNode. */
+/* A KeyChain structure is an n-ary tree stored as structure of
+   arrays: the links used for traversal are kept apart from the IDs
+   and from the 256 bit hashes, and siblings occupy consecutive
+   slots. */
 
 struct KeyChain
 {
     /* The number of keys in the key chain */
     int iNumKeys;
 
-    /* The address of the root node */
-    struct KeyNode *psRoot;
-};
+    /* Hash backend of the Merkle tree */
+    const struct KeyHash *psHash;
+
+    /* Record encoding fed to the hash, KEYCHAIN_ENCODING_* */
+    int iEncoding;
+
+    /* 1 if hashes of ancestors are updated by KeyChain_commit rather
+       than by every mutation */
+    int iDeferred;
+
+    /* Direct mapped cache of KEYCACHELEN derived plaintext keys, so
+       repeated use of a key does not decrypt its whole path to the
+       root */
+    struct KeyCacheEntry *psKeyCache;
+
+    /* Open addressing index from key ID to key node, linear probing
+       over uIndexCap slots (a power of 2) */
+    struct IndexSlot *psIndex;
+    size_t uIndexCap;
+
+    /* Index slots holding a node or a tombstone */
+    size_t uIndexUsed;
+
+    /* Node arrays, uNodeCap slots each */
+    struct KeyNodeLinks *psLinks;
+    struct KeyNodeID *psIDs;
+
+    /* 64 bit encrypted keys, encrypted by the parent key */
+    unsigned char (*paucEncKey)[KEYLEN];
+
+    /* 256 bit intermediate hashes or hashes of the data */
+    unsigned char (*paucInterHash)[HASHLEN];
+
+    /* 256 bit keyed hashes of the key records */
+    unsigned char (*paucHash)[HASHLEN];
+
+    /* Child trees, KEYCHAIN_ENCODING_TREE only */
+    struct ChildTree *psTrees;
+
+    /* Change and verification generations */
+    struct NodeGen *psGens;
+
+    /* Current generation, advanced by every mutation */
+    unsigned long ulGeneration;
+
+    /* Node slots ever handed out, and allocated */
+    NodeIdx uNumNodes;
+    NodeIdx uNodeCap;
+
+    /* Snapshot the arrays were mapped from by KeyChain_load(), NULL
+       if none. Arrays inside it are copied out when they grow. */
+    void *pvMap;
+    size_t uMapLen;
+
+    /* Number of child blocks of revoked keys in psPurge; while there
+       are any, lookups check that a node is linked */
+    size_t uNumPurge;
+
+#ifdef KEYCHAIN_STATS
+    /* Counters, bumped by readers too; NULL in the context of
+       KeyChain_verifyProof() */
+    struct KeyChainStats *psStats;
+#endif
+
+    /* The fields above are those readers use, which readView() copies;
+       the rest are only used by changes */
+
+    /* Free child blocks of 2^i slots */
+    NodeIdx auFreeBlocks[BLOCKCLASSES];
+
+    /* Journal every change is appended to, NULL if none */
+    Journal_T oJournal;
+
+    /* Number of the last checkpoint, 0 if none */
+    unsigned long ulCheckpoint;
+
+    /* Twice the number of changes made, plus 1 while one is being
+       made. Readers work on a copy of this structure and retry if the
+       count moved meanwhile. */
+    unsigned long ulSeq;
+
+    /* Nesting depth of the change being made */
+    int iChanging;
+
+    /* Held by the thread changing the keychain; recursive, since
+       changes nest */
+    pthread_mutex_t sChangeLock;
+
+    /* Updates waiting to be combined, newest first, and 1 while a
+       thread applies a batch of them; guarded by sQueueLock.
+       sApplied is signalled when a batch is done. */
+    pthread_mutex_t sQueueLock;
+    pthread_cond_t sApplied;
+    struct QueuedUpdate *psQueued;
+    int iCombining;
+
+    /* Child blocks of revoked keys not yet purged, uNumPurge used and
+       uPurgeCap allocated. Their nodes stay indexed meanwhile, but are
+       not linked into the tree. */
+    struct PurgeBlock *psPurge;
+    size_t uPurgeCap;
+
+    /* Number of nodes flagged NODE_HOLES, and the slot KeyChain_purge()
+       goes on looking for them from */
+    NodeIdx uNumHoly;
+    NodeIdx uHoleCursor;
+
+    /* Arrays shared copy-on-write with snapshots and transactions,
+       NULL if the keychain holds its arrays alone */
+    struct SharedArrays *psShared;
+
+    /* 1 for a snapshot, which cannot be changed */
+    int iReadOnly;
+
+    /* For a transaction, the keychain it commits to and the generation
+       of that keychain when it began; NULL otherwise */
+    KeyChain_T oBase;
+    unsigned long ulBaseGeneration;
+
+    /* Journal records of a transaction, each preceded by its u32
+       length, uStagedCap bytes allocated; iStageFailed is 1 once a
+       record could not be staged */
+    unsigned char *pucStaged;
+    size_t uStagedLen;
+    size_t uStagedCap;
+    int iStageFailed;
+
+    /* Arrays and IDs replaced by changes, freed once no reader can
+       see them */
+    Epoch_T oEpoch;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Node arrays shared by keychains, snapshots and transactions, which
+   hold them iRefs times. A holder that changes them first copies them
+   for itself, and the last one to let go frees them. */
+
+struct SharedArrays
+{
+    int iRefs;
+
+    /* the fields of the keychain the arrays were shared by; only
+       those describing the arrays are used */
+    struct KeyChain sOwner;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* The header of a snapshot file written by KeyChain_save(). The
+   arrays of the keychain follow at SNAPALIGN aligned offsets, in the
+   native layout, so they can be mapped and used in place. The root
+   key is not saved. */
+
+#define SNAP_MAGIC     "KEYCHAIN"
+#define SNAP_VERSION   3
+#define SNAP_BYTEORDER 0x01020304
+
+enum {SNAP_LINKS, SNAP_IDS, SNAP_ENCKEYS, SNAP_INTERHASHES, SNAP_HASHES,
+      SNAP_INDEX, SNAP_LONGIDS, SNAP_ARRAYS};
+
+struct SnapshotHeader
+{
+    /* SNAP_MAGIC, SNAP_VERSION and SNAP_BYTEORDER */
+    char acMagic[8];
+    unsigned int uVersion;
+    unsigned int uByteOrder;
+
+    /* sizes of the node and index records, which must match */
+    unsigned int uLinksSize;
+    unsigned int uIDSize;
+    unsigned int uSlotSize;
+
+    /* the keychain fields */
+    int iHashType;
+    int iEncoding;
+    int iNumKeys;
+    NodeIdx uNumNodes;
+    NodeIdx auFreeBlocks[BLOCKCLASSES];
+    unsigned long ulIndexCap;
+    unsigned long ulIndexUsed;
+
+    /* file offsets of the arrays, and of the end of the file */
+    unsigned long aulOffset[SNAP_ARRAYS];
+    unsigned long ulFileLen;
+
+    /* number of the checkpoint the snapshot was written by */
+    unsigned long ulCheckpoint;
+};
+
+/* Journal records written for every change by KeyChain_openJournal():
+   the record type, an argument byte, data of a length fixed by the
+   type, and the key ID with its terminating null. A journal starts
+   with a JOURNAL_BASE record naming the checkpoint it follows, with
+   the 8 byte checkpoint number, little endian, as its data. A
+   committed transaction is a single JOURNAL_BATCH record, so it is
+   replayed whole or not at all: in place of data and key ID come its
+   records, each preceded by its u32 length. */
+
+#define JOURNAL_BASE      'B'
+#define JOURNAL_ADD       'A'   // arg: type, data: encrypted key
+#define JOURNAL_REMOVE    'R'
+#define JOURNAL_UPDATE    'U'   // data: intermediate hash
+#define JOURNAL_CIPHER    'C'   // arg: cipher
+#define JOURNAL_ENCODING  'E'   // arg: encoding
+#define JOURNAL_ROTATE    'K'   // data: new encrypted key
+#define JOURNAL_BATCH     'T'   // records of a transaction
+#define JOURNAL_HDRLEN    2
+
+/* An inclusion proof written by KeyChain_prove(): PROOF_VERSION, the
+   hash type and the encoding, a byte each, then the entry of the
+   root. The entry of a node other than the root starts with its
+   encrypted key, u32 type and u32 cipher. Then comes the u32 number k
+   of its children in the proof; if k is 0, its intermediate hash
+   follows. Otherwise its u32 number of children n follows, and k
+   times the u32 position of a child, ascending, its u32 key ID suffix
+   length, the suffix and its entry; then what else the children
+   record needs: under KEYCHAIN_ENCODING_TREE the digests of the
+   child tree ranges without a child in the proof, left to right,
+   otherwise the hashes of the other n - k children, oldest first.
+   Integers are big endian. */
+
+#define PROOF_VERSION   1
+#define PROOF_HDRLEN    3
+#define PROOF_MAXDEPTH  4096   // deepest entry KeyChain_verifyProof()
+                               // follows
+
+/* Hooks counting into the struct KeyChainStats of a keychain. Built
+   without KEYCHAIN_STATS, a keychain has no counters and the hooks
+   compile to nothing. */
+
+#ifdef KEYCHAIN_STATS
+#define STAT_NEW(o)               statNew(o)
+#define STAT_FREE(o)              free((o)->psStats)
+#define STAT_ADD(o, field, n)     statAdd((o), \
+                                          offsetof(struct KeyChainStats, \
+                                                   field), (n))
+#define STAT_HASH(o, uLen)        statHash((o), (uLen))
+#define STAT_MULTI(o, auLen, n)   statMulti((o), (auLen), (n))
+#define STAT_START(ulStart)       ((ulStart) = statClock())
+#define STAT_OP(o, iOp, ulStart)  statOp((o), (iOp), (ulStart))
+#else
+#define STAT_NEW(o)               1
+#define STAT_FREE(o)              ((void)0)
+#define STAT_ADD(o, field, n)     ((void)0)
+#define STAT_HASH(o, uLen)        ((void)0)
+#define STAT_MULTI(o, auLen, n)   ((void)0)
+#define STAT_START(ulStart)       ((ulStart) = 0)
+#define STAT_OP(o, iOp, ulStart)  ((void)(ulStart))
+#endif
+
+/*--------------------------------------------------------------------*/
+/* Private functions:                                                 */
+/*--------------------------------------------------------------------*/
+
+/* Return the base 2 logarithm of ul > 0, rounded down */
+static int floorLog2(unsigned long ul)
+{
+    assert(ul > 0);
+
+    return (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(ul);
+}
+
+/*--------------------------------------------------------------------*/
+
+#ifdef KEYCHAIN_STATS
+
+/* Give oKeyChain zeroed counters. Return 1 on success, 0 if
+   insufficient memory is available. */
+static int statNew(KeyChain_T oKeyChain)
+{
+    oKeyChain->psStats = (struct KeyChainStats *)
+        calloc(1, sizeof(struct KeyChainStats));
+    return oKeyChain->psStats != NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add ul to the counter at byte offset uOffset of the counters of
+   oKeyChain, if it has any */
+static void statAdd(KeyChain_T oKeyChain, size_t uOffset, unsigned long ul)
+{
+    if (oKeyChain->psStats == NULL)
+        return;
+    __atomic_fetch_add((unsigned long *)((char *)oKeyChain->psStats +
+                                         uOffset),
+                       ul, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Count a message of uLen bytes hashed by oKeyChain, estimating its
+   compression blocks: SHA-256 appends at least 9 bytes of padding;
+   BLAKE2s pads to a whole block, and an empty message takes one. */
+static void statHash(KeyChain_T oKeyChain, size_t uLen)
+{
+    unsigned long ulBlocks;
+
+    if (oKeyChain->psHash->iType == KEYHASH_SHA256)
+        ulBlocks = (uLen + 9 + 63) / 64;
+    else
+        ulBlocks = uLen > 0 ? (uLen + 63) / 64 : 1;
+    STAT_ADD(oKeyChain, ulHashes, 1);
+    STAT_ADD(oKeyChain, ulEstimatedBlocks, ulBlocks);
+    STAT_ADD(oKeyChain, ulBytesHashed, uLen);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Count the uNum messages of auLen bytes hashed by oKeyChain */
+static void statMulti(KeyChain_T oKeyChain, const size_t auLen[],
+                      size_t uNum)
+{
+    size_t u;
+
+    for (u = 0; u < uNum; u++)
+        statHash(oKeyChain, auLen[u]);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the monotonic clock in nanoseconds */
+static unsigned long statClock(void)
+{
+    struct timespec sNow;
+
+    clock_gettime(CLOCK_MONOTONIC, &sNow);
+    return (unsigned long)sNow.tv_sec * 1000000000UL + sNow.tv_nsec;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Count a call of the operation iOp of oKeyChain that began at
+   ulStart */
+static void statOp(KeyChain_T oKeyChain, int iOp, unsigned long ulStart)
+{
+    struct KeyChainStats *psStats = oKeyChain->psStats;
+    unsigned long ulElapsed = statClock() - ulStart;
+    int iBucket;
+
+    iBucket = ulElapsed > 0 ? floorLog2(ulElapsed) : 0;
+    if (iBucket >= KEYCHAIN_LATENCYBUCKETS)
+        iBucket = KEYCHAIN_LATENCYBUCKETS - 1;
+    __atomic_fetch_add(&psStats->aulOps[iOp], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&psStats->aaulLatency[iOp][iBucket], 1,
+                       __ATOMIC_RELAXED);
+}
+
+#endif
+
+/*--------------------------------------------------------------------*/
+
+/* Return the long key ID of psID in oKeyChain, or NULL if the ID is
+   inline */
+static const char *longKeyID(KeyChain_T oKeyChain, struct KeyNodeID *psID)
+{
+    uintptr_t uLong = (uintptr_t)__atomic_load_n(&psID->pcLongKeyID,
+                                                 __ATOMIC_ACQUIRE);
+
+    if (uLong & 1)
+        return (char *)oKeyChain->pvMap + (uLong >> 1);
+    return (const char *)uLong;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the key ID of uNode in oKeyChain */
+static const char *keyIDOf(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    const char *pcKeyID = longKeyID(oKeyChain, &oKeyChain->psIDs[uNode]);
+
+    if (pcKeyID != NULL)
+        return pcKeyID;
+    return oKeyChain->psIDs[uNode].acKeyID;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the key ID of uNode in oKeyChain, which may be the view of a
+   reader while the keychain changes. An inline ID is copied to
+   pcInline, which must hold KEYIDINLINE bytes, so it cannot change
+   while in use; long IDs never change and are retired, not freed. */
+static const char *readKeyID(KeyChain_T oKeyChain, NodeIdx uNode,
+                             char *pcInline)
+{
+    const char *pcKeyID = longKeyID(oKeyChain, &oKeyChain->psIDs[uNode]);
+
+    if (pcKeyID != NULL)
+        return pcKeyID;
+    memcpy(pcInline, oKeyChain->psIDs[uNode].acKeyID, KEYIDINLINE);
+    pcInline[KEYIDINLINE - 1] = '\0';
+    return pcInline;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Overwrite uLength bytes at pv with zeros in a way the compiler
+   cannot elide */
+static void wipe(void *pv, size_t uLength)
+{
+    volatile unsigned char *pucIter = (volatile unsigned char *)pv;
+
+    while (uLength-- > 0)
+        *pucIter++ = 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if pv points into the snapshot mapped by oKeyChain, 0
+   otherwise */
+static int isMapped(KeyChain_T oKeyChain, const void *pv)
+{
+    const char *pcMap = (const char *)oKeyChain->pvMap;
+
+    return pcMap != NULL && (const char *)pv >= pcMap &&
+           (const char *)pv < pcMap + oKeyChain->uMapLen;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Free the array pv of oKeyChain unless it lives in the snapshot */
+static void freeArray(KeyChain_T oKeyChain, void *pv)
+{
+    if (!isMapped(oKeyChain, pv))
+        free(pv);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Free the replaced array pv of oKeyChain once no reader can see it,
+   unless it lives in the snapshot */
+static void retireArray(KeyChain_T oKeyChain, void *pv)
+{
+    if (!isMapped(oKeyChain, pv))
+        Epoch_retire(oKeyChain->oEpoch, pv);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the number of leaf positions of the child tree paucDigest,
+   0 if it is NULL */
+static unsigned int treeLeaves(unsigned char (*paucDigest)[HASHLEN])
+{
+    unsigned int uLeaves;
+
+    if (paucDigest == NULL)
+        return 0;
+    memcpy(&uLeaves, paucDigest[0], sizeof(uLeaves));
+    return uLeaves;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Free the node arrays and index of oKeyChain, the long key IDs and
+   child trees they point to, and the snapshot they may be mapped
+   from. No reader may be using them. */
+static void freeNodeArrays(KeyChain_T oKeyChain)
+{
+    char *pcLongKeyID;
+    NodeIdx u;
+
+    for (u = 0; u < oKeyChain->uNumNodes; u++) {
+        if (oKeyChain->psLinks[u].ucFlags & NODE_USED) {
+            pcLongKeyID = oKeyChain->psIDs[u].pcLongKeyID;
+            if (!((uintptr_t)pcLongKeyID & 1))
+                free(pcLongKeyID);
+            free(oKeyChain->psTrees[u].paucDigest);
+        }
+    }
+    if (oKeyChain->paucEncKey != NULL)
+        wipe(oKeyChain->paucEncKey[ROOTNODE], KEYLEN);
+    freeArray(oKeyChain, oKeyChain->psLinks);
+    freeArray(oKeyChain, oKeyChain->psIDs);
+    freeArray(oKeyChain, oKeyChain->paucEncKey);
+    freeArray(oKeyChain, oKeyChain->paucInterHash);
+    freeArray(oKeyChain, oKeyChain->paucHash);
+    freeArray(oKeyChain, oKeyChain->psIndex);
+    free(oKeyChain->psTrees);
+    free(oKeyChain->psGens);
+    if (oKeyChain->pvMap != NULL)
+        munmap(oKeyChain->pvMap, oKeyChain->uMapLen);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Drop a hold on the struct SharedArrays pvShared, freeing the arrays
+   with the last one. Takes a void pointer so that a hold can be
+   retired to an epoch. */
+static void releaseArrays(void *pvShared)
+{
+    struct SharedArrays *psShared = (struct SharedArrays *)pvShared;
+
+    if (__atomic_sub_fetch(&psShared->iRefs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    freeNodeArrays(&psShared->sOwner);
+    free(psShared);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Share the arrays of oKeyChain, which must not change meanwhile, and
+   return a new hold on them, or NULL if insufficient memory is
+   available */
+static struct SharedArrays *shareArrays(KeyChain_T oKeyChain)
+{
+    struct SharedArrays *psShared = oKeyChain->psShared;
+
+    if (psShared == NULL) {
+        psShared = (struct SharedArrays *)malloc(sizeof(*psShared));
+        if (psShared == NULL)
+            return NULL;
+        memcpy(&psShared->sOwner, oKeyChain, sizeof(struct KeyChain));
+        psShared->iRefs = 1;
+        oKeyChain->psShared = psShared;
+    }
+    __atomic_add_fetch(&psShared->iRefs, 1, __ATOMIC_RELAXED);
+    return psShared;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return a new array of uCap bytes starting with the uLen bytes at
+   pv, or NULL if insufficient memory is available */
+static void *copyArray(const void *pv, size_t uLen, size_t uCap)
+{
+    void *pvNew = malloc(uCap);
+
+    if (pvNew != NULL && uLen > 0)
+        memcpy(pvNew, pv, uLen);
+    return pvNew;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Give oKeyChain arrays of its own in place of the ones it shares,
+   copying them unless no one else holds them any more. Its hold is
+   released once no reader can see the shared ones. Called in a
+   change. Return 1 on success, 0 if insufficient memory is available,
+   leaving oKeyChain unchanged. */
+static int unshareArrays(KeyChain_T oKeyChain)
+{
+    struct SharedArrays *psShared = oKeyChain->psShared;
+    struct KeyChain sCopy;
+    NodeIdx uNumNodes = oKeyChain->uNumNodes;
+    NodeIdx uNodeCap = oKeyChain->uNodeCap;
+    unsigned int uLeaves;
+    const char *pcLongKeyID;
+    NodeIdx u;
+
+    // only holders share, and oKeyChain holds the changes, so a count
+    // of 1 cannot go up
+    if (__atomic_load_n(&psShared->iRefs, __ATOMIC_ACQUIRE) == 1) {
+        free(psShared);
+        oKeyChain->psShared = NULL;
+        return 1;
+    }
+
+    memset(&sCopy, 0, sizeof(sCopy));
+    sCopy.psLinks = (struct KeyNodeLinks *)
+        copyArray(oKeyChain->psLinks, uNumNodes * sizeof(struct KeyNodeLinks),
+                  uNodeCap * sizeof(struct KeyNodeLinks));
+    sCopy.psIDs = (struct KeyNodeID *)
+        copyArray(oKeyChain->psIDs, uNumNodes * sizeof(struct KeyNodeID),
+                  uNodeCap * sizeof(struct KeyNodeID));
+    sCopy.paucEncKey = (unsigned char (*)[KEYLEN])
+        copyArray(oKeyChain->paucEncKey, uNumNodes * KEYLEN,
+                  uNodeCap * KEYLEN);
+    sCopy.paucInterHash = (unsigned char (*)[HASHLEN])
+        copyArray(oKeyChain->paucInterHash, uNumNodes * HASHLEN,
+                  uNodeCap * HASHLEN);
+    sCopy.paucHash = (unsigned char (*)[HASHLEN])
+        copyArray(oKeyChain->paucHash, uNumNodes * HASHLEN,
+                  uNodeCap * HASHLEN);
+    sCopy.psTrees = (struct ChildTree *)
+        copyArray(oKeyChain->psTrees, uNumNodes * sizeof(struct ChildTree),
+                  uNodeCap * sizeof(struct ChildTree));
+    sCopy.psGens = (struct NodeGen *)
+        copyArray(oKeyChain->psGens, uNumNodes * sizeof(struct NodeGen),
+                  uNodeCap * sizeof(struct NodeGen));
+    sCopy.psIndex = (struct IndexSlot *)
+        copyArray(oKeyChain->psIndex,
+                  oKeyChain->uIndexCap * sizeof(struct IndexSlot),
+                  oKeyChain->uIndexCap * sizeof(struct IndexSlot));
+    if (sCopy.psLinks == NULL || sCopy.psIDs == NULL ||
+        sCopy.paucEncKey == NULL || sCopy.paucInterHash == NULL ||
+        sCopy.paucHash == NULL || sCopy.psTrees == NULL ||
+        sCopy.psGens == NULL || sCopy.psIndex == NULL) {
+        freeNodeArrays(&sCopy);
+        return 0;
+    }
+
+    // long key IDs, mapped ones too, and child trees are copied as
+    // well, so that freeing the copy leaves the shared ones alone
+    for (u = 0; u < uNumNodes; u++) {
+        sCopy.psIDs[u].pcLongKeyID = NULL;
+        sCopy.psTrees[u].paucDigest = NULL;
+    }
+    sCopy.uNumNodes = uNumNodes;
+    for (u = 0; u < uNumNodes; u++) {
+        if (!(sCopy.psLinks[u].ucFlags & NODE_USED))
+            continue;
+        pcLongKeyID = longKeyID(oKeyChain, &oKeyChain->psIDs[u]);
+        if (pcLongKeyID != NULL) {
+            sCopy.psIDs[u].pcLongKeyID = (char *)
+                copyArray(pcLongKeyID, strlen(pcLongKeyID) + 1,
+                          strlen(pcLongKeyID) + 1);
+            if (sCopy.psIDs[u].pcLongKeyID == NULL)
+                break;
+        }
+        uLeaves = treeLeaves(oKeyChain->psTrees[u].paucDigest);
+        if (uLeaves > 0) {
+            sCopy.psTrees[u].paucDigest = (unsigned char (*)[HASHLEN])
+                copyArray(oKeyChain->psTrees[u].paucDigest,
+                          uLeaves * HASHLEN, uLeaves * HASHLEN);
+            if (sCopy.psTrees[u].paucDigest == NULL)
+                break;
+        }
+    }
+    if (u < uNumNodes) {
+        freeNodeArrays(&sCopy);
+        return 0;
+    }
+
+    oKeyChain->psLinks = sCopy.psLinks;
+    oKeyChain->psIDs = sCopy.psIDs;
+    oKeyChain->paucEncKey = sCopy.paucEncKey;
+    oKeyChain->paucInterHash = sCopy.paucInterHash;
+    oKeyChain->paucHash = sCopy.paucHash;
+    oKeyChain->psTrees = sCopy.psTrees;
+    oKeyChain->psGens = sCopy.psGens;
+    oKeyChain->psIndex = sCopy.psIndex;
+    oKeyChain->pvMap = NULL;
+    oKeyChain->uMapLen = 0;
+    oKeyChain->psShared = NULL;
+    Epoch_retireWith(oKeyChain->oEpoch, psShared, releaseArrays);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Initialize the locks of oKeyChain */
+static void initLocks(KeyChain_T oKeyChain)
+{
+    pthread_mutexattr_t sAttr;
+
+    pthread_mutexattr_init(&sAttr);
+    pthread_mutexattr_settype(&sAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&oKeyChain->sChangeLock, &sAttr);
+    pthread_mutexattr_destroy(&sAttr);
+    pthread_mutex_init(&oKeyChain->sQueueLock, NULL);
+    pthread_cond_init(&oKeyChain->sApplied, NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Keep other threads from changing oKeyChain until the matching
+   unlockChanges(). Readers are not held up. */
+static void lockChanges(KeyChain_T oKeyChain)
+{
+    pthread_mutex_lock(&oKeyChain->sChangeLock);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void unlockChanges(KeyChain_T oKeyChain)
+{
+    pthread_mutex_unlock(&oKeyChain->sChangeLock);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* End a change of oKeyChain started by beginChange(), and free what
+   earlier changes replaced and no reader can see any more */
+static void endChange(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain->iChanging > 0);
+
+    if (--oKeyChain->iChanging > 0) {
+        unlockChanges(oKeyChain);
+        return;
+    }
+    __atomic_store_n(&oKeyChain->ulSeq, oKeyChain->ulSeq + 1,
+                     __ATOMIC_RELEASE);
+    Epoch_reclaim(oKeyChain->oEpoch);
+    unlockChanges(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Start a change of oKeyChain, waiting for any change by another
+   thread to end. Changes nest; readers that overlap the outermost one
+   retry. Shared arrays are copied first. Return 1 on success, 0 if
+   oKeyChain is a snapshot or insufficient memory is available to copy
+   its arrays, in which case no change is started. */
+static int beginChange(KeyChain_T oKeyChain)
+{
+    if (oKeyChain->iReadOnly)
+        return 0;
+
+    lockChanges(oKeyChain);
+    if (oKeyChain->iChanging++ > 0)
+        return 1;
+    __atomic_store_n(&oKeyChain->ulSeq, oKeyChain->ulSeq + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (oKeyChain->psShared != NULL && !unshareArrays(oKeyChain)) {
+        endChange(oKeyChain);
+        return 0;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if oKeyChain has not changed since the change count ulSeq
+   was read, so everything read from it since is consistent, 0
+   otherwise */
+static int readValid(KeyChain_T oKeyChain, unsigned long ulSeq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&oKeyChain->ulSeq, __ATOMIC_RELAXED) == ulSeq;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Copy the fields of oKeyChain readers use, as they are between two
+   changes, to psView and return the change count they were taken at.
+   A change in progress is waited out. The rest of psView, locks
+   included, is left alone. The caller must be inside the epoch of
+   oKeyChain, which keeps the arrays of the view allocated; whether
+   their contents still match the view is told by readValid(). */
+static unsigned long readView(KeyChain_T oKeyChain, struct KeyChain *psView)
+{
+    unsigned long ulSeq;
+
+    do {
+        while ((ulSeq = __atomic_load_n(&oKeyChain->ulSeq,
+                                        __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        memcpy(psView, oKeyChain, offsetof(struct KeyChain, auFreeBlocks));
+    } while (!readValid(oKeyChain, ulSeq));
+    return ulSeq;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Drop the long key ID of uNode in oKeyChain, if it has one, freeing
+   it once no reader can see it if it is on the heap */
+static void freeKeyID(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    char *pcLongKeyID = oKeyChain->psIDs[uNode].pcLongKeyID;
+
+    __atomic_store_n(&oKeyChain->psIDs[uNode].pcLongKeyID, NULL,
+                     __ATOMIC_RELAXED);
+    if (!((uintptr_t)pcLongKeyID & 1))
+        Epoch_retire(oKeyChain->oEpoch, pcLongKeyID);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the key ID of the parent of uNode in oKeyChain, "0" for the
+   root */
+static const char *parentKeyIDOf(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    NodeIdx uParent = oKeyChain->psLinks[uNode].uParent;
+
+    if (uParent == NONODE)
+        return "0";
+    return keyIDOf(oKeyChain, uParent);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the length of the key ID component at pcIn and place its
+   value in *puComponent, or return 0 if pcIn does not start with a
+   valid component */
+static size_t readComponent(const char *pcIn, unsigned int *puComponent)
+{
+    const unsigned char *pucIn = (const unsigned char *)pcIn;
+    unsigned long ulValue;
+    size_t uNumDigits;
+    size_t u;
+
+    if (pucIn[0] == '\0')
+        return 0;
+    if (pucIn[0] != COMPONENT_ESCAPE) {
+        *puComponent = pucIn[0];
+        return 1;
+    }
+
+    uNumDigits = pucIn[1];
+    if (uNumDigits == 0 || uNumDigits > COMPONENT_DIGITS)
+        return 0;
+    ulValue = 0;
+    for (u = 0; u < uNumDigits; u++) {
+        if (pucIn[2 + u] == '\0')
+            return 0;
+        ulValue = ulValue * 255 + pucIn[2 + u];
+        if (ulValue > KEYCHAIN_COMPONENTMAX)
+            return 0;
+    }
+
+    // a component with a one byte form has no other
+    if (ulValue < COMPONENT_ESCAPE)
+        return 0;
+    *puComponent = (unsigned int)ulValue;
+    return 2 + uNumDigits;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the offset of the last component of the key ID pcKeyID, or 0
+   if pcKeyID is the root or not a valid key ID */
+static size_t lastComponent(const char *pcKeyID)
+{
+    unsigned int uComponent;
+    size_t uOffset;
+    size_t uLast;
+    size_t uLen;
+
+    if (pcKeyID[0] != '0')
+        return 0;
+    uLast = 0;
+    for (uOffset = 1; pcKeyID[uOffset] != '\0'; uOffset += uLen) {
+        uLen = readComponent(pcKeyID + uOffset, &uComponent);
+        if (uLen == 0)
+            return 0;
+        uLast = uOffset;
+    }
+    return uLast;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Write the nonzero component uComponent to pcOut without a '\0' and
+   return its length */
+static size_t putComponent(unsigned int uComponent, char *pcOut)
+{
+    unsigned char aucDigits[COMPONENT_DIGITS];
+    unsigned long ulValue = uComponent;
+    size_t uNumDigits = 0;
+    size_t u;
+
+    if (uComponent < COMPONENT_ESCAPE) {
+        pcOut[0] = (char)uComponent;
+        return 1;
+    }
+
+    // bijective base 255, so that no digit is '\0'
+    while (ulValue > 0) {
+        aucDigits[uNumDigits] = (unsigned char)((ulValue - 1) % 255 + 1);
+        ulValue = (ulValue - aucDigits[uNumDigits]) / 255;
+        uNumDigits++;
+    }
+    pcOut[0] = (char)COMPONENT_ESCAPE;
+    pcOut[1] = (char)uNumDigits;
+    for (u = 0; u < uNumDigits; u++)
+        pcOut[2 + u] = (char)aucDigits[uNumDigits - 1 - u];
+    return 2 + uNumDigits;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Fill psRecord with the contents of uNode in oKeyChain */
+static void recordOf(KeyChain_T oKeyChain, NodeIdx uNode,
+                     struct NodeRecord *psRecord)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+
+    psRecord->pcKeyID = keyIDOf(oKeyChain, uNode);
+    psRecord->pcParentKeyID = parentKeyIDOf(oKeyChain, uNode);
+    psRecord->pucEncKey = oKeyChain->paucEncKey[uNode];
+    psRecord->pucInterHash = oKeyChain->paucInterHash[uNode];
+    psRecord->iType = psLinks->iType;
+    psRecord->iDepth = psLinks->iDepth;
+    psRecord->iCipher = psLinks->ucCipher;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Upper bound on the length of psRecord serialized in any encoding */
+static size_t recordLen(const struct NodeRecord *psRecord)
+{
+    return strlen(psRecord->pcKeyID) + strlen(psRecord->pcParentKeyID)
+           + KEYBUFLEN + HASHBUFLEN + 3 * INTBUFLEN;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Write the 32 bit value u to pucBuf in big endian order and return
+   the address just past it */
+static unsigned char *putU32(unsigned char *pucBuf, unsigned long u)
+{
+    pucBuf[0] = (u >> 24) & 0xff;
+    pucBuf[1] = (u >> 16) & 0xff;
+    pucBuf[2] = (u >> 8) & 0xff;
+    pucBuf[3] = u & 0xff;
+    return pucBuf + 4;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the 32 bit big endian value at pucBuf */
+static unsigned long getU32(const unsigned char *pucBuf)
+{
+    return (unsigned long)pucBuf[0] << 24 | (unsigned long)pucBuf[1] << 16 |
+           (unsigned long)pucBuf[2] << 8 | (unsigned long)pucBuf[3];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the format version of the binary records of oKeyChain */
+static unsigned char recordVersion(KeyChain_T oKeyChain)
+{
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE)
+        return TREE_VERSION;
+    return BINARY_VERSION;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Serialize the key node psRecord into pcBuf using the encoding of
+   oKeyChain. The cipher is only recorded when it is not the default,
+   so records of XOR keys are unchanged. pcBuf must hold
+   recordLen(psRecord) bytes. Return the number of bytes written. */
+static size_t serializeRecord(KeyChain_T oKeyChain,
+                              const struct NodeRecord *psRecord,
+                              char *pcBuf)
+{
+    const char *pcKeyID = psRecord->pcKeyID;
+    const char *pcParentKeyID = psRecord->pcParentKeyID;
+    char *pcIter;
+    unsigned char *pucIter;
+    size_t uLen;
+
+    assert(pcBuf != NULL);
+
+    if (oKeyChain->iEncoding != KEYCHAIN_ENCODING_TEXT) {
+        pucIter = (unsigned char *)pcBuf;
+        *pucIter++ = recordVersion(oKeyChain);
+        *pucIter++ = BINARY_NODE;
+
+        uLen = strlen(pcKeyID);
+        pucIter = putU32(pucIter, uLen);
+        memcpy(pucIter, pcKeyID, uLen);
+        pucIter += uLen;
+
+        uLen = strlen(pcParentKeyID);
+        pucIter = putU32(pucIter, uLen);
+        memcpy(pucIter, pcParentKeyID, uLen);
+        pucIter += uLen;
+
+        memcpy(pucIter, psRecord->pucEncKey, KEYLEN);
+        pucIter += KEYLEN;
+
+        memcpy(pucIter, psRecord->pucInterHash, HASHLEN);
+        pucIter += HASHLEN;
+
+        pucIter = putU32(pucIter, psRecord->iType);
+        pucIter = putU32(pucIter, psRecord->iDepth);
+        if (psRecord->iCipher != KEYCHAIN_CIPHER_XOR)
+            pucIter = putU32(pucIter, psRecord->iCipher);
+
+        return pucIter - (unsigned char *)pcBuf;
+    }
+
+    pcIter = pcBuf;
+
+    strcpy(pcIter, pcKeyID);
+    pcIter += strlen(pcIter);
+
+    strcpy(pcIter, pcParentKeyID);
+    pcIter += strlen(pcIter);
+
+    arrToString((unsigned char *)psRecord->pucEncKey, pcIter, KEYLEN);
+    pcIter += strlen(pcIter);
+
+    arrToString((unsigned char *)psRecord->pucInterHash, pcIter, HASHLEN);
+    pcIter += strlen(pcIter);
+
+    intToString(psRecord->iType, pcIter);
+    pcIter += strlen(pcIter);
+
+    intToString(psRecord->iDepth, pcIter);
+    pcIter += strlen(pcIter);
+
+    if (psRecord->iCipher != KEYCHAIN_CIPHER_XOR) {
+        intToString(psRecord->iCipher, pcIter);
+        pcIter += strlen(pcIter);
+    }
+
+    return pcIter - pcBuf;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* 256 bit hash of the key node record psRecord in the encoding of
+   oKeyChain */
+static void hashRecord(KeyChain_T oKeyChain,
+                       const struct NodeRecord *psRecord,
+                       unsigned char *hash)
+{
+    char acRecord[RECORDBUFLEN];
+    char *pcRecord;
+    size_t uLen;
+
+    assert(hash != NULL);
+
+    // long key IDs spill over to the heap
+    pcRecord = acRecord;
+    if (recordLen(psRecord) > RECORDBUFLEN) {
+        pcRecord = (char *)malloc(recordLen(psRecord));
+        if (pcRecord == NULL) {
+            memset(hash, 0, HASHLEN);
+            return;
+        }
+    }
+    uLen = serializeRecord(oKeyChain, psRecord, pcRecord);
+
+    // compute hash over all the contents
+    KeyHash_digest(oKeyChain->psHash, (unsigned char *)pcRecord, uLen,
+                   hash);
+    STAT_HASH(oKeyChain, uLen);
+
+    if (pcRecord != acRecord)
+        free(pcRecord);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* 256 bit hash of the key node uNode in oKeyChain */
+static void hashKeyNode(KeyChain_T oKeyChain, NodeIdx uNode,
+                        unsigned char *hash)
+{
+    struct NodeRecord sRecord;
+
+    recordOf(oKeyChain, uNode, &sRecord);
+    hashRecord(oKeyChain, &sRecord, hash);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the key cache slot of uNode in oKeyChain */
+static struct KeyCacheEntry *keyCacheSlot(KeyChain_T oKeyChain,
+                                          NodeIdx uNode)
+{
+    unsigned long ulHash = uNode * 2654435761UL;
+
+    return &oKeyChain->psKeyCache[(ulHash >> 8) & (KEYCACHELEN - 1)];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Claim the key cache entry psEntry for writing and place the version
+   to release it with in *pulVersion. Return 1 on success, 0 if
+   another thread is writing it. */
+static int claimEntry(struct KeyCacheEntry *psEntry,
+                      unsigned long *pulVersion)
+{
+    unsigned long ulVersion = __atomic_load_n(&psEntry->ulVersion,
+                                              __ATOMIC_RELAXED);
+
+    if ((ulVersion & 1) ||
+        !__atomic_compare_exchange_n(&psEntry->ulVersion, &ulVersion,
+                                     ulVersion + 1, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *pulVersion = ulVersion + 2;
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Place the cached key of uNode in oKeyChain, which may be the view
+   of a reader, in pucOutput. Return 1 if it was cached and is
+   current, 0 otherwise. */
+static int cachedKey(KeyChain_T oKeyChain, NodeIdx uNode,
+                     unsigned char *pucOutput)
+{
+    struct KeyCacheEntry *psEntry = keyCacheSlot(oKeyChain, uNode);
+    unsigned long ulVersion;
+    int iHit;
+
+    ulVersion = __atomic_load_n(&psEntry->ulVersion, __ATOMIC_ACQUIRE);
+    if (ulVersion & 1)
+        return 0;
+    iHit = psEntry->uNode == uNode &&
+           psEntry->ulStamp >= oKeyChain->psGens[uNode].ulArrived;
+    if (iHit)
+        memcpy(pucOutput, psEntry->aucKey, KEYLEN);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return iHit &&
+           __atomic_load_n(&psEntry->ulVersion, __ATOMIC_RELAXED) == ulVersion;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Cache the plaintext key pucKey of uNode in oKeyChain, derived in
+   generation ulStamp, evicting the previous occupant. An entry that
+   another thread is writing is left alone. */
+static void cacheKey(KeyChain_T oKeyChain, NodeIdx uNode,
+                     const unsigned char *pucKey, unsigned long ulStamp)
+{
+    struct KeyCacheEntry *psEntry = keyCacheSlot(oKeyChain, uNode);
+    unsigned long ulVersion;
+
+    if (!claimEntry(psEntry, &ulVersion))
+        return;
+    psEntry->uNode = uNode;
+    psEntry->ulStamp = ulStamp;
+    memcpy(psEntry->aucKey, pucKey, KEYLEN);
+    __atomic_store_n(&psEntry->ulVersion, ulVersion, __ATOMIC_RELEASE);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Wipe the cached key of uNode from oKeyChain, if any. Readers are
+   kept from using it by the generation its successor arrives in;
+   this only keeps the plaintext from lingering. */
+static void evictKey(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyCacheEntry *psEntry = keyCacheSlot(oKeyChain, uNode);
+    unsigned long ulVersion;
+
+    if (!claimEntry(psEntry, &ulVersion))
+        return;
+    if (psEntry->uNode == uNode) {
+        wipe(psEntry->aucKey, KEYLEN);
+        psEntry->uNode = ROOTNODE;
+    }
+    __atomic_store_n(&psEntry->ulVersion, ulVersion, __ATOMIC_RELEASE);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to get the plaintext key of uNode, which
+   is iDepth levels below the root of oKeyChain, placing the result in
+   pucOutput. Only ancestors missing from the key cache are decrypted,
+   and if iCache, the keys derived on the way are cached. oKeyChain
+   may be the view of a reader: return 0 if the path does not reach
+   the root in iDepth steps, 1 otherwise. */
+static int derivePlainKey(KeyChain_T oKeyChain, NodeIdx uNode, int iDepth,
+                          int iCache, unsigned char *pucOutput)
+{
+    unsigned char aucParentPlainKey[KEYLEN];
+
+    STAT_ADD(oKeyChain, ulNodesVisited, 1);
+    if (uNode == ROOTNODE) {    // is root, return UMK
+        memcpy(pucOutput, oKeyChain->paucEncKey[uNode], KEYLEN);
+        return 1;
+    }
+    if (iDepth <= 0 || uNode >= oKeyChain->uNumNodes)
+        return 0;
+
+    if (cachedKey(oKeyChain, uNode, pucOutput))
+        return 1;
+
+    if (!derivePlainKey(oKeyChain, oKeyChain->psLinks[uNode].uParent,
+                        iDepth - 1, iCache, aucParentPlainKey))
+        return 0;
+    xor_decrypt(oKeyChain->paucEncKey[uNode], pucOutput, KEYLEN,
+                aucParentPlainKey);
+    wipe(aucParentPlainKey, KEYLEN);
+
+    // a node may still move in the current generation, so the key is
+    // only trusted for nodes that arrived before it
+    if (iCache)
+        cacheKey(oKeyChain, uNode, pucOutput, oKeyChain->ulGeneration - 1);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Get the plaintext key of uNode in oKeyChain, placing the result in
+   pucOutput, and cache the keys derived on the way. Return
+   pucOutput. */
+static unsigned char *getPlainKey(KeyChain_T oKeyChain, NodeIdx uNode,
+                                  unsigned char *pucOutput)
+{
+    derivePlainKey(oKeyChain, uNode, oKeyChain->psLinks[uNode].iDepth, 1,
+                   pucOutput);
+    return pucOutput;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the FNV-1a hash of the key ID pcKeyID */
+static unsigned long hashKeyID(const char *pcKeyID)
+{
+    unsigned long ulHash = 2166136261UL;
+
+    while (*pcKeyID != '\0') {
+        ulHash ^= (unsigned char)*pcKeyID++;
+        ulHash *= 16777619UL;
+    }
+    return ulHash;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the index slot of key ID pcKeyID with hash ulHash in
+   oKeyChain, or the empty slot that ends its probe sequence. oKeyChain
+   may be the view of a reader, which gets NULL if it finds neither. */
+static struct IndexSlot *findSlot(KeyChain_T oKeyChain,
+                                  const char *pcKeyID,
+                                  unsigned long ulHash)
+{
+    struct IndexSlot *psSlot;
+    size_t uMask = oKeyChain->uIndexCap - 1;
+    char acInline[KEYIDINLINE];
+    NodeIdx uNode;
+    size_t uProbes;
+    size_t u;
+
+    u = ulHash & uMask;
+    for (uProbes = 0; uProbes < oKeyChain->uIndexCap; uProbes++) {
+        psSlot = &oKeyChain->psIndex[u];
+        uNode = psSlot->uNode;
+        if (uNode == INDEX_EMPTY ||
+            (uNode < oKeyChain->uNumNodes && psSlot->ulHash == ulHash &&
+             strcmp(readKeyID(oKeyChain, uNode, acInline), pcKeyID) == 0)) {
+            STAT_ADD(oKeyChain, ulProbes, uProbes + 1);
+            return psSlot;
+        }
+        u = (u + 1) & uMask;
+    }
+    STAT_ADD(oKeyChain, ulProbes, uProbes);
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Rebuild the index of oKeyChain with uCap slots, dropping all
+   tombstones. Return 1 on success, 0 if insufficient memory is
+   available. */
+static int resizeIndex(KeyChain_T oKeyChain, size_t uCap)
+{
+    struct IndexSlot *psOld = oKeyChain->psIndex;
+    size_t uOldCap = oKeyChain->uIndexCap;
+    struct IndexSlot *psSlot;
+    size_t u;
+
+    oKeyChain->psIndex = (struct IndexSlot *)malloc(uCap *
+                                                    sizeof(struct IndexSlot));
+    if (oKeyChain->psIndex == NULL) {
+        oKeyChain->psIndex = psOld;
+        return 0;
+    }
+    for (u = 0; u < uCap; u++)
+        oKeyChain->psIndex[u].uNode = INDEX_EMPTY;
+    oKeyChain->uIndexCap = uCap;
+    oKeyChain->uIndexUsed = 0;
+
+    for (u = 0; u < uOldCap; u++) {
+        if (psOld[u].uNode == INDEX_EMPTY ||
+            psOld[u].uNode == INDEX_TOMBSTONE)
+            continue;
+        psSlot = findSlot(oKeyChain, keyIDOf(oKeyChain, psOld[u].uNode),
+                          psOld[u].ulHash);
+        *psSlot = psOld[u];
+        oKeyChain->uIndexUsed++;
+    }
+    retireArray(oKeyChain, psOld);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Make room in the index of oKeyChain for one more key, keeping it
+   at most half full. Return 1 on success, 0 if insufficient memory is
+   available. */
+static int reserveIndex(KeyChain_T oKeyChain)
+{
+    size_t uCap;
+
+    if ((oKeyChain->uIndexUsed + 1) * 2 <= oKeyChain->uIndexCap)
+        return 1;
+
+    // size for the live keys; mostly tombstones just get swept out
+    uCap = INDEXMINCAP;
+    while (uCap < ((size_t)oKeyChain->iNumKeys + 2) * 4)
+        uCap *= 2;
+    return resizeIndex(oKeyChain, uCap);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add uNode to the index of oKeyChain, which must have room for it */
+static void indexKeyNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    const char *pcKeyID = keyIDOf(oKeyChain, uNode);
+    unsigned long ulHash = hashKeyID(pcKeyID);
+    struct IndexSlot *psSlot;
+
+    psSlot = findSlot(oKeyChain, pcKeyID, ulHash);
+
+    // a revoked key not yet purged gives its ID up
+    if (psSlot->uNode == INDEX_EMPTY)
+        oKeyChain->uIndexUsed++;
+    else
+        assert(oKeyChain->uNumPurge > 0);
+    psSlot->ulHash = ulHash;
+    psSlot->uNode = uNode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the index slot of the indexed node uNode in oKeyChain */
+static struct IndexSlot *slotOf(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    const char *pcKeyID = keyIDOf(oKeyChain, uNode);
+    struct IndexSlot *psSlot;
+
+    psSlot = findSlot(oKeyChain, pcKeyID, hashKeyID(pcKeyID));
+    assert(psSlot->uNode == uNode);
+    return psSlot;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if uNode of oKeyChain, which may be the view of a reader,
+   is linked into the tree, 0 if it is in a revoked subtree not yet
+   purged. A node is linked if it is among the children of its parent,
+   and so on up to the root. Depths must fall by one per step, so a
+   torn view cannot loop. */
+static int isLinked(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks sLinks = oKeyChain->psLinks[uNode];
+    struct KeyNodeLinks sParent;
+
+    while (uNode != ROOTNODE) {
+        if (!(sLinks.ucFlags & NODE_USED) || sLinks.iDepth <= 0 ||
+            sLinks.uParent >= oKeyChain->uNumNodes)
+            return 0;
+        sParent = oKeyChain->psLinks[sLinks.uParent];
+        if (!(sParent.ucFlags & NODE_USED) ||
+            sParent.iDepth != sLinks.iDepth - 1 ||
+            uNode - sParent.uFirstChild >= sParent.uNumChildren)
+            return 0;
+        uNode = sLinks.uParent;
+        sLinks = sParent;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if child slot u of the node with the links psLinks in
+   oKeyChain, which may be the view of a reader, is a hole, 0
+   otherwise */
+static int isHole(KeyChain_T oKeyChain, const struct KeyNodeLinks *psLinks,
+                  unsigned int u)
+{
+    return (psLinks->ucFlags & NODE_HOLES) &&
+           !(oKeyChain->psLinks[psLinks->uFirstChild + u].ucFlags &
+             NODE_USED);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the number of children of the node with the links psLinks in
+   oKeyChain, which may be the view of a reader, holes left out */
+static unsigned int numChildren(KeyChain_T oKeyChain,
+                                const struct KeyNodeLinks *psLinks)
+{
+    unsigned int uNum = psLinks->uNumChildren;
+    unsigned int u;
+
+    if (psLinks->ucFlags & NODE_HOLES) {
+        for (u = 0; u < psLinks->uNumChildren; u++)
+            uNum -= isHole(oKeyChain, psLinks, u);
+    }
+    return uNum;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the keynode of pcKeyID in oKeyChain, which may be the view
+   of a reader, or NONODE if there is none */
+static NodeIdx getKeyNode(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    struct IndexSlot *psSlot;
+    NodeIdx uNode;
+
+    psSlot = findSlot(oKeyChain, pcKeyID, hashKeyID(pcKeyID));
+    if (psSlot == NULL)
+        return NONODE;
+    uNode = psSlot->uNode;
+    if (uNode >= oKeyChain->uNumNodes)
+        return NONODE;
+
+    // keys of revoked subtrees stay indexed until they are purged
+    if (oKeyChain->uNumPurge > 0 && !isLinked(oKeyChain, uNode))
+        return NONODE;
+    return uNode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Grow the node array pv of oKeyChain from uOldLen to uNewLen bytes.
+   The array is copied rather than reallocated, since readers may still
+   be reading the old one, which is retired. Return the new array, or
+   NULL if insufficient memory is available. */
+static void *growArray(KeyChain_T oKeyChain, void *pv, size_t uOldLen,
+                       size_t uNewLen)
+{
+    void *pvNew;
+
+    pvNew = malloc(uNewLen);
+    if (pvNew == NULL)
+        return NULL;
+    if (uOldLen > 0)
+        memcpy(pvNew, pv, uOldLen);
+    retireArray(oKeyChain, pv);
+    return pvNew;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Grow the node arrays of oKeyChain to at least uMinCap slots. Return
+   1 on success, 0 if insufficient memory is available. */
+static int growNodes(KeyChain_T oKeyChain, NodeIdx uMinCap)
+{
+    NodeIdx uOldCap = oKeyChain->uNodeCap;
+    NodeIdx uCap = uOldCap;
+    void *pv;
+
+    if (uCap >= uMinCap)
+        return 1;
+    if (uCap < NODEMINCAP)
+        uCap = NODEMINCAP;
+    while (uCap < uMinCap)
+        uCap *= 2;
+
+    // arrays that were grown before a failure simply stay larger
+    pv = growArray(oKeyChain, oKeyChain->psLinks,
+                   uOldCap * sizeof(struct KeyNodeLinks),
+                   uCap * sizeof(struct KeyNodeLinks));
+    if (pv == NULL)
+        return 0;
+    oKeyChain->psLinks = (struct KeyNodeLinks *)pv;
+
+    pv = growArray(oKeyChain, oKeyChain->psIDs,
+                   uOldCap * sizeof(struct KeyNodeID),
+                   uCap * sizeof(struct KeyNodeID));
+    if (pv == NULL)
+        return 0;
+    oKeyChain->psIDs = (struct KeyNodeID *)pv;
+
+    pv = growArray(oKeyChain, oKeyChain->paucEncKey, uOldCap * KEYLEN,
+                   uCap * KEYLEN);
+    if (pv == NULL)
+        return 0;
+    oKeyChain->paucEncKey = (unsigned char (*)[KEYLEN])pv;
+
+    pv = growArray(oKeyChain, oKeyChain->paucInterHash, uOldCap * HASHLEN,
+                   uCap * HASHLEN);
+    if (pv == NULL)
+        return 0;
+    oKeyChain->paucInterHash = (unsigned char (*)[HASHLEN])pv;
+
+    pv = growArray(oKeyChain, oKeyChain->paucHash, uOldCap * HASHLEN,
+                   uCap * HASHLEN);
+    if (pv == NULL)
+        return 0;
+    oKeyChain->paucHash = (unsigned char (*)[HASHLEN])pv;
+
+    pv = growArray(oKeyChain, oKeyChain->psTrees,
+                   uOldCap * sizeof(struct ChildTree),
+                   uCap * sizeof(struct ChildTree));
+    if (pv == NULL)
+        return 0;
+    oKeyChain->psTrees = (struct ChildTree *)pv;
+
+    pv = growArray(oKeyChain, oKeyChain->psGens,
+                   uOldCap * sizeof(struct NodeGen),
+                   uCap * sizeof(struct NodeGen));
+    if (pv == NULL)
+        return 0;
+    oKeyChain->psGens = (struct NodeGen *)pv;
+
+    oKeyChain->uNodeCap = uCap;
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the first slot of a free block of 2^iClass node slots in
+   oKeyChain, or NONODE if insufficient memory is available. May move
+   the node arrays. */
+static NodeIdx allocBlock(KeyChain_T oKeyChain, int iClass)
+{
+    NodeIdx uFirst = oKeyChain->auFreeBlocks[iClass];
+    NodeIdx uSlots = (NodeIdx)1 << iClass;
+    NodeIdx u;
+
+    if (uFirst != NONODE) {
+        oKeyChain->auFreeBlocks[iClass] =
+            oKeyChain->psLinks[uFirst].uFirstChild;
+        return uFirst;
+    }
+
+    uFirst = oKeyChain->uNumNodes;
+    if (uFirst + uSlots < uFirst ||
+        !growNodes(oKeyChain, uFirst + uSlots))
+        return NONODE;
+    for (u = uFirst; u < uFirst + uSlots; u++) {
+        oKeyChain->psLinks[u].ucFlags = 0;
+        oKeyChain->psIDs[u].pcLongKeyID = NULL;
+        oKeyChain->psTrees[u].paucDigest = NULL;
+        oKeyChain->psGens[u].ulChanged = 0;
+        oKeyChain->psGens[u].ulPathChecked = 0;
+        oKeyChain->psGens[u].ulArrived = 0;
+    }
+    oKeyChain->uNumNodes += uSlots;
+    return uFirst;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the block of 2^iClass node slots starting at uFirst to
+   oKeyChain. Its slots must be unused. */
+static void freeBlock(KeyChain_T oKeyChain, NodeIdx uFirst, int iClass)
+{
+    oKeyChain->psLinks[uFirst].uFirstChild = oKeyChain->auFreeBlocks[iClass];
+    oKeyChain->auFreeBlocks[iClass] = uFirst;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return log2 of the power of 2 uSlots */
+static int blockClass(unsigned int uSlots)
+{
+    int iClass = 0;
+
+    while ((1u << iClass) < uSlots)
+        iClass++;
+    return iClass;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Move the used node uFrom of oKeyChain to the unused slot uTo,
+   updating its children, the index and the key cache. Pointers are
+   copied whole, as readers may load them at any time. */
+static void moveNode(KeyChain_T oKeyChain, NodeIdx uFrom, NodeIdx uTo)
+{
+    struct KeyNodeLinks *psLinks;
+    struct IndexSlot *psSlot;
+    struct NodeGen *psGen;
+    unsigned int u;
+
+    psSlot = slotOf(oKeyChain, uFrom);
+
+    oKeyChain->psLinks[uTo] = oKeyChain->psLinks[uFrom];
+    memcpy(oKeyChain->psIDs[uTo].acKeyID, oKeyChain->psIDs[uFrom].acKeyID,
+           KEYIDINLINE);
+    __atomic_store_n(&oKeyChain->psIDs[uTo].pcLongKeyID,
+                     oKeyChain->psIDs[uFrom].pcLongKeyID, __ATOMIC_RELEASE);
+    memcpy(oKeyChain->paucEncKey[uTo], oKeyChain->paucEncKey[uFrom], KEYLEN);
+    memcpy(oKeyChain->paucInterHash[uTo], oKeyChain->paucInterHash[uFrom],
+           HASHLEN);
+    memcpy(oKeyChain->paucHash[uTo], oKeyChain->paucHash[uFrom], HASHLEN);
+    __atomic_store_n(&oKeyChain->psTrees[uTo].paucDigest,
+                     oKeyChain->psTrees[uFrom].paucDigest, __ATOMIC_RELEASE);
+
+    // readers may still cache keys of, or mark verified, the previous
+    // node of uTo; arriving now keeps that from sticking to this one
+    psGen = &oKeyChain->psGens[uTo];
+    psGen->ulChanged = oKeyChain->psGens[uFrom].ulChanged;
+    psGen->ulArrived = oKeyChain->ulGeneration;
+
+    psLinks = &oKeyChain->psLinks[uTo];
+    for (u = 0; u < psLinks->uNumChildren; u++)
+        oKeyChain->psLinks[psLinks->uFirstChild + u].uParent = uTo;
+
+    psSlot->uNode = uTo;
+    evictKey(oKeyChain, uFrom);
+
+    oKeyChain->psLinks[uFrom].ucFlags = 0;
+    __atomic_store_n(&oKeyChain->psIDs[uFrom].pcLongKeyID, NULL,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&oKeyChain->psTrees[uFrom].paucDigest, NULL,
+                     __ATOMIC_RELAXED);
+    oKeyChain->psGens[uFrom].ulArrived = oKeyChain->ulGeneration;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Move the children of uNode in oKeyChain down over the holes among
+   them, keeping their order, and clear its NODE_HOLES flag. Return the
+   number of children moved. */
+static int closeHoles(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    NodeIdx uFirst = psLinks->uFirstChild;
+    unsigned int uTo = 0;
+    unsigned int u;
+    int iMoved = 0;
+
+    assert(psLinks->ucFlags & NODE_HOLES);
+
+    for (u = 0; u < psLinks->uNumChildren; u++) {
+        if (!(oKeyChain->psLinks[uFirst + u].ucFlags & NODE_USED))
+            continue;
+        if (u != uTo) {
+            moveNode(oKeyChain, uFirst + u, uFirst + uTo);
+            iMoved++;
+        }
+        uTo++;
+    }
+    psLinks->uNumChildren = uTo;
+    psLinks->ucFlags &= ~NODE_HOLES;
+    oKeyChain->uNumHoly--;
+    return iMoved;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Append an unused slot to the children of uParent in oKeyChain,
+   doubling its child block when full, and return it. Holes are closed
+   up first if that makes room. Return NONODE if insufficient memory is
+   available. May move the node arrays. */
+static NodeIdx addChildSlot(KeyChain_T oKeyChain, NodeIdx uParent)
+{
+    struct KeyNodeLinks *psParent = &oKeyChain->psLinks[uParent];
+    unsigned int uSlots = psParent->uChildSlots;
+    NodeIdx uOldFirst = psParent->uFirstChild;
+    unsigned int uNumChildren;
+    NodeIdx uNewFirst;
+    unsigned int u;
+
+    if (psParent->uNumChildren == uSlots &&
+        (psParent->ucFlags & NODE_HOLES))
+        closeHoles(oKeyChain, uParent);
+    uNumChildren = psParent->uNumChildren;
+
+    if (uNumChildren == uSlots) {
+        uNewFirst = allocBlock(oKeyChain, blockClass(uSlots ? 2 * uSlots : 1));
+        if (uNewFirst == NONODE)
+            return NONODE;
+
+        for (u = 0; u < uNumChildren; u++)
+            moveNode(oKeyChain, uOldFirst + u, uNewFirst + u);
+        if (uSlots > 0)
+            freeBlock(oKeyChain, uOldFirst, blockClass(uSlots));
+
+        psParent = &oKeyChain->psLinks[uParent];
+        psParent->uFirstChild = uNewFirst;
+        psParent->uChildSlots = uSlots ? 2 * uSlots : 1;
+    }
+
+    psParent->uNumChildren++;
+    return psParent->uFirstChild + uNumChildren;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Set the key ID of the unused slot uNode in oKeyChain to pcKeyID.
+   Return 1 on success, 0 if insufficient memory is available. */
+static int setKeyID(KeyChain_T oKeyChain, NodeIdx uNode,
+                    const char *pcKeyID)
+{
+    struct KeyNodeID *psID = &oKeyChain->psIDs[uNode];
+    size_t uLen = strlen(pcKeyID) + 1;
+    char *pcLongKeyID;
+
+    psID->pcLongKeyID = NULL;
+    if (uLen <= KEYIDINLINE) {
+        memcpy(psID->acKeyID, pcKeyID, uLen);
+        return 1;
+    }
+
+    pcLongKeyID = (char *)malloc(uLen);
+    if (pcLongKeyID == NULL)
+        return 0;
+    memcpy(pcLongKeyID, pcKeyID, uLen);
+    __atomic_store_n(&psID->pcLongKeyID, pcLongKeyID, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Drop the child tree of uNode in oKeyChain */
+static void freeChildTree(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    Epoch_retire(oKeyChain->oEpoch, oKeyChain->psTrees[uNode].paucDigest);
+    __atomic_store_n(&oKeyChain->psTrees[uNode].paucDigest, NULL,
+                     __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Release the node uNode of oKeyChain, which is or is about to be
+   unlinked from the tree: it leaves the index, unless a newer key took
+   its ID over, and the key cache. Its child block is left to the
+   caller. */
+static void releaseNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    const char *pcKeyID = keyIDOf(oKeyChain, uNode);
+    struct IndexSlot *psSlot;
+
+    psSlot = findSlot(oKeyChain, pcKeyID, hashKeyID(pcKeyID));
+    if (psSlot->uNode == uNode)
+        psSlot->uNode = INDEX_TOMBSTONE;
+    evictKey(oKeyChain, uNode);
+
+    freeKeyID(oKeyChain, uNode);
+    freeChildTree(oKeyChain, uNode);
+    if (oKeyChain->psLinks[uNode].ucFlags & NODE_HOLES)
+        oKeyChain->uNumHoly--;
+    oKeyChain->psLinks[uNode].ucFlags = 0;
+    oKeyChain->psGens[uNode].ulArrived = oKeyChain->ulGeneration;
+    oKeyChain->iNumKeys--;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the first used slot from uNode up to uEnd in oKeyChain, or
+   uEnd if there is none */
+static NodeIdx nextUsed(KeyChain_T oKeyChain, NodeIdx uNode, NodeIdx uEnd)
+{
+    while (uNode < uEnd && !(oKeyChain->psLinks[uNode].ucFlags & NODE_USED))
+        uNode++;
+    return uNode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the first node of the subtree of uNode in oKeyChain in
+   post-order */
+static NodeIdx firstPostOrder(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    NodeIdx uChild;
+
+    while (psLinks->uNumChildren > 0) {
+        uChild = nextUsed(oKeyChain, psLinks->uFirstChild,
+                          psLinks->uFirstChild + psLinks->uNumChildren);
+        if (uChild == psLinks->uFirstChild + psLinks->uNumChildren)
+            break;
+        uNode = uChild;
+        psLinks = &oKeyChain->psLinks[uNode];
+    }
+    return uNode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Unlink uNode from oKeyChain and release it. Its descendants are left
+   for purgeBlock(): their child block is placed in *psPurge, whose
+   uNumNodes is 0 if there are none. */
+static void detachKeyNode(KeyChain_T oKeyChain, NodeIdx uNode,
+                          struct PurgeBlock *psPurge)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    NodeIdx uParent = psLinks->uParent;
+    struct KeyNodeLinks *psParent = &oKeyChain->psLinks[uParent];
+    NodeIdx uLast = psParent->uFirstChild + psParent->uNumChildren - 1;
+    NodeIdx uEnd = psLinks->uFirstChild + psLinks->uNumChildren;
+    NodeIdx u;
+
+    psPurge->uFirst = psLinks->uFirstChild;
+    psPurge->uNumNodes = psLinks->uNumChildren;
+    psPurge->uSlots = psLinks->uChildSlots;
+    u = psPurge->uNumNodes > 0 ? nextUsed(oKeyChain, psPurge->uFirst, uEnd)
+                               : uEnd;
+    if (u < uEnd)
+        psPurge->uCursor = firstPostOrder(oKeyChain, u);
+    else {
+        if (psPurge->uSlots > 0)
+            freeBlock(oKeyChain, psPurge->uFirst,
+                      blockClass(psPurge->uSlots));
+        psPurge->uNumNodes = 0;
+    }
+    releaseNode(oKeyChain, uNode);
+
+    // the slot is left as a hole, so no sibling moves now; the detached
+    // children still name uNode as parent, but are not among the
+    // children of whichever node moves in later. Child tree leaves
+    // are positions, so there younger siblings move down at once.
+    if (uNode == uLast)
+        psParent->uNumChildren--;
+    else if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE) {
+        for (u = uNode; u < uLast; u++)
+            moveNode(oKeyChain, u + 1, u);
+        psParent->uNumChildren--;
+    }
+    else if (!(psParent->ucFlags & NODE_HOLES)) {
+        psParent->ucFlags |= NODE_HOLES;
+        oKeyChain->uNumHoly++;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Release up to iMaxNodes nodes of the detached child block psPurge
+   of oKeyChain and their descendants, in post-order, without
+   recursion. A child block is freed once its nodes are released.
+   Return the number of nodes released; psPurge->uNumNodes is 0 once
+   all are. */
+static int purgeBlock(KeyChain_T oKeyChain, struct PurgeBlock *psPurge,
+                      int iMaxNodes)
+{
+    struct KeyNodeLinks *psLinks;
+    NodeIdx uNode;
+    NodeIdx uParent;
+    NodeIdx uEnd;
+    int iTop;
+    int iCount;
+
+    for (iCount = 0; iCount < iMaxNodes && psPurge->uNumNodes > 0;
+         iCount++) {
+        uNode = psPurge->uCursor;
+        psLinks = &oKeyChain->psLinks[uNode];
+        uParent = psLinks->uParent;
+        if (psLinks->uChildSlots > 0)
+            freeBlock(oKeyChain, psLinks->uFirstChild,
+                      blockClass(psLinks->uChildSlots));
+        releaseNode(oKeyChain, uNode);
+
+        // the subtree of the next sibling follows, then the parent
+        iTop = uNode - psPurge->uFirst < psPurge->uNumNodes;
+        if (iTop)
+            uEnd = psPurge->uFirst + psPurge->uNumNodes;
+        else
+            uEnd = oKeyChain->psLinks[uParent].uFirstChild +
+                   oKeyChain->psLinks[uParent].uNumChildren;
+        uNode = nextUsed(oKeyChain, uNode + 1, uEnd);
+        if (uNode < uEnd)
+            psPurge->uCursor = firstPostOrder(oKeyChain, uNode);
+        else if (!iTop)
+            psPurge->uCursor = uParent;
+        else {
+            freeBlock(oKeyChain, psPurge->uFirst,
+                      blockClass(psPurge->uSlots));
+            psPurge->uNumNodes = 0;
+        }
+    }
+    return iCount;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Remove uNode and its descendants from oKeyChain, leaving a hole in
+   its parent's child block unless it was the last child */
+static void removeKeyNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct PurgeBlock sPurge;
+
+    detachKeyNode(oKeyChain, uNode, &sPurge);
+    purgeBlock(oKeyChain, &sPurge, INT_MAX);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Digest of a child tree node whose halves have the digests pucLeft
+   and pucRight, placed in pucOut. pucOut may be either half. */
+static void hashTreePair(KeyChain_T oKeyChain, const unsigned char *pucLeft,
+                         const unsigned char *pucRight,
+                         unsigned char *pucOut)
+{
+    unsigned char aucRecord[BINARY_HDRLEN + 2 * HASHLEN];
+
+    aucRecord[0] = TREE_VERSION;
+    aucRecord[1] = BINARY_TREE;
+    memcpy(aucRecord + BINARY_HDRLEN, pucLeft, HASHLEN);
+    memcpy(aucRecord + BINARY_HDRLEN + HASHLEN, pucRight, HASHLEN);
+    KeyHash_digest(oKeyChain->psHash, aucRecord, sizeof(aucRecord), pucOut);
+    STAT_HASH(oKeyChain, sizeof(aucRecord));
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to compute the child tree digest of the
+   uCount > 0 adjacent hashes at paucLeaf from scratch and place it in
+   pucOut */
+static void merkleRoot(KeyChain_T oKeyChain,
+                       unsigned char (*paucLeaf)[HASHLEN],
+                       unsigned int uCount, unsigned char *pucOut)
+{
+    unsigned char aucLeft[HASHLEN];
+    unsigned char aucRight[HASHLEN];
+    unsigned int uSplit = 1;
+
+    assert(uCount > 0);
+
+    if (uCount == 1) {
+        memcpy(pucOut, paucLeaf[0], HASHLEN);
+        return;
+    }
+
+    while (2 * uSplit < uCount)
+        uSplit *= 2;
+    merkleRoot(oKeyChain, paucLeaf, uSplit, aucLeft);
+    merkleRoot(oKeyChain, paucLeaf + uSplit, uCount - uSplit, aucRight);
+    hashTreePair(oKeyChain, aucLeft, aucRight, pucOut);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return digest i of the child tree paucDigest of the node with the
+   links psLinks in oKeyChain */
+static unsigned char *treeDigest(KeyChain_T oKeyChain,
+                                 const struct KeyNodeLinks *psLinks,
+                                 unsigned char (*paucDigest)[HASHLEN],
+                                 unsigned int i)
+{
+    unsigned int uLeaves = treeLeaves(paucDigest);
+
+    if (i >= uLeaves)
+        return oKeyChain->paucHash[psLinks->uFirstChild + i - uLeaves];
+    return paucDigest[i];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recompute the interior digest i of the child tree of uNode in
+   oKeyChain, which spans uWidth leaf positions */
+static void updateTreeNode(KeyChain_T oKeyChain, NodeIdx uNode,
+                           unsigned int i, unsigned int uWidth)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned char (*paucDigest)[HASHLEN] =
+        oKeyChain->psTrees[uNode].paucDigest;
+    unsigned int uLeaves = treeLeaves(paucDigest);
+    unsigned int uHalf = uWidth / 2;
+
+    // digests over no children are never read
+    if (i * uWidth - uLeaves >= psLinks->uNumChildren)
+        return;
+
+    if ((2 * i + 1) * uHalf - uLeaves >= psLinks->uNumChildren)
+        memcpy(paucDigest[i],
+               treeDigest(oKeyChain, psLinks, paucDigest, 2 * i), HASHLEN);
+    else
+        hashTreePair(oKeyChain,
+                     treeDigest(oKeyChain, psLinks, paucDigest, 2 * i),
+                     treeDigest(oKeyChain, psLinks, paucDigest, 2 * i + 1),
+                     paucDigest[i]);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Bring the child tree of uNode in oKeyChain up to date after the
+   hashes of its children at positions uFirst to uLast changed or
+   moved. Under other encodings, or if the tree cannot be allocated,
+   uNode is left without a tree. */
+static void updateChildTree(KeyChain_T oKeyChain, NodeIdx uNode,
+                            unsigned int uFirst, unsigned int uLast)
+{
+    struct ChildTree *psTree = &oKeyChain->psTrees[uNode];
+    unsigned int uNumChildren = oKeyChain->psLinks[uNode].uNumChildren;
+    unsigned int uLeaves = treeLeaves(psTree->paucDigest);
+    unsigned int uWidth;
+    unsigned int uLo;
+    unsigned int uHi;
+    unsigned int i;
+    void *pv;
+
+    if (oKeyChain->iEncoding != KEYCHAIN_ENCODING_TREE ||
+        uNumChildren < 2) {
+        freeChildTree(oKeyChain, uNode);
+        return;
+    }
+
+    // the tree doubles when full and halves when a quarter full, so it
+    // is rebuilt only once in many changes of the number of children;
+    // readers may still be reading the old one, so it is replaced
+    if (uLeaves < uNumChildren || uLeaves / 4 >= uNumChildren) {
+        uLeaves = 2;
+        while (uLeaves < uNumChildren)
+            uLeaves *= 2;
+        pv = malloc(uLeaves * HASHLEN);
+        freeChildTree(oKeyChain, uNode);
+        if (pv == NULL)
+            return;
+        memcpy(pv, &uLeaves, sizeof(uLeaves));
+        __atomic_store_n(&psTree->paucDigest, (unsigned char (*)[HASHLEN])pv,
+                         __ATOMIC_RELEASE);
+        uFirst = 0;
+        uLast = uLeaves - 1;
+    }
+
+    // rehash the digests above the changed positions, level by level
+    uLo = (uLeaves + uFirst) / 2;
+    uHi = (uLeaves + uLast) / 2;
+    for (uWidth = 2; uLo > 0; uWidth *= 2, uLo /= 2, uHi /= 2) {
+        for (i = uLo; i <= uHi; i++)
+            updateTreeNode(oKeyChain, uNode, i, uWidth);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Update the child tree of the parent of uChild in oKeyChain after the
+   hash of uChild changed */
+static void childChanged(KeyChain_T oKeyChain, NodeIdx uChild)
+{
+    NodeIdx uParent = oKeyChain->psLinks[uChild].uParent;
+    unsigned int uPos;
+
+    if (uParent == NONODE)
+        return;
+    uPos = uChild - oKeyChain->psLinks[uParent].uFirstChild;
+    updateChildTree(oKeyChain, uParent, uPos, uPos);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Place the child tree digest of the node with the links psLinks and
+   the child tree paucDigest in oKeyChain, which must have children,
+   in pucOut */
+static void childTreeRoot(KeyChain_T oKeyChain,
+                          const struct KeyNodeLinks *psLinks,
+                          unsigned char (*paucDigest)[HASHLEN],
+                          unsigned char *pucOut)
+{
+    if (paucDigest != NULL)
+        memcpy(pucOut, paucDigest[1], HASHLEN);
+    else
+        merkleRoot(oKeyChain, oKeyChain->paucHash + psLinks->uFirstChild,
+                   psLinks->uNumChildren, pucOut);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recompute the child tree digest of the node with the links psLinks
+   and the child tree paucDigest in oKeyChain from the hash of its
+   child at uPos and the digests beside that child's path up the tree,
+   and place it in pucOut. Only O(log n) of the n children are read. */
+static void childTreeProof(KeyChain_T oKeyChain,
+                           const struct KeyNodeLinks *psLinks,
+                           unsigned char (*paucDigest)[HASHLEN],
+                           unsigned int uPos, unsigned char *pucOut)
+{
+    unsigned int uLeaves = treeLeaves(paucDigest);
+    unsigned int uWidth;
+    unsigned int i;
+
+    if (paucDigest == NULL) {
+        childTreeRoot(oKeyChain, psLinks, paucDigest, pucOut);
+        return;
+    }
+
+    // a reader may see a tree that is out of step with the children;
+    // its view then fails validation anyway
+    if (uLeaves < psLinks->uNumChildren) {
+        memset(pucOut, 0, HASHLEN);
+        return;
+    }
+
+    memcpy(pucOut, oKeyChain->paucHash[psLinks->uFirstChild + uPos],
+           HASHLEN);
+    for (i = uLeaves + uPos, uWidth = 1; i > 1; i /= 2, uWidth *= 2) {
+        if (i % 2 == 1)
+            hashTreePair(oKeyChain,
+                         treeDigest(oKeyChain, psLinks, paucDigest, i - 1),
+                         pucOut, pucOut);
+        else if ((i + 1) * uWidth - uLeaves < psLinks->uNumChildren)
+            hashTreePair(oKeyChain, pucOut,
+                         treeDigest(oKeyChain, psLinks, paucDigest, i + 1),
+                         pucOut);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Upper bound on the length of the serialized child hashes of a node
+   with iNumChildren children, in any encoding */
+static size_t childrenRecordLen(int iNumChildren)
+{
+    return BINARY_HDRLEN + 4 + (iNumChildren + 1) * HASHLEN * 2 + 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Serialize the key node hashes of the children of the node with the
+   links psLinks into pcBuf using the encoding of oKeyChain, youngest
+   child first, skipping holes. Under KEYCHAIN_ENCODING_TREE the record
+   holds pucTreeRoot, the child tree digest, instead. pcBuf must hold
+   childrenRecordLen(number of children) bytes. Return the number of
+   bytes written. */
+static size_t serializeChildren(KeyChain_T oKeyChain,
+                                const struct KeyNodeLinks *psLinks,
+                                const unsigned char *pucTreeRoot,
+                                char *pcBuf)
+{
+    unsigned char *pucIter;
+    char *pcIter;
+    unsigned int u;
+
+    if (oKeyChain->iEncoding != KEYCHAIN_ENCODING_TEXT) {
+        pucIter = (unsigned char *)pcBuf;
+        *pucIter++ = recordVersion(oKeyChain);
+        *pucIter++ = BINARY_CHILDREN;
+        pucIter = putU32(pucIter, numChildren(oKeyChain, psLinks));
+        if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE) {
+            if (psLinks->uNumChildren > 0) {
+                memcpy(pucIter, pucTreeRoot, HASHLEN);
+                pucIter += HASHLEN;
+            }
+            return pucIter - (unsigned char *)pcBuf;
+        }
+        for (u = psLinks->uNumChildren; u-- > 0; ) {
+            if (isHole(oKeyChain, psLinks, u))
+                continue;
+            memcpy(pucIter, oKeyChain->paucHash[psLinks->uFirstChild + u],
+                   HASHLEN);
+            pucIter += HASHLEN;
+        }
+        return pucIter - (unsigned char *)pcBuf;
+    }
+
+    pcIter = pcBuf;
+    for (u = psLinks->uNumChildren; u-- > 0; ) {
+        if (isHole(oKeyChain, psLinks, u))
+            continue;
+        arrToString(oKeyChain->paucHash[psLinks->uFirstChild + u], pcIter,
+                    HASHLEN);
+        pcIter += HASHLEN * 2;
+    }
+    return pcIter - pcBuf;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Hash the children record of a node with children in uSlots > 0
+   child slots in the encoding of oKeyChain, over their key node hashes
+   paucChildHash, oldest first, or under KEYCHAIN_ENCODING_TREE over
+   their child tree digest pucTreeRoot, and place the result in
+   aucHashBuf. Slots whose links in psChildLinks are unused are holes
+   and left out; psChildLinks is NULL if there are none. */
+static void hashChildRecord(KeyChain_T oKeyChain,
+                            unsigned char (*paucChildHash)[HASHLEN],
+                            const struct KeyNodeLinks *psChildLinks,
+                            unsigned int uSlots,
+                            const unsigned char *pucTreeRoot,
+                            unsigned char *aucHashBuf)
+{
+    const struct KeyHash *psHash = oKeyChain->psHash;
+    struct KeyNodeLinks sLinks;
+    char hash_buf[HASHBUFLEN];
+    unsigned char aucHeader[BINARY_HDRLEN + 4];
+    unsigned char aucRecord[BINARY_HDRLEN + 4 + HASHLEN];
+    unsigned int uNumChildren = uSlots;
+    KeyHash_CTX ctx;
+    unsigned int u;
+    size_t uLen;
+
+    if (psChildLinks != NULL) {
+        for (u = 0; u < uSlots; u++)
+            uNumChildren -= !(psChildLinks[u].ucFlags & NODE_USED);
+    }
+
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE) {
+        memset(&sLinks, 0, sizeof(sLinks));
+        sLinks.uNumChildren = uNumChildren;
+        uLen = serializeChildren(oKeyChain, &sLinks, pucTreeRoot,
+                                 (char *)aucRecord);
+        KeyHash_digest(psHash, aucRecord, uLen, aucHashBuf);
+        STAT_HASH(oKeyChain, uLen);
+        return;
+    }
+
+    psHash->init(&ctx);
+
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_BINARY) {
+        aucHeader[0] = BINARY_VERSION;
+        aucHeader[1] = BINARY_CHILDREN;
+        putU32(aucHeader + BINARY_HDRLEN, uNumChildren);
+        psHash->update(&ctx, aucHeader, sizeof(aucHeader));
+    }
+
+    for (u = uSlots; u-- > 0; ) {
+        if (psChildLinks != NULL && !(psChildLinks[u].ucFlags & NODE_USED))
+            continue;
+        if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_BINARY) {
+            psHash->update(&ctx, paucChildHash[u], HASHLEN);
+        }
+        else {
+            arrToString(paucChildHash[u], hash_buf, HASHLEN);
+            psHash->update(&ctx, (unsigned char *)hash_buf, HASHLEN * 2);
+        }
+    }
+    psHash->final(&ctx, aucHashBuf);
+    STAT_HASH(oKeyChain,
+              oKeyChain->iEncoding == KEYCHAIN_ENCODING_BINARY ?
+                  sizeof(aucHeader) + (size_t)uNumChildren * HASHLEN :
+                  (size_t)uNumChildren * HASHLEN * 2);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Compute hash over the key node hashes uNode's children, youngest
+   first, or over their child tree digest, and place the result in
+   aucHashBuf */
+static void hashChildren(KeyChain_T oKeyChain, NodeIdx uNode,
+                         unsigned char *aucHashBuf)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned char aucRoot[HASHLEN];
+
+    assert(aucHashBuf != NULL);
+
+    memset(aucHashBuf, 0, HASHLEN);
+
+    if (numChildren(oKeyChain, psLinks) == 0)
+        return;
+
+    // sibling hashes are adjacent
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE)
+        childTreeRoot(oKeyChain, psLinks,
+                      oKeyChain->psTrees[uNode].paucDigest, aucRoot);
+    hashChildRecord(oKeyChain, oKeyChain->paucHash + psLinks->uFirstChild,
+                    psLinks->ucFlags & NODE_HOLES ?
+                        oKeyChain->psLinks + psLinks->uFirstChild : NULL,
+                    psLinks->uNumChildren, aucRoot, aucHashBuf);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Record that the hashed contents of uNode in oKeyChain changed in the
+   current generation */
+static void stampNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    oKeyChain->psGens[uNode].ulChanged = oKeyChain->ulGeneration;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the path from uNode to the root in oKeyChain, which may
+   be the view of a reader, was verified after all its nodes last
+   changed, 0 otherwise */
+static int pathVerified(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct NodeGen *psGen = &oKeyChain->psGens[uNode];
+    unsigned long ulChecked = __atomic_load_n(&psGen->ulPathChecked,
+                                              __ATOMIC_RELAXED);
+    int iSteps = oKeyChain->psLinks[uNode].iDepth;
+
+    if (ulChecked == 0 || ulChecked < psGen->ulArrived)
+        return 0;
+    for (; uNode != NONODE; uNode = oKeyChain->psLinks[uNode].uParent) {
+        if (uNode >= oKeyChain->uNumNodes || iSteps-- < 0 ||
+            oKeyChain->psGens[uNode].ulChanged > ulChecked)
+            return 0;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Update hash of intermediate node uNode */
+static void updateHashes(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    STAT_ADD(oKeyChain, ulNodesVisited, 1);
+    stampNode(oKeyChain, uNode);
+
+    // update internal hash with hashes of children
+    hashChildren(oKeyChain, uNode, oKeyChain->paucInterHash[uNode]);
+
+    // rehash entire key node
+    hashKeyNode(oKeyChain, uNode, oKeyChain->paucHash[uNode]);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Update the hashes of uNode and all its ancestors */
+static void updatePath(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    while (uNode != NONODE) {
+        updateHashes(oKeyChain, uNode);
+        childChanged(oKeyChain, uNode);
+        uNode = oKeyChain->psLinks[uNode].uParent;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Mark uNode and its ancestors in oKeyChain dirty, stopping at the
+   first ancestor that is dirty already */
+static void markPath(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    while (uNode != NONODE &&
+           !(oKeyChain->psLinks[uNode].ucFlags & NODE_DIRTY)) {
+        oKeyChain->psLinks[uNode].ucFlags |= NODE_DIRTY;
+        uNode = oKeyChain->psLinks[uNode].uParent;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Bring the hashes of uNode and its ancestors up to date after a
+   change below uNode: right away, or in deferred mode by marking them
+   dirty for the next commit. Marking stops at the first ancestor 
+   that is dirty already. */
+static void touchPath(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    if (!oKeyChain->iDeferred) {
+        updatePath(oKeyChain, uNode);
+        return;
+    }
+    markPath(oKeyChain, uNode);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to update the dirty node uNode after its
+   dirty descendants, clearing their flags */
+static void commitSubtree(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    NodeIdx uChild;
+    unsigned int u;
+
+    for (u = 0; u < psLinks->uNumChildren; u++) {
+        uChild = psLinks->uFirstChild + u;
+        if (oKeyChain->psLinks[uChild].ucFlags & NODE_DIRTY) {
+            commitSubtree(oKeyChain, uChild);
+            childChanged(oKeyChain, uChild);
+        }
+    }
+
+    updateHashes(oKeyChain, uNode);
+    psLinks->ucFlags &= ~NODE_DIRTY;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to recompute the hashes and child trees
+   of uNode and all its descendants, bottom-up. The intermediate hash
+   of a childless node is its data hash and is kept. */
+static void rehashSubtree(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned int u;
+
+    for (u = 0; u < psLinks->uNumChildren; u++) {
+        if (!isHole(oKeyChain, psLinks, u))
+            rehashSubtree(oKeyChain, psLinks->uFirstChild + u);
+    }
+
+    freeChildTree(oKeyChain, uNode);
+    updateChildTree(oKeyChain, uNode, 0, 0);
+    if (numChildren(oKeyChain, psLinks) > 0)
+        updateHashes(oKeyChain, uNode);
+    else {
+        hashKeyNode(oKeyChain, uNode, oKeyChain->paucHash[uNode]);
+        stampNode(oKeyChain, uNode);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Link a new key node pcKeyID with the plaintext key pucKey and type
+   iType into oKeyChain as the youngest child of pcParentKeyID, without
+   hashing anything. Return the new node, or NONODE if pcKeyID is not
+   a valid new child of pcParentKeyID or insufficient memory is
+   available. May move the node arrays. */
+static NodeIdx insertKeyNode(KeyChain_T oKeyChain,
+                             const char *pcParentKeyID,
+                             const char *pcKeyID,
+                             const unsigned char *pucKey,
+                             int iType)
+{
+    NodeIdx uNewNode;
+    NodeIdx uParentNode;
+    struct KeyNodeLinks *psNewLinks;
+    size_t uParentLen;
+    size_t uLen;
+    unsigned int uComponent;
+
+    unsigned char aucParentKeyBuf[KEYLEN];   // 64 bit key
+
+    // make sure key ID is the parent ID plus one component
+    uParentLen = strlen(pcParentKeyID);
+    uLen = strlen(pcKeyID);
+    if (uLen <= uParentLen ||
+        strncmp(pcParentKeyID, pcKeyID, uParentLen) != 0 ||
+        readComponent(pcKeyID + uParentLen, &uComponent) !=
+            uLen - uParentLen)
+        return NONODE;
+
+    // find parent node
+    uParentNode = getKeyNode(oKeyChain, (char *)pcParentKeyID);
+    if (uParentNode == NONODE)
+        return NONODE;
+
+    // make sure key is not already in the chain
+    if (getKeyNode(oKeyChain, (char *)pcKeyID) != NONODE)
+        return NONODE;
+
+    if (!reserveIndex(oKeyChain))
+        return NONODE;
+
+    // create new key node as the youngest child, with an all zero
+    // internal hash
+    uNewNode = addChildSlot(oKeyChain, uParentNode);
+    if (uNewNode == NONODE)
+        return NONODE;
+    if (!setKeyID(oKeyChain, uNewNode, pcKeyID)) {
+        oKeyChain->psLinks[uParentNode].uNumChildren--;
+        return NONODE;
+    }
+
+    xor_encrypt((unsigned char *)pucKey, oKeyChain->paucEncKey[uNewNode],
+                KEYLEN, getPlainKey(oKeyChain, uParentNode, aucParentKeyBuf));
+    wipe(aucParentKeyBuf, KEYLEN);
+    memset(oKeyChain->paucInterHash[uNewNode], 0, HASHLEN);
+
+    psNewLinks = &oKeyChain->psLinks[uNewNode];
+    psNewLinks->uParent = uParentNode;
+    psNewLinks->uFirstChild = NONODE;
+    psNewLinks->uNumChildren = 0;
+    psNewLinks->uChildSlots = 0;
+    psNewLinks->uComponent = uComponent;
+    psNewLinks->iType = iType;
+    psNewLinks->iDepth = oKeyChain->psLinks[uParentNode].iDepth + 1;
+    psNewLinks->ucCipher = KEYCHAIN_CIPHER_XOR;
+    psNewLinks->ucFlags = NODE_USED;
+
+    indexKeyNode(oKeyChain, uNewNode);
+    stampNode(oKeyChain, uNewNode);
+    __atomic_store_n(&oKeyChain->psGens[uNewNode].ulPathChecked, 0,
+                     __ATOMIC_RELAXED);
+    oKeyChain->psGens[uNewNode].ulArrived = oKeyChain->ulGeneration;
+    oKeyChain->iNumKeys++;
+
+    return uNewNode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* A level of dirty nodes hashed by KeyChain_addKeys() */
+struct HashLevel
+{
+    KeyChain_T oKeyChain;
+    NodeIdx *auNodes;
+    int iNumNodes;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Rehash the dirty node uNode of oKeyChain, whose dirty children are
+   up to date. Its child tree is updated at the dirty positions, or 
+   rebuilt if most of them are. */
+static void rehashDirtyNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned int uNumDirty = 0;
+    unsigned int u;
+
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE &&
+        psLinks->uNumChildren > 0) {
+        for (u = 0; u < psLinks->uNumChildren; u++) {
+            if (oKeyChain->psLinks[psLinks->uFirstChild + u].ucFlags &
+                NODE_DIRTY)
+                uNumDirty++;
+        }
+        if (2 * uNumDirty >= psLinks->uNumChildren) {
+            freeChildTree(oKeyChain, uNode);
+            updateChildTree(oKeyChain, uNode, 0, 0);
+        }
+        else {
+            for (u = 0; u < psLinks->uNumChildren; u++) {
+                if (oKeyChain->psLinks[psLinks->uFirstChild + u].ucFlags &
+                    NODE_DIRTY)
+                    updateChildTree(oKeyChain, uNode, u, u);
+            }
+        }
+    }
+
+    updateHashes(oKeyChain, uNode);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Parallel_for task iTask of the struct HashLevel pvLevel: rehash its
+   nodes iTask * BULKCHUNK to (iTask + 1) * BULKCHUNK - 1 */
+static void hashLevelTask(void *pvLevel, int iTask)
+{
+    struct HashLevel *psLevel = (struct HashLevel *)pvLevel;
+    int iEnd = (iTask + 1) * BULKCHUNK;
+    int i;
+
+    if (iEnd > psLevel->iNumNodes)
+        iEnd = psLevel->iNumNodes;
+    for (i = iTask * BULKCHUNK; i < iEnd; i++)
+        rehashDirtyNode(psLevel->oKeyChain, psLevel->auNodes[i]);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* The children of a node whose key KeyChain_rotateKey() replaced */
+struct Rotation
+{
+    KeyChain_T oKeyChain;
+    NodeIdx uFirst;
+    unsigned int uNumChildren;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Parallel_for task iTask of the struct Rotation pvRotation: rehash
+   its re-wrapped children iTask * ROTATECHUNK to
+   (iTask + 1) * ROTATECHUNK - 1 */
+static void rotateTask(void *pvRotation, int iTask)
+{
+    struct Rotation *psRotation = (struct Rotation *)pvRotation;
+    KeyChain_T oKeyChain = psRotation->oKeyChain;
+    unsigned int uEnd = ((unsigned int)iTask + 1) * ROTATECHUNK;
+    NodeIdx uChild;
+    unsigned int u;
+
+    if (uEnd > psRotation->uNumChildren)
+        uEnd = psRotation->uNumChildren;
+    for (u = (unsigned int)iTask * ROTATECHUNK; u < uEnd; u++) {
+        uChild = psRotation->uFirst + u;
+        if (!(oKeyChain->psLinks[uChild].ucFlags & NODE_USED))
+            continue;
+        stampNode(oKeyChain, uChild);
+        hashKeyNode(oKeyChain, uChild, oKeyChain->paucHash[uChild]);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the hashes of uNode in oKeyChain match its record and,
+   for a non-leaf, the hashes of its children, 0 otherwise. Child tree
+   digests are recomputed rather than taken from the cache. */
+static int checkKeyNode(KeyChain_T oKeyChain, NodeIdx uNode)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned char aucRecord[BINARY_HDRLEN + 4 + HASHLEN];
+    unsigned char aucRoot[HASHLEN];
+    unsigned char aucHash[HASHLEN];
+    size_t uLen;
+
+    if (psLinks->iType == 0) {
+        if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE &&
+            psLinks->uNumChildren > 0) {
+            merkleRoot(oKeyChain, oKeyChain->paucHash + psLinks->uFirstChild,
+                       psLinks->uNumChildren, aucRoot);
+            uLen = serializeChildren(oKeyChain, psLinks, aucRoot,
+                                     (char *)aucRecord);
+            KeyHash_digest(oKeyChain->psHash, aucRecord, uLen, aucHash);
+            STAT_HASH(oKeyChain, uLen);
+        }
+        else
+            hashChildren(oKeyChain, uNode, aucHash);
+        if (memcmp(oKeyChain->paucInterHash[uNode], aucHash, HASHLEN) != 0)
+            return 0;
+    }
+
+    hashKeyNode(oKeyChain, uNode, aucHash);
+    return memcmp(oKeyChain->paucHash[uNode], aucHash, HASHLEN) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* The node slots audited by KeyChain_verifyAll(), and a flag per slot
+   that is set for nodes that fail */
+struct Audit
+{
+    KeyChain_T oKeyChain;
+    unsigned char *pucBad;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Parallel_for task iTask of the struct Audit pvAudit: check the used
+   node slots iTask * AUDITCHUNK to (iTask + 1) * AUDITCHUNK - 1 */
+static void auditTask(void *pvAudit, int iTask)
+{
+    struct Audit *psAudit = (struct Audit *)pvAudit;
+    KeyChain_T oKeyChain = psAudit->oKeyChain;
+    NodeIdx uEnd = ((NodeIdx)iTask + 1) * AUDITCHUNK;
+    NodeIdx u;
+
+    if (uEnd > oKeyChain->uNumNodes)
+        uEnd = oKeyChain->uNumNodes;
+    for (u = (NodeIdx)iTask * AUDITCHUNK; u < uEnd; u++) {
+        if ((oKeyChain->psLinks[u].ucFlags & NODE_USED) &&
+            (oKeyChain->uNumPurge == 0 || isLinked(oKeyChain, u)) &&
+            !checkKeyNode(oKeyChain, u))
+            psAudit->pucBad[u] = 1;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to count the failed nodes of the subtree
+   of uNode in oKeyChain, flagged in pucBad, in pre-order, placing the
+   key IDs of the first iMaxBad of them in apcBad. *piNumBad holds the
+   count so far. */
+static void collectBad(KeyChain_T oKeyChain, NodeIdx uNode,
+                       const unsigned char *pucBad, char **apcBad,
+                       int iMaxBad, int *piNumBad)
+{
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    unsigned int u;
+
+    if (pucBad[uNode]) {
+        if (*piNumBad < iMaxBad)
+            apcBad[*piNumBad] = (char *)keyIDOf(oKeyChain, uNode);
+        (*piNumBad)++;
+    }
+    for (u = 0; u < psLinks->uNumChildren; u++) {
+        if (!isHole(oKeyChain, psLinks, u))
+            collectBad(oKeyChain, psLinks->uFirstChild + u, pucBad, apcBad,
+                       iMaxBad, piNumBad);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Verify the path from uResultNode to the root in oKeyChain, which
+   must have no dirty nodes. oKeyChain may be the view of a reader
+   while the keychain changes: the links and IDs of the path are
+   copied before use and every index is checked, so a torn view fails
+   verification rather than faulting. Return 1 if verified, 0
+   otherwise. */
+static int verifyPath(KeyChain_T oKeyChain, NodeIdx uResultNode)
+{
+    NodeIdx uNodeIter;
+    NodeIdx *auPath;
+    struct KeyNodeLinks *psPath;
+    struct NodeRecord *psRecords;
+    char (*pacInline)[KEYIDINLINE];
+    const unsigned char **apucMsg;
+    size_t *auMsgLen;
+    unsigned char **apucDigest;
+    unsigned char *pucDigests;
+    char *pcArena;
+    char *pcIter;
+    size_t uArenaLen;
+    unsigned char aucRoot[HASHLEN];
+    struct KeyNodeLinks *psLinks;
+    int iPathLen;
+    int iNumMsgs;
+    int iResult;
+    int i;
+
+    iPathLen = oKeyChain->psLinks[uResultNode].iDepth + 1;
+    if (iPathLen <= 0 || (NodeIdx)iPathLen > oKeyChain->uNumNodes)
+        return 0;
+
+    auPath = (NodeIdx *)malloc(iPathLen * sizeof(NodeIdx));
+    psPath = (struct KeyNodeLinks *)malloc(iPathLen *
+                                           sizeof(struct KeyNodeLinks));
+    psRecords = (struct NodeRecord *)malloc(iPathLen *
+                                            sizeof(struct NodeRecord));
+    pacInline = (char (*)[KEYIDINLINE])malloc(iPathLen * KEYIDINLINE);
+    apucMsg = (const unsigned char **)malloc(2 * iPathLen *
+                                             sizeof(unsigned char *));
+    auMsgLen = (size_t *)malloc(2 * iPathLen * sizeof(size_t));
+    apucDigest = (unsigned char **)malloc(2 * iPathLen *
+                                          sizeof(unsigned char *));
+    pucDigests = (unsigned char *)malloc(2 * iPathLen * HASHLEN);
+    pcArena = NULL;
+    iResult = 0;
+    if (auPath == NULL || psPath == NULL || psRecords == NULL ||
+        pacInline == NULL || apucMsg == NULL || auMsgLen == NULL ||
+        apucDigest == NULL || pucDigests == NULL)
+        goto cleanup;
+
+    // take copies of the links and IDs on the path first, so the
+    // records are sized and written from the same values
+    uNodeIter = uResultNode;
+    for (i = 0; i < iPathLen; i++) {
+        if (uNodeIter >= oKeyChain->uNumNodes)
+            goto cleanup;
+        auPath[i] = uNodeIter;
+        psPath[i] = oKeyChain->psLinks[uNodeIter];
+        psRecords[i].pcKeyID = readKeyID(oKeyChain, uNodeIter, pacInline[i]);
+        psRecords[i].pucEncKey = oKeyChain->paucEncKey[uNodeIter];
+        psRecords[i].pucInterHash = oKeyChain->paucInterHash[uNodeIter];
+        psRecords[i].iType = psPath[i].iType;
+        psRecords[i].iDepth = psPath[i].iDepth;
+        psRecords[i].iCipher = psPath[i].ucCipher;
+        uNodeIter = psPath[i].uParent;
+    }
+    if (uNodeIter != NONODE)
+        goto cleanup;
+
+    uArenaLen = 0;
+    for (i = 0; i < iPathLen; i++) {
+        psLinks = &psPath[i];
+        if (psLinks->uNumChildren > 0 &&
+            (psLinks->uFirstChild >= oKeyChain->uNumNodes ||
+             psLinks->uNumChildren >
+                 oKeyChain->uNumNodes - psLinks->uFirstChild))
+            goto cleanup;
+        if (i > 0 &&
+            auPath[i - 1] - psLinks->uFirstChild >= psLinks->uNumChildren)
+            goto cleanup;
+        psRecords[i].pcParentKeyID =
+            i + 1 < iPathLen ? psRecords[i + 1].pcKeyID : "0";
+        uArenaLen += recordLen(&psRecords[i]);
+        uArenaLen += childrenRecordLen(psLinks->uNumChildren);
+    }
+    pcArena = (char *)malloc(uArenaLen);
+    if (pcArena == NULL)
+        goto cleanup;
+
+    // every node on the path to the root is checked against its record
+    // and its children; these hashes are independent of each other, so
+    // they are computed together as one multi-buffer batch. Message 2i
+    // is the record of the i-th node on the path, message 2i+1 the
+    // hashes of its children.
+    iNumMsgs = 0;
+    pcIter = pcArena;
+    for (i = 0; i < iPathLen; i++) {
+        psLinks = &psPath[i];
+
+        apucMsg[iNumMsgs] = (unsigned char *)pcIter;
+        auMsgLen[iNumMsgs] = serializeRecord(oKeyChain, &psRecords[i],
+                                             pcIter);
+        apucDigest[iNumMsgs] = pucDigests + iNumMsgs * HASHLEN;
+        pcIter += auMsgLen[iNumMsgs];
+        iNumMsgs++;
+
+        // under the child tree encoding the key is checked against all
+        // its children, but ancestors only against the child on the path
+        if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE &&
+            psLinks->uNumChildren > 0) {
+            if (i == 0)
+                merkleRoot(oKeyChain,
+                           oKeyChain->paucHash + psLinks->uFirstChild,
+                           psLinks->uNumChildren, aucRoot);
+            else
+                childTreeProof(oKeyChain, psLinks,
+                               __atomic_load_n(
+                                   &oKeyChain->psTrees[auPath[i]].paucDigest,
+                                   __ATOMIC_ACQUIRE),
+                               auPath[i - 1] - psLinks->uFirstChild,
+                               aucRoot);
+        }
+
+        apucMsg[iNumMsgs] = (unsigned char *)pcIter;
+        auMsgLen[iNumMsgs] = serializeChildren(oKeyChain, psLinks, aucRoot,
+                                               pcIter);
+        apucDigest[iNumMsgs] = pucDigests + iNumMsgs * HASHLEN;
+        pcIter += auMsgLen[iNumMsgs];
+        iNumMsgs++;
+    }
+
+    oKeyChain->psHash->multi(apucMsg, auMsgLen, apucDigest, iNumMsgs);
+    STAT_MULTI(oKeyChain, auMsgLen, iNumMsgs);
+    STAT_ADD(oKeyChain, ulNodesVisited, iPathLen);
+
+    for (i = 0; i < iPathLen; i++) {
+        uNodeIter = auPath[i];
+
+        // childless nodes have an all zero intermediate hash
+        if (numChildren(oKeyChain, &psPath[i]) == 0)
+            memset(apucDigest[2*i + 1], 0, HASHLEN);
+
+        // non-leaf node intermediate hashes must match
+        if (psPath[i].iType == 0 &&
+            memcmp(oKeyChain->paucInterHash[uNodeIter], apucDigest[2*i + 1],
+                   HASHLEN) != 0)
+            goto cleanup;
+
+        // key node hash must match
+        if (memcmp(oKeyChain->paucHash[uNodeIter], apucDigest[2*i],
+                   HASHLEN) != 0)
+            goto cleanup;
+    }
+    iResult = 1;
+
+cleanup:
+    free(auPath);
+    free(psPath);
+    free(psRecords);
+    free(pacInline);
+    free(apucMsg);
+    free(auMsgLen);
+    free(apucDigest);
+    free(pucDigests);
+    free(pcArena);
+    return iResult;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Verify the path from the key pcKeyID to the root of oKeyChain,
+   skipping the work if iUseCache and the path was verified since it
+   last changed. Runs as a reader. Return 1 if verified, 0 if the key
+   is missing or the path fails verification. */
+static int verifyKeyID(KeyChain_T oKeyChain, char *pcKeyID, int iUseCache)
+{
+    struct KeyChain sView;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
+    int iCached;
+    int iResult;
+
+    // deferred hashes are brought up to date by the changing thread
+    if (oKeyChain->iDeferred)
+        KeyChain_commit(oKeyChain);
+
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        iCached = 0;
+        iResult = 0;
+        if (uResultNode != NONODE) {
+            iCached = iUseCache && pathVerified(&sView, uResultNode);
+            iResult = iCached || verifyPath(&sView, uResultNode);
+        }
+    } while (!readValid(oKeyChain, ulSeq));
+
+    // the stamp holds only for the generation the view was taken in;
+    // a later change to the path stamps its nodes past it
+    if (iResult && !iCached)
+        __atomic_store_n(&sView.psGens[uResultNode].ulPathChecked,
+                         sView.ulGeneration, __ATOMIC_RELAXED);
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+    return iResult;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the length of the data of journal records of type iType */
+static size_t journalDataLen(int iType)
+{
+    switch (iType) {
+    case JOURNAL_BASE:
+        return 8;
+    case JOURNAL_ADD:
+    case JOURNAL_ROTATE:
+        return KEYLEN;
+    case JOURNAL_UPDATE:
+        return HASHLEN;
+    default:
+        return 0;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Append the record made of the uFirstLen bytes at pvFirst and the
+   uSecondLen bytes at pvSecond to the journal of oKeyChain, if it has
+   one, or stage it if oKeyChain is a transaction. A record that
+   cannot be appended makes the next KeyChain_sync() fail; one that
+   cannot be staged makes the transaction fail to commit. */
+static void journalRecord(KeyChain_T oKeyChain,
+                          const void *pvFirst, size_t uFirstLen,
+                          const void *pvSecond, size_t uSecondLen)
+{
+    unsigned char *pucNew;
+    size_t uNeed;
+    size_t uNewCap;
+
+    if (oKeyChain->oBase == NULL) {
+        if (oKeyChain->oJournal != NULL)
+            Journal_append(oKeyChain->oJournal, pvFirst, uFirstLen,
+                           pvSecond, uSecondLen);
+        return;
+    }
+
+    uNeed = oKeyChain->uStagedLen + 4 + uFirstLen + uSecondLen;
+    if (uNeed > oKeyChain->uStagedCap) {
+        uNewCap = oKeyChain->uStagedCap > 0 ? oKeyChain->uStagedCap
+                                            : STAGEMINCAP;
+        while (uNewCap < uNeed)
+            uNewCap *= 2;
+        pucNew = (unsigned char *)realloc(oKeyChain->pucStaged, uNewCap);
+        if (pucNew == NULL) {
+            oKeyChain->iStageFailed = 1;
+            return;
+        }
+        oKeyChain->pucStaged = pucNew;
+        oKeyChain->uStagedCap = uNewCap;
+    }
+    pucNew = putU32(oKeyChain->pucStaged + oKeyChain->uStagedLen,
+                    uFirstLen + uSecondLen);
+    memcpy(pucNew, pvFirst, uFirstLen);
+    memcpy(pucNew + uFirstLen, pvSecond, uSecondLen);
+    oKeyChain->uStagedLen = uNeed;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Journal a record of type iType with the argument iArg, the data
+   pucData and the key ID pcKeyID for oKeyChain, see
+   journalRecord() */
+static void journalChange(KeyChain_T oKeyChain, int iType, int iArg,
+                          const unsigned char *pucData,
+                          const char *pcKeyID)
+{
+    unsigned char aucHead[JOURNAL_HDRLEN + HASHLEN];
+    size_t uDataLen = journalDataLen(iType);
+
+    if (oKeyChain->oJournal == NULL && oKeyChain->oBase == NULL)
+        return;
+
+    aucHead[0] = (unsigned char)iType;
+    aucHead[1] = (unsigned char)iArg;
+    if (uDataLen > 0)
+        memcpy(aucHead + JOURNAL_HDRLEN, pucData, uDataLen);
+    journalRecord(oKeyChain, aucHead, JOURNAL_HDRLEN + uDataLen,
+                  pcKeyID, strlen(pcKeyID) + 1);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Start the journal of oKeyChain with the number of its checkpoint */
+static void journalBase(KeyChain_T oKeyChain)
+{
+    unsigned char aucNumber[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        aucNumber[i] = (oKeyChain->ulCheckpoint >> (8 * i)) & 0xff;
+    journalChange(oKeyChain, JOURNAL_BASE, 0, aucNumber, "");
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Remove pcKeyID and its descendants from oKeyChain. If iRevoke, the
+   descendants are only unlinked and left for KeyChain_purge().
+   Return 1 on success, 0 if the key is the root or not in oKeyChain,
+   or insufficient memory is available. */
+static int unlinkKey(KeyChain_T oKeyChain, char *pcKeyID, int iRevoke)
+{
+    struct PurgeBlock sPurge;
+    struct PurgeBlock *psNew;
+    NodeIdx uResultNode;
+    NodeIdx uParentNode;
+    unsigned int uPos;
+    size_t uNewCap;
+
+    if (strcmp(pcKeyID, "0") == 0)
+        return 0;
+
+    if (!beginChange(oKeyChain))
+        return 0;
+    uResultNode = getKeyNode(oKeyChain, pcKeyID);
+    if (uResultNode == NONODE) {
+        endChange(oKeyChain);
+        return 0;
+    }
+
+    // room for the detached block first, so failing changes nothing
+    if (iRevoke && oKeyChain->uNumPurge == oKeyChain->uPurgeCap) {
+        uNewCap = oKeyChain->uPurgeCap > 0 ? 2 * oKeyChain->uPurgeCap
+                                           : PURGEMINCAP;
+        psNew = (struct PurgeBlock *)realloc(oKeyChain->psPurge,
+                    uNewCap * sizeof(struct PurgeBlock));
+        if (psNew == NULL) {
+            endChange(oKeyChain);
+            return 0;
+        }
+        oKeyChain->psPurge = psNew;
+        oKeyChain->uPurgeCap = uNewCap;
+    }
+
+    // cached keys and index entries of the subtree go with its nodes
+    oKeyChain->ulGeneration++;
+    uParentNode = oKeyChain->psLinks[uResultNode].uParent;
+    uPos = uResultNode - oKeyChain->psLinks[uParentNode].uFirstChild;
+    detachKeyNode(oKeyChain, uResultNode, &sPurge);
+    if (!iRevoke)
+        purgeBlock(oKeyChain, &sPurge, INT_MAX);
+    else if (sPurge.uNumNodes > 0)
+        oKeyChain->psPurge[oKeyChain->uNumPurge++] = sPurge;
+
+    // under the child tree encoding younger siblings moved down a
+    // position
+    updateChildTree(oKeyChain, uParentNode, uPos,
+                    oKeyChain->psLinks[uParentNode].uNumChildren);
+
+    // update intermediate hashes on path to root node
+    touchPath(oKeyChain, uParentNode);
+
+    journalChange(oKeyChain, JOURNAL_REMOVE, 0, NULL, pcKeyID);
+    endChange(oKeyChain);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Apply the queued updates psBatch, newest first, to oKeyChain as a
+   single change, oldest first. Ancestors shared by the updated keys
+   are rehashed once for the whole batch rather than once per key.
+   Set iApplied of each update and return the batch, linked oldest
+   first. */
+static struct QueuedUpdate *applyUpdates(KeyChain_T oKeyChain,
+                                         struct QueuedUpdate *psBatch)
+{
+    struct QueuedUpdate *psOldest = NULL;
+    struct QueuedUpdate *psUpdate;
+    NodeIdx uNode;
+
+    while (psBatch != NULL) {
+        psUpdate = psBatch;
+        psBatch = psBatch->psNext;
+        psUpdate->psNext = psOldest;
+        psOldest = psUpdate;
+    }
+
+    if (!beginChange(oKeyChain)) {
+        for (psUpdate = psOldest; psUpdate != NULL;
+             psUpdate = psUpdate->psNext)
+            psUpdate->iApplied = 0;
+        return psOldest;
+    }
+    oKeyChain->ulGeneration++;
+    for (psUpdate = psOldest; psUpdate != NULL; psUpdate = psUpdate->psNext) {
+        uNode = getKeyNode(oKeyChain, psUpdate->pcKeyID);
+        psUpdate->iApplied = uNode != NONODE;
+        if (uNode == NONODE)
+            continue;
+
+        // changes below the node predate this one
+        if (oKeyChain->psLinks[uNode].ucFlags & NODE_DIRTY)
+            commitSubtree(oKeyChain, uNode);
+
+        memcpy(oKeyChain->paucInterHash[uNode], psUpdate->pucInterHash,
+               HASHLEN);
+        hashKeyNode(oKeyChain, uNode, oKeyChain->paucHash[uNode]);
+        stampNode(oKeyChain, uNode);
+        childChanged(oKeyChain, uNode);
+        markPath(oKeyChain, oKeyChain->psLinks[uNode].uParent);
+        journalChange(oKeyChain, JOURNAL_UPDATE, 0, psUpdate->pucInterHash,
+                      psUpdate->pcKeyID);
+    }
+
+    // the paths of the batch meet below the root; each node on them
+    // is rehashed once
+    if (!oKeyChain->iDeferred)
+        KeyChain_commit(oKeyChain);
+    endChange(oKeyChain);
+    return psOldest;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* The progress of KeyChain_openJournal() through a journal */
+struct Replay
+{
+    KeyChain_T oKeyChain;
+
+    /* records seen so far */
+    int iNumRecords;
+
+    /* 1 if the journal precedes the checkpoint of oKeyChain */
+    int iStale;
+
+    /* 1 if a record was malformed or could not be applied */
+    int iFailed;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Apply the journal record of uLen bytes at pucRecord to the keychain
+   of the struct Replay pvReplay */
+static void replayChange(void *pvReplay, const unsigned char *pucRecord,
+                         size_t uLen)
+{
+    struct Replay *psReplay = (struct Replay *)pvReplay;
+    KeyChain_T oKeyChain = psReplay->oKeyChain;
+    unsigned char aucParentKey[KEYLEN];
+    unsigned char aucKey[KEYLEN];
+    unsigned long ulCheckpoint;
+    const unsigned char *pucData;
+    char *pcKeyID;
+    char *pcParentKeyID;
+    NodeIdx uParentNode;
+    NodeIdx uNode;
+    size_t uParentLen;
+    size_t uOffset;
+    size_t uSubLen;
+    int iType;
+    int iOK;
+    int i;
+
+    if (psReplay->iStale || psReplay->iFailed)
+        return;
+
+    iType = uLen > 0 ? pucRecord[0] : 0;
+    pucData = pucRecord + JOURNAL_HDRLEN;
+    pcKeyID = (char *)pucData + journalDataLen(iType);
+    if (uLen < JOURNAL_HDRLEN + journalDataLen(iType) + 1 ||
+        pucRecord[uLen - 1] != '\0' ||
+        (psReplay->iNumRecords++ == 0) != (iType == JOURNAL_BASE)) {
+        psReplay->iFailed = 1;
+        return;
+    }
+
+    switch (iType) {
+    case JOURNAL_BASE:
+        ulCheckpoint = 0;
+        for (i = 7; i >= 0; i--)
+            ulCheckpoint = ulCheckpoint << 8 | pucData[i];
+        // a journal left over from before the last checkpoint is
+        // already part of the snapshot
+        psReplay->iStale = ulCheckpoint < oKeyChain->ulCheckpoint;
+        iOK = ulCheckpoint <= oKeyChain->ulCheckpoint;
+        break;
+
+    case JOURNAL_ADD:
+        iOK = 0;
+        uParentLen = lastComponent(pcKeyID);
+        if (uParentLen == 0)
+            break;
+        pcParentKeyID = (char *)malloc(uParentLen + 1);
+        if (pcParentKeyID == NULL)
+            break;
+        memcpy(pcParentKeyID, pcKeyID, uParentLen);
+        pcParentKeyID[uParentLen] = '\0';
+        uParentNode = getKeyNode(oKeyChain, pcParentKeyID);
+        if (uParentNode != NONODE) {
+            getPlainKey(oKeyChain, uParentNode, aucParentKey);
+            xor_decrypt((unsigned char *)pucData, aucKey, KEYLEN,
+                        aucParentKey);
+            iOK = KeyChain_addKey(oKeyChain, pcParentKeyID, pcKeyID, aucKey,
+                                  pucRecord[1]);
+            wipe(aucParentKey, KEYLEN);
+            wipe(aucKey, KEYLEN);
+        }
+        free(pcParentKeyID);
+        break;
+
+    case JOURNAL_REMOVE:
+        iOK = KeyChain_removeKey(oKeyChain, pcKeyID);
+        break;
+
+    case JOURNAL_UPDATE:
+        iOK = KeyChain_updateKey(oKeyChain, pcKeyID,
+                                 (unsigned char *)pucData);
+        break;
+
+    case JOURNAL_ROTATE:
+        iOK = 0;
+        uNode = getKeyNode(oKeyChain, pcKeyID);
+        if (uNode != NONODE && uNode != ROOTNODE) {
+            getPlainKey(oKeyChain, oKeyChain->psLinks[uNode].uParent,
+                        aucParentKey);
+            xor_decrypt((unsigned char *)pucData, aucKey, KEYLEN,
+                        aucParentKey);
+            iOK = KeyChain_rotateKey(oKeyChain, pcKeyID, aucKey);
+            wipe(aucParentKey, KEYLEN);
+            wipe(aucKey, KEYLEN);
+        }
+        break;
+
+    case JOURNAL_CIPHER:
+        iOK = KeyChain_setCipher(oKeyChain, pcKeyID, pucRecord[1]);
+        break;
+
+    case JOURNAL_ENCODING:
+        iOK = KeyChain_setEncoding(oKeyChain, pucRecord[1]);
+        break;
+
+    case JOURNAL_BATCH:
+        iOK = 1;
+        uLen -= JOURNAL_HDRLEN;
+        for (uOffset = 0; iOK && uOffset < uLen; uOffset += uSubLen) {
+            if (uLen - uOffset < 4) {
+                iOK = 0;
+                break;
+            }
+            uSubLen = getU32(pucData + uOffset);
+            uOffset += 4;
+            if (uSubLen > uLen - uOffset) {
+                iOK = 0;
+                break;
+            }
+            replayChange(psReplay, pucData + uOffset, uSubLen);
+            iOK = !psReplay->iFailed;
+        }
+        break;
+
+    default:
+        iOK = 0;
+        break;
+    }
+    if (!iOK)
+        psReplay->iFailed = 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Flush the directory entry of pcFileName to disk. Return 1 on
+   success, 0 on failure. */
+static int syncDirectory(const char *pcFileName)
+{
+    const char *pcSlash = strrchr(pcFileName, '/');
+    char *pcDirName;
+    int fd;
+    int iOK;
+
+    if (pcSlash == NULL)
+        pcDirName = strdup(".");
+    else if (pcSlash == pcFileName)
+        pcDirName = strdup("/");
+    else
+        pcDirName = strndup(pcFileName, pcSlash - pcFileName);
+    if (pcDirName == NULL)
+        return 0;
+
+    fd = open(pcDirName, O_RDONLY);
+    free(pcDirName);
+    if (fd < 0)
+        return 0;
+    iOK = fsync(fd) == 0;
+    close(fd);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Round ulOffset up to a multiple of SNAPALIGN */
+static unsigned long snapAlign(unsigned long ulOffset)
+{
+    return (ulOffset + SNAPALIGN - 1) / SNAPALIGN * SNAPALIGN;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the uLen bytes at psHeader are a snapshot that this
+   build can map, 0 otherwise */
+static int snapshotValid(const struct SnapshotHeader *psHeader, size_t uLen)
+{
+    unsigned long aulLen[SNAP_ARRAYS];
+    NodeIdx uNumNodes = psHeader->uNumNodes;
+    int i;
+
+    if (memcmp(psHeader->acMagic, SNAP_MAGIC, sizeof(psHeader->acMagic))
+            != 0 ||
+        psHeader->uVersion != SNAP_VERSION ||
+        psHeader->uByteOrder != SNAP_BYTEORDER ||
+        psHeader->uLinksSize != sizeof(struct KeyNodeLinks) ||
+        psHeader->uIDSize != sizeof(struct KeyNodeID) ||
+        psHeader->uSlotSize != sizeof(struct IndexSlot) ||
+        psHeader->ulFileLen != uLen)
+        return 0;
+
+    if (KeyHash_get(psHeader->iHashType) == NULL ||
+        psHeader->iEncoding < KEYCHAIN_ENCODING_TEXT ||
+        psHeader->iEncoding > KEYCHAIN_ENCODING_TREE ||
+        uNumNodes == 0 || psHeader->ulIndexCap == 0 ||
+        (psHeader->ulIndexCap & (psHeader->ulIndexCap - 1)) != 0)
+        return 0;
+
+    // the arrays are aligned, in order and inside the file
+    aulLen[SNAP_LINKS] = uNumNodes * sizeof(struct KeyNodeLinks);
+    aulLen[SNAP_IDS] = uNumNodes * sizeof(struct KeyNodeID);
+    aulLen[SNAP_ENCKEYS] = uNumNodes * KEYLEN;
+    aulLen[SNAP_INTERHASHES] = uNumNodes * HASHLEN;
+    aulLen[SNAP_HASHES] = uNumNodes * HASHLEN;
+    aulLen[SNAP_INDEX] = psHeader->ulIndexCap * sizeof(struct IndexSlot);
+    aulLen[SNAP_LONGIDS] = 0;
+    for (i = 0; i < SNAP_ARRAYS; i++) {
+        if (psHeader->aulOffset[i] % SNAPALIGN != 0 ||
+            psHeader->aulOffset[i] < sizeof(struct SnapshotHeader) ||
+            psHeader->aulOffset[i] + aulLen[i] > uLen ||
+            (i + 1 < SNAP_ARRAYS &&
+             psHeader->aulOffset[i] + aulLen[i] > psHeader->aulOffset[i + 1]))
+            return 0;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* An inclusion proof being written by KeyChain_prove() for the nodes
+   auNodes, sorted by slot */
+struct ProofWriter
+{
+    KeyChain_T oKeyChain;
+    const NodeIdx *auNodes;
+    int iNumNodes;
+
+    /* the proof so far, uCap bytes allocated; 1 in iFailed if
+       insufficient memory was available */
+    unsigned char *pucProof;
+    size_t uLen;
+    size_t uCap;
+    int iFailed;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Append the uLen bytes at pv to the proof of psWriter */
+static void putProof(struct ProofWriter *psWriter, const void *pv,
+                     size_t uLen)
+{
+    unsigned char *pucNew;
+    size_t uNewCap;
+
+    if (psWriter->iFailed)
+        return;
+    if (psWriter->uLen + uLen > psWriter->uCap) {
+        uNewCap = psWriter->uCap > 0 ? psWriter->uCap : RECORDBUFLEN;
+        while (uNewCap < psWriter->uLen + uLen)
+            uNewCap *= 2;
+        pucNew = (unsigned char *)realloc(psWriter->pucProof, uNewCap);
+        if (pucNew == NULL) {
+            psWriter->iFailed = 1;
+            return;
+        }
+        psWriter->pucProof = pucNew;
+        psWriter->uCap = uNewCap;
+    }
+    memcpy(psWriter->pucProof + psWriter->uLen, pv, uLen);
+    psWriter->uLen += uLen;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void putProofU32(struct ProofWriter *psWriter, unsigned long u)
+{
+    unsigned char aucU32[4];
+
+    putU32(aucU32, u);
+    putProof(psWriter, aucU32, sizeof(aucU32));
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the number of the iNumNodes sorted nodes auNodes below
+   uNode */
+static int nodesBelow(const NodeIdx *auNodes, int iNumNodes, NodeIdx uNode)
+{
+    int iLo = 0;
+    int iHi = iNumNodes;
+    int iMid;
+
+    while (iLo < iHi) {
+        iMid = iLo + (iHi - iLo) / 2;
+        if (auNodes[iMid] < uNode)
+            iLo = iMid + 1;
+        else
+            iHi = iMid;
+    }
+    return iLo;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Place the child tree digest of the children at positions uLo to
+   uHi - 1 of the node with the links psLinks and the child tree
+   paucDigest in oKeyChain in pucOut. The range is one the tree is
+   split into, so the cached tree holds its digest. */
+static void rangeDigest(KeyChain_T oKeyChain,
+                        const struct KeyNodeLinks *psLinks,
+                        unsigned char (*paucDigest)[HASHLEN],
+                        unsigned int uLo, unsigned int uHi,
+                        unsigned char *pucOut)
+{
+    unsigned int uLeaves = treeLeaves(paucDigest);
+    unsigned int uWidth = 1;
+
+    if (uLeaves < psLinks->uNumChildren) {
+        merkleRoot(oKeyChain, oKeyChain->paucHash + psLinks->uFirstChild +
+                   uLo, uHi - uLo, pucOut);
+        return;
+    }
+    while (uWidth < uHi - uLo)
+        uWidth *= 2;
+    assert(uLo % uWidth == 0);
+    memcpy(pucOut, treeDigest(oKeyChain, psLinks, paucDigest,
+                              (uLeaves + uLo) / uWidth), HASHLEN);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to append to the proof of psWriter the
+   digests of the child tree ranges between positions uLo and uHi of
+   the node with the links psLinks and the child tree paucDigest that
+   hold none of the iNumKnown nodes auKnown, left to right. The tree
+   is split as merkleRoot() splits it. */
+static void proveRange(struct ProofWriter *psWriter,
+                       const struct KeyNodeLinks *psLinks,
+                       unsigned char (*paucDigest)[HASHLEN],
+                       unsigned int uLo, unsigned int uHi,
+                       const NodeIdx *auKnown, int iNumKnown)
+{
+    unsigned char aucDigest[HASHLEN];
+    unsigned int uSplit = 1;
+    int iLeft;
+
+    if (iNumKnown == 0) {
+        rangeDigest(psWriter->oKeyChain, psLinks, paucDigest, uLo, uHi,
+                    aucDigest);
+        putProof(psWriter, aucDigest, HASHLEN);
+        return;
+    }
+    if (uHi - uLo == 1)
+        return;
+
+    while (2 * uSplit < uHi - uLo)
+        uSplit *= 2;
+    iLeft = nodesBelow(auKnown, iNumKnown,
+                       psLinks->uFirstChild + uLo + uSplit);
+    proveRange(psWriter, psLinks, paucDigest, uLo, uLo + uSplit, auKnown,
+               iLeft);
+    proveRange(psWriter, psLinks, paucDigest, uLo + uSplit, uHi,
+               auKnown + iLeft, iNumKnown - iLeft);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to append the proof entry of uNode to the
+   proof of psWriter */
+static void proveEntry(struct ProofWriter *psWriter, NodeIdx uNode)
+{
+    KeyChain_T oKeyChain = psWriter->oKeyChain;
+    struct KeyNodeLinks *psLinks = &oKeyChain->psLinks[uNode];
+    size_t uParentLen = strlen(keyIDOf(oKeyChain, uNode));
+    const char *pcSuffix;
+    unsigned int uPos;
+    int iFirst;
+    int iEnd;
+    int i;
+    unsigned int u;
+
+    if (uNode != ROOTNODE) {
+        putProof(psWriter, oKeyChain->paucEncKey[uNode], KEYLEN);
+        putProofU32(psWriter, psLinks->iType);
+        putProofU32(psWriter, psLinks->ucCipher);
+    }
+
+    // the children in the proof are those in the child block
+    iFirst = iEnd = 0;
+    if (psLinks->uNumChildren > 0) {
+        iFirst = nodesBelow(psWriter->auNodes, psWriter->iNumNodes,
+                            psLinks->uFirstChild);
+        iEnd = nodesBelow(psWriter->auNodes, psWriter->iNumNodes,
+                          psLinks->uFirstChild + psLinks->uNumChildren);
+    }
+    putProofU32(psWriter, iEnd - iFirst);
+    if (iFirst == iEnd) {
+        putProof(psWriter, oKeyChain->paucInterHash[uNode], HASHLEN);
+        return;
+    }
+
+    // positions leave holes out
+    putProofU32(psWriter, numChildren(oKeyChain, psLinks));
+    for (i = iFirst, u = 0, uPos = 0; i < iEnd; i++) {
+        for (; psLinks->uFirstChild + u < psWriter->auNodes[i]; u++)
+            uPos += !isHole(oKeyChain, psLinks, u);
+        putProofU32(psWriter, uPos);
+        pcSuffix = keyIDOf(oKeyChain, psWriter->auNodes[i]) + uParentLen;
+        putProofU32(psWriter, strlen(pcSuffix));
+        putProof(psWriter, pcSuffix, strlen(pcSuffix));
+        proveEntry(psWriter, psWriter->auNodes[i]);
+    }
+
+    if (oKeyChain->iEncoding == KEYCHAIN_ENCODING_TREE) {
+        proveRange(psWriter, psLinks, oKeyChain->psTrees[uNode].paucDigest,
+                   0, psLinks->uNumChildren, psWriter->auNodes + iFirst,
+                   iEnd - iFirst);
+        return;
+    }
+    for (u = 0, i = iFirst; u < psLinks->uNumChildren; u++) {
+        if (i < iEnd && psWriter->auNodes[i] == psLinks->uFirstChild + u)
+            i++;
+        else if (!isHole(oKeyChain, psLinks, u))
+            putProof(psWriter, oKeyChain->paucHash[psLinks->uFirstChild + u],
+                     HASHLEN);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* qsort() comparison of two node indices */
+static int compareNodes(const void *pv1, const void *pv2)
+{
+    NodeIdx u1 = *(const NodeIdx *)pv1;
+    NodeIdx u2 = *(const NodeIdx *)pv2;
+
+    return (u1 > u2) - (u1 < u2);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* An inclusion proof being checked by KeyChain_verifyProof() */
+struct ProofReader
+{
+    /* a bare keychain structure holding the hash backend and the
+       encoding, all that hashing records reads */
+    struct KeyChain sContext;
+
+    const unsigned char *pucProof;
+    size_t uLen;
+    size_t uPos;
+
+    /* key sought, NULL if none, and where to place its encrypted key
+       and intermediate hash; iFound is 1 once it was met */
+    const char *pcKeyID;
+    unsigned char *pucEncKey;
+    unsigned char *pucInterHash;
+    int iFound;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Consume uLen bytes of the proof of psReader and return them, or
+   NULL if the proof ends first */
+static const unsigned char *readProof(struct ProofReader *psReader,
+                                      size_t uLen)
+{
+    const unsigned char *puc = psReader->pucProof + psReader->uPos;
+
+    if (uLen > psReader->uLen - psReader->uPos)
+        return NULL;
+    psReader->uPos += uLen;
+    return puc;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Consume a u32 of the proof of psReader and place it in *pul. Return
+   1 on success, 0 if the proof ends first. */
+static int readProofU32(struct ProofReader *psReader, unsigned long *pul)
+{
+    const unsigned char *puc = readProof(psReader, 4);
+
+    if (puc == NULL)
+        return 0;
+    *pul = (unsigned long)puc[0] << 24 | (unsigned long)puc[1] << 16 |
+           (unsigned long)puc[2] << 8 | (unsigned long)puc[3];
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to compute the child tree digest of the
+   children at positions uLo to uHi - 1 into pucOut, from the
+   iNumKnown proven children at the ascending positions auKnown with
+   the hashes paucKnown and from the digests the proof of psReader
+   gives for the other ranges. Return 1 on success, 0 if the proof
+   ends first. */
+static int verifyRange(struct ProofReader *psReader,
+                       unsigned int uLo, unsigned int uHi,
+                       const unsigned int *auKnown,
+                       unsigned char (*paucKnown)[HASHLEN],
+                       int iNumKnown, unsigned char *pucOut)
+{
+    unsigned char aucLeft[HASHLEN];
+    unsigned char aucRight[HASHLEN];
+    const unsigned char *puc;
+    unsigned int uSplit = 1;
+    int iLeft;
+
+    if (iNumKnown == 0) {
+        puc = readProof(psReader, HASHLEN);
+        if (puc == NULL)
+            return 0;
+        memcpy(pucOut, puc, HASHLEN);
+        return 1;
+    }
+    if (uHi - uLo == 1) {
+        memcpy(pucOut, paucKnown[0], HASHLEN);
+        return 1;
+    }
+
+    while (2 * uSplit < uHi - uLo)
+        uSplit *= 2;
+    for (iLeft = 0; iLeft < iNumKnown && auKnown[iLeft] < uLo + uSplit;
+         iLeft++)
+        ;
+    if (!verifyRange(psReader, uLo, uLo + uSplit, auKnown, paucKnown,
+                     iLeft, aucLeft) ||
+        !verifyRange(psReader, uLo + uSplit, uHi, auKnown + iLeft,
+                     paucKnown + iLeft, iNumKnown - iLeft, aucRight))
+        return 0;
+    hashTreePair(&psReader->sContext, aucLeft, aucRight, pucOut);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Recursive helper function to read the proof entry of the node
+   pcKeyID, a child of pcParentKeyID iDepth levels below the root,
+   from psReader, and compute its intermediate hash into pucInterHash
+   and, unless it is the root, its key node hash into pucHash. Return
+   1 if the entry is well formed, 0 otherwise. */
+static int verifyEntry(struct ProofReader *psReader,
+                       const char *pcParentKeyID, const char *pcKeyID,
+                       int iDepth, unsigned char *pucInterHash,
+                       unsigned char *pucHash)
+{
+    KeyChain_T oContext = &psReader->sContext;
+    struct NodeRecord sRecord;
+    const unsigned char *pucEncKey = NULL;
+    const unsigned char *puc;
+    unsigned char (*paucHash)[HASHLEN] = NULL;
+    unsigned char aucRoot[HASHLEN];
+    unsigned int *auKnown = NULL;
+    unsigned long ulType = 0;
+    unsigned long ulCipher = 0;
+    unsigned long ulNumKnown;
+    unsigned long ulNumChildren;
+    unsigned long ulPos;
+    unsigned long ulSuffix;
+    unsigned long ul;
+    size_t uIDLen = strlen(pcKeyID);
+    char *pcChildID;
+    int iOK = 0;
+
+    if (iDepth > PROOF_MAXDEPTH)
+        return 0;
+    if (iDepth > 0) {
+        pucEncKey = readProof(psReader, KEYLEN);
+        if (pucEncKey == NULL || !readProofU32(psReader, &ulType) ||
+            !readProofU32(psReader, &ulCipher))
+            return 0;
+    }
+
+    if (!readProofU32(psReader, &ulNumKnown))
+        return 0;
+    if (ulNumKnown == 0) {
+        puc = readProof(psReader, HASHLEN);
+        if (puc == NULL)
+            return 0;
+        memcpy(pucInterHash, puc, HASHLEN);
+    }
+    else {
+        // every proven child takes more than 8 bytes, so a forged
+        // count cannot claim much memory; no node has more children
+        // than half the slots
+        if (!readProofU32(psReader, &ulNumChildren) ||
+            ulNumChildren > NONODE / 2 || ulNumKnown > ulNumChildren ||
+            ulNumKnown > (psReader->uLen - psReader->uPos) / 8)
+            return 0;
+        if (oContext->iEncoding != KEYCHAIN_ENCODING_TREE &&
+            ulNumChildren - ulNumKnown >
+                (psReader->uLen - psReader->uPos) / HASHLEN)
+            return 0;
+        auKnown = (unsigned int *)malloc(ulNumKnown * sizeof(unsigned int));
+        paucHash = (unsigned char (*)[HASHLEN])malloc(
+            (oContext->iEncoding == KEYCHAIN_ENCODING_TREE ? ulNumKnown
+                                                           : ulNumChildren)
+            * HASHLEN);
+        if (auKnown == NULL || paucHash == NULL)
+            goto cleanup;
+
+        for (ul = 0; ul < ulNumKnown; ul++) {
+            if (!readProofU32(psReader, &ulPos) || ulPos >= ulNumChildren ||
+                (ul > 0 && ulPos <= auKnown[ul - 1]) ||
+                !readProofU32(psReader, &ulSuffix) || ulSuffix == 0 ||
+                (puc = readProof(psReader, ulSuffix)) == NULL ||
+                memchr(puc, '\0', ulSuffix) != NULL)
+                goto cleanup;
+            auKnown[ul] = ulPos;
+
+            pcChildID = (char *)malloc(uIDLen + ulSuffix + 1);
+            if (pcChildID == NULL)
+                goto cleanup;
+            memcpy(pcChildID, pcKeyID, uIDLen);
+            memcpy(pcChildID + uIDLen, puc, ulSuffix);
+            pcChildID[uIDLen + ulSuffix] = '\0';
+            iOK = verifyEntry(psReader, pcKeyID, pcChildID, iDepth + 1,
+                              aucRoot,
+                              paucHash[oContext->iEncoding ==
+                                       KEYCHAIN_ENCODING_TREE ? ul : ulPos]);
+            free(pcChildID);
+            if (!iOK)
+                goto cleanup;
+            iOK = 0;
+        }
+
+        if (oContext->iEncoding == KEYCHAIN_ENCODING_TREE) {
+            if (!verifyRange(psReader, 0, ulNumChildren, auKnown, paucHash,
+                             ulNumKnown, aucRoot))
+                goto cleanup;
+        }
+        else {
+            for (ulPos = 0, ul = 0; ulPos < ulNumChildren; ulPos++) {
+                if (ul < ulNumKnown && auKnown[ul] == ulPos) {
+                    ul++;
+                    continue;
+                }
+                puc = readProof(psReader, HASHLEN);
+                if (puc == NULL)
+                    goto cleanup;
+                memcpy(paucHash[ulPos], puc, HASHLEN);
+            }
+        }
+        hashChildRecord(oContext, paucHash, NULL, ulNumChildren, aucRoot,
+                        pucInterHash);
+    }
+
+    if (iDepth > 0) {
+        sRecord.pcKeyID = pcKeyID;
+        sRecord.pcParentKeyID = pcParentKeyID;
+        sRecord.pucEncKey = pucEncKey;
+        sRecord.pucInterHash = pucInterHash;
+        sRecord.iType = (int)ulType;
+        sRecord.iDepth = iDepth;
+        sRecord.iCipher = (int)ulCipher;
+        hashRecord(oContext, &sRecord, pucHash);
+    }
+
+    if (psReader->pcKeyID != NULL && strcmp(psReader->pcKeyID, pcKeyID) == 0) {
+        psReader->iFound = 1;
+        if (psReader->pucEncKey != NULL) {
+            if (pucEncKey != NULL)
+                memcpy(psReader->pucEncKey, pucEncKey, KEYLEN);
+            else
+                memset(psReader->pucEncKey, 0, KEYLEN);
+        }
+        if (psReader->pucInterHash != NULL)
+            memcpy(psReader->pucInterHash, pucInterHash, HASHLEN);
+    }
+    iOK = 1;
+
+cleanup:
+    free(auKnown);
+    free(paucHash);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return a new keychain sharing the arrays of oKeyChain, with a cache,
+   epoch, locks and list of revoked subtrees of its own and no
+   journal, or NULL if insufficient memory is available. The caller
+   holds the changes of oKeyChain, whose hashes must be committed. */
+static KeyChain_T shareKeyChain(KeyChain_T oKeyChain)
+{
+    KeyChain_T oCopy;
+    struct KeyCacheEntry *psKeyCache;
+    struct PurgeBlock *psPurge;
+    Epoch_T oEpoch;
+
+    assert(!(oKeyChain->psLinks[ROOTNODE].ucFlags & NODE_DIRTY));
+
+    // revoked subtrees not yet purged stay in the shared arrays, so
+    // the copy purges its own list of them if it ever changes
+    oCopy = (KeyChain_T)malloc(sizeof(struct KeyChain));
+    psKeyCache = (struct KeyCacheEntry *)
+        calloc(KEYCACHELEN, sizeof(struct KeyCacheEntry));
+    psPurge = NULL;
+    if (oKeyChain->uNumPurge > 0)
+        psPurge = (struct PurgeBlock *)
+            copyArray(oKeyChain->psPurge,
+                      oKeyChain->uNumPurge * sizeof(struct PurgeBlock),
+                      oKeyChain->uNumPurge * sizeof(struct PurgeBlock));
+    oEpoch = Epoch_new();
+    if (oCopy == NULL || psKeyCache == NULL || oEpoch == NULL ||
+        (oKeyChain->uNumPurge > 0 && psPurge == NULL)) {
+        free(oCopy);
+        free(psKeyCache);
+        free(psPurge);
+        if (oEpoch != NULL)
+            Epoch_free(oEpoch);
+        return NULL;
+    }
+
+    // counters are not shared
+    memcpy(oCopy, oKeyChain, sizeof(struct KeyChain));
+    oCopy->psShared = NULL;
+    if (STAT_NEW(oCopy))
+        oCopy->psShared = shareArrays(oKeyChain);
+    if (oCopy->psShared == NULL) {
+        STAT_FREE(oCopy);
+        free(oCopy);
+        free(psKeyCache);
+        free(psPurge);
+        Epoch_free(oEpoch);
+        return NULL;
+    }
+    initLocks(oCopy);
+    oCopy->psKeyCache = psKeyCache;
+    oCopy->oEpoch = oEpoch;
+    oCopy->oJournal = NULL;
+    oCopy->iDeferred = 0;
+    oCopy->iChanging = 0;
+    oCopy->psQueued = NULL;
+    oCopy->iCombining = 0;
+    oCopy->psPurge = psPurge;
+    oCopy->uPurgeCap = oKeyChain->uNumPurge;
+    oCopy->iReadOnly = 0;
+    oCopy->oBase = NULL;
+    oCopy->pucStaged = NULL;
+    oCopy->uStagedLen = 0;
+    oCopy->uStagedCap = 0;
+    oCopy->iStageFailed = 0;
+    return oCopy;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Give the tree of oFrom, with its arrays or its hold on shared ones,
+   to oKeyChain, whose own arrays the caller has dealt with. oFrom is
+   left without a tree. Called in a change of oKeyChain. */
+static void takeTree(KeyChain_T oKeyChain, KeyChain_T oFrom)
+{
+    int i;
+
+    free(oKeyChain->psPurge);
+    oKeyChain->iNumKeys = oFrom->iNumKeys;
+    oKeyChain->iEncoding = oFrom->iEncoding;
+    oKeyChain->psIndex = oFrom->psIndex;
+    oKeyChain->uIndexCap = oFrom->uIndexCap;
+    oKeyChain->uIndexUsed = oFrom->uIndexUsed;
+    oKeyChain->psLinks = oFrom->psLinks;
+    oKeyChain->psIDs = oFrom->psIDs;
+    oKeyChain->paucEncKey = oFrom->paucEncKey;
+    oKeyChain->paucInterHash = oFrom->paucInterHash;
+    oKeyChain->paucHash = oFrom->paucHash;
+    oKeyChain->psTrees = oFrom->psTrees;
+    oKeyChain->psGens = oFrom->psGens;
+    oKeyChain->ulGeneration = oFrom->ulGeneration;
+    oKeyChain->uNumNodes = oFrom->uNumNodes;
+    oKeyChain->uNodeCap = oFrom->uNodeCap;
+    for (i = 0; i < BLOCKCLASSES; i++)
+        oKeyChain->auFreeBlocks[i] = oFrom->auFreeBlocks[i];
+    oKeyChain->pvMap = oFrom->pvMap;
+    oKeyChain->uMapLen = oFrom->uMapLen;
+    oKeyChain->psPurge = oFrom->psPurge;
+    oKeyChain->uNumPurge = oFrom->uNumPurge;
+    oKeyChain->uPurgeCap = oFrom->uPurgeCap;
+    oKeyChain->uNumHoly = oFrom->uNumHoly;
+    oKeyChain->uHoleCursor = oFrom->uHoleCursor;
+    oKeyChain->psShared = oFrom->psShared;
+
+    oFrom->iNumKeys = 0;
+    oFrom->psIndex = NULL;
+    oFrom->psLinks = NULL;
+    oFrom->psIDs = NULL;
+    oFrom->paucEncKey = NULL;
+    oFrom->paucInterHash = NULL;
+    oFrom->paucHash = NULL;
+    oFrom->psTrees = NULL;
+    oFrom->psGens = NULL;
+    oFrom->uNumNodes = 0;
+    oFrom->pvMap = NULL;
+    oFrom->psPurge = NULL;
+    oFrom->uNumPurge = 0;
+    oFrom->uNumHoly = 0;
+    oFrom->psShared = NULL;
+}
+
+/*--------------------------------------------------------------------*/
+/* Public functions:                                                  */
+/*--------------------------------------------------------------------*/
+
+KeyChain_T KeyChain_new(unsigned long umk)
+{
+    return KeyChain_newWithHash(umk, KEYHASH_SHA256);
+}
+
+/*--------------------------------------------------------------------*/
+
+KeyChain_T KeyChain_newWithHash(unsigned long umk, int iHashType)
+{
+    KeyChain_T oKeyChain;
+    const struct KeyHash *psHash;
+    struct KeyNodeLinks *psRoot;
+    unsigned char *aucRootEncKey;
+    int i;
+    aucRootEncKey = (unsigned char*)&umk;
+
+    psHash = KeyHash_get(iHashType);
+    if (psHash == NULL)
+        return NULL;
+
+    oKeyChain = (KeyChain_T)calloc(1, sizeof(struct KeyChain));
+    if (oKeyChain == NULL)
+        return NULL;
+    initLocks(oKeyChain);
+    oKeyChain->psKeyCache = (struct KeyCacheEntry *)
+        calloc(KEYCACHELEN, sizeof(struct KeyCacheEntry));
+    oKeyChain->oEpoch = Epoch_new();
+    if (oKeyChain->psKeyCache == NULL || oKeyChain->oEpoch == NULL ||
+        !STAT_NEW(oKeyChain)) {
+        KeyChain_free(oKeyChain);
+        return NULL;
+    }
+
+    oKeyChain->iNumKeys = 0;
+    oKeyChain->psHash = psHash;
+    oKeyChain->iEncoding = KEYCHAIN_ENCODING_TEXT;
+    oKeyChain->iDeferred = 0;
+    oKeyChain->ulGeneration = 1;
+    for (i = 0; i < BLOCKCLASSES; i++)
+        oKeyChain->auFreeBlocks[i] = NONODE;
+
+    // Instantiate software root node, with the 64 bit UMK as its key
+    // and an all zero internal hash
+    if (allocBlock(oKeyChain, 0) != ROOTNODE ||
+        !resizeIndex(oKeyChain, INDEXMINCAP)) {
+        KeyChain_free(oKeyChain);
+        return NULL;
+    }
+    setKeyID(oKeyChain, ROOTNODE, "0");
+    memcpy(oKeyChain->paucEncKey[ROOTNODE], aucRootEncKey, KEYLEN);
+    memset(oKeyChain->paucInterHash[ROOTNODE], 0, HASHLEN);
+
+    psRoot = &oKeyChain->psLinks[ROOTNODE];
+    psRoot->uParent      = NONODE;
+    psRoot->uFirstChild  = NONODE;
+    psRoot->uNumChildren = 0;
+    psRoot->uChildSlots  = 0;
+    psRoot->uComponent   = '0';
+    psRoot->iType        = 0;
+    psRoot->iDepth       = 0;
+    psRoot->ucCipher     = KEYCHAIN_CIPHER_XOR;
+    psRoot->ucFlags      = NODE_USED;
+
+    hashKeyNode(oKeyChain, ROOTNODE, oKeyChain->paucHash[ROOTNODE]);
+    stampNode(oKeyChain, ROOTNODE);
+    indexKeyNode(oKeyChain, ROOTNODE);
+
+    return oKeyChain;
+}
+
+/*--------------------------------------------------------------------*/
+
+void KeyChain_free(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain != NULL);
+
+    if (oKeyChain->psShared != NULL)
+        releaseArrays(oKeyChain->psShared);
+    else
+        freeNodeArrays(oKeyChain);
+    if (oKeyChain->psKeyCache != NULL)
+        wipe(oKeyChain->psKeyCache,
+             KEYCACHELEN * sizeof(struct KeyCacheEntry));
+    free(oKeyChain->psKeyCache);
+    free(oKeyChain->psPurge);
+    free(oKeyChain->pucStaged);
+    STAT_FREE(oKeyChain);
+    if (oKeyChain->oJournal != NULL)
+        Journal_free(oKeyChain->oJournal);
+    if (oKeyChain->oEpoch != NULL)
+        Epoch_free(oKeyChain->oEpoch);
+    pthread_mutex_destroy(&oKeyChain->sChangeLock);
+    pthread_mutex_destroy(&oKeyChain->sQueueLock);
+    pthread_cond_destroy(&oKeyChain->sApplied);
+    free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_save(KeyChain_T oKeyChain, const char *pcFileName)
+{
+    struct SnapshotHeader sHeader;
+    struct KeyNodeID sID;
+    unsigned char aucNoKey[KEYLEN];
+    unsigned long ulOffset;
+    unsigned long ulLongIDs;
+    const char *pcKeyID;
+    KeyChain_T oCopy;
+    NodeIdx uNumNodes;
+    NodeIdx u;
+    FILE *fpo;
+    int iOK;
+    int i;
+
+    assert(oKeyChain != NULL);
+    assert(pcFileName != NULL);
+
+    lockChanges(oKeyChain);
+
+    // a snapshot has no room for revoked subtrees
+    KeyChain_purge(oKeyChain, INT_MAX);
+    KeyChain_commit(oKeyChain);
+
+    // a snapshot object cannot purge its own, so a private copy of it
+    // does and is saved instead
+    if (oKeyChain->uNumPurge > 0 || oKeyChain->uNumHoly > 0) {
+        oCopy = NULL;
+        if (!(oKeyChain->psLinks[ROOTNODE].ucFlags & NODE_DIRTY))
+            oCopy = shareKeyChain(oKeyChain);
+        unlockChanges(oKeyChain);
+        if (oCopy == NULL)
+            return 0;
+        iOK = KeyChain_purge(oCopy, INT_MAX) == 0 &&
+              KeyChain_save(oCopy, pcFileName);
+        KeyChain_free(oCopy);
+        return iOK;
+    }
+    uNumNodes = oKeyChain->uNumNodes;
+
+    memset(&sHeader, 0, sizeof(sHeader));
+    memcpy(sHeader.acMagic, SNAP_MAGIC, sizeof(sHeader.acMagic));
+    sHeader.uVersion = SNAP_VERSION;
+    sHeader.uByteOrder = SNAP_BYTEORDER;
+    sHeader.uLinksSize = sizeof(struct KeyNodeLinks);
+    sHeader.uIDSize = sizeof(struct KeyNodeID);
+    sHeader.uSlotSize = sizeof(struct IndexSlot);
+    sHeader.iHashType = oKeyChain->psHash->iType;
+    sHeader.iEncoding = oKeyChain->iEncoding;
+    sHeader.iNumKeys = oKeyChain->iNumKeys;
+    sHeader.uNumNodes = uNumNodes;
+    for (i = 0; i < BLOCKCLASSES; i++)
+        sHeader.auFreeBlocks[i] = oKeyChain->auFreeBlocks[i];
+    sHeader.ulIndexCap = oKeyChain->uIndexCap;
+    sHeader.ulIndexUsed = oKeyChain->uIndexUsed;
+    sHeader.ulCheckpoint = oKeyChain->ulCheckpoint;
+
+    // lay out the arrays
+    ulOffset = snapAlign(sizeof(sHeader));
+    sHeader.aulOffset[SNAP_LINKS] = ulOffset;
+    ulOffset = snapAlign(ulOffset + uNumNodes * sizeof(struct KeyNodeLinks));
+    sHeader.aulOffset[SNAP_IDS] = ulOffset;
+    ulOffset = snapAlign(ulOffset + uNumNodes * sizeof(struct KeyNodeID));
+    sHeader.aulOffset[SNAP_ENCKEYS] = ulOffset;
+    ulOffset = snapAlign(ulOffset + uNumNodes * KEYLEN);
+    sHeader.aulOffset[SNAP_INTERHASHES] = ulOffset;
+    ulOffset = snapAlign(ulOffset + uNumNodes * HASHLEN);
+    sHeader.aulOffset[SNAP_HASHES] = ulOffset;
+    ulOffset = snapAlign(ulOffset + uNumNodes * HASHLEN);
+    sHeader.aulOffset[SNAP_INDEX] = ulOffset;
+    ulOffset = snapAlign(ulOffset + oKeyChain->uIndexCap *
+                                    sizeof(struct IndexSlot));
+    sHeader.aulOffset[SNAP_LONGIDS] = ulOffset;
+    for (u = 0; u < uNumNodes; u++) {
+        if (!(oKeyChain->psLinks[u].ucFlags & NODE_USED))
+            continue;
+        pcKeyID = keyIDOf(oKeyChain, u);
+        if (strlen(pcKeyID) + 1 > KEYIDINLINE)
+            ulOffset += strlen(pcKeyID) + 1;
+    }
+    sHeader.ulFileLen = ulOffset;
+
+    fpo = fopen(pcFileName, "wb");
+    if (fpo == NULL) {
+        unlockChanges(oKeyChain);
+        return 0;
+    }
+
+    // long key IDs are stored as offsets into the file, tagged in the
+    // low bit; the gaps left by the seeks read as zeros
+    iOK = fwrite(&sHeader, sizeof(sHeader), 1, fpo) == 1;
+
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_LINKS], SEEK_SET) == 0;
+    iOK = iOK && fwrite(oKeyChain->psLinks, sizeof(struct KeyNodeLinks),
+                        uNumNodes, fpo) == uNumNodes;
+
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_IDS], SEEK_SET) == 0;
+    ulLongIDs = sHeader.aulOffset[SNAP_LONGIDS];
+    for (u = 0; iOK && u < uNumNodes; u++) {
+        memset(&sID, 0, sizeof(sID));
+        if (oKeyChain->psLinks[u].ucFlags & NODE_USED) {
+            pcKeyID = keyIDOf(oKeyChain, u);
+            if (strlen(pcKeyID) + 1 > KEYIDINLINE) {
+                sID.pcLongKeyID = (char *)(uintptr_t)(ulLongIDs << 1 | 1);
+                ulLongIDs += strlen(pcKeyID) + 1;
+            }
+            else
+                strcpy(sID.acKeyID, pcKeyID);
+        }
+        iOK = fwrite(&sID, sizeof(sID), 1, fpo) == 1;
+    }
+
+    // the root key stays out of the file
+    memset(aucNoKey, 0, KEYLEN);
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_ENCKEYS], SEEK_SET) == 0;
+    iOK = iOK && fwrite(aucNoKey, KEYLEN, 1, fpo) == 1;
+    iOK = iOK && fwrite(oKeyChain->paucEncKey + 1, KEYLEN, uNumNodes - 1,
+                        fpo) == uNumNodes - 1;
+
+    iOK = iOK &&
+          fseek(fpo, sHeader.aulOffset[SNAP_INTERHASHES], SEEK_SET) == 0;
+    iOK = iOK && fwrite(oKeyChain->paucInterHash, HASHLEN, uNumNodes,
+                        fpo) == uNumNodes;
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_HASHES], SEEK_SET) == 0;
+    iOK = iOK && fwrite(oKeyChain->paucHash, HASHLEN, uNumNodes,
+                        fpo) == uNumNodes;
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_INDEX], SEEK_SET) == 0;
+    iOK = iOK && fwrite(oKeyChain->psIndex, sizeof(struct IndexSlot),
+                        oKeyChain->uIndexCap, fpo) == oKeyChain->uIndexCap;
+
+    iOK = iOK && fseek(fpo, sHeader.aulOffset[SNAP_LONGIDS], SEEK_SET) == 0;
+    for (u = 0; iOK && u < uNumNodes; u++) {
+        if (!(oKeyChain->psLinks[u].ucFlags & NODE_USED))
+            continue;
+        pcKeyID = keyIDOf(oKeyChain, u);
+        if (strlen(pcKeyID) + 1 > KEYIDINLINE)
+            iOK = fwrite(pcKeyID, strlen(pcKeyID) + 1, 1, fpo) == 1;
+    }
+
+    iOK = iOK && fflush(fpo) == 0 && fsync(fileno(fpo)) == 0;
+    if (fclose(fpo) != 0)
+        iOK = 0;
+    unlockChanges(oKeyChain);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+KeyChain_T KeyChain_load(const char *pcFileName, unsigned long umk)
+{
+    const struct SnapshotHeader *psHeader;
+    KeyChain_T oKeyChain;
+    struct stat sStat;
+    char *pcMap;
+    int fd;
+    int i;
+
+    assert(pcFileName != NULL);
+
+    fd = open(pcFileName, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sStat) != 0 ||
+        (size_t)sStat.st_size < sizeof(struct SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    // a private mapping copies a page only when it is first written
+    pcMap = (char *)mmap(NULL, sStat.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pcMap == MAP_FAILED)
+        return NULL;
+
+    psHeader = (const struct SnapshotHeader *)pcMap;
+    oKeyChain = NULL;
+    if (snapshotValid(psHeader, sStat.st_size))
+        oKeyChain = (KeyChain_T)calloc(1, sizeof(struct KeyChain));
+    if (oKeyChain == NULL) {
+        munmap(pcMap, sStat.st_size);
+        return NULL;
+    }
+
+    // child trees and generations are not saved; untouched pages of
+    // these zeroed arrays cost nothing
+    oKeyChain->psTrees = (struct ChildTree *)calloc(psHeader->uNumNodes,
+                                                   sizeof(struct ChildTree));
+    oKeyChain->psGens = (struct NodeGen *)calloc(psHeader->uNumNodes,
+                                                 sizeof(struct NodeGen));
+    oKeyChain->psKeyCache = (struct KeyCacheEntry *)
+        calloc(KEYCACHELEN, sizeof(struct KeyCacheEntry));
+    oKeyChain->oEpoch = Epoch_new();
+    if (oKeyChain->psTrees == NULL || oKeyChain->psGens == NULL ||
+        oKeyChain->psKeyCache == NULL || oKeyChain->oEpoch == NULL ||
+        !STAT_NEW(oKeyChain)) {
+        free(oKeyChain->psTrees);
+        free(oKeyChain->psGens);
+        free(oKeyChain->psKeyCache);
+        STAT_FREE(oKeyChain);
+        if (oKeyChain->oEpoch != NULL)
+            Epoch_free(oKeyChain->oEpoch);
+        free(oKeyChain);
+        munmap(pcMap, sStat.st_size);
+        return NULL;
+    }
+
+    initLocks(oKeyChain);
+    oKeyChain->pvMap = pcMap;
+    oKeyChain->uMapLen = sStat.st_size;
+    oKeyChain->iNumKeys = psHeader->iNumKeys;
+    oKeyChain->psHash = KeyHash_get(psHeader->iHashType);
+    oKeyChain->iEncoding = psHeader->iEncoding;
+    oKeyChain->iDeferred = 0;
+    oKeyChain->ulGeneration = 1;
+    oKeyChain->ulCheckpoint = psHeader->ulCheckpoint;
+    oKeyChain->psIndex = (struct IndexSlot *)
+        (pcMap + psHeader->aulOffset[SNAP_INDEX]);
+    oKeyChain->uIndexCap = psHeader->ulIndexCap;
+    oKeyChain->uIndexUsed = psHeader->ulIndexUsed;
+    oKeyChain->psLinks = (struct KeyNodeLinks *)
+        (pcMap + psHeader->aulOffset[SNAP_LINKS]);
+    oKeyChain->psIDs = (struct KeyNodeID *)
+        (pcMap + psHeader->aulOffset[SNAP_IDS]);
+    oKeyChain->paucEncKey = (unsigned char (*)[KEYLEN])
+        (pcMap + psHeader->aulOffset[SNAP_ENCKEYS]);
+    oKeyChain->paucInterHash = (unsigned char (*)[HASHLEN])
+        (pcMap + psHeader->aulOffset[SNAP_INTERHASHES]);
+    oKeyChain->paucHash = (unsigned char (*)[HASHLEN])
+        (pcMap + psHeader->aulOffset[SNAP_HASHES]);
+    oKeyChain->uNumNodes = psHeader->uNumNodes;
+    oKeyChain->uNodeCap = psHeader->uNumNodes;
+    for (i = 0; i < BLOCKCLASSES; i++)
+        oKeyChain->auFreeBlocks[i] = psHeader->auFreeBlocks[i];
+
+    memcpy(oKeyChain->paucEncKey[ROOTNODE], &umk, KEYLEN);
+    return oKeyChain;
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_openJournal(KeyChain_T oKeyChain, const char *pcFileName)
+{
+    struct Replay sReplay;
+    Journal_T oJournal;
+    int iDeferred;
+    int iNumRecords;
+
+    assert(oKeyChain != NULL);
+    assert(pcFileName != NULL);
+    assert(oKeyChain->oJournal == NULL);
+
+    oJournal = Journal_new(pcFileName);
+    if (oJournal == NULL)
+        return 0;
+
+    // the journal is one burst of changes, hashed once at the end
+    sReplay.oKeyChain = oKeyChain;
+    sReplay.iNumRecords = 0;
+    sReplay.iStale = 0;
+    sReplay.iFailed = 0;
+    iDeferred = oKeyChain->iDeferred;
+    KeyChain_setDeferred(oKeyChain, 1);
+    iNumRecords = Journal_replay(oJournal, replayChange, &sReplay);
+    KeyChain_setDeferred(oKeyChain, iDeferred);
+    if (iNumRecords < 0 || sReplay.iFailed) {
+        Journal_free(oJournal);
+        return 0;
+    }
+
+    oKeyChain->oJournal = oJournal;
+    if (iNumRecords == 0 || sReplay.iStale) {
+        if (!Journal_reset(oJournal))
+            return 0;
+        journalBase(oKeyChain);
+        return Journal_sync(oJournal);
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_sync(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain != NULL);
+
+    if (oKeyChain->oJournal == NULL)
+        return 1;
+    return Journal_sync(oKeyChain->oJournal);
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_checkpoint(KeyChain_T oKeyChain, const char *pcFileName)
+{
+    char *pcTempName;
+    int iOK;
+
+    assert(oKeyChain != NULL);
+    assert(pcFileName != NULL);
+
+    pcTempName = (char *)malloc(strlen(pcFileName) + sizeof(".tmp"));
+    if (pcTempName == NULL)
+        return 0;
+    strcpy(pcTempName, pcFileName);
+    strcat(pcTempName, ".tmp");
+
+    // the snapshot replaces the old one in a single rename, so a crash
+    // leaves either the old snapshot and its journal, or the new one
+    // and a journal it recognizes as stale
+    oKeyChain->ulCheckpoint++;
+    if (!KeyChain_save(oKeyChain, pcTempName) ||
+        rename(pcTempName, pcFileName) != 0) {
+        remove(pcTempName);
+        free(pcTempName);
+        oKeyChain->ulCheckpoint--;
+        return 0;
+    }
+    free(pcTempName);
+    iOK = syncDirectory(pcFileName);
+
+    if (oKeyChain->oJournal != NULL) {
+        iOK = Journal_reset(oKeyChain->oJournal) && iOK;
+        journalBase(oKeyChain);
+        iOK = Journal_sync(oKeyChain->oJournal) && iOK;
+    }
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_getNumKeys(KeyChain_T oKeyChain)
+{
+    return __atomic_load_n(&oKeyChain->iNumKeys, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_getHashType(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain != NULL);
+
+    return oKeyChain->psHash->iType;
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_getEncoding(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain != NULL);
+
+    return oKeyChain->iEncoding;
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_setEncoding(KeyChain_T oKeyChain, int iEncoding)
+{
+    assert(oKeyChain != NULL);
+
+    if (iEncoding != KEYCHAIN_ENCODING_TEXT &&
+        iEncoding != KEYCHAIN_ENCODING_BINARY &&
+        iEncoding != KEYCHAIN_ENCODING_TREE)
+        return 0;
+
+    if (!beginChange(oKeyChain))
+        return 0;
+    if (iEncoding == oKeyChain->iEncoding) {
+        endChange(oKeyChain);
+        return 1;
+    }
+
+    // every node hash changes, so the whole tree is re-rooted; child
+    // trees take positions, which holes would shift
+    if (iEncoding == KEYCHAIN_ENCODING_TREE &&
+        KeyChain_purge(oKeyChain, INT_MAX)) {
+        endChange(oKeyChain);
+        return 0;
+    }
+    KeyChain_commit(oKeyChain);
+    oKeyChain->ulGeneration++;
+    oKeyChain->iEncoding = iEncoding;
+    rehashSubtree(oKeyChain, ROOTNODE);
+    journalChange(oKeyChain, JOURNAL_ENCODING, iEncoding, NULL, "");
+    endChange(oKeyChain);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+void KeyChain_setDeferred(KeyChain_T oKeyChain, int iDeferred)
+{
+    assert(oKeyChain != NULL);
+
+    lockChanges(oKeyChain);
+    if (!iDeferred)
+        KeyChain_commit(oKeyChain);
+    oKeyChain->iDeferred = iDeferred != 0;
+    unlockChanges(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+void KeyChain_commit(KeyChain_T oKeyChain)
+{
+    assert(oKeyChain != NULL);
+
+    // every dirty node has a dirty root; readers that find nothing to
+    // commit leave the change count alone
+    lockChanges(oKeyChain);
+    if ((oKeyChain->psLinks[ROOTNODE].ucFlags & NODE_DIRTY) &&
+        beginChange(oKeyChain)) {
+        commitSubtree(oKeyChain, ROOTNODE);
+        endChange(oKeyChain);
+    }
+    unlockChanges(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+int KeyChain_contains(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    struct KeyChain sView;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
+
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
+
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+
+    if (uResultNode != NONODE)
+        return 1;
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+unsigned char *KeyChain_getKey(KeyChain_T oKeyChain,
+                               char *pcKeyID,
+                               unsigned char *pucOutput)
+{
+    struct KeyChain sView;
+    unsigned char aucKey[KEYLEN];
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    unsigned long ulStart;
+    NodeIdx uResultNode;
+    int iFound;
+
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
+    assert(pucOutput != NULL);
+
+    STAT_START(ulStart);
+
+    // keys derived from a view that changed underneath are discarded,
+    // so only a validated key is cached, under the view's generation
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        iFound = uResultNode != NONODE &&
+                 derivePlainKey(&sView, uResultNode,
+                                sView.psLinks[uResultNode].iDepth, 0,
+                                aucKey);
+    } while (!readValid(oKeyChain, ulSeq));
+    if (iFound && uResultNode != ROOTNODE)
+        cacheKey(&sView, uResultNode, aucKey, sView.ulGeneration);
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+
+    if (iFound)
+        memcpy(pucOutput, aucKey, KEYLEN);
+    wipe(aucKey, KEYLEN);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_GETKEY, ulStart);
+    return iFound ? pucOutput : NULL;
+}
 
-/*--------------------------------------------------------------------*/
-/* Private functions:                                                 */
 /*--------------------------------------------------------------------*/
 
-/* 256 bit hash of the key node */
-static void hashKeyNode(struct KeyNode *psNode, unsigned char *hash)
+unsigned char *KeyChain_getEncryptedKey(KeyChain_T oKeyChain, char *pcKeyID)
 {
-    SHA256_CTX ctx;
-    char int_buf[INTBUFLEN];
-    char key_buf[KEYBUFLEN];
-    char hash_buf[HASHBUFLEN];
-    char *pcParentKeyID;
+    struct KeyChain sView;
+    unsigned char *pucEncKey;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
 
-    assert(psNode != NULL);
-    assert(hash != NULL);
-    assert(psNode->pcKeyID != NULL);
-    assert(psNode->pucEncKey != NULL);
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-    // clear buffers
-    memset(int_buf, 0, INTBUFLEN);
-    memset(key_buf, 0, KEYBUFLEN);
-    memset(hash_buf, 0, HASHBUFLEN);
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        pucEncKey = uResultNode != NONODE ? sView.paucEncKey[uResultNode]
+                                          : NULL;
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+    return pucEncKey;
+}
 
-    if (psNode->psParent == NULL)
-        pcParentKeyID = "0";
-    else
-        pcParentKeyID = psNode->psParent->pcKeyID;
+/*--------------------------------------------------------------------*/
 
-    // compute hash over all the contents
-    sha256_init(&ctx);
+unsigned char *KeyChain_getInterHash(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    struct KeyChain sView;
+    unsigned char *pucInterHash;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
 
-    sha256_update(&ctx, psNode->pcKeyID, strlen(psNode->pcKeyID));
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-    sha256_update(&ctx, pcParentKeyID, strlen(pcParentKeyID));
+    // deferred hashes are brought up to date by the changing thread
+    if (oKeyChain->iDeferred)
+        KeyChain_commit(oKeyChain);
+
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        pucInterHash = uResultNode != NONODE ?
+                       sView.paucInterHash[uResultNode] : NULL;
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+    return pucInterHash;
+}
 
-    arrToString(psNode->pucEncKey, key_buf, KEYLEN);
-    sha256_update(&ctx, key_buf, strlen(key_buf));
+/*--------------------------------------------------------------------*/
 
-    arrToString(psNode->pucInterHash, hash_buf, HASHLEN);
-    sha256_update(&ctx, hash_buf, strlen(hash_buf));
+unsigned char *KeyChain_copyInterHash(KeyChain_T oKeyChain,
+                                      char *pcKeyID,
+                                      unsigned char *pucOutput)
+{
+    struct KeyChain sView;
+    unsigned char aucHash[HASHLEN];
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
 
-    intToString(psNode->iType, int_buf);
-    sha256_update(&ctx, int_buf, strlen(int_buf));
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
+    assert(pucOutput != NULL);
 
-    intToString(psNode->iDepth, int_buf);
-    sha256_update(&ctx, int_buf, strlen(int_buf));
+    // deferred hashes are brought up to date by the changing thread
+    if (oKeyChain->iDeferred)
+        KeyChain_commit(oKeyChain);
 
-    sha256_final(&ctx, hash);
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        if (uResultNode != NONODE)
+            memcpy(aucHash, sView.paucInterHash[uResultNode], HASHLEN);
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
 
+    if (uResultNode == NONODE)
+        return NULL;
+    return memcpy(pucOutput, aucHash, HASHLEN);
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Recursive helper function to free psNode and all its children and 
-   siblings */
-static void freeNodes(struct KeyNode *psNode)
+int KeyChain_getType(KeyChain_T oKeyChain, char *pcKeyID)
 {
-    if (psNode) {
-        freeNodes(psNode->psNext);
-        freeNodes(psNode->psChild);
+    struct KeyChain sView;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
+    int iResult;
 
-        // free key node content
-        free(psNode->pcKeyID);
-        free(psNode->pucEncKey);
-        free(psNode->pucInterHash);
-        free(psNode->pucHash);
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-        free(psNode);
-    }
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        iResult = -1;
+        if (uResultNode != NONODE)
+            iResult = sView.psLinks[uResultNode].iType;
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Recursive helper function to get keynode of pcKeyID */
-static struct KeyNode *getKeyNode(struct KeyNode *psNode, char *pcKeyID)
+int KeyChain_getCipher(KeyChain_T oKeyChain, char *pcKeyID)
 {
-    int currDepth;
+    struct KeyChain sView;
+    unsigned long ulTicket;
+    unsigned long ulSeq;
+    NodeIdx uResultNode;
+    int iResult;
 
-    while (psNode != NULL) {
-        currDepth = psNode->iDepth;
-        if ((psNode->pcKeyID)[currDepth] == pcKeyID[currDepth]) {
-            if (strlen(pcKeyID) == currDepth+1)
-                return psNode;
-            else
-                return getKeyNode(psNode->psChild, pcKeyID);
-        }
-        psNode = psNode->psNext;
-    }
-    return NULL;
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
+
+    ulTicket = Epoch_enter(oKeyChain->oEpoch);
+    do {
+        ulSeq = readView(oKeyChain, &sView);
+        uResultNode = getKeyNode(&sView, pcKeyID);
+        iResult = -1;
+        if (uResultNode != NONODE)
+            iResult = sView.psLinks[uResultNode].ucCipher;
+    } while (!readValid(oKeyChain, ulSeq));
+    Epoch_exit(oKeyChain->oEpoch, ulTicket);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Recursive helper function to get plaintext key of psNode, placing
-   the result in pucOutput */
-static unsigned char *getPlainKey(struct KeyNode *psNode,
-                                  unsigned char *pucOutput)
+int KeyChain_setCipher(KeyChain_T oKeyChain, char *pcKeyID, int iCipher)
 {
-    unsigned char aucBuf[KEYLEN];
-    unsigned char *pucParentPlainKey;
+    NodeIdx uResultNode;
 
-    if (psNode->psParent == NULL)     // is root, return UMK
-        return psNode->pucEncKey;
-    pucParentPlainKey = getPlainKey(psNode->psParent, pucOutput);
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-    xor_decrypt(psNode->pucEncKey, aucBuf, KEYLEN, pucParentPlainKey);
-    memcpy(pucOutput, aucBuf, KEYLEN);
+    if (iCipher != KEYCHAIN_CIPHER_XOR &&
+        iCipher != KEYCHAIN_CIPHER_CHACHA20)
+        return 0;
 
-    return pucOutput;
+    if (!beginChange(oKeyChain))
+        return 0;
+    uResultNode = getKeyNode(oKeyChain, pcKeyID);
+    if (uResultNode == NONODE ||
+        oKeyChain->psLinks[uResultNode].iType != 1) {
+        endChange(oKeyChain);
+        return 0;
+    }
+
+    // changes below the node predate this one
+    if (oKeyChain->psLinks[uResultNode].ucFlags & NODE_DIRTY)
+        commitSubtree(oKeyChain, uResultNode);
+
+    oKeyChain->ulGeneration++;
+    oKeyChain->psLinks[uResultNode].ucCipher = (unsigned char)iCipher;
+
+    // the cipher is part of the key record
+    hashKeyNode(oKeyChain, uResultNode, oKeyChain->paucHash[uResultNode]);
+    stampNode(oKeyChain, uResultNode);
+    childChanged(oKeyChain, uResultNode);
+    touchPath(oKeyChain, oKeyChain->psLinks[uResultNode].uParent);
+    journalChange(oKeyChain, JOURNAL_CIPHER, iCipher, NULL, pcKeyID);
+    endChange(oKeyChain);
+    return 1;
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Recursive helper function to remove keynode with id pcKeyID */
-static struct KeyNode *removeKeyNode(struct KeyNode *psCurrNode, 
-                                     struct KeyNode *psPrevNode,
-                                     char *pcKeyID)
+int KeyChain_addKey(KeyChain_T oKeyChain,
+                    char *pcParentKeyID,
+                    char *pcKeyID,
+                    unsigned char *pucKey,
+                    int iType)
 {
-    int currDepth;
-    while (psCurrNode != NULL) {
-        currDepth = psCurrNode->iDepth;
-        if ((psCurrNode->pcKeyID)[currDepth] == pcKeyID[currDepth]) {
-            if (strlen(pcKeyID) == currDepth+1) {
-                if (psPrevNode->iDepth == psCurrNode->iDepth) {
-                    psPrevNode->psNext = psCurrNode->psNext;
-                }
-                else {
-                    psPrevNode->psChild = psCurrNode->psNext;
-                }
-                // free all children
-                freeNodes(psCurrNode->psChild);
-                return psCurrNode;
-            }
-            else {
-                return removeKeyNode(psCurrNode->psChild, psCurrNode, pcKeyID);
-            }             
-        }
-        psPrevNode = psCurrNode;
-        psCurrNode = psCurrNode->psNext;
+    unsigned long ulStart;
+    NodeIdx uNewNode;
+
+    assert(oKeyChain != NULL);
+    assert(pcParentKeyID != NULL);
+    assert(pcKeyID != NULL);
+    assert(pucKey != NULL);
+
+    STAT_START(ulStart);
+    if (!beginChange(oKeyChain)) {
+        STAT_OP(oKeyChain, KEYCHAIN_OP_ADD, ulStart);
+        return 0;
     }
-    return NULL;
+    oKeyChain->ulGeneration++;
+    uNewNode = insertKeyNode(oKeyChain, pcParentKeyID, pcKeyID, pucKey,
+                             iType);
+    if (uNewNode == NONODE) {
+        endChange(oKeyChain);
+        STAT_OP(oKeyChain, KEYCHAIN_OP_ADD, ulStart);
+        return 0;
+    }
+
+    hashKeyNode(oKeyChain, uNewNode, oKeyChain->paucHash[uNewNode]);
+    childChanged(oKeyChain, uNewNode);
+
+    // update intermediate hashes on path to root node
+    touchPath(oKeyChain, oKeyChain->psLinks[uNewNode].uParent);
+
+    journalChange(oKeyChain, JOURNAL_ADD, iType,
+                  oKeyChain->paucEncKey[uNewNode], pcKeyID);
+    endChange(oKeyChain);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_ADD, ulStart);
+    return 1;
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Compute hash over the key node hashes psNode's children, place
-   the result in aucHashBuf */
-static void hashChildren(struct KeyNode *psNode, unsigned char *aucHashBuf)
+char *KeyChain_pathKeyID(const unsigned int *auPath, int iPathLen,
+                         char *pcKeyID)
 {
-    struct KeyNode *psCurrNode;
-    char hash_buf[HASHBUFLEN];
-    SHA256_CTX ctx;
+    char *pcIter;
+    int i;
 
-    assert(psNode != NULL);
-    assert(aucHashBuf != NULL);
+    assert(auPath != NULL || iPathLen == 0);
+    assert(pcKeyID != NULL);
 
-    memset(aucHashBuf, 0, HASHLEN);
-    memset(hash_buf, 0, HASHBUFLEN);
+    pcIter = pcKeyID;
+    *pcIter++ = '0';
+    for (i = 0; i < iPathLen; i++) {
+        if (auPath[i] == 0)
+            return NULL;
+        pcIter += putComponent(auPath[i], pcIter);
+    }
+    *pcIter = '\0';
+    return pcKeyID;
+}
 
-    if (psNode->iNumChildren == 0)
-        return;
+/*--------------------------------------------------------------------*/
 
-    sha256_init(&ctx);
+int KeyChain_keyIDPath(const char *pcKeyID, unsigned int *auPath,
+                       int iMaxLen)
+{
+    size_t uOffset;
+    size_t uLen;
+    int iPathLen;
 
-    psCurrNode = psNode->psChild;
-    while (psCurrNode != NULL) {
-        arrToString(psCurrNode->pucHash, hash_buf, HASHLEN);
-        sha256_update(&ctx, hash_buf, strlen(hash_buf));
-        psCurrNode = psCurrNode->psNext;
+    assert(pcKeyID != NULL);
+    assert(auPath != NULL || iMaxLen == 0);
+
+    if (pcKeyID[0] != '0')
+        return -1;
+    iPathLen = 0;
+    for (uOffset = 1; pcKeyID[uOffset] != '\0'; uOffset += uLen) {
+        if (iPathLen == iMaxLen)
+            return -1;
+        uLen = readComponent(pcKeyID + uOffset, &auPath[iPathLen++]);
+        if (uLen == 0)
+            return -1;
     }
-    sha256_final(&ctx, aucHashBuf);
+    return iPathLen;
 }
 
 /*--------------------------------------------------------------------*/
 
-/* Update hash of intermediate node psNode */
-static void updateHashes(struct KeyNode *psNode)
+int KeyChain_addKeyPath(KeyChain_T oKeyChain,
+                        const unsigned int *auPath,
+                        int iPathLen,
+                        unsigned char *pucKey,
+                        int iType)
 {
-    char aucHashBuf[HASHLEN];
+    char *pcKeyID;
+    char *pcParentKeyID;
+    int iResult;
 
-    assert(psNode != NULL);
+    assert(oKeyChain != NULL);
+    assert(auPath != NULL);
+    assert(pucKey != NULL);
 
-    // update internal hash with hashes of children
-    hashChildren(psNode, aucHashBuf);
-    memcpy(psNode->pucInterHash, aucHashBuf, HASHLEN);
+    if (iPathLen <= 0)
+        return 0;
 
-    // rehash entire key node
-    memset(aucHashBuf, 0, HASHLEN);
-    hashKeyNode(psNode, aucHashBuf);
-    memcpy(psNode->pucHash, aucHashBuf, HASHLEN);
+    pcKeyID = (char *)malloc(2 * KEYCHAIN_KEYIDLEN(iPathLen));
+    if (pcKeyID == NULL)
+        return 0;
+    pcParentKeyID = pcKeyID + KEYCHAIN_KEYIDLEN(iPathLen);
+    iResult = KeyChain_pathKeyID(auPath, iPathLen, pcKeyID) != NULL &&
+              KeyChain_pathKeyID(auPath, iPathLen - 1, pcParentKeyID) != NULL &&
+              KeyChain_addKey(oKeyChain, pcParentKeyID, pcKeyID, pucKey,
+                              iType);
+    free(pcKeyID);
+    return iResult;
 }
 
-
-/*--------------------------------------------------------------------*/
-/* Public functions:                                                  */
 /*--------------------------------------------------------------------*/
 
-KeyChain_T KeyChain_new(unsigned long umk)
+int KeyChain_addKeys(KeyChain_T oKeyChain,
+                     const struct KeyChainRecord *psRecords,
+                     int iNumRecords)
 {
-    KeyChain_T oKeyChain;
-    struct KeyNode *psRoot;
-    char *pcRootKeyID;
-    unsigned char *pucRootEncKey;
-    unsigned char *pucRootInterHash;
-    unsigned char *pucRootHash;
-    unsigned char *aucRootEncKey;
-    unsigned char aucHashBuf[HASHLEN];   // 256 bit hash
-    aucRootEncKey = (unsigned char*)&umk;
+    struct HashLevel sLevel;
+    NodeIdx *auDirty;
+    NodeIdx *auByDepth;
+    int *aiLevelStart;
+    NodeIdx uNode;
+    int iNumDirty;
+    int iMaxDepth;
+    int iDepth;
+    int iResult;
+    int i;
 
-    oKeyChain = (KeyChain_T)malloc(sizeof(struct KeyChain));
-    if (oKeyChain == NULL)
-        return NULL;
+    assert(oKeyChain != NULL);
+    assert(psRecords != NULL || iNumRecords == 0);
 
-    // Instantiate software root node
-    psRoot = (struct KeyNode *)malloc(sizeof(struct KeyNode));
-    if (psRoot == NULL)
-        return NULL;
+    if (!beginChange(oKeyChain))
+        return 0;
+    KeyChain_commit(oKeyChain);
+    oKeyChain->ulGeneration++;
+
+    // every node that needs hashing is new or an ancestor of a new one
+    iResult = 0;
+    auDirty = (NodeIdx *)malloc((iNumRecords + oKeyChain->iNumKeys + 1) *
+                                sizeof(NodeIdx));
+    auByDepth = (NodeIdx *)malloc((iNumRecords + oKeyChain->iNumKeys + 1) *
+                                  sizeof(NodeIdx));
+    aiLevelStart = NULL;
+    if (auDirty == NULL || auByDepth == NULL)
+        goto cleanup;
+
+    // link and encrypt all keys first; nothing is hashed yet, so a bad
+    // record is undone by removing the keys added before it
+    for (i = 0; i < iNumRecords; i++) {
+        assert(psRecords[i].pcParentKeyID != NULL);
+        assert(psRecords[i].pcKeyID != NULL);
+        assert(psRecords[i].pucKey != NULL);
+
+        if (insertKeyNode(oKeyChain, psRecords[i].pcParentKeyID,
+                          psRecords[i].pcKeyID, psRecords[i].pucKey,
+                          psRecords[i].iType) == NONODE) {
+            while (i-- > 0)
+                removeKeyNode(oKeyChain, getKeyNode(oKeyChain,
+                                                    psRecords[i].pcKeyID));
+            goto cleanup;
+        }
+    }
 
-    pcRootKeyID = (char *)malloc(sizeof(char) + 1);
-    if (pcRootKeyID == NULL)
-        return NULL;
-    strcpy(pcRootKeyID, "0");
+    // nodes may have moved while their siblings were added, so they
+    // are looked up again by ID
+    iNumDirty = 0;
+    iMaxDepth = 0;
+    for (i = 0; i < iNumRecords; i++) {
+        uNode = getKeyNode(oKeyChain, psRecords[i].pcKeyID);
+        while (uNode != NONODE &&
+               !(oKeyChain->psLinks[uNode].ucFlags & NODE_DIRTY)) {
+            oKeyChain->psLinks[uNode].ucFlags |= NODE_DIRTY;
+            auDirty[iNumDirty++] = uNode;
+            if (oKeyChain->psLinks[uNode].iDepth > iMaxDepth)
+                iMaxDepth = oKeyChain->psLinks[uNode].iDepth;
+            uNode = oKeyChain->psLinks[uNode].uParent;
+        }
+    }
 
-    // 64 bit key
-    pucRootEncKey = (unsigned char *)malloc(KEYLEN * sizeof(unsigned char));
-    if (pucRootEncKey == NULL)
-        return NULL;
-    memcpy(pucRootEncKey, aucRootEncKey, KEYLEN);
+    // sort the dirty nodes by depth
+    aiLevelStart = (int *)calloc(iMaxDepth + 2, sizeof(int));
+    if (aiLevelStart == NULL) {
+        for (i = 0; i < iNumDirty; i++)
+            oKeyChain->psLinks[auDirty[i]].ucFlags &= ~NODE_DIRTY;
+        for (i = iNumRecords; i-- > 0; )
+            removeKeyNode(oKeyChain, getKeyNode(oKeyChain,
+                                                psRecords[i].pcKeyID));
+        goto cleanup;
+    }
+    for (i = 0; i < iNumDirty; i++)
+        aiLevelStart[oKeyChain->psLinks[auDirty[i]].iDepth + 1]++;
+    for (iDepth = 0; iDepth <= iMaxDepth; iDepth++)
+        aiLevelStart[iDepth + 1] += aiLevelStart[iDepth];
+    for (i = 0; i < iNumDirty; i++) {
+        iDepth = oKeyChain->psLinks[auDirty[i]].iDepth;
+        auByDepth[aiLevelStart[iDepth]++] = auDirty[i];
+    }
 
-    // 256 bit internal hash
-    pucRootInterHash = (unsigned char *)malloc(HASHLEN * sizeof(unsigned char));
-    if (pucRootInterHash == NULL)
-        return NULL;
-    memset(pucRootInterHash, 0, HASHLEN);
+    // hash the deepest level first; the nodes of a level only read
+    // the finished level below, so they are hashed in parallel
+    sLevel.oKeyChain = oKeyChain;
+    for (iDepth = iMaxDepth; iDepth >= 0; iDepth--) {
+        sLevel.auNodes = auByDepth + (iDepth > 0 ? aiLevelStart[iDepth - 1]
+                                                 : 0);
+        sLevel.iNumNodes = aiLevelStart[iDepth] -
+                           (iDepth > 0 ? aiLevelStart[iDepth - 1] : 0);
+        Parallel_for((sLevel.iNumNodes + BULKCHUNK - 1) / BULKCHUNK,
+                     hashLevelTask, &sLevel);
+    }
 
-    // 256 bit key node hash
-    pucRootHash = (unsigned char *)malloc(HASHLEN * sizeof(unsigned char));
-    if (pucRootHash == NULL)
-        return NULL;
+    for (i = 0; i < iNumDirty; i++)
+        oKeyChain->psLinks[auDirty[i]].ucFlags &= ~NODE_DIRTY;
+    for (i = 0; i < iNumRecords; i++)
+        journalChange(oKeyChain, JOURNAL_ADD, psRecords[i].iType,
+            oKeyChain->paucEncKey[getKeyNode(oKeyChain,
+                                             psRecords[i].pcKeyID)],
+            psRecords[i].pcKeyID);
+    iResult = 1;
+
+cleanup:
+    endChange(oKeyChain);
+    free(auDirty);
+    free(auByDepth);
+    free(aiLevelStart);
+    return iResult;
+}
 
-    psRoot->pcKeyID      = pcRootKeyID;
-    psRoot->pucEncKey    = pucRootEncKey;
-    psRoot->pucInterHash = pucRootInterHash;
-    psRoot->iType        = 0;
-    psRoot->iDepth       = 0;
-    psRoot->iNumChildren = 0;
-    psRoot->psChild      = NULL;
-    psRoot->psNext       = NULL;
-    psRoot->psParent     = NULL;
+/*--------------------------------------------------------------------*/
 
-    hashKeyNode(psRoot, aucHashBuf);
-    memcpy(pucRootHash, aucHashBuf, HASHLEN);
-    psRoot->pucHash = pucRootHash;
+int KeyChain_removeKey(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    unsigned long ulStart;
+    int iResult;
 
-    oKeyChain->iNumKeys = 0;
-    oKeyChain->psRoot = psRoot;
+    assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-    return oKeyChain;
+    STAT_START(ulStart);
+    iResult = unlinkKey(oKeyChain, pcKeyID, 0);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_REMOVE, ulStart);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-void KeyChain_free(KeyChain_T oKeyChain)
+int KeyChain_revokeKey(KeyChain_T oKeyChain, char *pcKeyID)
 {
+    unsigned long ulStart;
+    int iResult;
+
     assert(oKeyChain != NULL);
+    assert(pcKeyID != NULL);
 
-    freeNodes(oKeyChain->psRoot);
-    free(oKeyChain);
+    STAT_START(ulStart);
+    iResult = unlinkKey(oKeyChain, pcKeyID, 1);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_REMOVE, ulStart);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_getNumKeys(KeyChain_T oKeyChain)
+int KeyChain_purge(KeyChain_T oKeyChain, int iMaxKeys)
 {
-    return oKeyChain->iNumKeys;
+    struct PurgeBlock *psPurge;
+    NodeIdx uNode;
+    unsigned int uScanned = 0;
+    int iMore;
+
+    assert(oKeyChain != NULL);
+    assert(iMaxKeys > 0);
+
+    // nothing to purge is no change, so a snapshot can be saved
+    lockChanges(oKeyChain);
+    if (oKeyChain->uNumPurge == 0 && oKeyChain->uNumHoly == 0) {
+        unlockChanges(oKeyChain);
+        return 0;
+    }
+    if (!beginChange(oKeyChain)) {
+        unlockChanges(oKeyChain);
+        return 1;
+    }
+    while (oKeyChain->uNumPurge > 0 && iMaxKeys > 0) {
+        psPurge = &oKeyChain->psPurge[oKeyChain->uNumPurge - 1];
+        iMaxKeys -= purgeBlock(oKeyChain, psPurge, iMaxKeys);
+        if (psPurge->uNumNodes == 0)
+            oKeyChain->uNumPurge--;
+    }
+
+    // then the holes removed keys left, going on from where the last
+    // call stopped; each child moved counts as a key
+    while (oKeyChain->uNumPurge == 0 && oKeyChain->uNumHoly > 0 &&
+           iMaxKeys > 0) {
+        if (oKeyChain->uHoleCursor >= oKeyChain->uNumNodes)
+            oKeyChain->uHoleCursor = 0;
+        uNode = oKeyChain->uHoleCursor++;
+        if ((oKeyChain->psLinks[uNode].ucFlags & NODE_USED) &&
+            (oKeyChain->psLinks[uNode].ucFlags & NODE_HOLES))
+            iMaxKeys -= closeHoles(oKeyChain, uNode) + 1;
+        else if (++uScanned % HOLESCAN == 0)
+            iMaxKeys--;
+    }
+    iMore = oKeyChain->uNumPurge > 0 || oKeyChain->uNumHoly > 0;
+    endChange(oKeyChain);
+    unlockChanges(oKeyChain);
+    return iMore;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_contains(KeyChain_T oKeyChain, char *pcKeyID)
+int KeyChain_updateKey(KeyChain_T oKeyChain,
+                       char *pcKeyID,
+                       unsigned char *pucInterHash)
 {
-    struct KeyNode *psResultNode;
+    struct QueuedUpdate sUpdate;
+    struct QueuedUpdate *psBatch;
+    struct QueuedUpdate *psIter;
+    unsigned long ulStart;
 
     assert(oKeyChain != NULL);
     assert(pcKeyID != NULL);
+    assert(pucInterHash != NULL);
+
+    STAT_START(ulStart);
+    sUpdate.pcKeyID = pcKeyID;
+    sUpdate.pucInterHash = pucInterHash;
+    sUpdate.iResult = -1;
+
+    pthread_mutex_lock(&oKeyChain->sQueueLock);
+    sUpdate.psNext = oKeyChain->psQueued;
+    oKeyChain->psQueued = &sUpdate;
+    while (sUpdate.iResult < 0) {
+        if (oKeyChain->iCombining) {
+            pthread_cond_wait(&oKeyChain->sApplied, &oKeyChain->sQueueLock);
+            continue;
+        }
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode != NULL)
-        return 1;
-    return 0;
+        // apply ours and every update that queued up behind the last
+        // batch, on behalf of their writers
+        oKeyChain->iCombining = 1;
+        psBatch = oKeyChain->psQueued;
+        oKeyChain->psQueued = NULL;
+        pthread_mutex_unlock(&oKeyChain->sQueueLock);
+
+        psBatch = applyUpdates(oKeyChain, psBatch);
+
+        pthread_mutex_lock(&oKeyChain->sQueueLock);
+        for (psIter = psBatch; psIter != NULL; psIter = psIter->psNext)
+            psIter->iResult = psIter->iApplied;
+        oKeyChain->iCombining = 0;
+        pthread_cond_broadcast(&oKeyChain->sApplied);
+    }
+    pthread_mutex_unlock(&oKeyChain->sQueueLock);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_UPDATE, ulStart);
+    return sUpdate.iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-unsigned char *KeyChain_getKey(KeyChain_T oKeyChain, 
-                               char *pcKeyID,
-                               unsigned char *pucOutput)
+int KeyChain_rotateKey(KeyChain_T oKeyChain,
+                       char *pcKeyID,
+                       unsigned char *pucNewKey)
 {
-    struct KeyNode *psResultNode;
+    struct Rotation sRotation;
+    struct KeyNodeLinks *psLinks;
+    unsigned char aucParentKey[KEYLEN];
+    unsigned char aucOldKey[KEYLEN];
+    unsigned char aucDelta[KEYLEN];
+    NodeIdx uNode;
 
     assert(oKeyChain != NULL);
     assert(pcKeyID != NULL);
-    assert(pucOutput != NULL);
+    assert(pucNewKey != NULL);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode != NULL)
-        return getPlainKey(psResultNode, pucOutput);
-    return NULL;
+    if (strcmp(pcKeyID, "0") == 0)
+        return 0;
+
+    if (!beginChange(oKeyChain))
+        return 0;
+    uNode = getKeyNode(oKeyChain, pcKeyID);
+    if (uNode == NONODE) {
+        endChange(oKeyChain);
+        return 0;
+    }
+    psLinks = &oKeyChain->psLinks[uNode];
+    getPlainKey(oKeyChain, uNode, aucOldKey);
+    getPlainKey(oKeyChain, psLinks->uParent, aucParentKey);
+
+    // the node arrives anew with its new key, so no cached copy of the
+    // old one is used; keys below it do not change
+    oKeyChain->ulGeneration++;
+    evictKey(oKeyChain, uNode);
+    oKeyChain->psGens[uNode].ulArrived = oKeyChain->ulGeneration;
+    xor_encrypt(pucNewKey, oKeyChain->paucEncKey[uNode], KEYLEN,
+                aucParentKey);
+
+    // siblings are consecutive, so all children are re-wrapped in one
+    // pass over their encrypted keys, XORing each with old ^ new, and
+    // then rehashed in parallel
+    if (psLinks->uNumChildren > 0) {
+        xor_crypt(aucOldKey, aucDelta, KEYLEN, pucNewKey);
+        xor_crypt(oKeyChain->paucEncKey[psLinks->uFirstChild],
+                  oKeyChain->paucEncKey[psLinks->uFirstChild],
+                  (size_t)psLinks->uNumChildren * KEYLEN, aucDelta);
+
+        sRotation.oKeyChain = oKeyChain;
+        sRotation.uFirst = psLinks->uFirstChild;
+        sRotation.uNumChildren = psLinks->uNumChildren;
+        Parallel_for((psLinks->uNumChildren + ROTATECHUNK - 1) / ROTATECHUNK,
+                     rotateTask, &sRotation);
+        updateChildTree(oKeyChain, uNode, 0, psLinks->uNumChildren - 1);
+    }
+
+    // update intermediate hashes on path to root node; that of a
+    // childless node is its data hash, so only its record is rehashed
+    if (numChildren(oKeyChain, psLinks) > 0)
+        touchPath(oKeyChain, uNode);
+    else {
+        hashKeyNode(oKeyChain, uNode, oKeyChain->paucHash[uNode]);
+        stampNode(oKeyChain, uNode);
+        childChanged(oKeyChain, uNode);
+        touchPath(oKeyChain, psLinks->uParent);
+    }
+
+    journalChange(oKeyChain, JOURNAL_ROTATE, 0, oKeyChain->paucEncKey[uNode],
+                  pcKeyID);
+    wipe(aucParentKey, KEYLEN);
+    wipe(aucOldKey, KEYLEN);
+    wipe(aucDelta, KEYLEN);
+    endChange(oKeyChain);
+    return 1;
 }
 
 /*--------------------------------------------------------------------*/
 
-unsigned char *KeyChain_getEncryptedKey(KeyChain_T oKeyChain, char *pcKeyID)
+int KeyChain_verifyKey(KeyChain_T oKeyChain, char *pcKeyID)
 {
-    struct KeyNode *psResultNode;
+    unsigned long ulStart;
+    int iResult;
 
     assert(oKeyChain != NULL);
     assert(pcKeyID != NULL);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode != NULL)
-        return psResultNode->pucEncKey;
-    return NULL;
+    STAT_START(ulStart);
+    iResult = verifyKeyID(oKeyChain, pcKeyID, 1);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_VERIFY, ulStart);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-unsigned char *KeyChain_getInterHash(KeyChain_T oKeyChain, char *pcKeyID)
+int KeyChain_verifyKeyFull(KeyChain_T oKeyChain, char *pcKeyID)
 {
-    struct KeyNode *psResultNode;
+    unsigned long ulStart;
+    int iResult;
 
     assert(oKeyChain != NULL);
     assert(pcKeyID != NULL);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode != NULL)
-        return psResultNode->pucInterHash;
-    return NULL;
+    STAT_START(ulStart);
+    iResult = verifyKeyID(oKeyChain, pcKeyID, 0);
+    STAT_OP(oKeyChain, KEYCHAIN_OP_VERIFY, ulStart);
+    return iResult;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_getType(KeyChain_T oKeyChain, char *pcKeyID)
+int KeyChain_verifyAll(KeyChain_T oKeyChain, char **apcBad, int iMaxBad)
 {
-    struct KeyNode *psResultNode;
+    struct Audit sAudit;
+    int iNumBad;
 
     assert(oKeyChain != NULL);
-    assert(pcKeyID != NULL);
+    assert(apcBad != NULL || iMaxBad == 0);
+
+    lockChanges(oKeyChain);
+    KeyChain_commit(oKeyChain);
+
+    // each node is checked against the stored hashes of its children,
+    // so the checks are independent and slots are split evenly
+    sAudit.oKeyChain = oKeyChain;
+    sAudit.pucBad = (unsigned char *)calloc(oKeyChain->uNumNodes, 1);
+    if (sAudit.pucBad == NULL) {
+        unlockChanges(oKeyChain);
+        return -1;
+    }
+    Parallel_for((int)((oKeyChain->uNumNodes + AUDITCHUNK - 1) / AUDITCHUNK),
+                 auditTask, &sAudit);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode != NULL)
-        return psResultNode->iType;
-    return -1;
+    iNumBad = 0;
+    collectBad(oKeyChain, ROOTNODE, sAudit.pucBad, apcBad, iMaxBad,
+               &iNumBad);
+
+    unlockChanges(oKeyChain);
+    free(sAudit.pucBad);
+    return iNumBad;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_addKey(KeyChain_T oKeyChain, 
-                    char *pcParentKeyID,
-                    char *pcKeyID, 
-                    unsigned char *pucKey,
-                    int iType)
+unsigned char *KeyChain_prove(KeyChain_T oKeyChain, char **apcKeyIDs,
+                              int iNumKeys, size_t *puLen)
 {
-    struct KeyNode *psNewNode;
-    struct KeyNode *psParentNode;
-    struct KeyNode *psParentIter;
-    char *pcKeyIDCpy;
-    unsigned char *pucEncKey;
-    unsigned char *pucInterHash;
-    unsigned char *pucHash;
-
-    unsigned char aucParentKeyBuf[KEYLEN];   // 64 bit key
-    unsigned char aucHashBuf[HASHLEN];       // 256 bit hash 
+    struct ProofWriter sWriter;
+    unsigned char aucHeader[PROOF_HDRLEN];
+    NodeIdx *auNodes = NULL;
+    NodeIdx uNode;
+    size_t uMaxNodes;
+    int iNumNodes;
+    int i;
 
     assert(oKeyChain != NULL);
-    assert(pcParentKeyID != NULL);
-    assert(pcKeyID != NULL);
-    assert(pucKey != NULL);
-
-    // make sure key ID is a valid child of the parent
-    if (strlen(pcParentKeyID) + 1 != strlen(pcKeyID))
-        return 0;
-
-    // find parent node
-    psParentNode = getKeyNode(oKeyChain->psRoot, pcParentKeyID);
-    if (psParentNode == NULL)
-        return 0;
+    assert(apcKeyIDs != NULL);
+    assert(iNumKeys > 0);
+    assert(puLen != NULL);
+
+    lockChanges(oKeyChain);
+    KeyChain_commit(oKeyChain);
+
+    // the nodes on the paths of the keys, each once, sorted by slot so
+    // the children of a node in the proof are found by bisection
+    uMaxNodes = 0;
+    for (i = 0; i < iNumKeys; i++) {
+        assert(apcKeyIDs[i] != NULL);
+        uNode = getKeyNode(oKeyChain, apcKeyIDs[i]);
+        if (uNode == NONODE)
+            goto failed;
+        uMaxNodes += oKeyChain->psLinks[uNode].iDepth;
+    }
+    auNodes = (NodeIdx *)malloc((uMaxNodes + 1) * sizeof(NodeIdx));
+    if (auNodes == NULL)
+        goto failed;
+    iNumNodes = 0;
+    for (i = 0; i < iNumKeys; i++) {
+        for (uNode = getKeyNode(oKeyChain, apcKeyIDs[i]); uNode != ROOTNODE;
+             uNode = oKeyChain->psLinks[uNode].uParent)
+            auNodes[iNumNodes++] = uNode;
+    }
+    qsort(auNodes, iNumNodes, sizeof(NodeIdx), compareNodes);
+    for (i = 1, uMaxNodes = iNumNodes > 0; i < iNumNodes; i++) {
+        if (auNodes[i] != auNodes[uMaxNodes - 1])
+            auNodes[uMaxNodes++] = auNodes[i];
+    }
 
-    // make sure key is not already in the chain
-    if (KeyChain_contains(oKeyChain, pcKeyID))
-        return 0;
+    memset(&sWriter, 0, sizeof(sWriter));
+    sWriter.oKeyChain = oKeyChain;
+    sWriter.auNodes = auNodes;
+    sWriter.iNumNodes = (int)uMaxNodes;
+    aucHeader[0] = PROOF_VERSION;
+    aucHeader[1] = oKeyChain->psHash->iType;
+    aucHeader[2] = oKeyChain->iEncoding;
+    putProof(&sWriter, aucHeader, PROOF_HDRLEN);
+    proveEntry(&sWriter, ROOTNODE);
+    free(auNodes);
+    unlockChanges(oKeyChain);
+
+    if (sWriter.iFailed) {
+        free(sWriter.pucProof);
+        return NULL;
+    }
+    *puLen = sWriter.uLen;
+    return sWriter.pucProof;
 
-    // create new key node
-    psNewNode = (struct KeyNode *)malloc(sizeof(struct KeyNode));
-    if (psNewNode == NULL)
-        return 0;
+failed:
+    unlockChanges(oKeyChain);
+    return NULL;
+}
 
-    // make defensive copy of key id
-    pcKeyIDCpy = (char *)malloc(strlen(pcKeyID) + 1);
-    if (pcKeyIDCpy == NULL)
-        return 0;
-    strcpy(pcKeyIDCpy, pcKeyID);
+/*--------------------------------------------------------------------*/
 
-    pucEncKey = (unsigned char *)malloc(KEYLEN * sizeof(unsigned char));
-    if (pucEncKey == NULL)
-        return 0;
-    memset(pucEncKey, 0, KEYLEN);
-    xor_encrypt(pucKey, pucEncKey, KEYLEN, getPlainKey(psParentNode, aucParentKeyBuf));
+int KeyChain_verifyProof(const unsigned char *pucProof, size_t uLen,
+                         const unsigned char *pucRootHash,
+                         const char *pcKeyID, unsigned char *pucEncKey,
+                         unsigned char *pucInterHash)
+{
+    struct ProofReader sReader;
+    unsigned char aucRoot[HASHLEN];
 
-    pucInterHash = (unsigned char *)malloc(HASHLEN * sizeof(unsigned char));
-    if (pucInterHash == NULL)
-        return 0;
-    memset(pucInterHash, 0, HASHLEN);
+    assert(pucProof != NULL);
+    assert(pucRootHash != NULL);
 
-    pucHash = (unsigned char *)malloc(HASHLEN * sizeof(unsigned char));
-    if (pucHash == NULL)
+    if (uLen < PROOF_HDRLEN || pucProof[0] != PROOF_VERSION ||
+        KeyHash_get(pucProof[1]) == NULL ||
+        pucProof[2] > KEYCHAIN_ENCODING_TREE)
         return 0;
-    
-    psNewNode->pcKeyID = pcKeyIDCpy;
-    psNewNode->pucEncKey = pucEncKey;
-    psNewNode->pucInterHash = pucInterHash;
-
-    psNewNode->iType = iType;
-    psNewNode->iDepth = strlen(pcParentKeyID);
-    psNewNode->iNumChildren = 0;
 
-    psNewNode->psNext = psParentNode->psChild;
-    psNewNode->psChild = NULL;
-    psNewNode->psParent = psParentNode;
+    memset(&sReader, 0, sizeof(sReader));
+    sReader.sContext.psHash = KeyHash_get(pucProof[1]);
+    sReader.sContext.iEncoding = pucProof[2];
+    sReader.pucProof = pucProof;
+    sReader.uLen = uLen;
+    sReader.uPos = PROOF_HDRLEN;
+    sReader.pcKeyID = pcKeyID;
+    sReader.pucEncKey = pucEncKey;
+    sReader.pucInterHash = pucInterHash;
+
+    return verifyEntry(&sReader, NULL, "0", 0, aucRoot, NULL) &&
+           sReader.uPos == uLen &&
+           memcmp(aucRoot, pucRootHash, HASHLEN) == 0 &&
+           (pcKeyID == NULL || sReader.iFound);
+}
 
-    hashKeyNode(psNewNode, aucHashBuf);
-    memcpy(pucHash, aucHashBuf, HASHLEN);
-    psNewNode->pucHash = pucHash; 
+/*--------------------------------------------------------------------*/
 
-    psParentNode->psChild = psNewNode;
+KeyChain_T KeyChain_snapshot(KeyChain_T oKeyChain)
+{
+    KeyChain_T oSnapshot;
 
-    // update metadata and intermediate hashes on path to root node
-    psParentIter = psParentNode;
-    while (psParentIter != NULL) {
-        psParentIter->iNumChildren++;
-        updateHashes(psParentIter);
-        psParentIter = psParentIter->psParent;
-    }
-    oKeyChain->iNumKeys++;
+    assert(oKeyChain != NULL);
 
-    return 1;
+    // pending hashes are committed first, so the snapshot needs none;
+    // revoked subtrees not yet purged are shared like the rest
+    lockChanges(oKeyChain);
+    KeyChain_commit(oKeyChain);
+    oSnapshot = NULL;
+    if (!(oKeyChain->psLinks[ROOTNODE].ucFlags & NODE_DIRTY))
+        oSnapshot = shareKeyChain(oKeyChain);
+    if (oSnapshot != NULL)
+        oSnapshot->iReadOnly = 1;
+    unlockChanges(oKeyChain);
+    return oSnapshot;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_removeKey(KeyChain_T oKeyChain, char *pcKeyID)
+KeyChain_T KeyChain_beginTransaction(KeyChain_T oKeyChain)
 {
-    struct KeyNode *psResultNode;
-    struct KeyNode *psParentIter;
+    KeyChain_T oTransaction;
 
     assert(oKeyChain != NULL);
-    assert(pcKeyID != NULL);
-
-    if (strcmp(pcKeyID, "0") == 0)
-        return 0;
 
-    psResultNode = removeKeyNode(oKeyChain->psRoot->psChild,
-                                 oKeyChain->psRoot,
-                                 pcKeyID);
-    if (psResultNode == NULL)
-        return 0;
+    if (oKeyChain->iReadOnly)
+        return NULL;
 
-    // update metadata and intermediate hashes on path to root node
-    psParentIter = psResultNode->psParent;
-    while (psParentIter != NULL) {
-        (psParentIter->iNumChildren) -= (psResultNode->iNumChildren + 1);
-        updateHashes(psParentIter);
-        psParentIter = psParentIter->psParent;
+    lockChanges(oKeyChain);
+    KeyChain_commit(oKeyChain);
+    oTransaction = NULL;
+    if (!(oKeyChain->psLinks[ROOTNODE].ucFlags & NODE_DIRTY))
+        oTransaction = shareKeyChain(oKeyChain);
+    if (oTransaction != NULL) {
+        // staged changes are hashed once, on commit
+        oTransaction->iDeferred = 1;
+        oTransaction->oBase = oKeyChain;
+        oTransaction->ulBaseGeneration = oKeyChain->ulGeneration;
     }
+    unlockChanges(oKeyChain);
+    return oTransaction;
+}
 
-    (oKeyChain->iNumKeys) -= (psResultNode->iNumChildren + 1);
-    free(psResultNode->pcKeyID);
-    free(psResultNode->pucEncKey);
-    free(psResultNode->pucInterHash);
-    free(psResultNode->pucHash);
+/*--------------------------------------------------------------------*/
 
-    free(psResultNode);
+int KeyChain_commitTransaction(KeyChain_T oTransaction)
+{
+    KeyChain_T oKeyChain;
+    struct SharedArrays *psOld;
+    unsigned char aucHead[JOURNAL_HDRLEN];
+    int iOK;
+
+    assert(oTransaction != NULL);
+    assert(oTransaction->oBase != NULL);
+
+    oKeyChain = oTransaction->oBase;
+    KeyChain_commit(oTransaction);
+
+    // only mutations advance the generation, so reading oKeyChain or
+    // committing its hashes leaves the transaction valid
+    lockChanges(oKeyChain);
+    iOK = oKeyChain->ulGeneration == oTransaction->ulBaseGeneration &&
+          !oTransaction->iStageFailed &&
+          !(oTransaction->psLinks[ROOTNODE].ucFlags & NODE_DIRTY);
+
+    // a change that failed early, such as removing a missing key, may
+    // have given oKeyChain arrays of its own; they are retired like
+    // shared ones
+    if (iOK && oKeyChain->psShared == NULL) {
+        iOK = shareArrays(oKeyChain) != NULL;
+        if (iOK)
+            releaseArrays(oKeyChain->psShared);
+    }
+    if (iOK) {
+        // the tree of oKeyChain is the one the transaction began on;
+        // its arrays are swapped out, not copied
+        psOld = oKeyChain->psShared;
+        oKeyChain->psShared = NULL;
+        beginChange(oKeyChain);
+        takeTree(oKeyChain, oTransaction);
+        Epoch_retireWith(oKeyChain->oEpoch, psOld, releaseArrays);
+        if (oTransaction->uStagedLen > 0) {
+            aucHead[0] = JOURNAL_BATCH;
+            aucHead[1] = 0;
+            journalRecord(oKeyChain, aucHead, JOURNAL_HDRLEN,
+                          oTransaction->pucStaged, oTransaction->uStagedLen);
+        }
+        endChange(oKeyChain);
+    }
+    unlockChanges(oKeyChain);
 
-    return 1;
+    KeyChain_free(oTransaction);
+    return iOK;
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_updateKey(KeyChain_T oKeyChain, 
-                       char *pcKeyID, 
-                       unsigned char *pucInterHash)
+void KeyChain_rollbackTransaction(KeyChain_T oTransaction)
 {
-    struct KeyNode *psResultNode;
-    struct KeyNode *psCurrNode;
-    unsigned char aucHashBuf[HASHLEN];
-
-    assert(oKeyChain != NULL);
-    assert(pcKeyID != NULL);
+    assert(oTransaction != NULL);
+    assert(oTransaction->oBase != NULL);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode == NULL) {
-        return 0;
-    }
+    KeyChain_free(oTransaction);
+}
 
-    // update internal hash
-    memcpy(psResultNode->pucInterHash, pucInterHash, HASHLEN);
+/*--------------------------------------------------------------------*/
 
-    // rehash entire key node
-    hashKeyNode(psResultNode, aucHashBuf);
-    memcpy(psResultNode->pucHash, aucHashBuf, HASHLEN);
+int KeyChain_getStats(KeyChain_T oKeyChain, struct KeyChainStats *psStats)
+{
+#ifdef KEYCHAIN_STATS
+    struct KeyChainStats *psFrom;
+    int iOp;
+    int i;
+#endif
 
-    // update intermediate hashes on path to root node
-    psCurrNode = psResultNode->psParent;
-    while (psCurrNode != NULL) {
-        updateHashes(psCurrNode);
-        psCurrNode = psCurrNode->psParent;
+    assert(oKeyChain != NULL);
+    assert(psStats != NULL);
+
+    memset(psStats, 0, sizeof(struct KeyChainStats));
+#ifdef KEYCHAIN_STATS
+    psFrom = oKeyChain->psStats;
+    for (iOp = 0; iOp < KEYCHAIN_OPS; iOp++) {
+        psStats->aulOps[iOp] = __atomic_load_n(&psFrom->aulOps[iOp],
+                                               __ATOMIC_RELAXED);
+        for (i = 0; i < KEYCHAIN_LATENCYBUCKETS; i++)
+            psStats->aaulLatency[iOp][i] =
+                __atomic_load_n(&psFrom->aaulLatency[iOp][i],
+                                __ATOMIC_RELAXED);
     }
-    
+    psStats->ulHashes = __atomic_load_n(&psFrom->ulHashes, __ATOMIC_RELAXED);
+    psStats->ulEstimatedBlocks =
+        __atomic_load_n(&psFrom->ulEstimatedBlocks, __ATOMIC_RELAXED);
+    psStats->ulBytesHashed = __atomic_load_n(&psFrom->ulBytesHashed,
+                                             __ATOMIC_RELAXED);
+    psStats->ulProbes = __atomic_load_n(&psFrom->ulProbes, __ATOMIC_RELAXED);
+    psStats->ulNodesVisited = __atomic_load_n(&psFrom->ulNodesVisited,
+                                              __ATOMIC_RELAXED);
     return 1;
+#else
+    return 0;
+#endif
 }
 
 /*--------------------------------------------------------------------*/
 
-int KeyChain_verifyKey(KeyChain_T oKeyChain, char *pcKeyID)
+void KeyChain_resetStats(KeyChain_T oKeyChain)
 {
-    struct KeyNode *psResultNode;
-    struct KeyNode *psNodeIter;
-    struct KeyNode *psNodeChild;
-    unsigned char aucHashBuf[HASHLEN];
+#ifdef KEYCHAIN_STATS
+    unsigned long *pulCounter;
+    size_t u;
+#endif
 
     assert(oKeyChain != NULL);
-    assert(pcKeyID != NULL);
 
-    psResultNode = getKeyNode(oKeyChain->psRoot, pcKeyID);
-    if (psResultNode == NULL)
-        return 0;
+#ifdef KEYCHAIN_STATS
+    // the counters are all unsigned longs
+    pulCounter = (unsigned long *)oKeyChain->psStats;
+    for (u = 0; u < sizeof(struct KeyChainStats) / sizeof(unsigned long);
+         u++)
+        __atomic_store_n(&pulCounter[u], 0, __ATOMIC_RELAXED);
+#endif
+}
 
-    psNodeIter = psResultNode;
-    while (psNodeIter != NULL) {
-        hashChildren(psNodeIter, aucHashBuf);
+/*--------------------------------------------------------------------*/
 
-        // non-leaf node intermediate hashes must match
-        if (psNodeIter->iType == 0 && 
-            memcmp(psNodeIter->pucInterHash, aucHashBuf, HASHLEN) != 0) {
-            return 0;
-        }
+void KeyChain_getShape(KeyChain_T oKeyChain, struct KeyChainShape *psShape)
+{
+    struct KeyNodeLinks *psLinks;
+    const char *pcLongKeyID;
+    unsigned int uNumChildren;
+    int iBucket;
+    NodeIdx u;
 
-        // key node hash must match
-        hashKeyNode(psNodeIter, aucHashBuf);
-        if (memcmp(psNodeIter->pucHash, aucHashBuf, HASHLEN) != 0) {
-            return 0;
-        }
-        psNodeIter = psNodeIter->psParent;
+    assert(oKeyChain != NULL);
+    assert(psShape != NULL);
+
+    memset(psShape, 0, sizeof(struct KeyChainShape));
+    lockChanges(oKeyChain);
+    psShape->uBytes = (size_t)oKeyChain->uNodeCap *
+                      (sizeof(struct KeyNodeLinks) +
+                       sizeof(struct KeyNodeID) + KEYLEN + 2 * HASHLEN +
+                       sizeof(struct ChildTree) + sizeof(struct NodeGen)) +
+                      oKeyChain->uIndexCap * sizeof(struct IndexSlot);
+    for (u = 0; u < oKeyChain->uNumNodes; u++) {
+        psLinks = &oKeyChain->psLinks[u];
+        if (!(psLinks->ucFlags & NODE_USED))
+            continue;
+
+        // revoked subtrees hold their memory until they are purged
+        pcLongKeyID = longKeyID(oKeyChain, &oKeyChain->psIDs[u]);
+        if (pcLongKeyID != NULL)
+            psShape->uBytes += strlen(pcLongKeyID) + 1;
+        psShape->uBytes += (size_t)treeLeaves(oKeyChain->psTrees[u].paucDigest)
+                           * HASHLEN;
+        if (oKeyChain->uNumPurge > 0 && !isLinked(oKeyChain, u))
+            continue;
+
+        psShape->ulNodes++;
+        iBucket = psLinks->iDepth < KEYCHAIN_SHAPEBUCKETS ?
+                  psLinks->iDepth : KEYCHAIN_SHAPEBUCKETS - 1;
+        psShape->aulDepth[iBucket]++;
+        if (psLinks->iDepth > psShape->iMaxDepth)
+            psShape->iMaxDepth = psLinks->iDepth;
+
+        uNumChildren = numChildren(oKeyChain, psLinks);
+        iBucket = uNumChildren > 0 ? floorLog2(uNumChildren) + 1 : 0;
+        if (iBucket >= KEYCHAIN_SHAPEBUCKETS)
+            iBucket = KEYCHAIN_SHAPEBUCKETS - 1;
+        psShape->aulFanout[iBucket]++;
+        if (uNumChildren > psShape->ulMaxFanout)
+            psShape->ulMaxFanout = uNumChildren;
     }
-    return 1;
-}
+    unlockChanges(oKeyChain);
 
-/*--------------------------------------------------------------------*/
+    psShape->uBytesPerNode = psShape->uBytes / psShape->ulNodes;
+}
@@ -6,12 +6,69 @@
 #ifndef KEYCHAIN_INCLUDED
 #define KEYCHAIN_INCLUDED
 
+#include <stddef.h>
+
 /* A KeyChain_T object is a n-ary tree structure integrated with a 
    Merkle hash tree. It contains all the keys, each encrypted by its 
    parent key. */
 
 typedef struct KeyChain *KeyChain_T;
 
+/* Several threads may change a keychain at once; their changes are
+   applied one after another. Without taking their lock, other threads
+   may meanwhile call KeyChain_contains(), KeyChain_getKey(),
+   KeyChain_getType(), KeyChain_getCipher(), KeyChain_getEncryptedKey(),
+   KeyChain_getInterHash(), KeyChain_copyInterHash(),
+   KeyChain_verifyKey(), KeyChain_verifyKeyFull() and
+   KeyChain_getNumKeys(); each sees the keychain as it was between two
+   changes, and the root hash is read whole with
+   KeyChain_copyInterHash(oKeyChain, "0", ...). Readers are not
+   wait-free: one that finds a change in progress waits for it to end,
+   however long it takes, as for KeyChain_addKeys(),
+   KeyChain_setEncoding() or KeyChain_commit(), and one that overlaps
+   a change starts again. Under deferred hashing
+   KeyChain_getInterHash(), KeyChain_copyInterHash() and the two verify
+   functions commit first, which is a change. Pointers returned by
+   KeyChain_getEncryptedKey() and KeyChain_getInterHash() may be used
+   only until the next change or snapshot. KeyChain_setDeferred(),
+   KeyChain_openJournal(), KeyChain_checkpoint() and KeyChain_free()
+   need the keychain to themselves, and a transaction must end before
+   the keychain it was begun on is freed. A change that finds the
+   arrays shared with a snapshot or transaction fails as if memory had
+   run out if it cannot copy them. */
+
+/* Encodings of the key records that are hashed into the Merkle tree.
+   TEXT is the original hex and decimal string form; BINARY is a 
+   versioned record of fixed width fields with length prefixed IDs. 
+   TREE is BINARY with each node committing to its children through a
+   balanced binary Merkle tree over their hashes, so a changed child 
+   costs O(log n) hashes in a node with n children, not O(n). */
+
+#define KEYCHAIN_ENCODING_TEXT    0
+#define KEYCHAIN_ENCODING_BINARY  1
+#define KEYCHAIN_ENCODING_TREE    2
+
+/* Ciphers a leaf key can encrypt its data with. XOR is the repeating
+   64 bit pad; CHACHA20 is a counter mode stream cipher keyed from the
+   leaf key, see chacha20.h. */
+
+#define KEYCHAIN_CIPHER_XOR       0
+#define KEYCHAIN_CIPHER_CHACHA20  1
+
+/* A key ID is "0" for the root followed by one component per level
+   below it. A component is a number from 1 to KEYCHAIN_COMPONENTMAX.
+   One below 255 is written as that single byte, so "0ab" is the path
+   {'a', 'b'}. Any other is written as the byte 255, which never
+   occurs in UTF-8 text, the number of its digits, and its digits in
+   bijective base 255 (digits 1 to 255), most significant first, so a
+   node can have billions of children. A path of n components has a
+   key ID of at most KEYCHAIN_KEYIDLEN(n) bytes, including the
+   '\0'. */
+
+#define KEYCHAIN_COMPONENTMAX     0xffffffffU
+#define KEYCHAIN_COMPONENTLEN     7
+#define KEYCHAIN_KEYIDLEN(n)      (2 + KEYCHAIN_COMPONENTLEN * (n))
+
 /*--------------------------------------------------------------------*/
 
 /* Return a new KeyChain object, or NULL if insufficient memory is 
@@ -21,18 +78,123 @@ KeyChain_T KeyChain_new(unsigned long umk);
 
 /*--------------------------------------------------------------------*/
 
+/* Return a new KeyChain object whose Merkle tree is computed with the
+   hash backend iHashType (KEYHASH_SHA256 or KEYHASH_BLAKE2S, see 
+   keyhash.h). Return NULL if iHashType is unknown or insufficient 
+   memory is available. */
+
+KeyChain_T KeyChain_newWithHash(unsigned long umk, int iHashType);
+
+/*--------------------------------------------------------------------*/
+
 /* Free all memory occupied by oKeyChain. */
 
 void KeyChain_free(KeyChain_T oKeyChain);
 
 /*--------------------------------------------------------------------*/
 
-/* Return the number of keys in oKeyChain. */
+/* Write oKeyChain to the snapshot file pcFileName, committing pending
+   changes first. The root key is not written. Return 1 on success, 0
+   if the file could not be written. */
+
+int KeyChain_save(KeyChain_T oKeyChain, const char *pcFileName);
+
+/*--------------------------------------------------------------------*/
+
+/* Return a KeyChain object for the snapshot file pcFileName, written
+   by KeyChain_save() on a machine of the same architecture, with umk
+   as its root key. The file is mapped and used in place without being
+   parsed; pages are copied privately when first modified, and the
+   file itself is never written. A wrong umk makes keys fail
+   verification. Snapshots are trusted not to be corrupted; use
+   KeyChain_verifyAll() to check their hashes. Return NULL if the file
+   cannot be mapped or is not a snapshot of this format, or if
+   insufficient memory is available. */
+
+KeyChain_T KeyChain_load(const char *pcFileName, unsigned long umk);
+
+/*--------------------------------------------------------------------*/
+
+/* Apply the changes recorded in the journal file pcFileName to 
+   oKeyChain, then record every later change of oKeyChain there. The 
+   file is created if it does not exist. A journal continues the 
+   snapshot of the last KeyChain_checkpoint(), so oKeyChain should be
+   loaded from that snapshot, or new if there was no checkpoint. 
+   Return 1 on success, 0 if the file cannot be opened or read, does
+   not continue the checkpoint of oKeyChain, or holds a change that
+   cannot be applied. On failure oKeyChain may hold part of the 
+   changes. */
+
+int KeyChain_openJournal(KeyChain_T oKeyChain, const char *pcFileName);
+
+/*--------------------------------------------------------------------*/
+
+/* Make all changes of oKeyChain so far durable in its journal. Calls
+   from several threads, and a thread changing oKeyChain, may run at 
+   the same time; concurrent calls share one write and one fsync. 
+   Return 1 on success or if oKeyChain has no journal, 0 if a change 
+   could not be written. */
+
+int KeyChain_sync(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Replace the snapshot file pcFileName by one of oKeyChain and empty 
+   its journal, so the journal does not grow without bound. Return 1 
+   on success, 0 if the snapshot or the journal could not be 
+   written. */
+
+int KeyChain_checkpoint(KeyChain_T oKeyChain, const char *pcFileName);
+
+/*--------------------------------------------------------------------*/
+
+/* Return the number of keys in oKeyChain, including revoked keys not
+   yet purged. */
 
 int KeyChain_getNumKeys(KeyChain_T oKeyChain);
 
 /*--------------------------------------------------------------------*/
 
+/* Return the hash backend type oKeyChain was created with. */
+
+int KeyChain_getHashType(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Return the record encoding used by oKeyChain. New keychains use 
+   KEYCHAIN_ENCODING_TEXT. */
+
+int KeyChain_getEncoding(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Switch oKeyChain to the record encoding iEncoding, rehashing every 
+   key node so the tree gets a new root. Data hashes of leaf keys are
+   kept. Return 1 on success, 0 if iEncoding is unknown. */
+
+int KeyChain_setEncoding(KeyChain_T oKeyChain, int iEncoding);
+
+/*--------------------------------------------------------------------*/
+
+/* If iDeferred is nonzero, let mutations of oKeyChain only mark the 
+   path to the root as changed, and leave the rehashing to the next 
+   KeyChain_commit(), which updates every changed node once. Turning 
+   deferral off commits pending changes. New keychains update their 
+   hashes immediately. */
+
+void KeyChain_setDeferred(KeyChain_T oKeyChain, int iDeferred);
+
+/*--------------------------------------------------------------------*/
+
+/* Recompute the hashes of all nodes of oKeyChain changed since the 
+   last commit, bottom-up. KeyChain_getInterHash(), 
+   KeyChain_copyInterHash(), KeyChain_verifyKey() and 
+   KeyChain_verifyKeyFull() commit first by themselves. */
+
+void KeyChain_commit(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
 /* Return 1 if the oKeyChain contains a key with key ID pcKeyID, 0
    otherwise. */
 
@@ -50,7 +212,9 @@ unsigned char *KeyChain_getKey(KeyChain_T oKeyChain,
 
 /*--------------------------------------------------------------------*/
 
-/* Return the 64 bit encrypted key of pcKeyID in oKeyChain.
+/* Return the 64 bit encrypted key of pcKeyID in oKeyChain. The 
+   pointer is valid until oKeyChain is next modified. Writing through
+   it bypasses oKeyChain and every snapshot sharing its arrays.
    Return NULL if key is not in keychain. */
 
 unsigned char *KeyChain_getEncryptedKey(KeyChain_T oKeyChain, 
@@ -58,7 +222,9 @@ unsigned char *KeyChain_getEncryptedKey(KeyChain_T oKeyChain,
 
 /*--------------------------------------------------------------------*/
 
-/* Return the internal hash of key node pcKeyID in oKeyChain.
+/* Return the internal hash of key node pcKeyID in oKeyChain. The 
+   pointer is valid until oKeyChain is next modified. Writing through
+   it bypasses oKeyChain and every snapshot sharing its arrays.
    Return NULL if key is not in keychain. */
 
 unsigned char *KeyChain_getInterHash(KeyChain_T oKeyChain, 
@@ -66,6 +232,16 @@ unsigned char *KeyChain_getInterHash(KeyChain_T oKeyChain,
 
 /*--------------------------------------------------------------------*/
 
+/* Copy the internal hash of key node pcKeyID in oKeyChain to 
+   pucOutput, which must hold 32 bytes. Return 
+   pucOutput, or NULL if key is not in keychain. */
+
+unsigned char *KeyChain_copyInterHash(KeyChain_T oKeyChain, 
+                                      char *pcKeyID,
+                                      unsigned char *pucOutput);
+
+/*--------------------------------------------------------------------*/
+
 /* Return the type of key node pcKeyID in oKeyChain.
    Return -1 if key is not in keychain. */
 
@@ -73,6 +249,23 @@ int KeyChain_getType(KeyChain_T oKeyChain, char *pcKeyID);
 
 /*--------------------------------------------------------------------*/
 
+/* Return the data cipher of key node pcKeyID in oKeyChain, 
+   KEYCHAIN_CIPHER_XOR unless set otherwise. Return -1 if key is not
+   in keychain. */
+
+int KeyChain_getCipher(KeyChain_T oKeyChain, char *pcKeyID);
+
+/*--------------------------------------------------------------------*/
+
+/* Select the data cipher iCipher for the leaf key pcKeyID in 
+   oKeyChain, updating hashes on the path to the root. Return 1 on 
+   success, 0 if the key is not a leaf in the keychain or iCipher is 
+   unknown. */
+
+int KeyChain_setCipher(KeyChain_T oKeyChain, char *pcKeyID, int iCipher);
+
+/*--------------------------------------------------------------------*/
+
 /* Add the key pcKeyID with the pucKey as a child of pcParentKeyID in 
    oKeyChain. Return 1 on success, 0 on failure. */
 
@@ -84,6 +277,63 @@ int KeyChain_addKey(KeyChain_T oKeyChain,
 
 /*--------------------------------------------------------------------*/
 
+/* Write the key ID of the iPathLen components auPath below the root
+   to pcKeyID, which must hold KEYCHAIN_KEYIDLEN(iPathLen) bytes.
+   Return pcKeyID, or NULL if a component is 0. */
+
+char *KeyChain_pathKeyID(const unsigned int *auPath, int iPathLen,
+                         char *pcKeyID);
+
+/*--------------------------------------------------------------------*/
+
+/* Place the components of the key ID pcKeyID in auPath, which holds
+   iMaxLen of them. Return their number, or -1 if pcKeyID is not a
+   valid key ID or has more than iMaxLen components. */
+
+int KeyChain_keyIDPath(const char *pcKeyID, unsigned int *auPath,
+                       int iMaxLen);
+
+/*--------------------------------------------------------------------*/
+
+/* Add the key with the iPathLen components auPath and the pucKey as a
+   child of the key with the first iPathLen - 1 of them in oKeyChain.
+   Return 1 on success, 0 on failure. */
+
+int KeyChain_addKeyPath(KeyChain_T oKeyChain,
+                        const unsigned int *auPath,
+                        int iPathLen,
+                        unsigned char *pucKey,
+                        int iType);
+
+/*--------------------------------------------------------------------*/
+
+/* A key to add with KeyChain_addKeys(), with the meaning of the 
+   arguments of KeyChain_addKey(). */
+
+struct KeyChainRecord
+{
+    char *pcParentKeyID;
+    char *pcKeyID;
+    unsigned char *pucKey;
+    int iType;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Add the iNumRecords keys of psRecords to oKeyChain as if added in 
+   order by KeyChain_addKey(), so a record may name an earlier one as
+   its parent. The keys are linked first and every changed node is 
+   then hashed once, a level at a time, on Parallel_for() threads. 
+   Return 1 on success. Return 0 if a record could not be added by 
+   KeyChain_addKey() or insufficient memory is available, leaving 
+   oKeyChain unchanged. */
+
+int KeyChain_addKeys(KeyChain_T oKeyChain, 
+                     const struct KeyChainRecord *psRecords,
+                     int iNumRecords);
+
+/*--------------------------------------------------------------------*/
+
 /* Remove pcKeyID and its children from oKeyChain. Return 1 if 
    successful, 0 otherwise. */
 
@@ -91,18 +341,244 @@ int KeyChain_removeKey(KeyChain_T oKeyChain, char *pcKeyID);
 
 /*--------------------------------------------------------------------*/
 
-/* Update internal hash of key pcKeyID with pucInterHash. */
+/* Revoke pcKeyID and its descendants in oKeyChain. Only the key
+   itself is removed now and the hashes of its path updated; the
+   descendants are cut off at once, so no lookup finds them, but their
+   nodes are released by later calls to KeyChain_purge(). Until then
+   KeyChain_getNumKeys() still counts them. Return 1 if successful, 0
+   if the key is not in oKeyChain or insufficient memory is
+   available. */
+
+int KeyChain_revokeKey(KeyChain_T oKeyChain, char *pcKeyID);
+
+/*--------------------------------------------------------------------*/
+
+/* Release up to iMaxKeys keys of subtrees revoked in oKeyChain by
+   KeyChain_revokeKey(), then close up the gaps removed and revoked
+   keys left among their siblings. That moves at most about iMaxKeys
+   keys, though the siblings of one parent are always moved together,
+   so the time taken is bounded. It is a change like any other, so a
+   background thread may call it while others use oKeyChain. Return 1
+   if revoked keys or gaps remain, 0 otherwise. */
+
+int KeyChain_purge(KeyChain_T oKeyChain, int iMaxKeys);
+
+/*--------------------------------------------------------------------*/
+
+/* Update internal hash of key pcKeyID with pucInterHash. Updates
+   from threads that arrive while another batch is being applied are
+   combined, so ancestors they share are rehashed once per batch.
+   Return 1 on success, 0 if key is not in keychain. */
 
 int KeyChain_updateKey(KeyChain_T oKeyChain, char *pcKeyID, 
                       unsigned char *pucInterHash);
 
 /*--------------------------------------------------------------------*/
 
+/* Replace the plaintext key of pcKeyID in oKeyChain with the 64 bit
+   pucNewKey. The keys of its children are re-wrapped under the new
+   key in one pass and their hashes recomputed in parallel, then the
+   path to the root is rehashed once; keys further down are
+   untouched. Data encrypted with the old key of a leaf must be
+   re-encrypted by the caller. Return 1 on success, 0 if pcKeyID is
+   the root or not in oKeyChain. */
+
+int KeyChain_rotateKey(KeyChain_T oKeyChain, char *pcKeyID,
+                       unsigned char *pucNewKey);
+
+/*--------------------------------------------------------------------*/
+
 /* Verify the integrity of the key pcKeyID and all keys in the path
-   to the root. Return 1 if verified, 0 otherwise. */
+   to the root. A path that was verified before and has not changed 
+   since is not hashed again, so writes through pointers returned by
+   KeyChain_getEncryptedKey() or KeyChain_getInterHash() are caught
+   only by KeyChain_verifyKeyFull() and KeyChain_verifyAll(). Return
+   1 if verified, 0 otherwise. */
 
 int KeyChain_verifyKey(KeyChain_T oKeyChain, char *pcKeyID);
 
 /*--------------------------------------------------------------------*/
 
+/* Verify the key pcKeyID and its path to the root like 
+   KeyChain_verifyKey(), rehashing the whole path even if it was 
+   verified before. Return 1 if verified, 0 otherwise. */
+
+int KeyChain_verifyKeyFull(KeyChain_T oKeyChain, char *pcKeyID);
+
+/*--------------------------------------------------------------------*/
+
+/* Verify the integrity of every key in oKeyChain, checking each node
+   once against its record and its children, on Parallel_for() 
+   threads. Return the number of keys that fail, and place the key IDs
+   of the first iMaxBad of them in apcBad, parents before children. 
+   The IDs are valid until oKeyChain is next modified. Return -1 if 
+   insufficient memory is available. */
+
+int KeyChain_verifyAll(KeyChain_T oKeyChain, char **apcBad, int iMaxBad);
+
+/*--------------------------------------------------------------------*/
+
+/* Return an inclusion proof of the iNumKeys keys apcKeyIDs in
+   oKeyChain, which the caller frees, and place its length in *puLen.
+   It holds the records of the nodes on the paths to the root, each
+   once however many keys share it, and the sibling hashes needed to
+   recompute the root hash: under KEYCHAIN_ENCODING_TREE O(log n)
+   digests per node with n children, otherwise all n hashes. Return
+   NULL if a key is not in oKeyChain or insufficient memory is
+   available. */
+
+unsigned char *KeyChain_prove(KeyChain_T oKeyChain, char **apcKeyIDs,
+                              int iNumKeys, size_t *puLen);
+
+/*--------------------------------------------------------------------*/
+
+/* Check the proof pucProof of uLen bytes made by KeyChain_prove()
+   against the root hash pucRootHash, as returned by
+   KeyChain_copyInterHash(oKeyChain, "0", ...), without a keychain.
+   If pcKeyID is not NULL, the proof must also cover that key, and its
+   64 bit encrypted key and 256 bit intermediate hash are placed in
+   pucEncKey and pucInterHash unless they are NULL. Return 1 if the
+   proof holds, 0 otherwise. */
+
+int KeyChain_verifyProof(const unsigned char *pucProof, size_t uLen,
+                         const unsigned char *pucRootHash,
+                         const char *pcKeyID, unsigned char *pucEncKey,
+                         unsigned char *pucInterHash);
+
+/*--------------------------------------------------------------------*/
+
+/* Return a snapshot of oKeyChain: a KeyChain object that keeps the
+   keys and hashes oKeyChain has now while oKeyChain goes on changing.
+   Pending hashes are committed first. The snapshot shares the arrays
+   of oKeyChain, revoked keys not yet purged included, so taking it
+   costs no more than copying the list of those; the next change of
+   oKeyChain copies the arrays. Every function that does not change a
+   keychain, KeyChain_save(), KeyChain_snapshot() and the pointer
+   getters included, works on the snapshot; those that change one fail
+   on it. Free it with KeyChain_free(); it may outlive oKeyChain.
+   Return NULL if insufficient memory is available. */
+
+KeyChain_T KeyChain_snapshot(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Begin a transaction on oKeyChain and return it: a private KeyChain
+   object, taken like a snapshot, that the calling thread changes with
+   the usual functions and reads back with its changes applied. Its
+   hashes are deferred. Nothing is visible in oKeyChain until
+   KeyChain_commitTransaction(). Return NULL if oKeyChain is a
+   snapshot or insufficient memory is available. */
+
+KeyChain_T KeyChain_beginTransaction(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Commit the changes of oTransaction to the keychain it was begun on
+   with a single rehash of the changed paths, and free oTransaction.
+   Readers see all the changes or none, and the journal of the
+   keychain records them as one record. Return 1 on success, 0 if keys
+   of the keychain were added, removed or changed since the
+   transaction began or insufficient memory is available, in which
+   case the changes are dropped. Reading the keychain or committing
+   its hashes meanwhile does not count. */
+
+int KeyChain_commitTransaction(KeyChain_T oTransaction);
+
+/*--------------------------------------------------------------------*/
+
+/* Drop the changes of oTransaction and free it. */
+
+void KeyChain_rollbackTransaction(KeyChain_T oTransaction);
+
+/*--------------------------------------------------------------------*/
+
+/* Operations timed by a keychain built with KEYCHAIN_STATS defined:
+   KeyChain_addKey() and KeyChain_addKeyPath(), KeyChain_removeKey()
+   and KeyChain_revokeKey(), KeyChain_updateKey(), KeyChain_verifyKey()
+   and KeyChain_verifyKeyFull(), and KeyChain_getKey(). Latencies fall
+   in power of 2 buckets: bucket i counts calls of 2^i to 2^(i+1) - 1
+   nanoseconds, the last one all slower calls too. */
+
+#define KEYCHAIN_OP_ADD     0
+#define KEYCHAIN_OP_REMOVE  1
+#define KEYCHAIN_OP_UPDATE  2
+#define KEYCHAIN_OP_VERIFY  3
+#define KEYCHAIN_OP_GETKEY  4
+#define KEYCHAIN_OPS        5
+
+#define KEYCHAIN_LATENCYBUCKETS  32
+
+/* Counters of a keychain since it was made or last reset. Hashes
+   include those of readers and of every hash backend. Blocks are an
+   estimate of the calls of the 64 byte compression function,
+   sha256_transform() for SHA-256: they are derived from the message
+   lengths and the padding of the backend, not counted inside it. */
+
+struct KeyChainStats
+{
+    /* calls per KEYCHAIN_OP_*, and their latencies */
+    unsigned long aulOps[KEYCHAIN_OPS];
+    unsigned long aaulLatency[KEYCHAIN_OPS][KEYCHAIN_LATENCYBUCKETS];
+
+    /* messages hashed, their estimated compression blocks and
+       bytes */
+    unsigned long ulHashes;
+    unsigned long ulEstimatedBlocks;
+    unsigned long ulBytesHashed;
+
+    /* key ID index slots probed by lookups, and tree nodes walked on
+       paths to the root to derive, verify or rehash keys */
+    unsigned long ulProbes;
+    unsigned long ulNodesVisited;
+};
+
+/* The shape of a keychain. Fanouts fall in power of 2 buckets too:
+   bucket 0 counts the nodes without children, bucket i > 0 those
+   with 2^(i-1) to 2^i - 1, the last one all larger fanouts too. */
+
+#define KEYCHAIN_SHAPEBUCKETS  32
+
+struct KeyChainShape
+{
+    /* keys in the tree, the root included */
+    unsigned long ulNodes;
+
+    /* keys at depth i, the last bucket counting all deeper ones */
+    unsigned long aulDepth[KEYCHAIN_SHAPEBUCKETS];
+    int iMaxDepth;
+
+    /* keys by number of children */
+    unsigned long aulFanout[KEYCHAIN_SHAPEBUCKETS];
+    unsigned long ulMaxFanout;
+
+    /* bytes held by the node arrays, the index, long key IDs and
+       child trees, in total and per key */
+    size_t uBytes;
+    size_t uBytesPerNode;
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Place the counters of oKeyChain in *psStats. May be called while
+   other threads use oKeyChain. Return 1, or 0 if the keychain was
+   built without KEYCHAIN_STATS, in which case *psStats is zeroed and
+   nothing is ever counted. */
+
+int KeyChain_getStats(KeyChain_T oKeyChain, struct KeyChainStats *psStats);
+
+/*--------------------------------------------------------------------*/
+
+/* Set the counters of oKeyChain to zero. */
+
+void KeyChain_resetStats(KeyChain_T oKeyChain);
+
+/*--------------------------------------------------------------------*/
+
+/* Place the shape of oKeyChain in *psShape, walking every node once
+   between two changes. Revoked keys not yet purged are left out. */
+
+void KeyChain_getShape(KeyChain_T oKeyChain, struct KeyChainShape *psShape);
+
+/*--------------------------------------------------------------------*/
+
 #endif
@@ -8,39 +8,185 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEYCRYPTO_X86
+#include <immintrin.h>
+#endif
 
 #define KEYLEN 8  // bytes
 #define INTBUFLEN (sizeof(int) * 8 + 1)            
 #define ARRBUFLEN (sizeof(unsigned char) * 64 + 1)
 
+/*--------------------------------------------------------------------*/
+/* Private functions:                                                 */
+/*--------------------------------------------------------------------*/
+
+/* Place the 64 bit key pucKey, rotated left by iShift bytes, in 
+   pucRotKey. Byte i of the result lines up with input byte iShift+i. */
+static void rotateKey(const unsigned char *pucKey, int iShift,
+                      unsigned char *pucRotKey)
+{
+    int i;
+
+    for (i = 0; i < KEYLEN; i++)
+        pucRotKey[i] = pucKey[(iShift + i) % KEYLEN];
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Portable kernel: XOR 64 bits per step with the key broadcast into a
+   word. Loads and stores go through memcpy, so neither buffer needs
+   to be aligned. */
+static void xorWords(const unsigned char *pucInput, unsigned char *pucOutput,
+                     size_t uLength, const unsigned char *pucKey)
+{
+    uint64_t ulKey, ulA, ulB, ulC, ulD;
+    size_t i;
+
+    memcpy(&ulKey, pucKey, KEYLEN);
+
+    for (i = 0; i + 32 <= uLength; i += 32) {
+        memcpy(&ulA, pucInput + i, 8);
+        memcpy(&ulB, pucInput + i + 8, 8);
+        memcpy(&ulC, pucInput + i + 16, 8);
+        memcpy(&ulD, pucInput + i + 24, 8);
+        ulA ^= ulKey;
+        ulB ^= ulKey;
+        ulC ^= ulKey;
+        ulD ^= ulKey;
+        memcpy(pucOutput + i, &ulA, 8);
+        memcpy(pucOutput + i + 8, &ulB, 8);
+        memcpy(pucOutput + i + 16, &ulC, 8);
+        memcpy(pucOutput + i + 24, &ulD, 8);
+    }
+    for ( ; i + 8 <= uLength; i += 8) {
+        memcpy(&ulA, pucInput + i, 8);
+        ulA ^= ulKey;
+        memcpy(pucOutput + i, &ulA, 8);
+    }
+    for ( ; i < uLength; i++)
+        pucOutput[i] = pucInput[i] ^ pucKey[i % KEYLEN];
+}
+
+/*--------------------------------------------------------------------*/
+
+#ifdef KEYCRYPTO_X86
+
+/* 1 if the CPU supports AVX2, set once by checkAvx2() */
+static int iHasAvx2;
+static pthread_once_t sAvx2Once = PTHREAD_ONCE_INIT;
+
+static void checkAvx2(void)
+{
+    __builtin_cpu_init();
+    iHasAvx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+
+/* Return 1 if the CPU supports AVX2. Any thread may ask first. */
+static int hasAvx2(void)
+{
+    pthread_once(&sAvx2Once, checkAvx2);
+    return iHasAvx2;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* AVX2 kernel: XOR 64 bytes per step with the key broadcast into a
+   256 bit register. A byte-wise head brings pucOutput to a 32 byte 
+   boundary, and the key is rotated to match before the main loop. */
+__attribute__((target("avx2")))
+static void xorAvx2(const unsigned char *pucInput, unsigned char *pucOutput,
+                    size_t uLength, const unsigned char *pucKey)
+{
+    unsigned char aucRotKey[KEYLEN];
+    uint64_t ulKey;
+    __m256i vKey, vA, vB;
+    size_t uHead;
+    size_t i;
+
+    uHead = (32 - ((uintptr_t)pucOutput & 31)) & 31;
+    if (uHead > uLength)
+        uHead = uLength;
+    for (i = 0; i < uHead; i++)
+        pucOutput[i] = pucInput[i] ^ pucKey[i % KEYLEN];
+    pucInput += uHead;
+    pucOutput += uHead;
+    uLength -= uHead;
+
+    rotateKey(pucKey, uHead % KEYLEN, aucRotKey);
+    memcpy(&ulKey, aucRotKey, KEYLEN);
+    vKey = _mm256_set1_epi64x((long long)ulKey);
+
+    for (i = 0; i + 64 <= uLength; i += 64) {
+        vA = _mm256_loadu_si256((const __m256i *)(pucInput + i));
+        vB = _mm256_loadu_si256((const __m256i *)(pucInput + i + 32));
+        _mm256_store_si256((__m256i *)(pucOutput + i), 
+                           _mm256_xor_si256(vA, vKey));
+        _mm256_store_si256((__m256i *)(pucOutput + i + 32), 
+                           _mm256_xor_si256(vB, vKey));
+    }
+    if (i + 32 <= uLength) {
+        vA = _mm256_loadu_si256((const __m256i *)(pucInput + i));
+        _mm256_store_si256((__m256i *)(pucOutput + i), 
+                           _mm256_xor_si256(vA, vKey));
+        i += 32;
+    }
+
+    // tail of less than 32 bytes; i is a multiple of KEYLEN here
+    xorWords(pucInput + i, pucOutput + i, uLength - i, aucRotKey);
+}
+
+#endif
+
+/*--------------------------------------------------------------------*/
+/* Public functions:                                                  */
+/*--------------------------------------------------------------------*/
+
+void xor_crypt(const unsigned char *pucInput,
+               unsigned char *pucOutput,
+               size_t uLength,
+               const unsigned char *pucKey)
+{
+    assert(pucInput != NULL || uLength == 0);
+    assert(pucOutput != NULL || uLength == 0);
+    assert(pucKey != NULL);
+
+#ifdef KEYCRYPTO_X86
+    if (uLength >= 64 && hasAvx2()) {
+        xorAvx2(pucInput, pucOutput, uLength, pucKey);
+        return;
+    }
+#endif
+    xorWords(pucInput, pucOutput, uLength, pucKey);
+}
+
 /*--------------------------------------------------------------------*/
 
 void xor_encrypt(unsigned char *pucInput,
                  unsigned char *pucOutput,
-                 unsigned int uiLength, 
+                 size_t uLength, 
                  unsigned char *pucKey)
 {
-    unsigned int i;
-
     assert(pucInput != NULL);
     assert(pucOutput != NULL);
     assert(pucKey != NULL);
-    assert(uiLength % KEYLEN == 0);
+    assert(uLength % KEYLEN == 0);
 
-    memcpy(pucOutput, pucInput, uiLength);
-    for (i = 0; i < uiLength; i++)
-        pucOutput[i] ^= pucKey[i % KEYLEN];
+    xor_crypt(pucInput, pucOutput, uLength, pucKey);
 }
 
 /*--------------------------------------------------------------------*/
 
 void xor_decrypt(unsigned char *pucInput,
                  unsigned char *pucOutput,
-                 unsigned int uiLength, 
+                 size_t uLength, 
                  unsigned char *pucKey)
 {
     // symmetric to encrypt
-    xor_encrypt(pucInput, pucOutput, uiLength, pucKey);
+    xor_encrypt(pucInput, pucOutput, uLength, pucKey);
 }
 
 /*--------------------------------------------------------------------*/
@@ -55,12 +201,15 @@ void intToString(int i, char *pcBuf)
 
 void arrToString(unsigned char *pucArr, char *pcBuf, int iLen)
 {
+    static const char acHexDigits[] = "0123456789abcdef";
     int i;
 
     assert(pucArr != NULL);
     assert(pcBuf != NULL);
 
-    for (i = 0; i < iLen; i++)
-        sprintf(pcBuf + i*2, "%.2x", pucArr[i]);
+    for (i = 0; i < iLen; i++) {
+        pcBuf[i*2] = acHexDigits[pucArr[i] >> 4];
+        pcBuf[i*2 + 1] = acHexDigits[pucArr[i] & 0x0f];
+    }
     pcBuf[iLen*2] = '\0';
-}
\ No newline at end of file
+}
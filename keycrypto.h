@@ -6,22 +6,36 @@
 #ifndef KEY_CRYPTO_INCLUDED
 #define KEY_CRYPTO_INCLUDED
 
+#include <stddef.h>
+
+/*--------------------------------------------------------------------*/
+
+/* XOR the uLength input pucInput with the repeating 64 bit key pucKey
+   and place the result in pucOutput. Byte i is XORed with key byte 
+   i % 8. uLength need not be a multiple of 8, and pucInput and 
+   pucOutput may be the same buffer to work in place. */
+
+void xor_crypt(const unsigned char *pucInput,
+               unsigned char *pucOutput,
+               size_t uLength,
+               const unsigned char *pucKey);
+
 /*--------------------------------------------------------------------*/
 
-/* XOR Encrypt the uiLength input pucInput with 64 bit key pucKey */
+/* XOR Encrypt the uLength input pucInput with 64 bit key pucKey */
 
 void xor_encrypt(unsigned char *pucInput,
                  unsigned char *pucOutput,
-                 unsigned int uiLength, 
+                 size_t uLength, 
                  unsigned char *pucKey);
 
 /*--------------------------------------------------------------------*/
 
-/* XOR Decrypt the uiLength input pucInput with 64 bit key pucKey */
+/* XOR Decrypt the uLength input pucInput with 64 bit key pucKey */
 
 void xor_decrypt(unsigned char *pucInput,
                  unsigned char *pucOutput,
-                 unsigned int uiLength, 
+                 size_t uLength, 
                  unsigned char *pucKey);
 
 /*--------------------------------------------------------------------*/
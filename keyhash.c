@@ -0,0 +1,103 @@
+/*--------------------------------------------------------------------*/
+/* keyhash.c                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "keyhash.h"
+#include <assert.h>
+
+/*--------------------------------------------------------------------*/
+/* SHA-256                                                            */
+/*--------------------------------------------------------------------*/
+
+static void sha256Init(KeyHash_CTX *psCtx)
+{
+    sha256_init(&psCtx->sSha256);
+}
+
+static void sha256Update(KeyHash_CTX *psCtx, const unsigned char *pucData,
+                         size_t uLen)
+{
+    sha256_update(&psCtx->sSha256, pucData, uLen);
+}
+
+static void sha256Final(KeyHash_CTX *psCtx, unsigned char *pucHash)
+{
+    sha256_final(&psCtx->sSha256, pucHash);
+}
+
+static void sha256Multi(const unsigned char *apucData[], const size_t auLen[],
+                        unsigned char *apucHash[], size_t uNum)
+{
+    sha256_multi(apucData, auLen, apucHash, uNum);
+}
+
+/*--------------------------------------------------------------------*/
+/* BLAKE2s                                                            */
+/*--------------------------------------------------------------------*/
+
+static void blake2sInit(KeyHash_CTX *psCtx)
+{
+    blake2s_init(&psCtx->sBlake2s);
+}
+
+static void blake2sUpdate(KeyHash_CTX *psCtx, const unsigned char *pucData,
+                          size_t uLen)
+{
+    blake2s_update(&psCtx->sBlake2s, pucData, uLen);
+}
+
+static void blake2sFinal(KeyHash_CTX *psCtx, unsigned char *pucHash)
+{
+    blake2s_final(&psCtx->sBlake2s, pucHash);
+}
+
+static void blake2sMulti(const unsigned char *apucData[], 
+                         const size_t auLen[],
+                         unsigned char *apucHash[], size_t uNum)
+{
+    BLAKE2S_CTX ctx;
+    size_t i;
+
+    for (i = 0; i < uNum; i++) {
+        blake2s_init(&ctx);
+        blake2s_update(&ctx, apucData[i], auLen[i]);
+        blake2s_final(&ctx, apucHash[i]);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+static const struct KeyHash asBackends[] = {
+    {KEYHASH_SHA256, "sha256",
+     sha256Init, sha256Update, sha256Final, sha256Multi},
+    {KEYHASH_BLAKE2S, "blake2s",
+     blake2sInit, blake2sUpdate, blake2sFinal, blake2sMulti}
+};
+
+#define NUM_BACKENDS (sizeof(asBackends) / sizeof(asBackends[0]))
+
+/*--------------------------------------------------------------------*/
+
+const struct KeyHash *KeyHash_get(int iType)
+{
+    if (iType < 0 || iType >= (int)NUM_BACKENDS)
+        return NULL;
+    return &asBackends[iType];
+}
+
+/*--------------------------------------------------------------------*/
+
+void KeyHash_digest(const struct KeyHash *psHash, 
+                    const unsigned char *pucData, size_t uLen,
+                    unsigned char *pucHash)
+{
+    KeyHash_CTX ctx;
+
+    assert(psHash != NULL);
+    assert(pucHash != NULL);
+
+    psHash->init(&ctx);
+    psHash->update(&ctx, pucData, uLen);
+    psHash->final(&ctx, pucHash);
+}
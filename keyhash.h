@@ -0,0 +1,59 @@
+/*--------------------------------------------------------------------*/
+/* keyhash.h                                                          */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef KEY_HASH_INCLUDED
+#define KEY_HASH_INCLUDED
+
+#include "sha256.h"
+#include "blake2s.h"
+#include <stddef.h>
+
+/* A KeyHash is a 256 bit hash backend for the Merkle tree of a 
+   KeyChain and the data digests of the TSM. */
+
+#define KEYHASH_SHA256   0
+#define KEYHASH_BLAKE2S  1
+
+/* Hashing state large enough for any backend */
+
+typedef union {
+    SHA256_CTX sSha256;
+    BLAKE2S_CTX sBlake2s;
+} KeyHash_CTX;
+
+struct KeyHash
+{
+    /* KEYHASH_* identifier */
+    int iType;
+
+    /* printable name */
+    const char *pcName;
+
+    void (*init)(KeyHash_CTX *psCtx);
+    void (*update)(KeyHash_CTX *psCtx, const unsigned char *pucData, 
+                   size_t uLen);
+    void (*final)(KeyHash_CTX *psCtx, unsigned char *pucHash);
+
+    /* hash uNum independent messages, see sha256_multi */
+    void (*multi)(const unsigned char *apucData[], const size_t auLen[],
+                  unsigned char *apucHash[], size_t uNum);
+};
+
+/*--------------------------------------------------------------------*/
+
+/* Return the backend identified by iType, or NULL if there is none. */
+
+const struct KeyHash *KeyHash_get(int iType);
+
+/*--------------------------------------------------------------------*/
+
+/* Hash uLen bytes of pucData with psHash in one call, placing the 
+   256 bit digest in pucHash. */
+
+void KeyHash_digest(const struct KeyHash *psHash, 
+                    const unsigned char *pucData, size_t uLen,
+                    unsigned char *pucHash);
+
+#endif
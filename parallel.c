@@ -0,0 +1,176 @@
+/*--------------------------------------------------------------------*/
+/* parallel.c                                                         */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#include "parallel.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define MAXTHREADS 64
+
+/* One worker's share of a Parallel_for call: tasks iFirst, 
+   iFirst + iStride, ... below iNumTasks */
+struct Share
+{
+    void (*pfTask)(void *pvArg, int iTask);
+    void *pvArg;
+    int iFirst;
+    int iStride;
+    int iNumTasks;
+};
+
+/* The pool of worker threads, started on first use and kept for the
+   life of the process. Worker i runs share i of each job; the thread 
+   calling Parallel_for runs share 0. */
+
+/* held by the Parallel_for call that owns the pool */
+static pthread_mutex_t sPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* guards the job fields below */
+static pthread_mutex_t sJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sJobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sJobDone = PTHREAD_COND_INITIALIZER;
+
+/* shares of the current job, and the number of them in use */
+static struct Share asShares[MAXTHREADS];
+static int iNumShares;
+
+/* incremented for every job, so workers can tell a new one */
+static unsigned long ulJob;
+
+/* shares of the current job not finished yet, share 0 aside */
+static int iPending;
+
+/* workers started so far; they are numbered 1 to iNumWorkers */
+static int iNumWorkers;
+
+/* the last job before each worker was started */
+static unsigned long aulFirstSeen[MAXTHREADS];
+
+/*--------------------------------------------------------------------*/
+/* Private functions:                                                 */
+/*--------------------------------------------------------------------*/
+
+static void runShare(struct Share *psShare)
+{
+    int i;
+
+    for (i = psShare->iFirst; i < psShare->iNumTasks; i += psShare->iStride)
+        psShare->pfTask(psShare->pvArg, i);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Body of worker thread number (long)pvWorker */
+static void *runWorker(void *pvWorker)
+{
+    int iWorker = (int)(long)pvWorker;
+    unsigned long ulSeen;
+    int iRun;
+
+    pthread_mutex_lock(&sJobLock);
+    ulSeen = aulFirstSeen[iWorker];
+    for (;;) {
+        while (ulJob == ulSeen)
+            pthread_cond_wait(&sJobReady, &sJobLock);
+        ulSeen = ulJob;
+        iRun = iWorker < iNumShares;
+        pthread_mutex_unlock(&sJobLock);
+
+        if (iRun)
+            runShare(&asShares[iWorker]);
+
+        pthread_mutex_lock(&sJobLock);
+        if (iRun && --iPending == 0)
+            pthread_cond_signal(&sJobDone);
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Start workers until there are iWanted of them or one fails to 
+   start. Must be called with sPoolLock held. */
+static void startWorkers(int iWanted)
+{
+    pthread_t thread;
+
+    while (iNumWorkers < iWanted) {
+        aulFirstSeen[iNumWorkers + 1] = ulJob;
+        if (pthread_create(&thread, NULL, runWorker,
+                           (void *)(long)(iNumWorkers + 1)) != 0)
+            return;
+        pthread_detach(thread);
+        iNumWorkers++;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+/* Public functions:                                                  */
+/*--------------------------------------------------------------------*/
+
+int Parallel_getNumThreads(void)
+{
+    long lNumCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (lNumCPUs < 1)
+        return 1;
+    if (lNumCPUs > MAXTHREADS)
+        return MAXTHREADS;
+    return (int)lNumCPUs;
+}
+
+/*--------------------------------------------------------------------*/
+
+void Parallel_for(int iNumTasks, 
+                  void (*pfTask)(void *pvArg, int iTask),
+                  void *pvArg)
+{
+    struct Share sAll;
+    int iNumThreads;
+    int i;
+
+    assert(pfTask != NULL);
+
+    // single tasks, and calls made while the pool is busy (such as 
+    // from inside a task), run on the calling thread
+    sAll.pfTask = pfTask;
+    sAll.pvArg = pvArg;
+    sAll.iFirst = 0;
+    sAll.iStride = 1;
+    sAll.iNumTasks = iNumTasks;
+    if (iNumTasks < 2 || pthread_mutex_trylock(&sPoolLock) != 0) {
+        runShare(&sAll);
+        return;
+    }
+
+    startWorkers(Parallel_getNumThreads() - 1);
+    iNumThreads = iNumWorkers + 1;
+    if (iNumThreads > iNumTasks)
+        iNumThreads = iNumTasks;
+
+    pthread_mutex_lock(&sJobLock);
+    for (i = 0; i < iNumThreads; i++) {
+        asShares[i].pfTask = pfTask;
+        asShares[i].pvArg = pvArg;
+        asShares[i].iFirst = i;
+        asShares[i].iStride = iNumThreads;
+        asShares[i].iNumTasks = iNumTasks;
+    }
+    iNumShares = iNumThreads;
+    iPending = iNumThreads - 1;
+    ulJob++;
+    pthread_cond_broadcast(&sJobReady);
+    pthread_mutex_unlock(&sJobLock);
+
+    runShare(&asShares[0]);
+
+    pthread_mutex_lock(&sJobLock);
+    while (iPending > 0)
+        pthread_cond_wait(&sJobDone, &sJobLock);
+    pthread_mutex_unlock(&sJobLock);
+
+    pthread_mutex_unlock(&sPoolLock);
+}
@@ -0,0 +1,28 @@
+/*--------------------------------------------------------------------*/
+/* parallel.h                                                         */
+/* Author: Gerry Wan                                                  */
+/*--------------------------------------------------------------------*/
+
+#ifndef PARALLEL_INCLUDED
+#define PARALLEL_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+/* Call pfTask(pvArg, i) once for every i in [0, iNumTasks), spread 
+   over the online cores. Tasks must be independent of each other. 
+   Return once all tasks are done. The worker threads are started by
+   the first call and reused by later ones; a call made while another
+   one is running, e.g. from inside a task, runs its tasks on the 
+   calling thread. */
+
+void Parallel_for(int iNumTasks, 
+                  void (*pfTask)(void *pvArg, int iTask),
+                  void *pvArg);
+
+/*--------------------------------------------------------------------*/
+
+/* Return the number of threads Parallel_for runs tasks on. */
+
+int Parallel_getNumThreads(void);
+
+#endif
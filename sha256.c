@@ -15,8 +15,15 @@
 /*************************** HEADER FILES ***************************/
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "sha256.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /****************************** MACROS ******************************/
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
@@ -41,45 +48,418 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+
+// Portable kernel. Compresses nblocks consecutive 64 byte blocks of
+// data into state. This is the reference every other kernel is
+// checked against.
+static void sha256_blocks_c(WORD state[8], const BYTE data[], size_t nblocks)
 {
     WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
-    for (i = 0, j = 0; i < 16; ++i, j += 4)
-        m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-    for ( ; i < 64; ++i)
-        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-    a = ctx->state[0];
-    b = ctx->state[1];
-    c = ctx->state[2];
-    d = ctx->state[3];
-    e = ctx->state[4];
-    f = ctx->state[5];
-    g = ctx->state[6];
-    h = ctx->state[7];
-
-    for (i = 0; i < 64; ++i) {
-        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-        t2 = EP0(a) + MAJ(a,b,c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
-    }
-
-    ctx->state[0] += a;
-    ctx->state[1] += b;
-    ctx->state[2] += c;
-    ctx->state[3] += d;
-    ctx->state[4] += e;
-    ctx->state[5] += f;
-    ctx->state[6] += g;
-    ctx->state[7] += h;
+    for ( ; nblocks > 0; --nblocks, data += 64) {
+        for (i = 0, j = 0; i < 16; ++i, j += 4)
+            m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
+        for ( ; i < 64; ++i)
+            m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; ++i) {
+            t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+            t2 = EP0(a) + MAJ(a,b,c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef SHA256_X86
+
+// x86 SHA extensions kernel. Two rounds per sha256rnds2; the message
+// schedule is produced four words at a time by sha256msg1/msg2.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(WORD state[8], const BYTE data[], size_t nblocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save, msg, tmp, w[4];
+    int i;
+
+    // Rearrange the state into the ABEF/CDGH layout the instructions use.
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for ( ; nblocks > 0; --nblocks, data += 64) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (i = 0; i < 16; ++i) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), MASK);
+            }
+            else {
+                // w[i & 3] holds W[t-16..t-13] on entry
+                tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+            }
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    // Back to the A..H word order.
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define AVX2_ROR(x,n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define AVX2_SIG0(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x,7), AVX2_ROR(x,18)), _mm256_srli_epi32((x), 3))
+#define AVX2_SIG1(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x,17), AVX2_ROR(x,19)), _mm256_srli_epi32((x), 10))
+
+// AVX2 kernel. The message schedule does not depend on the chaining
+// state, so the schedules of up to eight consecutive blocks are
+// expanded together, one block per 32 bit lane. The rounds then run
+// scalar over the precomputed W[t] + K[t] values.
+__attribute__((target("avx2")))
+static void sha256_blocks_avx2(WORD state[8], const BYTE data[], size_t nblocks)
+{
+    const __m256i BSWAP = _mm256_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+                                          12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+    WORD wk[64][8] __attribute__((aligned(32)));
+    __m256i w[64], offsets;
+    WORD a, b, c, d, e, f, g, h, t1, t2;
+    size_t lanes, j;
+    int i, lane_off[8];
+
+    while (nblocks > 1) {
+        lanes = nblocks < 8 ? nblocks : 8;
+
+        // Unused lanes reread the last real block rather than run off
+        // the end of the caller's buffer.
+        for (j = 0; j < 8; ++j)
+            lane_off[j] = 64 * (int)(j < lanes ? j : lanes - 1);
+        offsets = _mm256_loadu_si256((const __m256i *)lane_off);
+
+        for (i = 0; i < 16; ++i) {
+            w[i] = _mm256_i32gather_epi32((const int *)(data + 4 * i), offsets, 1);
+            w[i] = _mm256_shuffle_epi8(w[i], BSWAP);
+        }
+        for ( ; i < 64; ++i)
+            w[i] = _mm256_add_epi32(_mm256_add_epi32(AVX2_SIG1(w[i - 2]), w[i - 7]),
+                                    _mm256_add_epi32(AVX2_SIG0(w[i - 15]), w[i - 16]));
+        for (i = 0; i < 64; ++i)
+            _mm256_store_si256((__m256i *)wk[i], _mm256_add_epi32(w[i], _mm256_set1_epi32(k[i])));
+
+        for (j = 0; j < lanes; ++j) {
+            a = state[0];
+            b = state[1];
+            c = state[2];
+            d = state[3];
+            e = state[4];
+            f = state[5];
+            g = state[6];
+            h = state[7];
+
+            for (i = 0; i < 64; ++i) {
+                t1 = h + EP1(e) + CH(e,f,g) + wk[i][j];
+                t2 = EP0(a) + MAJ(a,b,c);
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+
+        data += 64 * lanes;
+        nblocks -= lanes;
+    }
+
+    // A lone block gains nothing from the lanes.
+    if (nblocks > 0)
+        sha256_blocks_c(state, data, nblocks);
+}
+
+#define AVX2_ROTR(x,n) AVX2_ROR(x,n)
+#define AVX2_EP0(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(x,2), AVX2_ROTR(x,13)), AVX2_ROTR(x,22))
+#define AVX2_EP1(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(x,6), AVX2_ROTR(x,11)), AVX2_ROTR(x,25))
+#define AVX2_CH(x,y,z) _mm256_xor_si256(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define AVX2_MAJ(x,y,z) _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256((x), (y)), \
+                        _mm256_and_si256((x), (z))), _mm256_and_si256((y), (z)))
+
+// One message of a multi-buffer batch, already split into the part
+// that is read in place and a padded tail of one or two blocks.
+typedef struct {
+    const BYTE *data;
+    size_t full;                        // whole blocks read from data
+    size_t nblocks;                     // total blocks including padding
+    BYTE tail[128];
+} SHA256_LANE;
+
+static void sha256_lane_init(SHA256_LANE *lane, const BYTE data[], size_t len)
+{
+    unsigned long long bitlen = (unsigned long long)len * 8;
+    size_t rem, tail_len, i;
+
+    lane->data = data;
+    lane->full = len / 64;
+    rem = len - 64 * lane->full;
+    tail_len = (rem < 56) ? 64 : 128;
+    lane->nblocks = lane->full + tail_len / 64;
+
+    memset(lane->tail, 0, sizeof(lane->tail));
+    memcpy(lane->tail, data + 64 * lane->full, rem);
+    lane->tail[rem] = 0x80;
+    for (i = 0; i < 8; ++i)
+        lane->tail[tail_len - 1 - i] = bitlen >> (8 * i);
+}
+
+static const BYTE *sha256_lane_block(const SHA256_LANE *lane, size_t b)
+{
+    if (b < lane->full)
+        return lane->data + 64 * b;
+    if (b < lane->nblocks)
+        return lane->tail + 64 * (b - lane->full);
+    return lane->tail;                  // lane idle, result masked off
+}
+
+// Hash up to eight independent messages, one per 32 bit lane. Lanes
+// whose message has run out of blocks keep their state unchanged.
+__attribute__((target("avx2")))
+static void sha256_multi_avx2(const BYTE *data[], const size_t len[],
+                              BYTE *hash[], size_t n)
+{
+    const __m256i BSWAP = _mm256_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+                                          12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+    static const WORD init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    SHA256_LANE lanes[8];
+    WORD words[16][8] __attribute__((aligned(32)));
+    WORD out[8][8] __attribute__((aligned(32)));
+    int nblocks[8] __attribute__((aligned(32)));
+    __m256i st[8], v[8], w[16], t1, t2, active;
+    const BYTE *p;
+    size_t b, max_blocks, j;
+    int i;
+
+    max_blocks = 0;
+    for (j = 0; j < 8; ++j) {
+        if (j < n) {
+            sha256_lane_init(&lanes[j], data[j], len[j]);
+            nblocks[j] = (int)lanes[j].nblocks;
+        }
+        else {
+            sha256_lane_init(&lanes[j], (const BYTE *)"", 0);
+            nblocks[j] = 0;
+        }
+        if ((size_t)nblocks[j] > max_blocks)
+            max_blocks = nblocks[j];
+    }
+
+    for (i = 0; i < 8; ++i)
+        st[i] = _mm256_set1_epi32(init[i]);
+
+    for (b = 0; b < max_blocks; ++b) {
+        // Transpose the b-th block of every lane into word-major order.
+        for (j = 0; j < 8; ++j) {
+            p = sha256_lane_block(&lanes[j], b);
+            for (i = 0; i < 16; ++i)
+                memcpy(&words[i][j], p + 4 * i, 4);
+        }
+        for (i = 0; i < 16; ++i)
+            w[i] = _mm256_shuffle_epi8(_mm256_load_si256((const __m256i *)words[i]), BSWAP);
+
+        for (i = 0; i < 8; ++i)
+            v[i] = st[i];
+
+        for (i = 0; i < 64; ++i) {
+            if (i >= 16)
+                w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(AVX2_SIG1(w[(i - 2) & 15]), w[(i - 7) & 15]),
+                                             _mm256_add_epi32(AVX2_SIG0(w[(i - 15) & 15]), w[i & 15]));
+            t1 = _mm256_add_epi32(_mm256_add_epi32(v[7], AVX2_EP1(v[4])),
+                                  _mm256_add_epi32(AVX2_CH(v[4], v[5], v[6]),
+                                                   _mm256_add_epi32(_mm256_set1_epi32(k[i]), w[i & 15])));
+            t2 = _mm256_add_epi32(AVX2_EP0(v[0]), AVX2_MAJ(v[0], v[1], v[2]));
+            v[7] = v[6];
+            v[6] = v[5];
+            v[5] = v[4];
+            v[4] = _mm256_add_epi32(v[3], t1);
+            v[3] = v[2];
+            v[2] = v[1];
+            v[1] = v[0];
+            v[0] = _mm256_add_epi32(t1, t2);
+        }
+
+        active = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)nblocks),
+                                    _mm256_set1_epi32((int)b));
+        for (i = 0; i < 8; ++i)
+            st[i] = _mm256_blendv_epi8(st[i], _mm256_add_epi32(st[i], v[i]), active);
+    }
+
+    for (i = 0; i < 8; ++i)
+        _mm256_store_si256((__m256i *)out[i], st[i]);
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i < 8; ++i) {
+            hash[j][4 * i]     = out[i][j] >> 24;
+            hash[j][4 * i + 1] = out[i][j] >> 16;
+            hash[j][4 * i + 2] = out[i][j] >> 8;
+            hash[j][4 * i + 3] = out[i][j];
+        }
+    }
+}
+
+static int sha256_has_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    if (!(ebx & (1u << 29)))                          // SHA
+        return 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ecx & (1u << 19)) && (ecx & (1u << 9));   // SSE4.1, SSSE3
+}
+
+static int sha256_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif   // SHA256_X86
+
+typedef void (*sha256_blocks_fn)(WORD state[8], const BYTE data[], size_t nblocks);
+
+// Set with atomic stores, since kernels are picked on first use and
+// that may happen on several threads at once.
+static sha256_blocks_fn sha256_blocks;
+static int sha256_impl = -1;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+// Returns 1 if impl can run on this CPU.
+static int sha256_impl_supported(int impl)
+{
+    switch (impl) {
+    case SHA256_IMPL_C:
+        return 1;
+#ifdef SHA256_X86
+    case SHA256_IMPL_AVX2:
+        return sha256_has_avx2();
+    case SHA256_IMPL_SHANI:
+        return sha256_has_shani();
+#endif
+    default:
+        return 0;
+    }
+}
+
+int sha256_set_impl(int impl)
+{
+    sha256_blocks_fn blocks;
+
+    if (impl == SHA256_IMPL_AUTO) {
+        if (sha256_impl_supported(SHA256_IMPL_SHANI))
+            impl = SHA256_IMPL_SHANI;
+        else if (sha256_impl_supported(SHA256_IMPL_AVX2))
+            impl = SHA256_IMPL_AVX2;
+        else
+            impl = SHA256_IMPL_C;
+    }
+    else if (!sha256_impl_supported(impl)) {
+        return 0;
+    }
+
+    switch (impl) {
+#ifdef SHA256_X86
+    case SHA256_IMPL_SHANI:
+        blocks = sha256_blocks_shani;
+        break;
+    case SHA256_IMPL_AVX2:
+        blocks = sha256_blocks_avx2;
+        break;
+#endif
+    default:
+        blocks = sha256_blocks_c;
+        break;
+    }
+    __atomic_store_n(&sha256_blocks, blocks, __ATOMIC_RELEASE);
+    __atomic_store_n(&sha256_impl, impl, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Picks the fastest kernel, unless sha256_set_impl() already picked one.
+static void sha256_pick_impl(void)
+{
+    if (__atomic_load_n(&sha256_blocks, __ATOMIC_ACQUIRE) == NULL)
+        sha256_set_impl(SHA256_IMPL_AUTO);
+}
+
+// Returns the block kernel, picking it once on first use.
+static sha256_blocks_fn sha256_kernel(void)
+{
+    pthread_once(&sha256_once, sha256_pick_impl);
+    return __atomic_load_n(&sha256_blocks, __ATOMIC_ACQUIRE);
+}
+
+int sha256_get_impl(void)
+{
+    sha256_kernel();
+    return __atomic_load_n(&sha256_impl, __ATOMIC_ACQUIRE);
+}
+
+void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+{
+    sha256_kernel()(ctx->state, data, 1);
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -98,16 +478,38 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-    WORD i;
+    sha256_blocks_fn blocks = sha256_kernel();
+    size_t fill, nblocks;
 
-    for (i = 0; i < len; ++i) {
-        ctx->data[ctx->datalen] = data[i];
-        ctx->datalen++;
-        if (ctx->datalen == 64) {
-            sha256_transform(ctx, ctx->data);
-            ctx->bitlen += 512;
-            ctx->datalen = 0;
+    // Top up a partially filled buffer first.
+    if (ctx->datalen > 0) {
+        fill = 64 - ctx->datalen;
+        if (len < fill) {
+            memcpy(ctx->data + ctx->datalen, data, len);
+            ctx->datalen += len;
+            return;
         }
+        memcpy(ctx->data + ctx->datalen, data, fill);
+        blocks(ctx->state, ctx->data, 1);
+        ctx->bitlen += 512;
+        ctx->datalen = 0;
+        data += fill;
+        len -= fill;
+    }
+
+    // Whole blocks are hashed straight from the caller's buffer.
+    nblocks = len / 64;
+    if (nblocks > 0) {
+        blocks(ctx->state, data, nblocks);
+        ctx->bitlen += 512 * (unsigned long long)nblocks;
+        data += 64 * nblocks;
+        len -= 64 * nblocks;
+    }
+
+    // Keep the tail for the next call.
+    if (len > 0) {
+        memcpy(ctx->data, data, len);
+        ctx->datalen = len;
     }
 }
 
@@ -155,4 +557,31 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
         hash[i + 24] = (ctx->state[6] >> (24 - i * 8)) & 0x000000ff;
         hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
     }
+}
+
+void sha256_multi(const BYTE *data[], const size_t len[], BYTE *hash[], size_t n)
+{
+    SHA256_CTX ctx;
+    size_t i, batch;
+
+#ifdef SHA256_X86
+    // The lanes only pay off against the scalar AVX2 and portable
+    // kernels; SHA-NI is quicker one message at a time.
+    if (sha256_get_impl() == SHA256_IMPL_AVX2) {
+        for (i = 0; n - i >= 2; i += batch) {
+            batch = (n - i < 8) ? n - i : 8;
+            sha256_multi_avx2(data + i, len + i, hash + i, batch);
+        }
+        data += i;
+        len += i;
+        hash += i;
+        n -= i;
+    }
+#endif
+
+    for (i = 0; i < n; ++i) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, data[i], len[i]);
+        sha256_final(&ctx, hash[i]);
+    }
 }
\ No newline at end of file
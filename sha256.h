@@ -15,6 +15,12 @@
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
+// Block compression kernels, see sha256_set_impl()
+#define SHA256_IMPL_AUTO  0             // fastest kernel this CPU supports
+#define SHA256_IMPL_C     1             // portable reference kernel
+#define SHA256_IMPL_AVX2  2             // AVX2 message schedule
+#define SHA256_IMPL_SHANI 3             // x86 SHA extensions
+
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;             // 8-bit byte
 typedef unsigned int  WORD;             // 32-bit word, change to "long" for 16-bit machines
@@ -31,4 +37,15 @@ void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 
+// Select the block compression kernel. The kernel is otherwise picked
+// via CPUID once, on first use by any thread. Returns 0 if impl is not
+// supported here.
+int sha256_set_impl(int impl);
+int sha256_get_impl(void);
+
+// Hash n independent messages at once: data[i] holds len[i] bytes and
+// its digest is written to hash[i]. With AVX2 up to eight messages
+// share the SIMD lanes.
+void sha256_multi(const BYTE *data[], const size_t len[], BYTE *hash[], size_t n);
+
 #endif   // SHA256_H
\ No newline at end of file
@@ -4,10 +4,12 @@
 /*--------------------------------------------------------------------*/
 
 #include "keychain.h"
+#include "keyhash.h"
 #include <stdlib.h>
 #include <string.h>  
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #define ASSURE(i) assure(i, __LINE__)
 #define KEYLEN 8
@@ -587,11 +589,2620 @@ static void testHorizontalTree()
 
 /*--------------------------------------------------------------------*/
 
+static void testVerify()
+{
+    KeyChain_T oKeyChain;
+    unsigned long umk = 0x5e2a71c0d3b49f86;
+    unsigned char aucKey[KEYLEN] = {0x10, 0x32, 0x54, 0x76,
+                                    0x98, 0xba, 0xdc, 0xfe};
+    char acKeyID[16];
+    char acParentID[16];
+    unsigned char *pucInterHash;
+    int iValue;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain verification.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+
+    // a chain deep enough to fill more than one batch of hash lanes,
+    // with a few siblings at every level
+    strcpy(acKeyID, "0");
+    for (i = 1; i < 12; i++) {
+        strcpy(acParentID, acKeyID);
+        acKeyID[i] = 'a';
+        acKeyID[i+1] = '\0';
+        aucKey[0] = i;
+        iValue = KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 0);
+        ASSURE(iValue == 1);
+        acKeyID[i] = 'b';
+        iValue = KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 1);
+        ASSURE(iValue == 1);
+        acKeyID[i] = 'a';
+    }
+
+    iValue = KeyChain_verifyKey(oKeyChain, acKeyID);
+    ASSURE(iValue == 1);
+
+    iValue = KeyChain_verifyKey(oKeyChain, "0ab");
+    ASSURE(iValue == 1);
+
+    // tamper with an intermediate hash halfway up the path
+    pucInterHash = KeyChain_getInterHash(oKeyChain, "0aaaa");
+    ASSURE(pucInterHash != NULL);
+    pucInterHash[5] ^= 0x01;
+
+    iValue = KeyChain_verifyKeyFull(oKeyChain, acKeyID);
+    ASSURE(iValue == 0);
+
+    iValue = KeyChain_verifyKeyFull(oKeyChain, "0aaaa");
+    ASSURE(iValue == 0);
+
+    // other branches are unaffected
+    iValue = KeyChain_verifyKey(oKeyChain, "0ab");
+    ASSURE(iValue == 1);
+
+    pucInterHash[5] ^= 0x01;
+    iValue = KeyChain_verifyKey(oKeyChain, acKeyID);
+    ASSURE(iValue == 1);
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testHashBackends()
+{
+    KeyChain_T oSha256Chain;
+    KeyChain_T oBlake2sChain;
+    unsigned long umk = 0x0123456789abcdef;
+    unsigned char aucKey[KEYLEN] = {0x01, 0x02, 0x03, 0x04,
+                                    0x05, 0x06, 0x07, 0x08};
+    unsigned char aucBuf[KEYLEN];
+    unsigned char aucDataHash[32];
+    unsigned char *pucResult;
+    int iValue;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain hash backends.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    ASSURE(KeyChain_newWithHash(umk, 7) == NULL);
+
+    oSha256Chain = KeyChain_new(umk);
+    ASSURE(oSha256Chain != NULL);
+    ASSURE(KeyChain_getHashType(oSha256Chain) == KEYHASH_SHA256);
+
+    oBlake2sChain = KeyChain_newWithHash(umk, KEYHASH_BLAKE2S);
+    ASSURE(oBlake2sChain != NULL);
+    ASSURE(KeyChain_getHashType(oBlake2sChain) == KEYHASH_BLAKE2S);
+
+    iValue = KeyChain_addKey(oSha256Chain, "0", "00", aucKey, 0);
+    ASSURE(iValue == 1);
+    iValue = KeyChain_addKey(oSha256Chain, "00", "000", aucKey, 1);
+    ASSURE(iValue == 1);
+
+    iValue = KeyChain_addKey(oBlake2sChain, "0", "00", aucKey, 0);
+    ASSURE(iValue == 1);
+    iValue = KeyChain_addKey(oBlake2sChain, "00", "000", aucKey, 1);
+    ASSURE(iValue == 1);
+
+    pucResult = KeyChain_getKey(oBlake2sChain, "000", aucBuf);
+    ASSURE(memcmp(pucResult, aucKey, KEYLEN) == 0);
+
+    iValue = KeyChain_verifyKey(oBlake2sChain, "000");
+    ASSURE(iValue == 1);
+
+    memset(aucDataHash, 0xab, sizeof(aucDataHash));
+    iValue = KeyChain_updateKey(oBlake2sChain, "000", aucDataHash);
+    ASSURE(iValue == 1);
+    iValue = KeyChain_verifyKey(oBlake2sChain, "000");
+    ASSURE(iValue == 1);
+
+    // same keys, different trees
+    ASSURE(memcmp(KeyChain_getInterHash(oSha256Chain, "0"),
+                  KeyChain_getInterHash(oBlake2sChain, "0"), 32) != 0);
+
+    KeyChain_free(oSha256Chain);
+    KeyChain_free(oBlake2sChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add the keys 00, 01, 000, 001 and 0010 to oKeyChain */
+
+static void addSmallTree(KeyChain_T oKeyChain)
+{
+    static char *apcParentID[] = {"0", "0", "00", "00", "001"};
+    static char *apcKeyID[] = {"00", "01", "000", "001", "0010"};
+    unsigned char aucKey[KEYLEN] = {0xaa, 0x01, 0x02, 0x03,
+                                    0x04, 0x05, 0x06, 0x07};
+    int iValue;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        aucKey[0] = i;
+        iValue = KeyChain_addKey(oKeyChain, apcParentID[i], apcKeyID[i],
+                                 aucKey, i % 2);
+        ASSURE(iValue == 1);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testEncoding()
+{
+    KeyChain_T oTextChain;
+    KeyChain_T oKeyChain;
+    unsigned long umk = 0x1122334455667788;
+    unsigned char aucKey[KEYLEN] = {0x11, 0x22, 0x33, 0x44,
+                                    0x55, 0x66, 0x77, 0x88};
+    unsigned char aucDataHash[32];
+    unsigned char aucBuf[KEYLEN];
+    unsigned char *pucResult;
+    int iValue;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain record encodings.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oTextChain = KeyChain_new(umk);
+    ASSURE(oTextChain != NULL);
+    addSmallTree(oTextChain);
+    ASSURE(KeyChain_getEncoding(oTextChain) == KEYCHAIN_ENCODING_TEXT);
+
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+    addSmallTree(oKeyChain);
+
+    // data hash on a leaf must survive migration
+    memset(aucDataHash, 0x5a, sizeof(aucDataHash));
+    iValue = KeyChain_updateKey(oTextChain, "01", aucDataHash);
+    ASSURE(iValue == 1);
+    iValue = KeyChain_updateKey(oKeyChain, "01", aucDataHash);
+    ASSURE(iValue == 1);
+
+    ASSURE(KeyChain_setEncoding(oKeyChain, 5) == 0);
+
+    // migrate an existing tree
+    iValue = KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_BINARY);
+    ASSURE(iValue == 1);
+    ASSURE(KeyChain_getEncoding(oKeyChain) == KEYCHAIN_ENCODING_BINARY);
+    ASSURE(memcmp(KeyChain_getInterHash(oTextChain, "0"),
+                  KeyChain_getInterHash(oKeyChain, "0"), 32) != 0);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "01"), 
+                  aucDataHash, 32) == 0);
+
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0") == 1);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "01") == 1);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0010") == 1);
+
+    // mutations under the binary encoding
+    iValue = KeyChain_addKey(oKeyChain, "01", "010", aucKey, 1);
+    ASSURE(iValue == 1);
+    iValue = KeyChain_addKey(oTextChain, "01", "010", aucKey, 1);
+    ASSURE(iValue == 1);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "010") == 1);
+
+    pucResult = KeyChain_getKey(oKeyChain, "010", aucBuf);
+    ASSURE(memcmp(pucResult, aucKey, KEYLEN) == 0);
+
+    iValue = KeyChain_removeKey(oKeyChain, "001");
+    ASSURE(iValue == 1);
+    iValue = KeyChain_removeKey(oTextChain, "001");
+    ASSURE(iValue == 1);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "000") == 1);
+
+    pucResult = KeyChain_getInterHash(oKeyChain, "00");
+    pucResult[0] ^= 0x80;
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "000") == 0);
+    pucResult[0] ^= 0x80;
+
+    // and back again: the same tree as one that was never migrated
+    iValue = KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TEXT);
+    ASSURE(iValue == 1);
+    ASSURE(memcmp(KeyChain_getInterHash(oTextChain, "0"),
+                  KeyChain_getInterHash(oKeyChain, "0"), 32) == 0);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "010") == 1);
+
+    KeyChain_free(oTextChain);
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testCipher()
+{
+    KeyChain_T oKeyChain;
+    unsigned char aucRoot[32];
+    int iEncoding;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain data ciphers.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (iEncoding = KEYCHAIN_ENCODING_TEXT; 
+         iEncoding <= KEYCHAIN_ENCODING_BINARY; iEncoding++) {
+        oKeyChain = KeyChain_new(0x1122334455667788);
+        ASSURE(oKeyChain != NULL);
+        ASSURE(KeyChain_setEncoding(oKeyChain, iEncoding) == 1);
+        addSmallTree(oKeyChain);
+        memcpy(aucRoot, KeyChain_getInterHash(oKeyChain, "0"), 32);
+
+        ASSURE(KeyChain_getCipher(oKeyChain, "01") == KEYCHAIN_CIPHER_XOR);
+        ASSURE(KeyChain_getCipher(oKeyChain, "05") == -1);
+
+        // only known ciphers on leaf keys
+        ASSURE(KeyChain_setCipher(oKeyChain, "00", 
+                                  KEYCHAIN_CIPHER_CHACHA20) == 0);
+        ASSURE(KeyChain_setCipher(oKeyChain, "05", 
+                                  KEYCHAIN_CIPHER_CHACHA20) == 0);
+        ASSURE(KeyChain_setCipher(oKeyChain, "01", 7) == 0);
+        ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"), 
+                      aucRoot, 32) == 0);
+
+        // the cipher is covered by the Merkle tree
+        ASSURE(KeyChain_setCipher(oKeyChain, "001", 
+                                  KEYCHAIN_CIPHER_CHACHA20) == 1);
+        ASSURE(KeyChain_getCipher(oKeyChain, "001") == 
+               KEYCHAIN_CIPHER_CHACHA20);
+        ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"), 
+                      aucRoot, 32) != 0);
+        ASSURE(KeyChain_verifyKey(oKeyChain, "001") == 1);
+        ASSURE(KeyChain_verifyKey(oKeyChain, "0010") == 1);
+
+        // switching back restores the old records
+        ASSURE(KeyChain_setCipher(oKeyChain, "001", 
+                                  KEYCHAIN_CIPHER_XOR) == 1);
+        ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"), 
+                      aucRoot, 32) == 0);
+
+        KeyChain_free(oKeyChain);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add a chain of iDepth keys below "0" ("0a", "0aa", ...) whose key
+   at level i is aucKey with byte 0 replaced by i */
+
+static void addDeepChain(KeyChain_T oKeyChain, int iFirst, int iDepth,
+                         unsigned char *aucKey)
+{
+    char acKeyID[64];
+    char acParentID[64];
+    int iValue;
+    int i;
+
+    memset(acKeyID, 'a', iDepth + 1);
+    acKeyID[0] = '0';
+    for (i = iFirst; i <= iDepth; i++) {
+        memcpy(acParentID, acKeyID, i);
+        acParentID[i] = '\0';
+        acKeyID[i+1] = '\0';
+        aucKey[0] = i;
+        iValue = KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 
+                                 i == iDepth);
+        ASSURE(iValue == 1);
+        acKeyID[i+1] = 'a';
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the keys of the deep chain levels iFirst..iDepth in
+   oKeyChain match aucKey as added by addDeepChain */
+
+static int checkDeepChain(KeyChain_T oKeyChain, int iFirst, int iDepth,
+                          unsigned char *aucKey)
+{
+    unsigned char aucBuf[KEYLEN];
+    char acKeyID[64];
+    int i;
+
+    memset(acKeyID, 'a', iDepth + 1);
+    acKeyID[0] = '0';
+    for (i = iFirst; i <= iDepth; i++) {
+        acKeyID[i+1] = '\0';
+        aucKey[0] = i;
+        if (KeyChain_getKey(oKeyChain, acKeyID, aucBuf) == NULL ||
+            memcmp(aucBuf, aucKey, KEYLEN) != 0)
+            return 0;
+        acKeyID[i+1] = 'a';
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testKeyCache()
+{
+    KeyChain_T oKeyChain;
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    unsigned char aucKey[KEYLEN] = {0x00, 0x9a, 0x8b, 0x7c,
+                                    0x6d, 0x5e, 0x4f, 0x30};
+    unsigned char aucBuf[KEYLEN];
+    unsigned char *pucResult;
+    char acKeyID[3];
+    int iValue;
+    int iRound;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain key cache.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+
+    // the root key is the UMK
+    pucResult = KeyChain_getKey(oKeyChain, "0", aucBuf);
+    ASSURE(pucResult == aucBuf);
+    ASSURE(memcmp(aucBuf, &umk, KEYLEN) == 0);
+
+    addDeepChain(oKeyChain, 1, 40, aucKey);
+
+    // more siblings than the cache has slots
+    strcpy(acKeyID, "0x");
+    aucKey[0] = 0x00;
+    for (i = 0; i < 90; i++) {
+        acKeyID[1] = 'b' + i;
+        aucKey[1] = i;
+        iValue = KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 1);
+        ASSURE(iValue == 1);
+    }
+
+    // cold and warm lookups agree
+    for (iRound = 0; iRound < 3; iRound++) {
+        aucKey[1] = 0x9a;
+        ASSURE(checkDeepChain(oKeyChain, 1, 40, aucKey));
+        for (i = 0; i < 90; i++) {
+            acKeyID[1] = 'b' + i;
+            aucKey[0] = 0x00;
+            aucKey[1] = i;
+            pucResult = KeyChain_getKey(oKeyChain, acKeyID, aucBuf);
+            ASSURE(pucResult != NULL);
+            ASSURE(memcmp(aucBuf, aucKey, KEYLEN) == 0);
+        }
+    }
+
+    // replaced keys must not be served from the cache
+    iValue = KeyChain_removeKey(oKeyChain, "0aaaaaaaaaa");
+    ASSURE(iValue == 1);
+    ASSURE(KeyChain_getKey(oKeyChain, "0aaaaaaaaaaa", aucBuf) == NULL);
+    aucKey[1] = 0xee;
+    addDeepChain(oKeyChain, 10, 40, aucKey);
+    ASSURE(checkDeepChain(oKeyChain, 10, 40, aucKey));
+    aucKey[1] = 0x9a;
+    ASSURE(checkDeepChain(oKeyChain, 1, 9, aucKey));
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testIndex()
+{
+    KeyChain_T oKeyChain;
+    unsigned char aucKey[KEYLEN] = {0x31, 0x41, 0x59, 0x26,
+                                    0x53, 0x58, 0x97, 0x93};
+    unsigned char aucBuf[KEYLEN];
+    char acKeyID[4];
+    char acParentID[4];
+    int iValue;
+    int iRound;
+    int i, j;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain key ID index.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(0x2718281828459045);
+    ASSURE(oKeyChain != NULL);
+
+    // key IDs must extend the parent ID
+    iValue = KeyChain_addKey(oKeyChain, "0", "1a", aucKey, 0);
+    ASSURE(iValue == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "1a") == 0);
+
+    // a wide two level tree, removed and rebuilt so the index fills
+    // up with tombstones
+    acKeyID[0] = '0';
+    acKeyID[3] = '\0';
+    for (iRound = 0; iRound < 4; iRound++) {
+        for (i = 0; i < 40; i++) {
+            acKeyID[1] = 'A' + i;
+            acKeyID[2] = '\0';
+            aucKey[0] = i;
+            iValue = KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0);
+            ASSURE(iValue == 1);
+            strcpy(acParentID, acKeyID);
+            for (j = 0; j < 40; j++) {
+                acKeyID[2] = 'A' + j;
+                aucKey[1] = j + iRound;
+                iValue = KeyChain_addKey(oKeyChain, acParentID, acKeyID,
+                                         aucKey, 1);
+                ASSURE(iValue == 1);
+            }
+        }
+        ASSURE(KeyChain_getNumKeys(oKeyChain) == 40 + 40 * 40);
+
+        for (i = 0; i < 40; i++) {
+            acKeyID[1] = 'A' + i;
+            for (j = 0; j < 40; j++) {
+                acKeyID[2] = 'A' + j;
+                aucKey[0] = i;
+                aucKey[1] = j + iRound;
+                ASSURE(KeyChain_getKey(oKeyChain, acKeyID, aucBuf) != NULL);
+                ASSURE(memcmp(aucBuf, aucKey, KEYLEN) == 0);
+                ASSURE(KeyChain_getType(oKeyChain, acKeyID) == 1);
+            }
+        }
+        ASSURE(KeyChain_verifyKey(oKeyChain, "0AA") == 1);
+
+        // whole subtrees leave the index
+        for (i = 0; i < 40; i++) {
+            acKeyID[1] = 'A' + i;
+            acKeyID[2] = '\0';
+            iValue = KeyChain_removeKey(oKeyChain, acKeyID);
+            ASSURE(iValue == 1);
+            ASSURE(KeyChain_contains(oKeyChain, acKeyID) == 0);
+            acKeyID[2] = 'A' + i;
+            ASSURE(KeyChain_contains(oKeyChain, acKeyID) == 0);
+        }
+        ASSURE(KeyChain_getNumKeys(oKeyChain) == 0);
+        ASSURE(KeyChain_contains(oKeyChain, "0") == 1);
+    }
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testSiblingOrder()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oFreshChain;
+    unsigned char aucKey[KEYLEN] = {0x0a, 0x1b, 0x2c, 0x3d,
+                                    0x4e, 0x5f, 0x60, 0x71};
+    char acKeyID[3] = "0x";
+    char acChildID[4] = "0xy";
+    char *apcKeyIDs[1];
+    unsigned char aucRoot[32];
+    unsigned char *pucProof;
+    size_t uLen;
+    KeyChain_T oLoaded;
+    KeyChain_T oSnapshot;
+    KeyChain_T oTransaction;
+    int iValue;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain sibling order.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // removing keys from the middle of a family must leave the same
+    // tree as never adding them
+    oKeyChain = KeyChain_new(0x0123456789abcdef);
+    oFreshChain = KeyChain_new(0x0123456789abcdef);
+    ASSURE(oKeyChain != NULL && oFreshChain != NULL);
+    for (i = 0; i < 50; i++) {
+        acKeyID[1] = 'A' + i;
+        aucKey[0] = i;
+        iValue = KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0);
+        ASSURE(iValue == 1);
+        if (i % 3 != 0) {
+            iValue = KeyChain_addKey(oFreshChain, "0", acKeyID, aucKey, 0);
+            ASSURE(iValue == 1);
+        }
+
+        // grandchildren move along with their parents
+        acChildID[1] = acKeyID[1];
+        iValue = KeyChain_addKey(oKeyChain, acKeyID, acChildID, aucKey, 1);
+        ASSURE(iValue == 1);
+        if (i % 3 != 0) {
+            iValue = KeyChain_addKey(oFreshChain, acKeyID, acChildID, 
+                                     aucKey, 1);
+            ASSURE(iValue == 1);
+        }
+    }
+    for (i = 0; i < 50; i += 3) {
+        acKeyID[1] = 'A' + i;
+        iValue = KeyChain_removeKey(oKeyChain, acKeyID);
+        ASSURE(iValue == 1);
+    }
+
+    ASSURE(KeyChain_getNumKeys(oKeyChain) == 
+           KeyChain_getNumKeys(oFreshChain));
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oFreshChain, "0"), 32) == 0);
+    for (i = 1; i < 50; i += 3) {
+        acChildID[1] = 'A' + i;
+        ASSURE(KeyChain_verifyKey(oKeyChain, acChildID) == 1);
+        ASSURE(memcmp(KeyChain_getEncryptedKey(oKeyChain, acChildID),
+                      KeyChain_getEncryptedKey(oFreshChain, acChildID),
+                      KEYLEN) == 0);
+    }
+
+    // the removed keys left gaps the siblings are not moved into until
+    // KeyChain_purge(); proofs and later keys must not see them
+    ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+    apcKeyIDs[0] = "0zy";
+    acChildID[1] = 'z';
+    acKeyID[1] = 'z';
+    for (i = 0; i < 2; i++) {
+        iValue = KeyChain_addKey(i ? oFreshChain : oKeyChain, "0",
+                                 acKeyID, aucKey, 0);
+        ASSURE(iValue == 1);
+        iValue = KeyChain_addKey(i ? oFreshChain : oKeyChain, acKeyID,
+                                 acChildID, aucKey, 1);
+        ASSURE(iValue == 1);
+    }
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oFreshChain, "0"), 32) == 0);
+    KeyChain_copyInterHash(oKeyChain, "0", aucRoot);
+    pucProof = KeyChain_prove(oKeyChain, apcKeyIDs, 1, &uLen);
+    ASSURE(pucProof != NULL);
+    ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, "0zy", NULL,
+                                NULL) == 1);
+    free(pucProof);
+
+    // saving closes the gaps in a copy only
+    ASSURE(KeyChain_save(oKeyChain, "testkeychain.snap") == 1);
+    oLoaded = KeyChain_load("testkeychain.snap", 0x0123456789abcdef);
+    ASSURE(oLoaded != NULL);
+    ASSURE(memcmp(KeyChain_getInterHash(oLoaded, "0"), aucRoot, 32) == 0);
+    ASSURE(KeyChain_verifyAll(oLoaded, NULL, 0) == 0);
+    KeyChain_free(oLoaded);
+    remove("testkeychain.snap");
+
+    // the gaps are closed a family at a time, in a transaction too,
+    // while a snapshot keeps them
+    oSnapshot = KeyChain_snapshot(oKeyChain);
+    ASSURE(oSnapshot != NULL);
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(oTransaction != NULL);
+    ASSURE(KeyChain_purge(oTransaction, 1000) == 0);
+    ASSURE(memcmp(KeyChain_getInterHash(oTransaction, "0"), aucRoot,
+                  32) == 0);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 1);
+    for (i = 0; i < 10 && KeyChain_purge(oKeyChain, 1) == 1; i++)
+        ;
+    ASSURE(i < 10);
+    ASSURE(KeyChain_purge(oFreshChain, 4) == 0);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"), aucRoot, 32) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+    ASSURE(memcmp(KeyChain_getInterHash(oSnapshot, "0"), aucRoot, 32) == 0);
+    ASSURE(KeyChain_verifyAll(oSnapshot, NULL, 0) == 0);
+    KeyChain_free(oSnapshot);
+    for (i = 1; i < 50; i += 3) {
+        acChildID[1] = 'A' + i;
+        ASSURE(KeyChain_verifyKey(oKeyChain, acChildID) == 1);
+    }
+
+    // the child tree encoding closes them at once
+    for (i = 2; i < 50; i += 3) {
+        acKeyID[1] = 'A' + i;
+        ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+        ASSURE(KeyChain_removeKey(oFreshChain, acKeyID) == 1);
+    }
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(KeyChain_setEncoding(oFreshChain, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(KeyChain_purge(oKeyChain, 1) == 0);
+    acKeyID[1] = 'B';
+    ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+    ASSURE(KeyChain_removeKey(oFreshChain, acKeyID) == 1);
+    ASSURE(KeyChain_purge(oKeyChain, 1) == 0);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oFreshChain, "0"), 32) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oFreshChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Apply the same mix of adds, removes and data hash updates to 
+   oImmediate and oDeferred, iNumOps operations long, starting at op
+   number iFirst */
+
+static void mutateBoth(KeyChain_T oImmediate, KeyChain_T oDeferred,
+                       int iFirst, int iNumOps)
+{
+    unsigned char aucKey[KEYLEN] = {0x99, 0x88, 0x77, 0x66,
+                                    0x55, 0x44, 0x33, 0x22};
+    unsigned char aucDataHash[32];
+    char acParentID[8];
+    char acKeyID[8];
+    int iOp;
+    int iLen;
+
+    for (iOp = iFirst; iOp < iFirst + iNumOps; iOp++) {
+        // key IDs over a small alphabet, so ops hit existing keys
+        iLen = 1 + iOp % 4;
+        acKeyID[0] = '0';
+        acKeyID[1] = 'a' + (iOp * 7) % 3;
+        acKeyID[2] = 'a' + (iOp * 5) % 4;
+        acKeyID[3] = 'a' + (iOp * 3) % 2;
+        acKeyID[4] = 'a' + iOp % 3;
+        acKeyID[iLen + 1] = '\0';
+        memcpy(acParentID, acKeyID, iLen);
+        acParentID[iLen] = '\0';
+
+        switch (iOp % 5) {
+        case 0:
+        case 1:
+        case 2:
+            aucKey[0] = iOp;
+            ASSURE(KeyChain_addKey(oImmediate, acParentID, acKeyID, aucKey,
+                                   iLen == 4) ==
+                   KeyChain_addKey(oDeferred, acParentID, acKeyID, aucKey,
+                                   iLen == 4));
+            break;
+        case 3:
+            ASSURE(KeyChain_removeKey(oImmediate, acParentID) ==
+                   KeyChain_removeKey(oDeferred, acParentID));
+            break;
+        case 4:
+            memset(aucDataHash, iOp, sizeof(aucDataHash));
+            ASSURE(KeyChain_updateKey(oImmediate, acKeyID, aucDataHash) ==
+                   KeyChain_updateKey(oDeferred, acKeyID, aucDataHash));
+            break;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testDeferred()
+{
+    KeyChain_T oImmediate;
+    KeyChain_T oDeferred;
+    unsigned char aucRoot[32];
+    int iRound;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain deferred hashing.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oImmediate = KeyChain_new(0x5555aaaa5555aaaa);
+    oDeferred = KeyChain_new(0x5555aaaa5555aaaa);
+    ASSURE(oImmediate != NULL && oDeferred != NULL);
+
+    KeyChain_setDeferred(oDeferred, 1);
+    memcpy(aucRoot, KeyChain_getInterHash(oDeferred, "0"), 32);
+
+    // nothing is hashed until the commit
+    mutateBoth(oImmediate, oDeferred, 0, 3);
+    ASSURE(KeyChain_getNumKeys(oDeferred) > 0);
+    KeyChain_commit(oDeferred);
+    ASSURE(memcmp(KeyChain_getInterHash(oImmediate, "0"),
+                  KeyChain_getInterHash(oDeferred, "0"), 32) == 0);
+    ASSURE(memcmp(aucRoot, KeyChain_getInterHash(oDeferred, "0"), 
+                  32) != 0);
+
+    // bursts of changes end up with the same tree
+    for (iRound = 0; iRound < 20; iRound++) {
+        mutateBoth(oImmediate, oDeferred, iRound * 37, 37);
+        switch (iRound % 3) {
+        case 0:
+            KeyChain_commit(oDeferred);
+            break;
+        case 1:
+            // verification commits by itself
+            ASSURE(KeyChain_verifyKey(oDeferred, "0") == 1);
+            break;
+        }
+        // and so does reading an intermediate hash
+        ASSURE(memcmp(KeyChain_getInterHash(oImmediate, "0"),
+                      KeyChain_getInterHash(oDeferred, "0"), 32) == 0);
+        ASSURE(KeyChain_getNumKeys(oImmediate) == 
+               KeyChain_getNumKeys(oDeferred));
+    }
+
+    // turning deferral off commits
+    mutateBoth(oImmediate, oDeferred, 1000, 50);
+    KeyChain_setDeferred(oDeferred, 0);
+    mutateBoth(oImmediate, oDeferred, 1050, 50);
+    ASSURE(memcmp(KeyChain_getInterHash(oImmediate, "0"),
+                  KeyChain_getInterHash(oDeferred, "0"), 32) == 0);
+
+    KeyChain_free(oImmediate);
+    KeyChain_free(oDeferred);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testChildTree()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oRebuiltChain;
+    unsigned char aucKey[KEYLEN] = {0x31, 0x41, 0x59, 0x26,
+                                    0x53, 0x58, 0x97, 0x93};
+    unsigned char aucDataHash[32];
+    unsigned char *pucResult;
+    char acKeyID[3] = "0x";
+    char acChildID[4] = "0xy";
+    int iValue;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain child trees.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // one chain maintains its child trees through every change, the 
+    // other builds them once at the end
+    oKeyChain = KeyChain_new(0x0f1e2d3c4b5a6978);
+    oRebuiltChain = KeyChain_new(0x0f1e2d3c4b5a6978);
+    ASSURE(oKeyChain != NULL && oRebuiltChain != NULL);
+    iValue = KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE);
+    ASSURE(iValue == 1);
+    ASSURE(KeyChain_getEncoding(oKeyChain) == KEYCHAIN_ENCODING_TREE);
+
+    for (i = 0; i < 200; i++) {
+        acKeyID[1] = (char)(i + 1);
+        aucKey[0] = i;
+        iValue = KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0);
+        ASSURE(iValue == 1);
+        iValue = KeyChain_addKey(oRebuiltChain, "0", acKeyID, aucKey, 0);
+        ASSURE(iValue == 1);
+        if (i % 10 == 0) {
+            acChildID[1] = acKeyID[1];
+            iValue = KeyChain_addKey(oKeyChain, acKeyID, acChildID, aucKey, 1);
+            ASSURE(iValue == 1);
+            iValue = KeyChain_addKey(oRebuiltChain, acKeyID, acChildID, 
+                                     aucKey, 1);
+            ASSURE(iValue == 1);
+        }
+    }
+
+    // removals from the middle and the end, down to a quarter
+    for (i = 199; i >= 0; i--) {
+        if (i % 4 == 0 || i > 150)
+            continue;
+        acKeyID[1] = (char)(i + 1);
+        ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+        ASSURE(KeyChain_removeKey(oRebuiltChain, acKeyID) == 1);
+    }
+    for (i = 0; i < 200; i += 20) {
+        acChildID[1] = (char)(i + 1);
+        memset(aucDataHash, i, sizeof(aucDataHash));
+        ASSURE(KeyChain_updateKey(oKeyChain, acChildID, aucDataHash) == 1);
+        ASSURE(KeyChain_updateKey(oRebuiltChain, acChildID, 
+                                  aucDataHash) == 1);
+    }
+
+    iValue = KeyChain_setEncoding(oRebuiltChain, KEYCHAIN_ENCODING_TREE);
+    ASSURE(iValue == 1);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oRebuiltChain, "0"), 32) == 0);
+
+    for (i = 0; i < 200; i += 20) {
+        acChildID[1] = (char)(i + 1);
+        ASSURE(KeyChain_verifyKey(oKeyChain, acChildID) == 1);
+    }
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0") == 1);
+
+    // a tampered key on the path is caught through its child tree
+    acChildID[1] = (char)(40 + 1);
+    pucResult = KeyChain_getInterHash(oKeyChain, acChildID);
+    pucResult[3] ^= 0x01;
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, acChildID) == 0);
+    pucResult[3] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, acChildID) == 1);
+
+    // deferred changes reach the child trees on commit
+    KeyChain_setDeferred(oKeyChain, 1);
+    for (i = 0; i < 200; i += 20) {
+        acChildID[1] = (char)(i + 1);
+        memset(aucDataHash, i + 1, sizeof(aucDataHash));
+        KeyChain_updateKey(oKeyChain, acChildID, aucDataHash);
+        KeyChain_updateKey(oRebuiltChain, acChildID, aucDataHash);
+    }
+    KeyChain_commit(oKeyChain);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oRebuiltChain, "0"), 32) == 0);
+
+    // and the other encodings are unaffected
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TEXT) == 1);
+    ASSURE(KeyChain_setEncoding(oRebuiltChain, KEYCHAIN_ENCODING_TEXT) 
+           == 1);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oRebuiltChain, "0"), 32) == 0);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0") == 1);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oRebuiltChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Fill psRecords with a three level hierarchy under "0" with the key
+   IDs in acIDs, iFanout children per key and pucKey for every key,
+   parents first. Return the number of records. */
+
+static int makeRecords(struct KeyChainRecord *psRecords, char (*acIDs)[5],
+                       unsigned char *pucKey, int iFanout)
+{
+    int iNumRecords = 0;
+    size_t uLen;
+    int iParent;
+    int i;
+
+    // level 1 hangs off the root, every later record off an earlier one
+    for (i = 0; i < iFanout; i++) {
+        sprintf(acIDs[iNumRecords], "0%c", 'A' + i);
+        psRecords[iNumRecords].pcParentKeyID = "0";
+        psRecords[iNumRecords].pcKeyID = acIDs[iNumRecords];
+        psRecords[iNumRecords].pucKey = pucKey;
+        psRecords[iNumRecords].iType = 0;
+        iNumRecords++;
+    }
+    for (iParent = 0; iParent < iFanout * (iFanout + 1); iParent++) {
+        for (i = 0; i < iFanout; i++) {
+            uLen = strlen(acIDs[iParent]);
+            assert(uLen + 2 <= sizeof(acIDs[iNumRecords]));
+            memcpy(acIDs[iNumRecords], acIDs[iParent], uLen);
+            acIDs[iNumRecords][uLen] = 'A' + i;
+            acIDs[iNumRecords][uLen + 1] = '\0';
+            psRecords[iNumRecords].pcParentKeyID = acIDs[iParent];
+            psRecords[iNumRecords].pcKeyID = acIDs[iNumRecords];
+            psRecords[iNumRecords].pucKey = pucKey;
+            psRecords[iNumRecords].iType = iParent >= iFanout;
+            iNumRecords++;
+        }
+    }
+    return iNumRecords;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testAddKeys()
+{
+    enum {FANOUT = 20, NUMRECORDS = FANOUT * (1 + FANOUT + FANOUT*FANOUT)};
+    KeyChain_T oKeyChain;
+    KeyChain_T oBulkChain;
+    struct KeyChainRecord *psRecords;
+    char (*acIDs)[5];
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucRoot[32];
+    unsigned char aucBuf[KEYLEN];
+    char *pcParentKeyID;
+    int iEncoding;
+    int iNumRecords;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain bulk loading.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    psRecords = (struct KeyChainRecord *)malloc(NUMRECORDS * 
+                                                sizeof(*psRecords));
+    acIDs = (char (*)[5])malloc(NUMRECORDS * sizeof(*acIDs));
+    ASSURE(psRecords != NULL && acIDs != NULL);
+    iNumRecords = makeRecords(psRecords, acIDs, aucKey, FANOUT);
+    ASSURE(iNumRecords == NUMRECORDS);
+
+    for (iEncoding = KEYCHAIN_ENCODING_TEXT; 
+         iEncoding <= KEYCHAIN_ENCODING_TREE; iEncoding++) {
+        oKeyChain = KeyChain_new(0x1234123412341234);
+        oBulkChain = KeyChain_new(0x1234123412341234);
+        ASSURE(oKeyChain != NULL && oBulkChain != NULL);
+        KeyChain_setEncoding(oKeyChain, iEncoding);
+        KeyChain_setEncoding(oBulkChain, iEncoding);
+
+        // one key at a time, against the first level one at a time and
+        // the rest in bulk
+        for (i = 0; i < iNumRecords; i++)
+            ASSURE(KeyChain_addKey(oKeyChain, psRecords[i].pcParentKeyID,
+                                   psRecords[i].pcKeyID, aucKey,
+                                   psRecords[i].iType) == 1);
+        for (i = 0; i < FANOUT; i++)
+            ASSURE(KeyChain_addKey(oBulkChain, psRecords[i].pcParentKeyID,
+                                   psRecords[i].pcKeyID, aucKey,
+                                   psRecords[i].iType) == 1);
+
+        // a bad record leaves the keychain as it was
+        memcpy(aucRoot, KeyChain_getInterHash(oBulkChain, "0"), 32);
+        pcParentKeyID = psRecords[iNumRecords - 1].pcParentKeyID;
+        psRecords[iNumRecords - 1].pcParentKeyID = "0Z";
+        ASSURE(KeyChain_addKeys(oBulkChain, psRecords + FANOUT, 
+                                iNumRecords - FANOUT) == 0);
+        psRecords[iNumRecords - 1].pcParentKeyID = pcParentKeyID;
+        ASSURE(KeyChain_getNumKeys(oBulkChain) == FANOUT);
+        ASSURE(!KeyChain_contains(oBulkChain, psRecords[FANOUT].pcKeyID));
+        ASSURE(memcmp(aucRoot, KeyChain_getInterHash(oBulkChain, "0"), 
+                      32) == 0);
+        ASSURE(KeyChain_verifyKey(oBulkChain, psRecords[0].pcKeyID) == 1);
+
+        ASSURE(KeyChain_addKeys(oBulkChain, psRecords + FANOUT, 
+                                iNumRecords - FANOUT) == 1);
+        ASSURE(KeyChain_getNumKeys(oBulkChain) == 
+               KeyChain_getNumKeys(oKeyChain));
+        ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                      KeyChain_getInterHash(oBulkChain, "0"), 32) == 0);
+        ASSURE(KeyChain_verifyKey(oBulkChain, acIDs[iNumRecords - 1]) 
+               == 1);
+        ASSURE(KeyChain_getKey(oBulkChain, acIDs[iNumRecords / 2], aucBuf) 
+               != NULL);
+        ASSURE(memcmp(aucBuf, aucKey, KEYLEN) == 0);
+
+        // the records are all in now
+        ASSURE(KeyChain_addKeys(oBulkChain, psRecords, 1) == 0);
+        ASSURE(KeyChain_addKeys(oBulkChain, psRecords, 0) == 1);
+
+        KeyChain_free(oKeyChain);
+        KeyChain_free(oBulkChain);
+    }
+
+    free(psRecords);
+    free(acIDs);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testVerifyAll()
+{
+    enum {FANOUT = 12, NUMRECORDS = FANOUT * (1 + FANOUT + FANOUT*FANOUT)};
+    KeyChain_T oKeyChain;
+    struct KeyChainRecord *psRecords;
+    char (*acIDs)[5];
+    unsigned char aucKey[KEYLEN] = {0x16, 0x18, 0x03, 0x39,
+                                    0x88, 0x74, 0x98, 0x94};
+    unsigned char *pucInterHash;
+    unsigned char *pucEncKey;
+    char *apcBad[2];
+    int iEncoding;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain whole tree verification.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    psRecords = (struct KeyChainRecord *)malloc(NUMRECORDS * 
+                                                sizeof(*psRecords));
+    acIDs = (char (*)[5])malloc(NUMRECORDS * sizeof(*acIDs));
+    ASSURE(psRecords != NULL && acIDs != NULL);
+    ASSURE(makeRecords(psRecords, acIDs, aucKey, FANOUT) == NUMRECORDS);
+
+    for (iEncoding = KEYCHAIN_ENCODING_TEXT; 
+         iEncoding <= KEYCHAIN_ENCODING_TREE; iEncoding++) {
+        oKeyChain = KeyChain_new(0x0a0b0c0d0e0f0102);
+        ASSURE(oKeyChain != NULL);
+        KeyChain_setEncoding(oKeyChain, iEncoding);
+        ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+        ASSURE(KeyChain_addKeys(oKeyChain, psRecords, NUMRECORDS) == 1);
+        KeyChain_removeKey(oKeyChain, "0BB");
+        ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+        // a changed data hash is caught at its leaf only
+        pucInterHash = KeyChain_getInterHash(oKeyChain, "0CDE");
+        pucInterHash[31] ^= 0x40;
+        ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 1);
+        ASSURE(strcmp(apcBad[0], "0CDE") == 0);
+
+        // a changed key is reported before the leaf below it
+        pucEncKey = KeyChain_getEncryptedKey(oKeyChain, "0C");
+        pucEncKey[0] ^= 0x01;
+        ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 2);
+        ASSURE(strcmp(apcBad[0], "0C") == 0);
+        ASSURE(strcmp(apcBad[1], "0CDE") == 0);
+        ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 1) == 2);
+        ASSURE(strcmp(apcBad[0], "0C") == 0);
+
+        pucEncKey[0] ^= 0x01;
+        pucInterHash[31] ^= 0x40;
+        ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+
+        KeyChain_free(oKeyChain);
+    }
+
+    free(psRecords);
+    free(acIDs);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testVerifyCache()
+{
+    KeyChain_T oKeyChain;
+    unsigned char aucKey[KEYLEN] = {0x14, 0x14, 0x21, 0x35,
+                                    0x62, 0x37, 0x30, 0x95};
+    unsigned char aucDataHash[32];
+    unsigned char *pucInterHash;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain verified path cache.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(0x7766554433221100);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0a", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0a", "0ab", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0ab", "0abc", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0x", aucKey, 1) == 1);
+
+    pucInterHash = KeyChain_getInterHash(oKeyChain, "0ab");
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+
+    // a verified path is taken on trust until it changes, so this
+    // write goes unnoticed by all but a full check
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0abc") == 0);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+
+    // a change elsewhere in the tree changes the root
+    memset(aucDataHash, 0x11, sizeof(aucDataHash));
+    ASSURE(KeyChain_updateKey(oKeyChain, "0x", aucDataHash) == 1);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 0);
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0abc") == 1);
+
+    // asking for a pointer into the path is no change, so writes
+    // through it need a full check too
+    pucInterHash = KeyChain_getInterHash(oKeyChain, "0a");
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0abc") == 0);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0x") == 1);
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0abc") == 1);
+
+    // reading a copy does not
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0a", aucDataHash) != NULL);
+    ASSURE(memcmp(aucDataHash, pucInterHash, 32) == 0);
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 1);
+    pucInterHash[0] ^= 0x01;
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0q", aucDataHash) == NULL);
+
+    // a removed and re-added key starts unverified
+    ASSURE(KeyChain_removeKey(oKeyChain, "0abc") == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0ab", "0abc", aucKey, 1) == 1);
+    KeyChain_getEncryptedKey(oKeyChain, "0abc")[0] ^= 0x01;
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0abc") == 0);
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testSnapshot()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oLoaded;
+    KeyChain_T oReloaded;
+    char *pcSpine = "0abcdefghijklmnopqrstuvw";
+    unsigned char aucKey[KEYLEN] = {0x31, 0x41, 0x59, 0x26,
+                                    0x53, 0x58, 0x97, 0x93};
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucRoot[32];
+    char acParentID[32];
+    char acKeyID[sizeof(acParentID) + 1];
+    char *apcBad[4];
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain snapshots.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(0x0123456789abcdef);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+
+    // a spine deep enough for long key IDs, with a leaf off every node
+    for (i = 1; i < (int)strlen(pcSpine); i++) {
+        aucKey[0] = i;
+        sprintf(acParentID, "%.*s", i, pcSpine);
+        sprintf(acKeyID, "%.*s", i + 1, pcSpine);
+        ASSURE(KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 0)
+               == 1);
+        sprintf(acKeyID, "%.*sX", i, pcSpine);
+        ASSURE(KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 1)
+               == 1);
+    }
+    ASSURE(KeyChain_setCipher(oKeyChain, "0abcX",
+                              KEYCHAIN_CIPHER_CHACHA20) == 1);
+    ASSURE(KeyChain_removeKey(oKeyChain, "0abcdefX") == 1);
+    ASSURE(KeyChain_save(oKeyChain, "testkeychain.snap") == 1);
+    memcpy(aucRoot, KeyChain_getInterHash(oKeyChain, "0"), 32);
+
+    // the loaded chain is the saved one
+    oLoaded = KeyChain_load("testkeychain.snap", 0x0123456789abcdef);
+    ASSURE(oLoaded != NULL);
+    ASSURE(KeyChain_getNumKeys(oLoaded) == KeyChain_getNumKeys(oKeyChain));
+    ASSURE(KeyChain_getEncoding(oLoaded) == KEYCHAIN_ENCODING_TREE);
+    ASSURE(memcmp(KeyChain_getInterHash(oLoaded, "0"), aucRoot, 32) == 0);
+    ASSURE(KeyChain_getCipher(oLoaded, "0abcX") ==
+           KEYCHAIN_CIPHER_CHACHA20);
+    ASSURE(KeyChain_getKey(oLoaded, "0abcdefghijklmnopqrsX", aucOut)
+           != NULL);
+    ASSURE(memcmp(aucOut, KeyChain_getKey(oKeyChain,
+                  "0abcdefghijklmnopqrsX", aucKey), KEYLEN) == 0);
+    ASSURE(KeyChain_getKey(oLoaded, "0abcdefX", aucOut) == NULL);
+    ASSURE(KeyChain_verifyKey(oLoaded, pcSpine) == 1);
+    ASSURE(KeyChain_verifyKey(oLoaded, "0abcX") == 1);
+    ASSURE(KeyChain_verifyAll(oLoaded, apcBad, 4) == 0);
+
+    // and changes the same way, past the size of the mapping
+    for (i = 0; i < 200; i++) {
+        sprintf(acParentID, "%.*s", 1 + i % 23, pcSpine);
+        snprintf(acKeyID, sizeof(acKeyID), "%s%c", acParentID,
+                 'A' + i / 23);
+        memset(aucKey, i, KEYLEN);
+        ASSURE(KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 1)
+               == KeyChain_addKey(oLoaded, acParentID, acKeyID, aucKey, 1));
+    }
+    ASSURE(KeyChain_removeKey(oKeyChain, "0abcdefghijklmnopqrstuvX") ==
+           KeyChain_removeKey(oLoaded, "0abcdefghijklmnopqrstuvX"));
+    ASSURE(KeyChain_removeKey(oKeyChain, "0abcdefghijklmnopq") ==
+           KeyChain_removeKey(oLoaded, "0abcdefghijklmnopq"));
+    mutateBoth(oKeyChain, oLoaded, 0, 100);
+    ASSURE(KeyChain_getNumKeys(oLoaded) == KeyChain_getNumKeys(oKeyChain));
+    ASSURE(memcmp(KeyChain_getInterHash(oLoaded, "0"),
+                  KeyChain_getInterHash(oKeyChain, "0"), 32) == 0);
+    ASSURE(KeyChain_verifyAll(oLoaded, apcBad, 4) ==
+           KeyChain_verifyAll(oKeyChain, apcBad, 4));
+
+    // the file is left as it was saved
+    oReloaded = KeyChain_load("testkeychain.snap", 0x0123456789abcdef);
+    ASSURE(oReloaded != NULL);
+    ASSURE(memcmp(KeyChain_getInterHash(oReloaded, "0"), aucRoot, 32) == 0);
+    KeyChain_free(oReloaded);
+
+    // the root key is not in the file
+    oReloaded = KeyChain_load("testkeychain.snap", 0x1123456789abcdef);
+    ASSURE(oReloaded != NULL);
+    ASSURE(KeyChain_verifyKey(oReloaded, "0abcX") == 0);
+    KeyChain_free(oReloaded);
+
+    ASSURE(KeyChain_load("testkeychain.nosnap", 0) == NULL);
+    ASSURE(KeyChain_load("file.txt", 0) == NULL);
+
+    KeyChain_free(oLoaded);
+    KeyChain_free(oKeyChain);
+    remove("testkeychain.snap");
+}
+
+/*--------------------------------------------------------------------*/
+
+/* A thread adding keys under a lock and syncing each one */
+struct JournalWriter
+{
+    KeyChain_T oKeyChain;
+    pthread_mutex_t *psLock;
+    int iWriter;
+    int iFailed;
+};
+
+#define WRITERS     4
+#define WRITERKEYS  25
+
+static void *journalWriter(void *pvWriter)
+{
+    struct JournalWriter *psWriter = (struct JournalWriter *)pvWriter;
+    unsigned char aucKey[KEYLEN] = {0};
+    char acParentID[3];
+    char acKeyID[4];
+    int i;
+
+    sprintf(acParentID, "0%c", 'P' + psWriter->iWriter);
+    for (i = 0; i < WRITERKEYS; i++) {
+        sprintf(acKeyID, "%s%c", acParentID, 'a' + i);
+        aucKey[0] = i;
+        pthread_mutex_lock(psWriter->psLock);
+        if (!KeyChain_addKey(psWriter->oKeyChain, acParentID, acKeyID,
+                             aucKey, 1))
+            psWriter->iFailed = 1;
+        pthread_mutex_unlock(psWriter->psLock);
+        if (!KeyChain_sync(psWriter->oKeyChain))
+            psWriter->iFailed = 1;
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Read up to uLen bytes of the file pcFileName into pcBuf and return
+   the number read */
+static size_t readFile(const char *pcFileName, char *pcBuf, size_t uLen)
+{
+    FILE *fp = fopen(pcFileName, "rb");
+    size_t uRead;
+
+    ASSURE(fp != NULL);
+    uRead = fread(pcBuf, 1, uLen, fp);
+    fclose(fp);
+    return uRead;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Replace the file pcFileName by the uLen bytes at pcBuf, or append
+   them if iAppend */
+static void writeFile(const char *pcFileName, const char *pcBuf,
+                      size_t uLen, int iAppend)
+{
+    FILE *fp = fopen(pcFileName, iAppend ? "ab" : "wb");
+
+    ASSURE(fp != NULL);
+    ASSURE(fwrite(pcBuf, 1, uLen, fp) == uLen);
+    fclose(fp);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if oKeyChain and oReference have the same keys and root */
+static int sameChain(KeyChain_T oKeyChain, KeyChain_T oReference)
+{
+    return KeyChain_getNumKeys(oKeyChain) ==
+               KeyChain_getNumKeys(oReference) &&
+           memcmp(KeyChain_getInterHash(oKeyChain, "0"),
+                  KeyChain_getInterHash(oReference, "0"), 32) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testJournal()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oReference;
+    struct KeyChainRecord asRecords[64];
+    struct JournalWriter asWriters[WRITERS];
+    pthread_t asThreads[WRITERS];
+    pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucRoot[32];
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    char acIDs[64][5];
+    char acKeyID[3];
+    static char acJournal[1 << 16];
+    size_t uJournalLen;
+    int iNumRecords;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain journal.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    remove("testkeychain.jnl");
+    remove("testkeychain.snap");
+
+    // every kind of change survives a restart from the journal alone
+    oKeyChain = KeyChain_new(umk);
+    oReference = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL && oReference != NULL);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(KeyChain_setEncoding(oReference, KEYCHAIN_ENCODING_TREE) == 1);
+    iNumRecords = makeRecords(asRecords, acIDs, aucKey, 3);
+    ASSURE(KeyChain_addKeys(oKeyChain, asRecords, iNumRecords) == 1);
+    ASSURE(KeyChain_addKeys(oReference, asRecords, iNumRecords) == 1);
+    ASSURE(KeyChain_setCipher(oKeyChain, "0ABC",
+                              KEYCHAIN_CIPHER_CHACHA20) == 1);
+    ASSURE(KeyChain_setCipher(oReference, "0ABC",
+                              KEYCHAIN_CIPHER_CHACHA20) == 1);
+    mutateBoth(oKeyChain, oReference, 0, 150);
+    ASSURE(KeyChain_sync(oKeyChain) == 1);
+    KeyChain_free(oKeyChain);
+
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(sameChain(oKeyChain, oReference));
+    ASSURE(KeyChain_getEncoding(oKeyChain) == KEYCHAIN_ENCODING_TREE);
+    ASSURE(KeyChain_getCipher(oKeyChain, "0ABC") ==
+           KEYCHAIN_CIPHER_CHACHA20);
+    ASSURE(KeyChain_getKey(oKeyChain, "0BCA", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, KeyChain_getKey(oReference, "0BCA", aucKey),
+                  KEYLEN) == 0);
+
+    // after a checkpoint the journal continues the snapshot
+    ASSURE(KeyChain_checkpoint(oKeyChain, "testkeychain.snap") == 1);
+    mutateBoth(oKeyChain, oReference, 150, 100);
+    KeyChain_free(oKeyChain);
+
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(sameChain(oKeyChain, oReference));
+
+    // a torn record at the end is dropped, and later ones follow the
+    // last whole record
+    KeyChain_free(oKeyChain);
+    writeFile("testkeychain.jnl", "\x09\x00\x00", 3, 1);
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(sameChain(oKeyChain, oReference));
+    mutateBoth(oKeyChain, oReference, 250, 20);
+    KeyChain_free(oKeyChain);
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(sameChain(oKeyChain, oReference));
+
+    // a crash between the new snapshot and the emptied journal leaves
+    // a journal that is already part of the snapshot
+    uJournalLen = readFile("testkeychain.jnl", acJournal, sizeof(acJournal));
+    ASSURE(uJournalLen < sizeof(acJournal));
+    ASSURE(KeyChain_checkpoint(oKeyChain, "testkeychain.snap") == 1);
+    KeyChain_free(oKeyChain);
+    writeFile("testkeychain.jnl", acJournal, uJournalLen, 0);
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(sameChain(oKeyChain, oReference));
+    KeyChain_free(oKeyChain);
+
+    // a journal does not apply to an older snapshot
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 0);
+    KeyChain_free(oKeyChain);
+
+    // writers on several threads share syncs
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    for (i = 0; i < WRITERS; i++) {
+        sprintf(acKeyID, "0%c", 'P' + i);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0) == 1);
+        asWriters[i].oKeyChain = oKeyChain;
+        asWriters[i].psLock = &sLock;
+        asWriters[i].iWriter = i;
+        asWriters[i].iFailed = 0;
+    }
+    for (i = 0; i < WRITERS; i++)
+        ASSURE(pthread_create(&asThreads[i], NULL, journalWriter,
+                              &asWriters[i]) == 0);
+    for (i = 0; i < WRITERS; i++) {
+        pthread_join(asThreads[i], NULL);
+        ASSURE(!asWriters[i].iFailed);
+    }
+    memcpy(aucRoot, KeyChain_getInterHash(oKeyChain, "0"), 32);
+    iNumRecords = KeyChain_getNumKeys(oKeyChain);
+    KeyChain_free(oKeyChain);
+
+    oKeyChain = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) == iNumRecords);
+    ASSURE(memcmp(KeyChain_getInterHash(oKeyChain, "0"), aucRoot, 32) == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0Sy"));
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oReference);
+    remove("testkeychain.jnl");
+    remove("testkeychain.snap");
+}
+
+/*--------------------------------------------------------------------*/
+
+/* A thread reading keys that stay put while another thread changes
+   the keychain around them */
+struct ConcurrentReader
+{
+    KeyChain_T oKeyChain;
+    int *piDone;
+    int iFailed;
+};
+
+#define READERS     4
+#define SPINEDEPTH  20
+#define CHURNKEYS   600
+#define CHURNLIVE   8
+
+/* Last characters of the key IDs the writer adds and removes */
+static const char acChurn[] = "ABCDEFGHIJKLMNOPQRSTUVWXYbcdefghijklmnopqrstuvwxy";
+
+static void *concurrentReader(void *pvReader)
+{
+    struct ConcurrentReader *psReader = (struct ConcurrentReader *)pvReader;
+    KeyChain_T oKeyChain = psReader->oKeyChain;
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucOut[KEYLEN];
+    char acLeafID[SPINEDEPTH + 2];
+
+    memset(acLeafID, 'a', SPINEDEPTH + 1);
+    acLeafID[0] = '0';
+    acLeafID[SPINEDEPTH + 1] = '\0';
+    while (!__atomic_load_n(psReader->piDone, __ATOMIC_ACQUIRE)) {
+        aucKey[0] = 1;
+        if (KeyChain_getKey(oKeyChain, "0a", aucOut) == NULL ||
+            memcmp(aucOut, aucKey, KEYLEN) != 0)
+            psReader->iFailed = 1;
+        aucKey[0] = SPINEDEPTH;
+        if (KeyChain_getKey(oKeyChain, acLeafID, aucOut) == NULL ||
+            memcmp(aucOut, aucKey, KEYLEN) != 0)
+            psReader->iFailed = 1;
+        aucKey[0] = 'z';
+        if (KeyChain_getKey(oKeyChain, "0z", aucOut) == NULL ||
+            memcmp(aucOut, aucKey, KEYLEN) != 0)
+            psReader->iFailed = 1;
+        if (KeyChain_verifyKey(oKeyChain, acLeafID) != 1 ||
+            KeyChain_verifyKeyFull(oKeyChain, "0z") != 1 ||
+            !KeyChain_contains(oKeyChain, "0a") ||
+            KeyChain_getType(oKeyChain, "0z") != 1)
+            psReader->iFailed = 1;
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testConcurrentReaders()
+{
+    KeyChain_T oKeyChain;
+    struct ConcurrentReader asReaders[READERS];
+    pthread_t asThreads[READERS];
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucHash[32];
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    char acLeafID[SPINEDEPTH + 2];
+    char acSpineID[16];
+    char acKeyID[64];
+    int iDone = 0;
+    int iNumChurn = sizeof(acChurn) - 1;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain readers concurrent with a writer.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // the spine ends in a long ID; "0z" lands after siblings that the
+    // writer removes, so it moves down while readers look it up
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    addDeepChain(oKeyChain, 1, SPINEDEPTH, aucKey);
+    memset(acLeafID, 'a', SPINEDEPTH + 1);
+    acLeafID[0] = '0';
+    acLeafID[SPINEDEPTH + 1] = '\0';
+    memcpy(acSpineID, acLeafID, 15);
+    acSpineID[15] = '\0';
+    for (i = 0; i < CHURNLIVE; i++) {
+        sprintf(acKeyID, "0%c", acChurn[i]);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0) == 1);
+    }
+    aucKey[0] = 'z';
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0z", aucKey, 1) == 1);
+
+    for (i = 0; i < READERS; i++) {
+        asReaders[i].oKeyChain = oKeyChain;
+        asReaders[i].piDone = &iDone;
+        asReaders[i].iFailed = 0;
+        ASSURE(pthread_create(&asThreads[i], NULL, concurrentReader,
+                              &asReaders[i]) == 0);
+    }
+
+    // keys come and go beside the stable ones, growing and shrinking
+    // the arrays, the index and the child trees under the readers
+    // keys come and go beside the stable ones, at the root and with
+    // long IDs beside the spine, growing and shrinking the arrays, the
+    // index and the child trees under the readers
+    for (i = CHURNLIVE; i < CHURNKEYS; i++) {
+        sprintf(acKeyID, "0%c", acChurn[i % iNumChurn]);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", acKeyID, aucKey, 0) == 1);
+        sprintf(acKeyID, "0%c", acChurn[(i - CHURNLIVE) % iNumChurn]);
+        ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+
+        sprintf(acKeyID, "%s%c", acSpineID, acChurn[i % iNumChurn]);
+        ASSURE(KeyChain_addKey(oKeyChain, acSpineID, acKeyID, aucKey,
+                               1) == 1);
+        sprintf(acKeyID, "%s%c", acSpineID,
+                acChurn[(i - CHURNLIVE) % iNumChurn]);
+        if (i >= 2 * CHURNLIVE)
+            ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+
+        memset(aucHash, i, sizeof(aucHash));
+        ASSURE(KeyChain_updateKey(oKeyChain, acLeafID, aucHash) == 1);
+        ASSURE(KeyChain_updateKey(oKeyChain, "0z", aucHash) == 1);
+    }
+    __atomic_store_n(&iDone, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < READERS; i++) {
+        pthread_join(asThreads[i], NULL);
+        ASSURE(!asReaders[i].iFailed);
+    }
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, acLeafID) == 1);
+    ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* A thread updating the leaves of its own subtree */
+struct ConcurrentUpdater
+{
+    KeyChain_T oKeyChain;
+    int iUpdater;
+    int iFailed;
+};
+
+#define UPDATERS       4
+#define UPDATERLEAVES  16
+#define UPDATERROUNDS  300
+
+/* Place the intermediate hash that updater iUpdater writes in round
+   iRound in pucHash */
+static void updaterHash(int iUpdater, int iRound, unsigned char *pucHash)
+{
+    memset(pucHash, iRound, 32);
+    pucHash[0] = iUpdater;
+    pucHash[1] = iRound >> 8;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *concurrentUpdater(void *pvUpdater)
+{
+    struct ConcurrentUpdater *psUpdater =
+        (struct ConcurrentUpdater *)pvUpdater;
+    unsigned char aucHash[32];
+    char acKeyID[4];
+    int i;
+
+    for (i = 0; i < UPDATERROUNDS; i++) {
+        sprintf(acKeyID, "0%c%c", 'A' + psUpdater->iUpdater,
+                'a' + i % UPDATERLEAVES);
+        updaterHash(psUpdater->iUpdater, i, aucHash);
+        if (KeyChain_updateKey(psUpdater->oKeyChain, acKeyID, aucHash) != 1)
+            psUpdater->iFailed = 1;
+
+        // a missing key fails alone, not the batch it lands in
+        if (i % 50 == 0 &&
+            KeyChain_updateKey(psUpdater->oKeyChain, "0Zz", aucHash) != 0)
+            psUpdater->iFailed = 1;
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add to oKeyChain a subtree of UPDATERLEAVES leaves for each
+   updater */
+static void addUpdaterTrees(KeyChain_T oKeyChain, unsigned char *aucKey)
+{
+    char acParentID[3];
+    char acKeyID[4];
+    int i;
+    int j;
+
+    for (i = 0; i < UPDATERS; i++) {
+        sprintf(acParentID, "0%c", 'A' + i);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", acParentID, aucKey, 0) == 1);
+        for (j = 0; j < UPDATERLEAVES; j++) {
+            sprintf(acKeyID, "%s%c", acParentID, 'a' + j);
+            ASSURE(KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey,
+                                   1) == 1);
+        }
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testConcurrentWriters()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oReference;
+    struct ConcurrentUpdater asUpdaters[UPDATERS];
+    pthread_t asThreads[UPDATERS];
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucHash[32];
+    unsigned char aucRoot[32];
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    char acKeyID[4];
+    int iDeferred;
+    int iRound;
+    int i;
+    int j;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain concurrent writers.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // however the updates are batched, the result matches applying
+    // the last update of every leaf in turn
+    for (iDeferred = 0; iDeferred <= 1; iDeferred++) {
+        oKeyChain = KeyChain_new(umk);
+        oReference = KeyChain_new(umk);
+        ASSURE(oKeyChain != NULL && oReference != NULL);
+        ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+        ASSURE(KeyChain_setEncoding(oReference,
+                                    KEYCHAIN_ENCODING_TREE) == 1);
+        addUpdaterTrees(oKeyChain, aucKey);
+        addUpdaterTrees(oReference, aucKey);
+        KeyChain_setDeferred(oKeyChain, iDeferred);
+
+        for (i = 0; i < UPDATERS; i++) {
+            asUpdaters[i].oKeyChain = oKeyChain;
+            asUpdaters[i].iUpdater = i;
+            asUpdaters[i].iFailed = 0;
+            ASSURE(pthread_create(&asThreads[i], NULL, concurrentUpdater,
+                                  &asUpdaters[i]) == 0);
+        }
+        for (i = 0; i < UPDATERS; i++) {
+            pthread_join(asThreads[i], NULL);
+            ASSURE(!asUpdaters[i].iFailed);
+        }
+
+        for (i = 0; i < UPDATERS; i++) {
+            for (j = 0; j < UPDATERLEAVES; j++) {
+                sprintf(acKeyID, "0%c%c", 'A' + i, 'a' + j);
+                iRound = UPDATERROUNDS - 1 -
+                         (UPDATERROUNDS - 1 - j) % UPDATERLEAVES;
+                updaterHash(i, iRound, aucHash);
+                ASSURE(KeyChain_updateKey(oReference, acKeyID,
+                                          aucHash) == 1);
+            }
+        }
+        ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+        ASSURE(memcmp(aucRoot, KeyChain_getInterHash(oReference, "0"),
+                      32) == 0);
+        ASSURE(KeyChain_verifyAll(oKeyChain, NULL, 0) == 0);
+        ASSURE(KeyChain_verifyKey(oKeyChain, "0Dp") == 1);
+
+        KeyChain_free(oKeyChain);
+        KeyChain_free(oReference);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+#define FLATKEYS  1000
+
+static void testKeyPaths()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oReplayed;
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucRoot[32];
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    unsigned int auPath[3];
+    unsigned int auBack[3];
+    unsigned int auValues[] = {1, 'a', 254, 255, 256, 65535, 65536,
+                               4000000000U, 0xffffffffU};
+    char acKeyID[KEYCHAIN_KEYIDLEN(3)];
+    char *apcBad[2];
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain key paths.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // components round trip, and small ones are plain characters
+    for (i = 0; i < (int)(sizeof(auValues) / sizeof(auValues[0])); i++) {
+        auPath[0] = auValues[i];
+        auPath[1] = 'b';
+        auPath[2] = auValues[i];
+        ASSURE(KeyChain_pathKeyID(auPath, 3, acKeyID) == acKeyID);
+        ASSURE(strlen(acKeyID) < sizeof(acKeyID));
+        ASSURE(KeyChain_keyIDPath(acKeyID, auBack, 3) == 3);
+        ASSURE(memcmp(auPath, auBack, sizeof(auPath)) == 0);
+    }
+    auPath[0] = 'a';
+    auPath[1] = 'b';
+    ASSURE(strcmp(KeyChain_pathKeyID(auPath, 2, acKeyID), "0ab") == 0);
+    ASSURE(strcmp(KeyChain_pathKeyID(auPath, 0, acKeyID), "0") == 0);
+    auPath[1] = 0;
+    ASSURE(KeyChain_pathKeyID(auPath, 2, acKeyID) == NULL);
+
+    // malformed IDs: a cut off component, a long form of a short one,
+    // no root, and more components than room
+    ASSURE(KeyChain_keyIDPath("0a\xff\x02\x01", auBack, 3) == -1);
+    ASSURE(KeyChain_keyIDPath("0\xff\x01\x61", auBack, 3) == -1);
+    ASSURE(KeyChain_keyIDPath("ab", auBack, 3) == -1);
+    ASSURE(KeyChain_keyIDPath("0abcd", auBack, 3) == -1);
+    ASSURE(KeyChain_keyIDPath("0", auBack, 3) == 0);
+
+    // a flat tree far wider than one character per level allows
+    remove("testkeychain.jnl");
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    for (i = 1; i <= FLATKEYS; i++) {
+        auPath[0] = i * 1000;
+        aucKey[0] = i;
+        aucKey[1] = i >> 8;
+        ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 1, aucKey, 0) == 1);
+    }
+    auPath[0] = 500 * 1000;
+    auPath[1] = 70000;
+    ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 2, aucKey, 1) == 1);
+    ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 2, aucKey, 1) == 0);
+    auPath[0] = 7;
+    ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 2, aucKey, 1) == 0);
+
+    auPath[0] = 777 * 1000;
+    KeyChain_pathKeyID(auPath, 1, acKeyID);
+    aucKey[0] = 777 & 0xff;
+    aucKey[1] = 777 >> 8;
+    ASSURE(KeyChain_getKey(oKeyChain, acKeyID, aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucKey, KEYLEN) == 0);
+    ASSURE(KeyChain_verifyKey(oKeyChain, acKeyID) == 1);
+    ASSURE(KeyChain_removeKey(oKeyChain, acKeyID) == 1);
+    ASSURE(KeyChain_contains(oKeyChain, acKeyID) == 0);
+
+    // the added child sits one level down, whatever its ID length
+    auPath[0] = 500 * 1000;
+    auPath[1] = 70000;
+    KeyChain_pathKeyID(auPath, 2, acKeyID);
+    ASSURE(KeyChain_getType(oKeyChain, acKeyID) == 1);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, acKeyID) == 1);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) == FLATKEYS);
+
+    // the journal finds the parent of a multi-byte component
+    ASSURE(KeyChain_sync(oKeyChain) == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    oReplayed = KeyChain_new(umk);
+    ASSURE(KeyChain_openJournal(oReplayed, "testkeychain.jnl") == 1);
+    ASSURE(memcmp(KeyChain_getInterHash(oReplayed, "0"), aucRoot,
+                  32) == 0);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oReplayed);
+    remove("testkeychain.jnl");
+}
+
+/*--------------------------------------------------------------------*/
+
+#define TENANTFANOUT  40
+#define TENANTDEPTH   30
+
+/* Add to oKeyChain a tenant key "0" cTenant with TENANTFANOUT children
+   of TENANTFANOUT leaves each, and a spine TENANTDEPTH deep below its
+   first child. Return 1 if all keys were added, 0 otherwise. */
+static int addTenant(KeyChain_T oKeyChain, char cTenant)
+{
+    unsigned char aucKey[KEYLEN] = {0x16, 0x18, 0x03, 0x39,
+                                    0x88, 0x74, 0x98, 0x94};
+    char acTenantID[3] = {'0', cTenant, '\0'};
+    char acParentID[TENANTDEPTH + 4] = {'0', cTenant};
+    char acKeyID[TENANTDEPTH + 4] = {'0', cTenant};
+    int iOK;
+    int i;
+    int j;
+
+    iOK = KeyChain_addKey(oKeyChain, "0", acTenantID, aucKey, 0);
+    for (i = 0; i < TENANTFANOUT; i++) {
+        acParentID[2] = i + 1;
+        aucKey[0] = i;
+        iOK &= KeyChain_addKey(oKeyChain, acTenantID, acParentID, aucKey,
+                               0);
+        for (j = 0; j < TENANTFANOUT; j++) {
+            memcpy(acKeyID, acParentID, 3);
+            acKeyID[3] = j + 1;
+            aucKey[1] = j;
+            iOK &= KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey,
+                                   1);
+        }
+    }
+
+    // "0t\x01z", "0t\x01zz", ...
+    acKeyID[2] = 1;
+    acKeyID[3] = '\0';
+    for (i = 3; i < TENANTDEPTH + 3; i++) {
+        memcpy(acParentID, acKeyID, i + 1);
+        acKeyID[i] = 'z';
+        acKeyID[i + 1] = '\0';
+        iOK &= KeyChain_addKey(oKeyChain, acParentID, acKeyID, aucKey, 0);
+    }
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Purge the revoked keys of the keychain pvKeyChain in small slices */
+static void *purgeRevoked(void *pvKeyChain)
+{
+    while (KeyChain_purge((KeyChain_T)pvKeyChain, 16))
+        ;
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testRevocation()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oReference;
+    pthread_t sPurger;
+    unsigned char aucKey[KEYLEN] = {0x14, 0x14, 0x21, 0x35,
+                                    0x62, 0x37, 0x30, 0x95};
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucRoot[32];
+    unsigned char aucRefRoot[32];
+    unsigned long umk = 0x1122334455667788;
+    char acKeyID[] = "0u?";
+    char *apcBad[2];
+    int iSlices;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain revocation.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // the reference removes what the keychain revokes
+    oKeyChain = KeyChain_new(umk);
+    oReference = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL && oReference != NULL);
+    ASSURE(addTenant(oKeyChain, 't') == 1);
+    ASSURE(addTenant(oReference, 't') == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0u", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0", "0u", aucKey, 0) == 1);
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0") == 0);
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0x") == 0);
+    ASSURE(KeyChain_purge(oKeyChain, 1) == 0);
+
+    // the subtree is gone at once, and the root hash with it
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0t") == 1);
+    ASSURE(KeyChain_removeKey(oReference, "0t") == 1);
+    ASSURE(KeyChain_contains(oKeyChain, "0t") == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05") == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05\x07") == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, "0t\x01zzz", aucOut) == NULL);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0t\x05\x07") == 0);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucRefRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucRefRoot, 32) == 0);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) >
+           KeyChain_getNumKeys(oReference));
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // revoked IDs can be reused before the purge, without bringing
+    // back the old descendants
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0t", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0t", "0t\x05", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0", "0t", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0t", "0t\x05", aucKey, 1) == 1);
+    ASSURE(KeyChain_getKey(oKeyChain, "0t\x05", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucKey, KEYLEN) == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05\x07") == 0);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0t\x05") == 1);
+
+    // bounded slices release the rest
+    for (iSlices = 1; KeyChain_purge(oKeyChain, 100); iSlices++)
+        ;
+    ASSURE(iSlices > 1);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) ==
+           KeyChain_getNumKeys(oReference));
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05") == 1);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // a background thread purges while keys are added
+    ASSURE(addTenant(oKeyChain, 'v') == 1);
+    ASSURE(addTenant(oReference, 'v') == 1);
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0v") == 1);
+    ASSURE(KeyChain_removeKey(oReference, "0v") == 1);
+    ASSURE(pthread_create(&sPurger, NULL, purgeRevoked, oKeyChain) == 0);
+    for (i = 1; i <= 100; i++) {
+        acKeyID[2] = i;
+        ASSURE(KeyChain_addKey(oKeyChain, "0u", acKeyID, aucKey, 1) == 1);
+        ASSURE(KeyChain_addKey(oReference, "0u", acKeyID, aucKey, 1) == 1);
+        ASSURE(KeyChain_contains(oKeyChain, "0v\x02\x02") == 0);
+    }
+    pthread_join(sPurger, NULL);
+    ASSURE(KeyChain_purge(oKeyChain, 1) == 0);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) ==
+           KeyChain_getNumKeys(oReference));
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucRefRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucRefRoot, 32) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oReference);
+}
+
+/*--------------------------------------------------------------------*/
+
+#define ROTATEKEYS  2000
+
+/* Add to oKeyChain the key "0a" with the plaintext key pucKey and
+   ROTATEKEYS children below it, the first with a leaf of its own.
+   Return 1 if all keys were added, 0 otherwise. */
+static int addRotated(KeyChain_T oKeyChain, unsigned char *pucKey)
+{
+    unsigned char aucKey[KEYLEN] = {0, 0, 0x11, 0x22,
+                                    0x33, 0x44, 0x55, 0x66};
+    unsigned int auPath[3] = {'a', 0, 'z'};
+    int iOK;
+    int i;
+
+    iOK = KeyChain_addKey(oKeyChain, "0", "0a", pucKey, 0);
+    for (i = 1; i <= ROTATEKEYS; i++) {
+        auPath[1] = i;
+        aucKey[0] = i;
+        aucKey[1] = i >> 8;
+        iOK &= KeyChain_addKeyPath(oKeyChain, auPath, 2, aucKey, 0);
+    }
+    auPath[1] = 1;
+    iOK &= KeyChain_addKeyPath(oKeyChain, auPath, 3, aucKey, 1);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testRotation()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oReference;
+    KeyChain_T oReplayed;
+    unsigned char aucOldKey[KEYLEN] = {0x01, 0x02, 0x03, 0x04,
+                                       0x05, 0x06, 0x07, 0x08};
+    unsigned char aucNewKey[KEYLEN] = {0xa1, 0xb2, 0xc3, 0xd4,
+                                       0xe5, 0xf6, 0x07, 0x18};
+    unsigned char aucLeaf[KEYLEN];
+    unsigned char aucChild[KEYLEN];
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucRoot[32];
+    unsigned char aucRefRoot[32];
+    unsigned char aucData[32];
+    unsigned char aucHash[32];
+    unsigned long umk = 0x0123456789abcdef;
+    char acLeafID[KEYCHAIN_KEYIDLEN(3)];
+    char acChildID[KEYCHAIN_KEYIDLEN(2)];
+    unsigned int auPath[3] = {'a', 1500, 'z'};
+    char *apcBad[2];
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain key rotation.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // the reference gets the new key from the start
+    remove("testkeychain.jnl");
+    oKeyChain = KeyChain_new(umk);
+    oReference = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL && oReference != NULL);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(KeyChain_setEncoding(oReference, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(addRotated(oKeyChain, aucOldKey) == 1);
+    ASSURE(addRotated(oReference, aucNewKey) == 1);
+    KeyChain_pathKeyID(auPath, 2, acChildID);
+    auPath[1] = 1;
+    KeyChain_pathKeyID(auPath, 3, acLeafID);
+    ASSURE(KeyChain_getKey(oKeyChain, acChildID, aucChild) != NULL);
+    ASSURE(KeyChain_getKey(oKeyChain, acLeafID, aucLeaf) != NULL);
+
+    ASSURE(KeyChain_rotateKey(oKeyChain, "0", aucNewKey) == 0);
+    ASSURE(KeyChain_rotateKey(oKeyChain, "0b", aucNewKey) == 0);
+    ASSURE(KeyChain_rotateKey(oKeyChain, "0a", aucNewKey) == 1);
+
+    // only the rotated key changes, and the tree hashes as if it had
+    // always had it
+    ASSURE(KeyChain_getKey(oKeyChain, "0a", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucNewKey, KEYLEN) == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, acChildID, aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucChild, KEYLEN) == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, acLeafID, aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucLeaf, KEYLEN) == 0);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucRefRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucRefRoot, 32) == 0);
+    ASSURE(KeyChain_verifyKeyFull(oKeyChain, acLeafID) == 1);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // the journal replays the rotation
+    ASSURE(KeyChain_sync(oKeyChain) == 1);
+    oReplayed = KeyChain_new(umk);
+    ASSURE(KeyChain_openJournal(oReplayed, "testkeychain.jnl") == 1);
+    ASSURE(memcmp(KeyChain_getInterHash(oReplayed, "0"), aucRoot,
+                  32) == 0);
+    ASSURE(KeyChain_getKey(oReplayed, "0a", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucNewKey, KEYLEN) == 0);
+
+    // deferred hashing catches up on commit
+    KeyChain_setDeferred(oKeyChain, 1);
+    ASSURE(KeyChain_rotateKey(oKeyChain, "0a", aucOldKey) == 1);
+    ASSURE(KeyChain_rotateKey(oKeyChain, acChildID, aucNewKey) == 1);
+    KeyChain_setDeferred(oKeyChain, 0);
+    ASSURE(KeyChain_rotateKey(oReference, "0a", aucOldKey) == 1);
+    ASSURE(KeyChain_rotateKey(oReference, acChildID, aucNewKey) == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucRefRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucRefRoot, 32) == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, acLeafID, aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucLeaf, KEYLEN) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // a leaf keeps its data hash, with or without deferred hashing
+    memset(aucData, 0xab, 32);
+    ASSURE(KeyChain_updateKey(oKeyChain, acLeafID, aucData) == 1);
+    ASSURE(KeyChain_updateKey(oReference, acLeafID, aucData) == 1);
+    ASSURE(KeyChain_rotateKey(oKeyChain, acLeafID, aucNewKey) == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, acLeafID, aucHash) != NULL);
+    ASSURE(memcmp(aucHash, aucData, 32) == 0);
+    KeyChain_setDeferred(oKeyChain, 1);
+    ASSURE(KeyChain_rotateKey(oKeyChain, acLeafID, aucOldKey) == 1);
+    KeyChain_setDeferred(oKeyChain, 0);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, acLeafID, aucHash) != NULL);
+    ASSURE(memcmp(aucHash, aucData, 32) == 0);
+    ASSURE(KeyChain_rotateKey(oReference, acLeafID, aucOldKey) == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucRefRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucRefRoot, 32) == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, acLeafID, aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucOldKey, KEYLEN) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oReference);
+    KeyChain_free(oReplayed);
+    remove("testkeychain.jnl");
+}
+
+/*--------------------------------------------------------------------*/
+
+#define PROOFKEYS  300
+
+static void testProofs()
+{
+    KeyChain_T oKeyChain;
+    unsigned char aucKey[KEYLEN] = {0x31, 0x41, 0x59, 0x26,
+                                    0x53, 0x58, 0x97, 0x93};
+    unsigned char aucData[32];
+    unsigned char aucRoot[32];
+    unsigned char aucEncKey[KEYLEN];
+    unsigned char aucInterHash[32];
+    unsigned char aucWantEncKey[KEYLEN];
+    unsigned char aucWantInterHash[32];
+    unsigned char *pucProof;
+    unsigned char *pucBatch;
+    unsigned long umk = 0x2718281828459045;
+    unsigned int auPath[3] = {'a', 0, 'x'};
+    char acLeafID[KEYCHAIN_KEYIDLEN(3)];
+    char acOtherID[KEYCHAIN_KEYIDLEN(3)];
+    char *apcKeyIDs[3];
+    size_t uLen;
+    size_t uBatchLen;
+    size_t u;
+    int iEncoding;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain inclusion proofs.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (iEncoding = KEYCHAIN_ENCODING_TEXT;
+         iEncoding <= KEYCHAIN_ENCODING_TREE; iEncoding++) {
+        oKeyChain = KeyChain_new(umk);
+        ASSURE(oKeyChain != NULL);
+        ASSURE(KeyChain_setEncoding(oKeyChain, iEncoding) == 1);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", "0a", aucKey, 0) == 1);
+        ASSURE(KeyChain_addKey(oKeyChain, "0", "0b", aucKey, 0) == 1);
+        for (i = 1; i <= PROOFKEYS; i++) {
+            auPath[1] = i;
+            aucKey[0] = i;
+            ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 2, aucKey,
+                                       0) == 1);
+            ASSURE(KeyChain_addKeyPath(oKeyChain, auPath, 3, aucKey,
+                                       1) == 1);
+            memset(aucData, i, sizeof(aucData));
+            ASSURE(KeyChain_updateKey(oKeyChain,
+                KeyChain_pathKeyID(auPath, 3, acLeafID), aucData) == 1);
+        }
+        auPath[1] = 123;
+        KeyChain_pathKeyID(auPath, 3, acLeafID);
+        auPath[1] = 277;
+        KeyChain_pathKeyID(auPath, 3, acOtherID);
+        ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+        memcpy(aucWantEncKey, KeyChain_getEncryptedKey(oKeyChain, acLeafID),
+               KEYLEN);
+        memcpy(aucWantInterHash, KeyChain_getInterHash(oKeyChain, acLeafID),
+               32);
+
+        apcKeyIDs[0] = acLeafID;
+        apcKeyIDs[1] = acOtherID;
+        apcKeyIDs[2] = "0b";
+        pucProof = KeyChain_prove(oKeyChain, apcKeyIDs, 1, &uLen);
+        ASSURE(pucProof != NULL);
+        pucBatch = KeyChain_prove(oKeyChain, apcKeyIDs, 3, &uBatchLen);
+        ASSURE(pucBatch != NULL);
+        apcKeyIDs[2] = "0c";
+        ASSURE(KeyChain_prove(oKeyChain, apcKeyIDs, 3, &u) == NULL);
+        KeyChain_free(oKeyChain);
+
+        // the proof alone vouches for the key
+        ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, acLeafID,
+                                    aucEncKey, aucInterHash) == 1);
+        ASSURE(memcmp(aucEncKey, aucWantEncKey, KEYLEN) == 0);
+        ASSURE(memcmp(aucInterHash, aucWantInterHash, 32) == 0);
+        ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, NULL, NULL,
+                                    NULL) == 1);
+        ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, acOtherID,
+                                    NULL, NULL) == 0);
+        ASSURE(KeyChain_verifyProof(pucProof, uLen - 1, aucRoot, NULL,
+                                    NULL, NULL) == 0);
+        aucRoot[5] ^= 1;
+        ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, NULL, NULL,
+                                    NULL) == 0);
+        aucRoot[5] ^= 1;
+        for (u = 0; u < uLen; u += 7) {
+            pucProof[u] ^= 0x10;
+            ASSURE(KeyChain_verifyProof(pucProof, uLen, aucRoot, NULL,
+                                        NULL, NULL) == 0);
+            pucProof[u] ^= 0x10;
+        }
+
+        // a batch shares the path it has in common
+        ASSURE(uBatchLen < 3 * uLen);
+        ASSURE(KeyChain_verifyProof(pucBatch, uBatchLen, aucRoot, acLeafID,
+                                    NULL, aucInterHash) == 1);
+        ASSURE(memcmp(aucInterHash, aucWantInterHash, 32) == 0);
+        ASSURE(KeyChain_verifyProof(pucBatch, uBatchLen, aucRoot,
+                                    acOtherID, NULL, NULL) == 1);
+        ASSURE(KeyChain_verifyProof(pucBatch, uBatchLen, aucRoot, "0b",
+                                    NULL, NULL) == 1);
+
+        // child trees keep proofs logarithmic in the fan-out
+        if (iEncoding == KEYCHAIN_ENCODING_TREE)
+            ASSURE(uLen < 1024);
+        else
+            ASSURE(uLen > PROOFKEYS * 32);
+        free(pucProof);
+        free(pucBatch);
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+#define TXNKEYS  50
+
+/* A reader of the root hash of oKeyChain, which must always be one of
+   pucBefore and pucAfter, until iStop is set */
+struct RootReader
+{
+    KeyChain_T oKeyChain;
+    const unsigned char *pucBefore;
+    const unsigned char *pucAfter;
+    int iStop;
+    int iTorn;
+};
+
+/*--------------------------------------------------------------------*/
+
+static void *readRoot(void *pvReader)
+{
+    struct RootReader *psReader = (struct RootReader *)pvReader;
+    unsigned char aucRoot[32];
+
+    while (!__atomic_load_n(&psReader->iStop, __ATOMIC_ACQUIRE)) {
+        if (KeyChain_copyInterHash(psReader->oKeyChain, "0", aucRoot) == NULL ||
+            (memcmp(aucRoot, psReader->pucBefore, 32) != 0 &&
+             memcmp(aucRoot, psReader->pucAfter, 32) != 0))
+            psReader->iTorn = 1;
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Add to oKeyChain, or the transaction on it, the key "0x" with
+   TXNKEYS leaves, remove "0t\x05" and update "0t\x01\x01". Return 1
+   if all changes were made, 0 otherwise. */
+static int changeTenant(KeyChain_T oKeyChain)
+{
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucHash[32];
+    char acKeyID[] = "0x?";
+    int iOK;
+    int i;
+
+    memset(aucHash, 0x5a, sizeof(aucHash));
+    iOK = KeyChain_addKey(oKeyChain, "0", "0x", aucKey, 0);
+    for (i = 1; i <= TXNKEYS; i++) {
+        acKeyID[2] = i;
+        aucKey[0] = i;
+        iOK &= KeyChain_addKey(oKeyChain, "0x", acKeyID, aucKey, 1);
+    }
+    iOK &= KeyChain_removeKey(oKeyChain, "0t\x05");
+    iOK &= KeyChain_updateKey(oKeyChain, "0t\x01\x01", aucHash);
+    return iOK;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testTransactions()
+{
+    KeyChain_T oKeyChain;
+    KeyChain_T oSnapshot;
+    KeyChain_T oMapped;
+    KeyChain_T oReference;
+    KeyChain_T oTransaction;
+    KeyChain_T oReplayed;
+    struct RootReader sReader;
+    pthread_t sThread;
+    unsigned char aucKey[KEYLEN] = {0x31, 0x41, 0x59, 0x26,
+                                    0x53, 0x58, 0x97, 0x93};
+    unsigned char aucOld[KEYLEN];
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucHash[32];
+    unsigned char aucBefore[32];
+    unsigned char aucAfter[32];
+    unsigned char aucRoot[32];
+    unsigned long umk = 0x0f1e2d3c4b5a6978;
+    char *apcBad[2];
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain snapshots and transactions.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    // long key IDs and child trees are shared too; pending revocations
+    // are purged first
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_setEncoding(oKeyChain, KEYCHAIN_ENCODING_TREE) == 1);
+    ASSURE(addTenant(oKeyChain, 't') == 1);
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0t\x28") == 1);
+    ASSURE(KeyChain_getKey(oKeyChain, "0t\x02", aucOld) != NULL);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucBefore) != NULL);
+    oSnapshot = KeyChain_snapshot(oKeyChain);
+    ASSURE(oSnapshot != NULL);
+    ASSURE(KeyChain_getNumKeys(oSnapshot) == KeyChain_getNumKeys(oKeyChain));
+
+    // revoked keys not yet purged are shared as well; the snapshot
+    // leaves them out but cannot purge them, and the keychain can
+    ASSURE(KeyChain_contains(oSnapshot, "0t\x28\x01") == 0);
+    ASSURE(KeyChain_purge(oSnapshot, 1) == 1);
+    ASSURE(KeyChain_purge(oKeyChain, 1000) == 0);
+    ASSURE(KeyChain_contains(oSnapshot, "0t\x28\x01") == 0);
+    ASSURE(KeyChain_verifyAll(oSnapshot, apcBad, 2) == 0);
+
+    // the snapshot keeps the tree while the keychain changes
+    memset(aucHash, 0x3c, sizeof(aucHash));
+    ASSURE(KeyChain_removeKey(oKeyChain, "0t\x05") == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0s", aucKey, 1) == 1);
+    ASSURE(KeyChain_updateKey(oKeyChain, "0t\x01\x01", aucHash) == 1);
+    ASSURE(KeyChain_rotateKey(oKeyChain, "0t\x02", aucKey) == 1);
+    ASSURE(KeyChain_copyInterHash(oSnapshot, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucBefore, 32) == 0);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucBefore, 32) != 0);
+    ASSURE(KeyChain_contains(oSnapshot, "0t\x05\x07") == 1);
+    ASSURE(KeyChain_contains(oSnapshot, "0s") == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05\x07") == 0);
+    ASSURE(KeyChain_getKey(oSnapshot, "0t\x02", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucOld, KEYLEN) == 0);
+    ASSURE(KeyChain_getKey(oKeyChain, "0t\x02", aucOut) != NULL);
+    ASSURE(memcmp(aucOut, aucKey, KEYLEN) == 0);
+    ASSURE(KeyChain_verifyKeyFull(oSnapshot, "0t\x01zzzzzzzzzzzzzzzzzzzz") == 1);
+    ASSURE(KeyChain_getInterHash(oSnapshot, "0") != NULL);
+    ASSURE(memcmp(KeyChain_getInterHash(oSnapshot, "0"), aucBefore, 32) == 0);
+    ASSURE(KeyChain_getEncryptedKey(oSnapshot, "0t\x02") != NULL);
+    ASSURE(memcmp(KeyChain_getEncryptedKey(oSnapshot, "0t\x02"),
+                  KeyChain_getEncryptedKey(oKeyChain, "0t\x02"),
+                  KEYLEN) != 0);
+    ASSURE(KeyChain_verifyAll(oSnapshot, apcBad, 2) == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // snapshots cannot be changed
+    ASSURE(KeyChain_addKey(oSnapshot, "0", "0s", aucKey, 1) == 0);
+    ASSURE(KeyChain_removeKey(oSnapshot, "0t") == 0);
+    ASSURE(KeyChain_updateKey(oSnapshot, "0t\x01\x01", aucHash) == 0);
+    ASSURE(KeyChain_beginTransaction(oSnapshot) == NULL);
+
+    // a snapshot outlives its keychain and saves like one, and
+    // snapshots of mapped keychains hold on to the mapping
+    KeyChain_free(oKeyChain);
+    ASSURE(KeyChain_verifyKey(oSnapshot, "0t\x05\x07") == 1);
+    ASSURE(KeyChain_save(oSnapshot, "testkeychain.snap") == 1);
+    KeyChain_free(oSnapshot);
+    oMapped = KeyChain_load("testkeychain.snap", umk);
+    ASSURE(oMapped != NULL);
+    oSnapshot = KeyChain_snapshot(oMapped);
+    ASSURE(oSnapshot != NULL);
+    ASSURE(KeyChain_addKey(oMapped, "0", "0s", aucKey, 1) == 1);
+    KeyChain_free(oMapped);
+    ASSURE(KeyChain_copyInterHash(oSnapshot, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucBefore, 32) == 0);
+    ASSURE(KeyChain_verifyAll(oSnapshot, apcBad, 2) == 0);
+    ASSURE(KeyChain_contains(oSnapshot, "0t\x01zzzzzzzzzzzzzzzzzzzz") == 1);
+    ASSURE(KeyChain_contains(oSnapshot, "0t\x28\x01") == 0);
+    KeyChain_free(oSnapshot);
+    remove("testkeychain.snap");
+
+    // a transaction stages its changes; nothing shows until the commit
+    remove("testkeychain.jnl");
+    oKeyChain = KeyChain_new(umk);
+    oReference = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL && oReference != NULL);
+    ASSURE(KeyChain_openJournal(oKeyChain, "testkeychain.jnl") == 1);
+    ASSURE(addTenant(oKeyChain, 't') == 1);
+    ASSURE(addTenant(oReference, 't') == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucBefore) != NULL);
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(oTransaction != NULL);
+    ASSURE(changeTenant(oTransaction) == 1);
+    ASSURE(changeTenant(oReference) == 1);
+    ASSURE(KeyChain_contains(oTransaction, "0x\x07") == 1);
+    ASSURE(KeyChain_contains(oKeyChain, "0x\x07") == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0t\x05") == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucBefore, 32) == 0);
+    ASSURE(KeyChain_copyInterHash(oTransaction, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucAfter) != NULL);
+    ASSURE(memcmp(aucRoot, aucAfter, 32) == 0);
+
+    // readers see the whole transaction or none of it
+    sReader.oKeyChain = oKeyChain;
+    sReader.pucBefore = aucBefore;
+    sReader.pucAfter = aucAfter;
+    sReader.iStop = 0;
+    sReader.iTorn = 0;
+    ASSURE(pthread_create(&sThread, NULL, readRoot, &sReader) == 0);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 1);
+    __atomic_store_n(&sReader.iStop, 1, __ATOMIC_RELEASE);
+    pthread_join(sThread, NULL);
+    ASSURE(sReader.iTorn == 0);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucAfter, 32) == 0);
+    ASSURE(KeyChain_getNumKeys(oKeyChain) ==
+           KeyChain_getNumKeys(oReference));
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+
+    // a rollback drops the changes, and so does a commit after the
+    // keychain changed underneath
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(KeyChain_removeKey(oTransaction, "0x") == 1);
+    KeyChain_rollbackTransaction(oTransaction);
+    ASSURE(KeyChain_contains(oKeyChain, "0x\x07") == 1);
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(KeyChain_addKey(oTransaction, "0", "0y", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0z", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0", "0z", aucKey, 1) == 1);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0y") == 0);
+
+    // reading the keychain, committing its hashes or failing to change
+    // it is no change
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(KeyChain_addKey(oTransaction, "0", "0y", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0", "0y", aucKey, 1) == 1);
+    ASSURE(KeyChain_getEncryptedKey(oKeyChain, "0z") != NULL);
+    KeyChain_commit(oKeyChain);
+    ASSURE(KeyChain_verifyKey(oKeyChain, "0z") == 1);
+    ASSURE(KeyChain_removeKey(oKeyChain, "0w") == 0);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 1);
+    ASSURE(KeyChain_contains(oKeyChain, "0y") == 1);
+
+    // revoked keys not yet purged go along with the transaction
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0x") == 1);
+    ASSURE(KeyChain_revokeKey(oReference, "0x") == 1);
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(oTransaction != NULL);
+    ASSURE(KeyChain_contains(oTransaction, "0x\x07") == 0);
+    ASSURE(KeyChain_addKey(oTransaction, "0", "0x", aucKey, 1) == 1);
+    ASSURE(KeyChain_addKey(oReference, "0", "0x", aucKey, 1) == 1);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 1);
+    ASSURE(KeyChain_purge(oKeyChain, 1000) == 0);
+    ASSURE(KeyChain_contains(oKeyChain, "0x") == 1);
+    ASSURE(KeyChain_contains(oKeyChain, "0x\x07") == 0);
+    ASSURE(KeyChain_verifyAll(oKeyChain, apcBad, 2) == 0);
+    oTransaction = KeyChain_beginTransaction(oKeyChain);
+    ASSURE(KeyChain_commitTransaction(oTransaction) == 1);
+    ASSURE(KeyChain_copyInterHash(oKeyChain, "0", aucRoot) != NULL);
+    ASSURE(KeyChain_copyInterHash(oReference, "0", aucAfter) != NULL);
+    ASSURE(memcmp(aucRoot, aucAfter, 32) == 0);
+
+    // the journal replays the transaction as one record
+    ASSURE(KeyChain_sync(oKeyChain) == 1);
+    oReplayed = KeyChain_new(umk);
+    ASSURE(KeyChain_openJournal(oReplayed, "testkeychain.jnl") == 1);
+    ASSURE(KeyChain_copyInterHash(oReplayed, "0", aucRoot) != NULL);
+    ASSURE(memcmp(aucRoot, aucAfter, 32) == 0);
+
+    KeyChain_free(oKeyChain);
+    KeyChain_free(oReference);
+    KeyChain_free(oReplayed);
+    remove("testkeychain.jnl");
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return the sum of the uNum counters at pul */
+
+static unsigned long sumOf(const unsigned long *pul, size_t uNum)
+{
+    unsigned long ulSum = 0;
+    size_t u;
+
+    for (u = 0; u < uNum; u++)
+        ulSum += pul[u];
+    return ulSum;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testStats()
+{
+    KeyChain_T oKeyChain;
+    struct KeyChainShape sShape;
+    struct KeyChainStats sStats;
+    struct KeyChainStats sBefore;
+    unsigned char aucKey[KEYLEN] = {0x27, 0x18, 0x28, 0x18,
+                                    0x28, 0x45, 0x90, 0x45};
+    unsigned char aucOut[KEYLEN];
+    unsigned char aucHash[32];
+    unsigned long umk = 0x1122334455667788;
+    char acKeyID[4] = "0a?";
+    int iStats;
+    int iOp;
+    int i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing KeyChain statistics and shape.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    oKeyChain = KeyChain_new(umk);
+    ASSURE(oKeyChain != NULL);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0a", aucKey, 0) == 1);
+    ASSURE(KeyChain_addKey(oKeyChain, "0", "0b", aucKey, 1) == 1);
+    for (i = 1; i <= 5; i++) {
+        acKeyID[2] = (char)i;
+        ASSURE(KeyChain_addKey(oKeyChain, "0a", acKeyID, aucKey, 1) == 1);
+    }
+
+    // 8 keys on 3 levels; fanouts 2, 5 and six leaves
+    KeyChain_getShape(oKeyChain, &sShape);
+    ASSURE(sShape.ulNodes == 8);
+    ASSURE(sShape.aulDepth[0] == 1);
+    ASSURE(sShape.aulDepth[1] == 2);
+    ASSURE(sShape.aulDepth[2] == 5);
+    ASSURE(sumOf(sShape.aulDepth, KEYCHAIN_SHAPEBUCKETS) == 8);
+    ASSURE(sShape.iMaxDepth == 2);
+    ASSURE(sShape.aulFanout[0] == 6);
+    ASSURE(sShape.aulFanout[2] == 1);
+    ASSURE(sShape.aulFanout[3] == 1);
+    ASSURE(sumOf(sShape.aulFanout, KEYCHAIN_SHAPEBUCKETS) == 8);
+    ASSURE(sShape.ulMaxFanout == 5);
+    ASSURE(sShape.uBytesPerNode > 2 * 32);
+    ASSURE(sShape.uBytes >= sShape.uBytesPerNode * 8);
+
+    // the test is built with the same flag as the keychain; without
+    // it nothing is counted
+    iStats = KeyChain_getStats(oKeyChain, &sStats);
+#ifdef KEYCHAIN_STATS
+    ASSURE(iStats == 1);
+#else
+    ASSURE(iStats == 0);
+#endif
+    if (!iStats) {
+        ASSURE(sStats.ulHashes == 0);
+        ASSURE(sumOf(sStats.aulOps, KEYCHAIN_OPS) == 0);
+        KeyChain_resetStats(oKeyChain);
+    }
+    else {
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_ADD] == 7);
+        ASSURE(sStats.ulHashes > 0);
+        ASSURE(sStats.ulEstimatedBlocks >= sStats.ulHashes);
+        ASSURE(sStats.ulBytesHashed > 0);
+        ASSURE(sStats.ulProbes > 0);
+
+        KeyChain_resetStats(oKeyChain);
+        ASSURE(KeyChain_getStats(oKeyChain, &sStats) == 1);
+        ASSURE(sStats.ulHashes == 0);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_ADD] == 0);
+
+        // an add hashes the record of the new key and rehashes both
+        // records of its two ancestors; the parent key is cached
+        ASSURE(KeyChain_addKey(oKeyChain, "0a", "0a\x06", aucKey, 1) == 1);
+        ASSURE(KeyChain_getStats(oKeyChain, &sStats) == 1);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_ADD] == 1);
+        ASSURE(sStats.ulHashes == 5);
+        ASSURE(sStats.ulNodesVisited == 3);
+
+        // a full verify of a key at depth 2 hashes 6 messages at once
+        sBefore = sStats;
+        ASSURE(KeyChain_verifyKeyFull(oKeyChain, "0a\x06") == 1);
+        ASSURE(KeyChain_getStats(oKeyChain, &sStats) == 1);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_VERIFY] == 1);
+        ASSURE(sStats.ulHashes - sBefore.ulHashes == 6);
+        ASSURE(sStats.ulNodesVisited - sBefore.ulNodesVisited == 3);
+
+        // a key and its parent are derived once, then come from the
+        // cache
+        sBefore = sStats;
+        ASSURE(KeyChain_getKey(oKeyChain, "0a\x06", aucOut) != NULL);
+        ASSURE(KeyChain_getKey(oKeyChain, "0a\x06", aucOut) != NULL);
+        ASSURE(KeyChain_getKey(oKeyChain, "0c", aucOut) == NULL);
+        ASSURE(KeyChain_getStats(oKeyChain, &sStats) == 1);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_GETKEY] == 3);
+        ASSURE(sStats.ulHashes == sBefore.ulHashes);
+        ASSURE(sStats.ulProbes - sBefore.ulProbes >= 3);
+
+        memset(aucHash, 0x5a, sizeof(aucHash));
+        ASSURE(KeyChain_updateKey(oKeyChain, "0a\x06", aucHash) == 1);
+        ASSURE(KeyChain_removeKey(oKeyChain, "0b") == 1);
+        ASSURE(KeyChain_revokeKey(oKeyChain, "0a\x01") == 1);
+        ASSURE(KeyChain_getStats(oKeyChain, &sStats) == 1);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_UPDATE] == 1);
+        ASSURE(sStats.aulOps[KEYCHAIN_OP_REMOVE] == 2);
+
+        // every timed call lands in one latency bucket
+        for (iOp = 0; iOp < KEYCHAIN_OPS; iOp++)
+            ASSURE(sumOf(sStats.aaulLatency[iOp], KEYCHAIN_LATENCYBUCKETS)
+                   == sStats.aulOps[iOp]);
+    }
+
+    // revoked keys leave the shape before they are purged
+    ASSURE(KeyChain_revokeKey(oKeyChain, "0a") == 1);
+    KeyChain_getShape(oKeyChain, &sShape);
+    ASSURE(sShape.ulNodes == sShape.aulDepth[0] + sShape.aulDepth[1]);
+    ASSURE(sShape.aulDepth[2] == 0);
+    ASSURE(sShape.iMaxDepth <= 1);
+    while (KeyChain_purge(oKeyChain, 2))
+        ;
+    KeyChain_getShape(oKeyChain, &sShape);
+    ASSURE(sShape.aulDepth[2] == 0);
+    ASSURE(sShape.ulNodes ==
+           (unsigned long)KeyChain_getNumKeys(oKeyChain) + 1);
+
+    KeyChain_free(oKeyChain);
+}
+
+/*--------------------------------------------------------------------*/
+
 int main(void)
 {
     testBasics();
     testVerticalTree();
     testHorizontalTree();
+    testVerify();
+    testHashBackends();
+    testEncoding();
+    testCipher();
+    testKeyCache();
+    testIndex();
+    testSiblingOrder();
+    testDeferred();
+    testChildTree();
+    testAddKeys();
+    testVerifyAll();
+    testVerifyCache();
+    testSnapshot();
+    testJournal();
+    testConcurrentReaders();
+    testConcurrentWriters();
+    testKeyPaths();
+    testRevocation();
+    testRotation();
+    testProofs();
+    testTransactions();
+    testStats();
     printf("------------------------------------------------------\n");
     printf("End of tests\n");
 } 
@@ -5,6 +5,8 @@
 
 #include "keycrypto.h"
 #include "sha256.h"
+#include "keyhash.h"
+#include "chacha20.h"
 #include <stdlib.h>
 #include <string.h>  
 #include <assert.h>
@@ -208,10 +210,401 @@ static void testHash()
 
 /*--------------------------------------------------------------------*/
 
+/* Hash iLen bytes of pucData with the current SHA-256 kernel, feeding
+   it to sha256_update in pieces of at most iStep bytes. */
+
+static void hashInSteps(unsigned char *pucData, int iLen, int iStep,
+                        unsigned char *pucHash)
+{
+    SHA256_CTX ctx;
+    int iOff;
+    int iPiece;
+
+    sha256_init(&ctx);
+    for (iOff = 0; iOff < iLen; iOff += iPiece) {
+        iPiece = (iLen - iOff < iStep) ? iLen - iOff : iStep;
+        sha256_update(&ctx, pucData + iOff, iPiece);
+    }
+    sha256_final(&ctx, pucHash);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testHashVectors()
+{
+    static const char *apcMsg[] = {
+        "",
+        "abc",
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+    };
+    static const unsigned char aucDigest[][32] = {
+        {0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+         0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+         0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+         0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55},
+        {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+         0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+         0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+         0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad},
+        {0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+         0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+         0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+         0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1}
+    };
+    static const unsigned char aucMillionA[] = {
+        0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+        0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+        0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+        0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0
+    };
+    static const int aiImpl[] = {
+        SHA256_IMPL_C, SHA256_IMPL_AVX2, SHA256_IMPL_SHANI
+    };
+    static const int aiStep[] = {1, 7, 63, 64, 65, 200, 1000000};
+    unsigned char *pucData;
+    unsigned char aucRef[600][32];
+    unsigned char hash[32];
+    int iImpl, iMsg, iStep, iLen;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing SHA-256 kernels against test vectors.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    pucData = (unsigned char *)malloc(1000000);
+    ASSURE(pucData != NULL);
+
+    // reference digests of assorted lengths from the portable kernel
+    ASSURE(sha256_set_impl(SHA256_IMPL_C));
+    for (iLen = 0; iLen < 1000000; iLen++)
+        pucData[iLen] = (unsigned char)(iLen * 131 + (iLen >> 8));
+    for (iLen = 0; iLen < 600; iLen++)
+        hashInSteps(pucData, iLen, iLen + 1, aucRef[iLen]);
+
+    for (iImpl = 0; iImpl < 3; iImpl++) {
+        // skip kernels this CPU cannot run
+        if (!sha256_set_impl(aiImpl[iImpl]))
+            continue;
+
+        for (iMsg = 0; iMsg < 3; iMsg++) {
+            hashInSteps((unsigned char *)apcMsg[iMsg], strlen(apcMsg[iMsg]),
+                        64, hash);
+            ASSURE(memcmp(hash, aucDigest[iMsg], 32) == 0);
+        }
+
+        memset(pucData, 'a', 1000000);
+        for (iStep = 0; iStep < 7; iStep++) {
+            hashInSteps(pucData, 1000000, aiStep[iStep], hash);
+            ASSURE(memcmp(hash, aucMillionA, 32) == 0);
+        }
+
+        for (iLen = 0; iLen < 1000000; iLen++)
+            pucData[iLen] = (unsigned char)(iLen * 131 + (iLen >> 8));
+        for (iLen = 0; iLen < 600; iLen++) {
+            hashInSteps(pucData, iLen, 600, hash);
+            ASSURE(memcmp(hash, aucRef[iLen], 32) == 0);
+            hashInSteps(pucData, iLen, 13, hash);
+            ASSURE(memcmp(hash, aucRef[iLen], 32) == 0);
+        }
+    }
+
+    sha256_set_impl(SHA256_IMPL_AUTO);
+    free(pucData);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testHashMulti()
+{
+    static const int aiImpl[] = {
+        SHA256_IMPL_C, SHA256_IMPL_AVX2, SHA256_IMPL_SHANI
+    };
+    unsigned char aucData[2000];
+    unsigned char aucOut[20][32];
+    unsigned char hash[32];
+    const unsigned char *apucData[20];
+    size_t auLen[20];
+    unsigned char *apucOut[20];
+    SHA256_CTX ctx;
+    int iImpl, iNum, i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing multi-buffer SHA-256.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (i = 0; i < 2000; i++)
+        aucData[i] = (unsigned char)(i * 7 + 3);
+
+    for (iImpl = 0; iImpl < 3; iImpl++) {
+        if (!sha256_set_impl(aiImpl[iImpl]))
+            continue;
+
+        // batches of every size up to 20, with lengths straddling the
+        // one and two block padding boundaries
+        for (iNum = 0; iNum <= 20; iNum++) {
+            for (i = 0; i < iNum; i++) {
+                apucData[i] = aucData + i * 13;
+                auLen[i] = (i * 37 + iNum * 11) % 200;
+                apucOut[i] = aucOut[i];
+            }
+            sha256_multi(apucData, auLen, apucOut, iNum);
+
+            for (i = 0; i < iNum; i++) {
+                sha256_init(&ctx);
+                sha256_update(&ctx, apucData[i], auLen[i]);
+                sha256_final(&ctx, hash);
+                ASSURE(memcmp(hash, aucOut[i], 32) == 0);
+            }
+        }
+    }
+
+    sha256_set_impl(SHA256_IMPL_AUTO);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the 32 byte hash equals the hex string pcHex */
+
+static int hashEqualsHex(unsigned char *hash, const char *pcHex)
+{
+    char acBuf[65];
+    int idx;
+
+    for (idx = 0; idx < 32; idx++)
+        sprintf(acBuf + 2*idx, "%02x", hash[idx]);
+    return strcmp(acBuf, pcHex) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testBlake2s()
+{
+    static const char *apcMsg[] = {
+        "",
+        "abc",
+        "The quick brown fox jumps over the lazy dog"
+    };
+    static const char *apcMsgDigest[] = {
+        "69217a3079908094e11121d042354a7c1f55b6482ca1a51e1b250dfd1ed0eef9",
+        "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982",
+        "606beeec743ccbeff6cbcdf5d5302aa855c256c29b88c8ed331ea1a6bf3c8812"
+    };
+    // digests of the first n bytes of i * 7 + 3, around block edges
+    static const int aiLen[] = {63, 64, 65, 128, 129, 1000};
+    static const char *apcLenDigest[] = {
+        "de27df0e375d83c49f1af9ca8270f9f2fe7b70bf800fc01672db0e9746021ebf",
+        "5377e4ff957bda4d4535f4879876b71a61056c4cec31e78397c66ec47a86a130",
+        "19b1b26fba093f4a670d8913e1b71cbb2916dfa701018cc6b05785c966593374",
+        "83470c75afa23d90cd7659906e4b47daa278131fbb225241dd37a40fd5355ac7",
+        "26fd8892ab0a5f12d4acbff1efd7dcd92b99e2d377f888f07e3cb81b232b11cf",
+        "02a016193469710efadf8fb005ca19b509331cb847df5598cc0794bded669681"
+    };
+    const struct KeyHash *psHash;
+    const unsigned char *apucData[6];
+    size_t auLen[6];
+    unsigned char *apucOut[6];
+    unsigned char aucOut[6][32];
+    unsigned char aucData[1000];
+    unsigned char hash[32];
+    BLAKE2S_CTX ctx;
+    int i, j;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing BLAKE2s.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (i = 0; i < 1000; i++)
+        aucData[i] = (unsigned char)(i * 7 + 3);
+
+    for (i = 0; i < 3; i++) {
+        blake2s_init(&ctx);
+        blake2s_update(&ctx, (unsigned char *)apcMsg[i], strlen(apcMsg[i]));
+        blake2s_final(&ctx, hash);
+        ASSURE(hashEqualsHex(hash, apcMsgDigest[i]));
+    }
+
+    for (i = 0; i < 6; i++) {
+        // one byte at a time
+        blake2s_init(&ctx);
+        for (j = 0; j < aiLen[i]; j++)
+            blake2s_update(&ctx, aucData + j, 1);
+        blake2s_final(&ctx, hash);
+        ASSURE(hashEqualsHex(hash, apcLenDigest[i]));
+    }
+
+    // the same through the backend table
+    psHash = KeyHash_get(KEYHASH_BLAKE2S);
+    ASSURE(psHash != NULL);
+    ASSURE(strcmp(psHash->pcName, "blake2s") == 0);
+    for (i = 0; i < 6; i++) {
+        apucData[i] = aucData;
+        auLen[i] = aiLen[i];
+        apucOut[i] = aucOut[i];
+    }
+    psHash->multi(apucData, auLen, apucOut, 6);
+    for (i = 0; i < 6; i++)
+        ASSURE(hashEqualsHex(aucOut[i], apcLenDigest[i]));
+
+    KeyHash_digest(psHash, (unsigned char *)apcMsg[1], 3, hash);
+    ASSURE(hashEqualsHex(hash, apcMsgDigest[1]));
+
+    psHash = KeyHash_get(KEYHASH_SHA256);
+    ASSURE(psHash != NULL);
+    KeyHash_digest(psHash, (unsigned char *)apcMsg[1], 3, hash);
+    ASSURE(hashEqualsHex(hash, 
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+
+    ASSURE(KeyHash_get(-1) == NULL);
+    ASSURE(KeyHash_get(2) == NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testXorKernels()
+{
+    unsigned char aucKey[] = {0x04, 0x00, 0x20, 0xff,
+                              0x6d, 0x22, 0xa5, 0x1d};
+    unsigned char aucInput[600];
+    unsigned char aucSource[608];
+    unsigned char aucOutput[640];
+    unsigned char aucExpected[600];
+    unsigned char aucInPlace[640];
+    int iLen, iInOff, iOutOff, i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing XOR kernels.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (i = 0; i < 600; i++)
+        aucInput[i] = (unsigned char)(i * 29 + 5);
+
+    // every length around the word and vector widths, with input and
+    // output at every alignment
+    for (iLen = 0; iLen < 300; iLen++) {
+        for (i = 0; i < iLen; i++)
+            aucExpected[i] = aucInput[i] ^ aucKey[i % 8];
+
+        for (iInOff = 0; iInOff < 8; iInOff++) {
+            for (iOutOff = 0; iOutOff < 32; iOutOff += 3) {
+                memcpy(aucSource + iInOff, aucInput, iLen);
+                xor_crypt(aucSource + iInOff, aucOutput + iOutOff,
+                          iLen, aucKey);
+                ASSURE(memcmp(aucOutput + iOutOff, aucExpected, iLen) == 0);
+            }
+
+            memcpy(aucInPlace + iInOff, aucInput, iLen);
+            xor_crypt(aucInPlace + iInOff, aucInPlace + iInOff, iLen, aucKey);
+            ASSURE(memcmp(aucInPlace + iInOff, aucExpected, iLen) == 0);
+        }
+    }
+
+    // a round trip through the 8 byte aligned API
+    xor_encrypt(aucInput, aucOutput, 512, aucKey);
+    xor_decrypt(aucOutput, aucOutput, 512, aucKey);
+    ASSURE(memcmp(aucOutput, aucInput, 512) == 0);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void testChaCha20()
+{
+    // RFC 8439 section 2.4.2, block counter 1
+    static const char acPlain[] = "Ladies and Gentlemen of the class "
+        "of '99: If I could offer you only one tip for the future, "
+        "sunscreen would be it.";
+    static const unsigned char aucCipher[] = {
+        0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 
+        0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+        0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 
+        0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+        0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 
+        0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+        0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 
+        0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+        0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 
+        0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+        0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 
+        0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+        0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 
+        0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+        0x87, 0x4d
+    };
+    static const unsigned char aucNonce[CHACHA20_NONCELEN] = {
+        0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0
+    };
+    static const int aiImpl[] = {CHACHA20_IMPL_C, CHACHA20_IMPL_AVX2};
+    unsigned char aucKey[CHACHA20_KEYLEN];
+    unsigned char aucInput[1200];
+    unsigned char aucExpected[1200];
+    unsigned char aucOutput[1200];
+    size_t uLen = sizeof(aucCipher);
+    int iImpl, iOff, iSplit, i;
+
+    printf("------------------------------------------------------\n");
+    printf("Testing ChaCha20.\n");
+    printf("No output should appear here:\n");
+    fflush(stdout);
+
+    for (i = 0; i < CHACHA20_KEYLEN; i++)
+        aucKey[i] = (unsigned char)i;
+    for (i = 0; i < 1200; i++)
+        aucInput[i] = (unsigned char)(i * 13 + 1);
+
+    ASSURE(chacha20_set_impl(CHACHA20_IMPL_C));
+    ASSURE(!chacha20_set_impl(-1));
+
+    // reference stream from the portable kernel
+    chacha20_crypt(aucKey, aucNonce, 0, aucInput, aucExpected, 1200);
+
+    for (iImpl = 0; iImpl < 2; iImpl++) {
+        if (!chacha20_set_impl(aiImpl[iImpl]))
+            continue;
+
+        // keystream block 1 starts at byte 64
+        chacha20_crypt(aucKey, aucNonce, 64, (unsigned char *)acPlain, 
+                       aucOutput, uLen);
+        ASSURE(memcmp(aucOutput, aucCipher, uLen) == 0);
+
+        // in place
+        memcpy(aucOutput, acPlain, uLen);
+        chacha20_crypt(aucKey, aucNonce, 64, aucOutput, aucOutput, uLen);
+        ASSURE(memcmp(aucOutput, aucCipher, uLen) == 0);
+
+        // any range of the stream matches the stream from offset 0
+        for (iOff = 0; iOff < 1200; iOff += 37) {
+            for (iSplit = 0; iOff + iSplit <= 1200; iSplit += 61) {
+                memset(aucOutput, 0, sizeof(aucOutput));
+                chacha20_crypt(aucKey, aucNonce, iOff, aucInput + iOff,
+                               aucOutput + iOff, iSplit);
+                ASSURE(memcmp(aucOutput + iOff, aucExpected + iOff, 
+                              iSplit) == 0);
+            }
+        }
+
+        // decrypting the full stream in two pieces
+        chacha20_crypt(aucKey, aucNonce, 0, aucExpected, aucOutput, 555);
+        chacha20_crypt(aucKey, aucNonce, 555, aucExpected + 555, 
+                       aucOutput + 555, 1200 - 555);
+        ASSURE(memcmp(aucOutput, aucInput, 1200) == 0);
+    }
+
+    ASSURE(chacha20_set_impl(CHACHA20_IMPL_AUTO));
+}
+
+/*--------------------------------------------------------------------*/
+
 int main(void)
 {
     testBasics();
+    testXorKernels();
     testHash();
+    testHashVectors();
+    testHashMulti();
+    testBlake2s();
+    testChaCha20();
 
     printf("------------------------------------------------------\n");
     printf("End of tests\n");
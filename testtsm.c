@@ -4,7 +4,7 @@
 /*--------------------------------------------------------------------*/
 
 #include "keychain.h"
-#include "sha256.h"
+#include "keyhash.h"
 #include "tsm.h"
 #include <stdlib.h>
 //#include <string.h>  
@@ -47,6 +47,136 @@ static void phex(unsigned char *str)
 }
 
 
+/*--------------------------------------------------------------------*/
+
+/* Write iLen bytes of filler to pcFileName */
+
+static void writeFile(const char *pcFileName, int iLen)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(pcFileName, "w");
+    assert(fp != NULL);
+    for (i = 0; i < iLen; i++)
+        fputc((i * 31 + i / 251) & 0xff, fp);
+    fclose(fp);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Return 1 if the files pcFileName1 and pcFileName2 are identical */
+
+static int sameFiles(const char *pcFileName1, const char *pcFileName2)
+{
+    FILE *fp1, *fp2;
+    int c1, c2;
+
+    fp1 = fopen(pcFileName1, "r");
+    fp2 = fopen(pcFileName2, "r");
+    if (fp1 == NULL || fp2 == NULL)
+        return 0;
+    do {
+        c1 = fgetc(fp1);
+        c2 = fgetc(fp2);
+    } while (c1 == c2 && c1 != EOF);
+    fclose(fp1);
+    fclose(fp2);
+    return c1 == c2;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Round trip files around the TSM's internal chunk size */
+
+static void testLargeFiles(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    static const int aiLen[] = {0, 7, 8, 65536, 65535, 65537, 
+                                131072, 200003};
+    int status;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        writeFile("tsmtest.txt", aiLen[i]);
+
+        status = Encrypt("tsmtest.txt", "tsmtest.enc", oKeyChain, pcKeyID);
+        ASSURE(status);
+
+        status = Decrypt("tsmtest.enc", "tsmtest.dec", oKeyChain, pcKeyID);
+        ASSURE(status);
+
+        ASSURE(sameFiles("tsmtest.txt", "tsmtest.dec"));
+    }
+
+    remove("tsmtest.txt");
+    remove("tsmtest.enc");
+    remove("tsmtest.dec");
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Round trip files with ChaCha20 and decrypt ranges of them */
+
+static void testChaCha20(KeyChain_T oKeyChain, char *pcKeyID)
+{
+    static const int aiLen[] = {0, 1, 63, 64, 65536, 65537, 1048576 + 5};
+    FILE *fp;
+    int status;
+    int i, c;
+
+    status = KeyChain_setCipher(oKeyChain, pcKeyID, KEYCHAIN_CIPHER_CHACHA20);
+    ASSURE(status);
+    ASSURE(KeyChain_getCipher(oKeyChain, pcKeyID) == KEYCHAIN_CIPHER_CHACHA20);
+
+    for (i = 0; i < 7; i++) {
+        writeFile("tsmtest.txt", aiLen[i]);
+
+        status = Encrypt("tsmtest.txt", "tsmtest.enc", oKeyChain, pcKeyID);
+        ASSURE(status);
+
+        status = Decrypt("tsmtest.enc", "tsmtest.dec", oKeyChain, pcKeyID);
+        ASSURE(status);
+
+        ASSURE(sameFiles("tsmtest.txt", "tsmtest.dec"));
+    }
+
+    // bytes 100000 .. 100009 of the last file
+    status = DecryptRange("tsmtest.enc", "tsmtest.dec", oKeyChain, pcKeyID,
+                          100000, 10);
+    ASSURE(status);
+    fp = fopen("tsmtest.dec", "r");
+    ASSURE(fp != NULL);
+    for (i = 100000; i < 100010; i++) {
+        c = fgetc(fp);
+        ASSURE(c == ((i * 31 + i / 251) & 0xff));
+    }
+    ASSURE(fgetc(fp) == EOF);
+    fclose(fp);
+
+    // ranges are cut short at the end of the data
+    status = DecryptRange("tsmtest.enc", "tsmtest.dec", oKeyChain, pcKeyID,
+                          0, ~0ULL);
+    ASSURE(status);
+    ASSURE(sameFiles("tsmtest.txt", "tsmtest.dec"));
+
+    // a tampered ciphertext is rejected
+    printf("------------------------------------------------------\n");
+    printf("A data hash mismatch should appear here:\n");
+    fflush(stdout);
+    fp = fopen("tsmtest.enc", "r+");
+    ASSURE(fp != NULL);
+    fseek(fp, 5000, SEEK_SET);
+    fputc(0, fp);
+    fclose(fp);
+    status = DecryptRange("tsmtest.enc", "tsmtest.dec", oKeyChain, pcKeyID,
+                          0, 1);
+    ASSURE(!status);
+
+    remove("tsmtest.txt");
+    remove("tsmtest.enc");
+    remove("tsmtest.dec");
+}
+
 /*--------------------------------------------------------------------*/
 
 int main(void)
@@ -114,6 +244,28 @@ int main(void)
     status = Decrypt("file.enc", "file.dec", oKeyChain, "02");
     ASSURE(status);
 
+    KeyChain_free(oKeyChain);
+
+    // data digests follow the keychain's hash backend
+    oKeyChain = KeyChain_newWithHash(umk, KEYHASH_BLAKE2S);
+    ASSURE(oKeyChain != NULL);
+    status = AddKeyToChain(oKeyChain, "0", "00", 1);
+    ASSURE(status);
+
+    status = Encrypt("file.txt", "file.enc", oKeyChain, "00");
+    ASSURE(status);
+
+    status = Decrypt("file.enc", "file.dec", oKeyChain, "00");
+    ASSURE(status);
+
+    testLargeFiles(oKeyChain, "00");
+
+    // XOR keys cannot be read by range
+    status = DecryptRange("file.enc", "file.dec", oKeyChain, "00", 0, 1);
+    ASSURE(!status);
+
+    testChaCha20(oKeyChain, "00");
+
     KeyChain_free(oKeyChain);
     
     printf("------------------------------------------------------\n");
@@ -6,15 +6,37 @@
 #include "tsm.h"
 #include "keychain.h"
 #include "keycrypto.h"
-#include "sha256.h"
+#include "keyhash.h"
+#include "chacha20.h"
+#include "parallel.h"
 #include <stdlib.h> 
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 
-#define KEYLEN  8
-#define HASHLEN 32
-#define BUFLEN  (sizeof(unsigned char) * KEYLEN*2 + 1)
+#define KEYLEN    8
+#define HASHLEN   32
+#define CHUNKLEN  (64 * 1024)   // bytes, a multiple of KEYLEN
+#define HEXBUFLEN ((CHUNKLEN + KEYLEN) * 2 + 1)
+
+/* ChaCha20 files start with a magic and the random nonce, followed by
+   the ciphertext without padding. Their data hash covers every byte 
+   of the file. */
+#define MAGICLEN  4
+#define HEADERLEN (MAGICLEN + CHACHA20_NONCELEN)
+#define BATCHLEN  (16 * CHUNKLEN)   // bytes handed to the cores at once
+
+static const unsigned char aucMagic[MAGICLEN] = {'T', 'S', 'M', 'C'};
+
+/* A batch of ChaCha20 work, split into CHUNKLEN tasks */
+struct CryptJob
+{
+    const unsigned char *pucKey;
+    const unsigned char *pucNonce;
+    unsigned long long ullOffset;   // keystream offset of pucBuf
+    unsigned char *pucBuf;
+    size_t uLength;
+};
 
 /*--------------------------------------------------------------------*/
 /* Private functions:                                                 */
@@ -33,6 +55,227 @@ static int isPadded(int pad, char *buf) {
     return 1;
 }
 
+/*--------------------------------------------------------------------*/
+
+/* Derive the 256 bit ChaCha20 key of the 64 bit leaf key pucKey with
+   the hash backend psHash */
+static void deriveStreamKey(const struct KeyHash *psHash, 
+                            const unsigned char *pucKey,
+                            unsigned char *pucStreamKey)
+{
+    static const char acDomain[] = "tsm chacha20 key";
+    KeyHash_CTX ctx;
+
+    psHash->init(&ctx);
+    psHash->update(&ctx, (const unsigned char *)acDomain, 
+                   sizeof(acDomain) - 1);
+    psHash->update(&ctx, pucKey, KEYLEN);
+    psHash->final(&ctx, pucStreamKey);
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Fill pucBuf with uLength bytes from the system entropy source. 
+   Return 1 on success, 0 on failure. */
+static int getRandom(unsigned char *pucBuf, size_t uLength)
+{
+    FILE *fp;
+    size_t uNumRead;
+
+    fp = fopen("/dev/urandom", "r");
+    if (fp == NULL)
+        return 0;
+    uNumRead = fread(pucBuf, 1, uLength, fp);
+    fclose(fp);
+    return uNumRead == uLength;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void cryptTask(void *pvJob, int iTask)
+{
+    struct CryptJob *psJob = (struct CryptJob *)pvJob;
+    size_t uStart = (size_t)iTask * CHUNKLEN;
+    size_t uLength = psJob->uLength - uStart;
+
+    if (uLength > CHUNKLEN)
+        uLength = CHUNKLEN;
+    chacha20_crypt(psJob->pucKey, psJob->pucNonce, 
+                   psJob->ullOffset + uStart,
+                   psJob->pucBuf + uStart, psJob->pucBuf + uStart, 
+                   uLength);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* En/decrypt uLength bytes of pucBuf in place at keystream offset 
+   ullOffset, spreading the chunks over the available cores */
+static void cryptBatch(const unsigned char *pucKey, 
+                       const unsigned char *pucNonce,
+                       unsigned long long ullOffset,
+                       unsigned char *pucBuf, size_t uLength)
+{
+    struct CryptJob sJob;
+
+    sJob.pucKey = pucKey;
+    sJob.pucNonce = pucNonce;
+    sJob.ullOffset = ullOffset;
+    sJob.pucBuf = pucBuf;
+    sJob.uLength = uLength;
+    Parallel_for((int)((uLength + CHUNKLEN - 1) / CHUNKLEN), cryptTask, 
+                 &sJob);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Encrypt fpi into fpo with ChaCha20 keyed from the leaf key pucKey,
+   feeding the file bytes to ctx. Return 1 on success, 0 on failure,
+   including a file longer than the keystream. */
+static int encryptChaCha(FILE *fpi, FILE *fpo, const unsigned char *pucKey,
+                         const struct KeyHash *psHash, KeyHash_CTX *ctx)
+{
+    unsigned char aucStreamKey[CHACHA20_KEYLEN];
+    unsigned char aucHeader[HEADERLEN];
+    unsigned char *pucBuf;
+    unsigned long long ullOffset;
+    size_t uNumRead;
+
+    pucBuf = (unsigned char *)malloc(BATCHLEN);
+    if (pucBuf == NULL)
+        return 0;
+
+    // a fresh nonce per file, so keystreams are never reused
+    memcpy(aucHeader, aucMagic, MAGICLEN);
+    if (!getRandom(aucHeader + MAGICLEN, CHACHA20_NONCELEN)) {
+        free(pucBuf);
+        return 0;
+    }
+    psHash->update(ctx, aucHeader, HEADERLEN);
+    fwrite(aucHeader, 1, HEADERLEN, fpo);
+
+    deriveStreamKey(psHash, pucKey, aucStreamKey);
+
+    ullOffset = 0;
+    while ((uNumRead = fread(pucBuf, 1, BATCHLEN, fpi)) > 0) {
+        // past the end of the keystream it would repeat
+        if (uNumRead > CHACHA20_MAXLEN - ullOffset) {
+            memset(aucStreamKey, 0, sizeof(aucStreamKey));
+            free(pucBuf);
+            return 0;
+        }
+        cryptBatch(aucStreamKey, aucHeader + MAGICLEN, ullOffset, 
+                   pucBuf, uNumRead);
+        psHash->update(ctx, pucBuf, uNumRead);
+        fwrite(pucBuf, 1, uNumRead, fpo);
+        ullOffset += uNumRead;
+    }
+
+    memset(aucStreamKey, 0, sizeof(aucStreamKey));
+    free(pucBuf);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Decrypt the plaintext bytes [ullOffset, ullOffset + ullLength) of 
+   the ChaCha20 file fpi into fpo, stopping early at the end of the 
+   file or of the keystream. Return 1 on success, 0 if fpi is not a ChaCha20 file. */
+static int decryptChaCha(FILE *fpi, FILE *fpo, const unsigned char *pucKey,
+                         const struct KeyHash *psHash,
+                         unsigned long long ullOffset,
+                         unsigned long long ullLength)
+{
+    unsigned char aucStreamKey[CHACHA20_KEYLEN];
+    unsigned char aucHeader[HEADERLEN];
+    unsigned char *pucBuf;
+    size_t uNumRead;
+    size_t uWant;
+
+    if (fread(aucHeader, 1, HEADERLEN, fpi) != HEADERLEN ||
+        memcmp(aucHeader, aucMagic, MAGICLEN) != 0)
+        return 0;
+
+    // every block has its own counter, so reading starts right at the 
+    // requested offset
+    if (fseek(fpi, (long)(HEADERLEN + ullOffset), SEEK_SET) != 0)
+        return 0;
+
+    pucBuf = (unsigned char *)malloc(BATCHLEN);
+    if (pucBuf == NULL)
+        return 0;
+
+    deriveStreamKey(psHash, pucKey, aucStreamKey);
+
+    while (ullLength > 0) {
+        uWant = ullLength < BATCHLEN ? (size_t)ullLength : BATCHLEN;
+        uNumRead = fread(pucBuf, 1, uWant, fpi);
+        if (uNumRead == 0 || ullOffset > CHACHA20_MAXLEN ||
+            uNumRead > CHACHA20_MAXLEN - ullOffset)
+            break;
+        cryptBatch(aucStreamKey, aucHeader + MAGICLEN, ullOffset, 
+                   pucBuf, uNumRead);
+        fwrite(pucBuf, 1, uNumRead, fpo);
+        ullOffset += uNumRead;
+        ullLength -= uNumRead;
+    }
+
+    memset(aucStreamKey, 0, sizeof(aucStreamKey));
+    free(pucBuf);
+    return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Hash the ciphertext file inputFileName the way Encrypt did for 
+   iCipher and compare it against the data hash of pcKeyID. Return 1 
+   if they match, 0 otherwise. */
+static int verifyData(const char *inputFileName, KeyChain_T oKeyChain,
+                      char *pcKeyID, int iCipher)
+{
+    size_t uNumRead;
+    FILE *fpi;
+    unsigned char *pucBuf;
+    char *pcHexBuf;
+    unsigned char hash[HASHLEN];
+    unsigned char aucDataHash[HASHLEN];
+    const struct KeyHash *psHash;
+    KeyHash_CTX ctx;
+
+    fpi = fopen(inputFileName, "r");
+    if (fpi == NULL)
+        return 0;
+
+    pucBuf = (unsigned char *)malloc(CHUNKLEN);
+    pcHexBuf = (char *)malloc(HEXBUFLEN);
+    if (pucBuf == NULL || pcHexBuf == NULL) {
+        free(pucBuf);
+        free(pcHexBuf);
+        fclose(fpi);
+        return 0;
+    }
+
+    psHash = KeyHash_get(KeyChain_getHashType(oKeyChain));
+    psHash->init(&ctx);
+    while ((uNumRead = fread(pucBuf, 1, CHUNKLEN, fpi)) > 0) {
+        if (iCipher == KEYCHAIN_CIPHER_CHACHA20) {
+            psHash->update(&ctx, pucBuf, uNumRead);
+        }
+        else {
+            arrToString(pucBuf, pcHexBuf, (int)uNumRead);
+            psHash->update(&ctx, (unsigned char *)pcHexBuf, uNumRead * 2);
+        }
+    }
+    psHash->final(&ctx, hash);
+
+    free(pucBuf);
+    free(pcHexBuf);
+    fclose(fpi);
+    // a copy keeps the key's verified path valid
+    KeyChain_copyInterHash(oKeyChain, pcKeyID, aucDataHash);
+    return memcmp(aucDataHash, hash, HASHLEN) == 0;
+}
+
 /*--------------------------------------------------------------------*/
 /* Public functions:                                                  */
 /*--------------------------------------------------------------------*/
@@ -66,16 +309,17 @@ int Encrypt(const char *inputFileName,
             KeyChain_T oKeyChain, 
             char *pcKeyID)
 {
-    int c;
-    int numRead;
-    int padded;                   // for PKCS#7 padding
+    size_t uNumRead;
+    size_t uPad;
+    int iLast;
+    int iResult;
     FILE *fpi, *fpo;
     unsigned char keybuf[KEYLEN];
-    unsigned char inbuf[KEYLEN];
-    unsigned char outbuf[KEYLEN];
+    unsigned char *pucBuf;
+    char *pcHexBuf;
     unsigned char hash[HASHLEN];
-    char temp_buf[BUFLEN];
-    SHA256_CTX ctx;
+    const struct KeyHash *psHash;
+    KeyHash_CTX ctx;
 
     // must be a leaf key
     if (KeyChain_getType(oKeyChain, pcKeyID) != 1) {
@@ -96,38 +340,62 @@ int Encrypt(const char *inputFileName,
     if (fpi == NULL)
         return 0;
     fpo = fopen(outputFileName, "w");
-    if (fpo == NULL)
+    if (fpo == NULL) {
+        fclose(fpi);
         return 0;
+    }
 
-    sha256_init(&ctx);
+    // data digests use the hash backend of the keychain
+    psHash = KeyHash_get(KeyChain_getHashType(oKeyChain));
+    psHash->init(&ctx);
 
-    padded = 0;
-    while ((numRead = fread(inbuf, 1, KEYLEN, fpi)) > 0) {
-        if (numRead < KEYLEN) {
-            // requires padding to a multiple of 8 bytes
-            memset(inbuf+numRead, KEYLEN - numRead, KEYLEN - numRead);
-            padded = 1;
-        }
-        // encrypt-then-hash
-        xor_encrypt(inbuf, outbuf, KEYLEN, keybuf);
-        arrToString(outbuf, temp_buf, KEYLEN);
-        sha256_update(&ctx, temp_buf, strlen(temp_buf));
-        fwrite(outbuf, 1, KEYLEN, fpo);
+    if (KeyChain_getCipher(oKeyChain, pcKeyID) == KEYCHAIN_CIPHER_CHACHA20) {
+        iResult = encryptChaCha(fpi, fpo, keybuf, psHash, &ctx);
+        fclose(fpi);
+        fclose(fpo);
+        if (!iResult)
+            return 0;
+        psHash->final(&ctx, hash);
+        KeyChain_updateKey(oKeyChain, pcKeyID, hash);
+        return 1;
     }
 
-    if (!padded) {
-        memset(inbuf, KEYLEN, KEYLEN);
-        xor_encrypt(inbuf, outbuf, KEYLEN, keybuf);
-        arrToString(outbuf, temp_buf, KEYLEN);
-        sha256_update(&ctx, temp_buf, strlen(temp_buf));
-        fwrite(outbuf, 1, KEYLEN, fpo);
+    // room for the padding block after a short final chunk
+    pucBuf = (unsigned char *)malloc(CHUNKLEN + KEYLEN);
+    pcHexBuf = (char *)malloc(HEXBUFLEN);
+    if (pucBuf == NULL || pcHexBuf == NULL) {
+        free(pucBuf);
+        free(pcHexBuf);
+        fclose(fpi);
+        fclose(fpo);
+        return 0;
     }
 
-    sha256_final(&ctx, hash);
+    iLast = 0;
+    while (!iLast) {
+        uNumRead = fread(pucBuf, 1, CHUNKLEN, fpi);
+        if (uNumRead < CHUNKLEN) {
+            // PKCS#7 pad to a multiple of 8 bytes, adding a whole block
+            // if the data already ends on one
+            uPad = KEYLEN - uNumRead % KEYLEN;
+            memset(pucBuf + uNumRead, (int)uPad, uPad);
+            uNumRead += uPad;
+            iLast = 1;
+        }
+        // encrypt-then-hash, in place
+        xor_crypt(pucBuf, pucBuf, uNumRead, keybuf);
+        arrToString(pucBuf, pcHexBuf, (int)uNumRead);
+        psHash->update(&ctx, (unsigned char *)pcHexBuf, uNumRead * 2);
+        fwrite(pucBuf, 1, uNumRead, fpo);
+    }
+
+    psHash->final(&ctx, hash);
 
     // set internal hash of key with hash of data ciphertext
     KeyChain_updateKey(oKeyChain, pcKeyID, hash);
 
+    free(pucBuf);
+    free(pcHexBuf);
     fclose(fpi);
     fclose(fpo);
     return 1;
@@ -140,40 +408,27 @@ int Decrypt(const char *inputFileName,
             KeyChain_T oKeyChain,
             char *pcKeyID)
 {
-    int c;
-    int numRead;
+    size_t uNumRead;
     int pad;
-    int padded;
+    int iHeld;
+    int iResult;
+    int iCipher;
     FILE *fpi, *fpo;
     unsigned char keybuf[KEYLEN];
-    unsigned char inbuf[KEYLEN];
-    unsigned char outbuf[KEYLEN];
-    unsigned char hash[HASHLEN];
-    char temp_buf[BUFLEN];
-    SHA256_CTX ctx;
-
-    fpi = fopen(inputFileName, "r");
-    if (fpi == NULL)
-        return 0;
+    unsigned char aucLastBlock[KEYLEN];
+    unsigned char *pucBuf;
 
     if (!KeyChain_contains(oKeyChain, pcKeyID)) {
         printf("\n---invalid key\n");   // for demo
         return 0;
     }
+    iCipher = KeyChain_getCipher(oKeyChain, pcKeyID);
 
     // verify hash of the data
-    sha256_init(&ctx);
-    while ((numRead = fread(inbuf, 1, KEYLEN, fpi)) > 0) {
-        arrToString(inbuf, temp_buf, KEYLEN);
-        sha256_update(&ctx, temp_buf, strlen(temp_buf));
-    }
-    sha256_final(&ctx, hash);
-    if (memcmp(KeyChain_getInterHash(oKeyChain, pcKeyID), hash, HASHLEN) != 0) {
+    if (!verifyData(inputFileName, oKeyChain, pcKeyID, iCipher)) {
         printf("\n---data hash mismatch!\n");   // for demo
-        fclose(fpi);
         return 0;
     }
-    fclose(fpi);
 
     // verify integrity of key node
     if (!KeyChain_verifyKey(oKeyChain, pcKeyID)) {
@@ -187,31 +442,102 @@ int Decrypt(const char *inputFileName,
     if (fpi == NULL)
         return 0;
     fpo = fopen(outputFileName, "w");
-    if (fpo == NULL)
+    if (fpo == NULL) {
+        fclose(fpi);
         return 0;
+    }
 
-    padded = 0;
-    while ((numRead = fread(inbuf, 1, KEYLEN, fpi)) > 0) {
-        // if previous block had padding
-        if (padded) {
-            fwrite(outbuf + KEYLEN - pad, 1, pad, fpo);
-            padded = 0;
-        }
-        if (numRead < KEYLEN) {
-            return 0;
+    if (iCipher == KEYCHAIN_CIPHER_CHACHA20) {
+        iResult = decryptChaCha(fpi, fpo, keybuf, 
+                                KeyHash_get(KeyChain_getHashType(oKeyChain)),
+                                0, ~0ULL);
+        fclose(fpi);
+        fclose(fpo);
+        return iResult;
+    }
+
+    pucBuf = (unsigned char *)malloc(CHUNKLEN);
+    if (pucBuf == NULL) {
+        fclose(fpi);
+        fclose(fpo);
+        return 0;
+    }
+
+    // the last block is held back until EOF so its padding can be
+    // stripped
+    iHeld = 0;
+    iResult = 1;
+    while ((uNumRead = fread(pucBuf, 1, CHUNKLEN, fpi)) > 0) {
+        if (uNumRead % KEYLEN != 0) {
+            iResult = 0;
+            break;
         }
 
-        xor_decrypt(inbuf, outbuf, KEYLEN, keybuf);
-        pad = outbuf[KEYLEN-1];
-        padded = isPadded(pad, outbuf);
-        if (padded) {
-            fwrite(outbuf, 1, KEYLEN - pad, fpo);
+        xor_crypt(pucBuf, pucBuf, uNumRead, keybuf);
+        if (iHeld)
+            fwrite(aucLastBlock, 1, KEYLEN, fpo);
+        fwrite(pucBuf, 1, uNumRead - KEYLEN, fpo);
+        memcpy(aucLastBlock, pucBuf + uNumRead - KEYLEN, KEYLEN);
+        iHeld = 1;
+    }
+
+    if (iResult && iHeld) {
+        pad = aucLastBlock[KEYLEN-1];
+        if (isPadded(pad, (char *)aucLastBlock)) {
+            fwrite(aucLastBlock, 1, KEYLEN - pad, fpo);
         } else {
-            fwrite(outbuf, 1, KEYLEN, fpo);
+            fwrite(aucLastBlock, 1, KEYLEN, fpo);
         }
     }
 
+    free(pucBuf);
     fclose(fpi);
     fclose(fpo);
-    return 1;
+    return iResult;
+}
+
+/*--------------------------------------------------------------------*/
+
+int DecryptRange(const char *inputFileName, 
+                 const char *outputFileName,
+                 KeyChain_T oKeyChain,
+                 char *pcKeyID,
+                 unsigned long long ullOffset,
+                 unsigned long long ullLength)
+{
+    int iResult;
+    FILE *fpi, *fpo;
+    unsigned char keybuf[KEYLEN];
+
+    if (KeyChain_getCipher(oKeyChain, pcKeyID) != KEYCHAIN_CIPHER_CHACHA20)
+        return 0;
+
+    if (!verifyData(inputFileName, oKeyChain, pcKeyID, 
+                    KEYCHAIN_CIPHER_CHACHA20)) {
+        printf("\n---data hash mismatch!\n");   // for demo
+        return 0;
+    }
+
+    if (!KeyChain_verifyKey(oKeyChain, pcKeyID)) {
+        printf("\n---key hash mismatch!\n");   // for demo
+        return 0;
+    }
+
+    KeyChain_getKey(oKeyChain, pcKeyID, keybuf);
+
+    fpi = fopen(inputFileName, "r");
+    if (fpi == NULL)
+        return 0;
+    fpo = fopen(outputFileName, "w");
+    if (fpo == NULL) {
+        fclose(fpi);
+        return 0;
+    }
+
+    iResult = decryptChaCha(fpi, fpo, keybuf, 
+                            KeyHash_get(KeyChain_getHashType(oKeyChain)),
+                            ullOffset, ullLength);
+    fclose(fpi);
+    fclose(fpo);
+    return iResult;
 }
@@ -26,7 +26,10 @@ int DeleteKeyFromChain(KeyChain_T oKeyChain, char *pcKeyID);
 
 /*--------------------------------------------------------------------*/
 
-/* Encrypt inputFileName into outputFileName using pcKeyID.
+/* Encrypt inputFileName into outputFileName using pcKeyID, with the
+   cipher selected for it by KeyChain_setCipher(). ChaCha20 files are 
+   encrypted on all cores, and fail past 256 GiB, where the keystream
+   ends. Several threads may encrypt with different keys at once.
    Return 1 on success, 0 on failure. */
 
 int Encrypt(const char *inputFileName, 
@@ -46,4 +49,19 @@ int Decrypt(const char *inputFileName,
 
 /*--------------------------------------------------------------------*/
 
+/* Decrypt ullLength bytes of plaintext starting at byte ullOffset of 
+   the ChaCha20 file inputFileName into outputFileName using pcKeyID.
+   The range is cut short at the end of the data. The whole file is 
+   still checked against the data hash first. Return 1 on success, 0 
+   on failure or if pcKeyID does not use KEYCHAIN_CIPHER_CHACHA20. */
+
+int DecryptRange(const char *inputFileName, 
+                 const char *outputFileName,
+                 KeyChain_T oKeyChain,
+                 char *pcKeyID,
+                 unsigned long long ullOffset,
+                 unsigned long long ullLength);
+
+/*--------------------------------------------------------------------*/
+
 #endif